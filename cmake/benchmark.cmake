@@ -0,0 +1,10 @@
+# google benchmark, for pikiwidb_bench
+FETCHCONTENT_DECLARE(
+        benchmark
+        GIT_REPOSITORY https://github.com/google/benchmark.git
+        GIT_TAG v1.8.3
+)
+SET(BENCHMARK_ENABLE_TESTING OFF CACHE BOOL "" FORCE)
+SET(BENCHMARK_ENABLE_GTEST_TESTS OFF CACHE BOOL "" FORCE)
+SET(BENCHMARK_ENABLE_INSTALL OFF CACHE BOOL "" FORCE)
+FETCHCONTENT_MAKEAVAILABLE(benchmark)
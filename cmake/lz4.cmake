@@ -0,0 +1,16 @@
+# lz4
+FETCHCONTENT_DECLARE(
+        lz4
+        GIT_REPOSITORY https://github.com/lz4/lz4.git
+        GIT_TAG v1.9.4
+)
+SET(LZ4_BUILD_CLI OFF CACHE BOOL "" FORCE)
+SET(LZ4_BUILD_LEGACY_LZ4C OFF CACHE BOOL "" FORCE)
+SET(BUILD_STATIC_LIBS ON CACHE BOOL "" FORCE)
+FETCHCONTENT_GETPROPERTIES(lz4)
+IF (NOT lz4_POPULATED)
+    FETCHCONTENT_POPULATE(lz4)
+    # the cmake project is not at the top of source
+    ADD_SUBDIRECTORY(${lz4_SOURCE_DIR}/build/cmake ${lz4_BINARY_DIR})
+ENDIF ()
+SET(LZ4_INCLUDE_DIR ${lz4_SOURCE_DIR}/lib)
@@ -0,0 +1,17 @@
+# zstd
+FETCHCONTENT_DECLARE(
+        zstd
+        GIT_REPOSITORY https://github.com/facebook/zstd.git
+        GIT_TAG v1.5.5
+)
+SET(ZSTD_BUILD_PROGRAMS OFF CACHE BOOL "" FORCE)
+SET(ZSTD_BUILD_TESTS OFF CACHE BOOL "" FORCE)
+SET(ZSTD_BUILD_SHARED OFF CACHE BOOL "" FORCE)
+SET(ZSTD_BUILD_STATIC ON CACHE BOOL "" FORCE)
+FETCHCONTENT_GETPROPERTIES(zstd)
+IF (NOT zstd_POPULATED)
+    FETCHCONTENT_POPULATE(zstd)
+    # the cmake project is not at the top of source
+    ADD_SUBDIRECTORY(${zstd_SOURCE_DIR}/build/cmake ${zstd_BINARY_DIR})
+ENDIF ()
+SET(ZSTD_INCLUDE_DIR ${zstd_SOURCE_DIR}/lib)
@@ -0,0 +1,686 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "aof.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+
+#include "command.h"
+#include "config.h"
+#include "db.h"
+#include "loading.h"
+#include "log.h"
+#include "memory_file.h"
+#include "proto_parser.h"
+#include "replication.h"
+#include "snapshot.h"
+#include "store.h"
+
+namespace pikiwidb {
+
+int AofFsyncPolicy(const PString& name) {
+  if (strcasecmp(name.c_str(), "always") == 0) {
+    return PAofFsync_always;
+  }
+  if (strcasecmp(name.c_str(), "everysec") == 0) {
+    return PAofFsync_everysec;
+  }
+  if (strcasecmp(name.c_str(), "no") == 0) {
+    return PAofFsync_no;
+  }
+
+  return -1;
+}
+
+PAof& PAof::Instance() {
+  static PAof aof;
+  return aof;
+}
+
+PAof::PAof() {}
+
+PAof::~PAof() { Close(); }
+
+bool PAof::SetFsyncPolicy(const PString& name) {
+  int policy = AofFsyncPolicy(name);
+  if (policy == -1) {
+    return false;
+  }
+
+  fsyncPolicy_ = policy;
+  return true;
+}
+
+PString PAof::fileName(uint64_t seq, char type) const {
+  return name_ + "." + std::to_string(seq) + (type == PAofFile_base ? ".base.rdb" : ".incr.aof");
+}
+
+// manifest lines: file appendonly.aof.1.base.rdb seq 1 type b
+bool PAof::loadManifest() {
+  base_ = PAofFile();
+  incrs_.clear();
+  seq_ = 0;
+
+  FILE* fp = ::fopen(path(name_ + ".manifest").c_str(), "r");
+  if (!fp) {
+    return false;
+  }
+
+  char name[256];
+  unsigned long long seq = 0;
+  char type = 0;
+  int n = 0;
+  while ((n = ::fscanf(fp, "file %255s seq %llu type %c\n", name, &seq, &type)) == 3) {
+    if (type != PAofFile_base && type != PAofFile_incr) {
+      break;
+    }
+
+    PAofFile file;
+    file.name = name;
+    file.seq = seq;
+    file.type = type;
+
+    if (type == PAofFile_base) {
+      base_ = file;
+    } else {
+      incrs_.push_back(file);
+    }
+
+    seq_ = std::max<uint64_t>(seq_, seq);
+  }
+
+  // a line not parsed is never skipped, the files after it would be removed as unused
+  const bool succ = (n == EOF && !::ferror(fp));
+  ::fclose(fp);
+  if (!succ) {
+    ERROR("aof manifest {} is corrupted", path(name_ + ".manifest"));
+  }
+
+  return succ;
+}
+
+// never modify the live manifest, write a new one and rename it
+bool PAof::saveManifest() {
+  PString content;
+  auto append = [&content](const PAofFile& f) {
+    content += "file " + f.name + " seq " + std::to_string(f.seq) + " type " + f.type + "\n";
+  };
+
+  if (!base_.name.empty()) {
+    append(base_);
+  }
+  for (const auto& f : incrs_) {
+    append(f);
+  }
+
+  const PString manifest = path(name_ + ".manifest");
+  const PString tmp = manifest + ".tmp";
+
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    ERROR("open aof manifest {} failed: {}", tmp, strerror(errno));
+    return false;
+  }
+
+  bool succ = (::write(fd, content.data(), content.size()) == static_cast<ssize_t>(content.size()));
+  succ = succ && (::fsync(fd) == 0);
+  ::close(fd);
+
+  if (!succ || ::rename(tmp.c_str(), manifest.c_str()) != 0) {
+    ERROR("save aof manifest {} failed: {}", manifest, strerror(errno));
+    ::unlink(tmp.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+// remove the files left by crash: tmp files and files not in manifest
+void PAof::removeUnusedFiles() {
+  DIR* dir = ::opendir(dir_.c_str());
+  if (!dir) {
+    return;
+  }
+
+  const PString prefix = name_ + ".";
+  while (struct dirent* ent = ::readdir(dir)) {
+    PString file(ent->d_name);
+    if (file.compare(0, prefix.size(), prefix) != 0 || file == name_ + ".manifest") {
+      continue;
+    }
+
+    bool used = (file == base_.name);
+    for (const auto& f : incrs_) {
+      used = used || (file == f.name);
+    }
+
+    if (!used) {
+      WARN("remove unused aof file {}", file);
+      ::unlink(path(file).c_str());
+    }
+  }
+
+  ::closedir(dir);
+}
+
+static uint64_t FileSize(const PString& file) {
+  struct stat st;
+  if (::stat(file.c_str(), &st) != 0) {
+    return 0;
+  }
+
+  return static_cast<uint64_t>(st.st_size);
+}
+
+bool PAof::Open(const PString& dir, const PString& name) {
+  Close();
+
+  dir_ = dir;
+  name_ = name;
+  if (::mkdir(dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+    ERROR("create aof dir {} failed: {}", dir_, strerror(errno));
+    return false;
+  }
+
+  // removeUnusedFiles trusts the manifest, a new one only if there is none
+  if (!loadManifest() && Exists(dir_, name_)) {
+    ERROR("open aof {} failed: can not read manifest", dir_);
+    return false;
+  }
+  removeUnusedFiles();
+
+  if (incrs_.empty()) {
+    PAofFile incr;
+    incr.seq = ++seq_;
+    incr.name = fileName(incr.seq, PAofFile_incr);
+    incrs_.push_back(incr);
+
+    if (!saveManifest()) {
+      return false;
+    }
+  }
+
+  if (!openIncr(incrs_.back())) {
+    return false;
+  }
+
+  size_ = base_.name.empty() ? 0 : FileSize(path(base_.name));
+  for (const auto& f : incrs_) {
+    size_ += FileSize(path(f.name));
+  }
+  rewriteBaseSize_ = size_;
+
+  startFsyncThread();
+  INFO("open aof {}/{}, size {}", dir_, incrs_.back().name, size_);
+
+  // no base: the data loaded from rdb is not in aof yet;
+  // more than one incr: the last rewrite was interrupted.
+  if (base_.name.empty() || incrs_.size() > 1) {
+    Rewrite();
+  }
+
+  return true;
+}
+
+bool PAof::openIncr(const PAofFile& file) {
+  // the pending commands belong to the old file
+  Flush();
+
+  int fd = ::open(path(file.name).c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+  if (fd == -1) {
+    ERROR("open aof {} failed: {}", file.name, strerror(errno));
+    return false;
+  }
+
+  const uint64_t size = FileSize(path(file.name));
+
+  {
+    std::unique_lock<std::mutex> guard(mutex_);
+    // the fsync thread may be syncing the old fd, so it closes it
+    if (fd_ != -1) {
+      closingFds_.push_back(fd_);
+      cond_.notify_all();
+    }
+    fd_ = fd;
+    ++fileGen_;
+    written_ = synced_ = size;
+  }
+
+  incrSize_ = size;
+  // the first command written must select its db
+  selectedDB_ = -1;
+  return true;
+}
+
+void PAof::Close() {
+  if (fd_ == -1) {
+    return;
+  }
+
+  if (rewriting_) {
+    PSNAPSHOT.Abort();
+  }
+
+  Flush();
+  stopFsyncThread();
+
+  ::fdatasync(fd_);
+  ::close(fd_);
+  fd_ = -1;
+  buf_.Clear();
+}
+
+void PAof::Feed(int dbno, const std::vector<PString>& params) {
+  if (fd_ == -1 || loading_) {
+    return;
+  }
+
+  if (dbno != selectedDB_) {
+    std::vector<PString> select{"select", std::to_string(dbno)};
+    SaveCommand(select, buf_);
+    selectedDB_ = dbno;
+  }
+
+  feedCommand(params);
+}
+
+// relative expire time must be translated to absolute time,
+// otherwise the key lives longer after reload.
+void PAof::feedCommand(const std::vector<PString>& params) {
+  const PString& cmd = params[0];
+  uint64_t unit = 0;
+  if (strcasecmp(cmd.c_str(), "expire") == 0 || strcasecmp(cmd.c_str(), "setex") == 0) {
+    unit = 1000;
+  } else if (strcasecmp(cmd.c_str(), "pexpire") == 0 || strcasecmp(cmd.c_str(), "psetex") == 0) {
+    unit = 1;
+  }
+
+  if (unit == 0) {
+    SaveCommand(params, buf_);
+    return;
+  }
+
+  const bool isSet = (params.size() == 4);  // setex key seconds value
+
+  // parse the ttl as the handlers do: setex is checked by Strtol, expire takes
+  // whatever atoi gives. A negative ttl expires the key, it must not wrap.
+  long ttl = 0;
+  if (isSet) {
+    Strtol(params[2].c_str(), params[2].size(), &ttl);
+  } else {
+    ttl = atoi(params[2].c_str());
+  }
+
+  const long long now = static_cast<long long>(::Now());
+  const long long limit = (std::numeric_limits<long long>::max() - now) / static_cast<long long>(unit);
+  long long when = 0;
+  if (ttl > limit) {
+    when = std::numeric_limits<long long>::max();
+  } else if (ttl > 0 || -ttl < now / static_cast<long long>(unit)) {
+    when = now + ttl * static_cast<long long>(unit);
+  }
+
+  if (isSet) {
+    std::vector<PString> set{"set", params[1], params[3]};
+    SaveCommand(set, buf_);
+  }
+
+  std::vector<PString> expire{"pexpireat", params[1], std::to_string(when)};
+  SaveCommand(expire, buf_);
+}
+
+void PAof::Flush() {
+  if (fd_ == -1 || buf_.IsEmpty()) {
+    return;
+  }
+
+  while (!buf_.IsEmpty()) {
+    ssize_t n = ::write(fd_, buf_.ReadAddr(), buf_.ReadableSize());
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      // keep the data, retry in the next loop
+      ++writeErrors_;
+      ERROR("write aof failed: {}, pending {} bytes", strerror(errno), buf_.ReadableSize());
+      return;
+    }
+
+    buf_.AdjustReadPtr(static_cast<std::size_t>(n));
+    size_ += static_cast<uint64_t>(n);
+    incrSize_ += static_cast<uint64_t>(n);
+  }
+
+  buf_.Clear();
+  written_ = incrSize_;
+
+  if (fsyncPolicy_ == PAofFsync_always) {
+    ::fdatasync(fd_);
+    synced_ = incrSize_;
+    lastFsync_ = ::Now();
+  }
+}
+
+bool PAof::Rewrite() {
+  if (fd_ == -1 || rewriting_) {
+    return false;
+  }
+
+  // only one snapshot at a time, and not before loading done, try again in cron
+  if (PSNAPSHOT.IsRunning() || PLOADING.IsLoading()) {
+    rewriteScheduled_ = true;
+    return true;
+  }
+
+  rewriteScheduled_ = false;
+
+  // the commands from now on are not in the snapshot, write them to a new incr file
+  PAofFile incr;
+  incr.seq = ++seq_;
+  incr.name = fileName(incr.seq, PAofFile_incr);
+  if (!openIncr(incr)) {
+    lastRewriteOk_ = false;
+    return false;
+  }
+
+  incrs_.push_back(incr);
+  if (!saveManifest()) {
+    // the manifest does not list the new incr, which would be removed at next start:
+    // write to the previous one again
+    incrs_.pop_back();
+    if (openIncr(incrs_.back())) {
+      ::unlink(path(incr.name).c_str());
+    } else {
+      ERROR("aof rewrite can not reopen {}", incrs_.back().name);
+    }
+    lastRewriteOk_ = false;
+    return false;
+  }
+
+  const uint64_t seq = incr.seq;
+  const PString base = path(fileName(seq, PAofFile_base));
+  if (!PSNAPSHOT.Start(base, [this, seq](bool succ) { this->onRewriteDone(succ, seq); })) {
+    ERROR("aof rewrite can not start snapshot {}", base);
+    lastRewriteOk_ = false;
+    return false;
+  }
+
+  rewriting_ = true;
+  INFO("aof rewrite started, base {}", base);
+  return true;
+}
+
+void PAof::onRewriteDone(bool succ, uint64_t seq) {
+  rewriting_ = false;
+  lastRewriteOk_ = succ;
+
+  if (!succ) {
+    ERROR("aof rewrite failed, base seq {}", seq);
+    return;
+  }
+
+  PAofFile oldBase = base_;
+  std::vector<PAofFile> oldIncrs;
+  oldIncrs.swap(incrs_);
+
+  base_.name = fileName(seq, PAofFile_base);
+  base_.seq = seq;
+  base_.type = PAofFile_base;
+
+  std::vector<PAofFile> history;
+  for (auto& f : oldIncrs) {
+    if (f.seq >= seq) {
+      incrs_.push_back(f);
+    } else {
+      history.push_back(f);
+    }
+  }
+
+  if (!saveManifest()) {
+    // the old manifest is still valid, keep everything
+    ::unlink(path(base_.name).c_str());
+    base_ = oldBase;
+    incrs_.swap(oldIncrs);
+    lastRewriteOk_ = false;
+    return;
+  }
+
+  if (!oldBase.name.empty()) {
+    history.push_back(oldBase);
+  }
+  for (const auto& f : history) {
+    ::unlink(path(f.name).c_str());
+  }
+
+  size_ = FileSize(path(base_.name)) + incrSize_;
+  rewriteBaseSize_ = size_;
+  ++rewrites_;
+
+  INFO("aof rewrite done, base {}, size {}", base_.name, size_);
+}
+
+void PAof::Cron() {
+  if (fd_ == -1 || rewriting_) {
+    return;
+  }
+
+  if (rewriteScheduled_) {
+    if (!PSNAPSHOT.IsRunning() && !PLOADING.IsLoading()) {
+      Rewrite();
+    }
+    return;
+  }
+
+  if (g_config.autoAofRewritePerc <= 0 || size_ < g_config.autoAofRewriteMinSize) {
+    return;
+  }
+
+  uint64_t base = std::max<uint64_t>(rewriteBaseSize_, 1);
+  uint64_t growth = size_ > base ? (size_ - base) * 100 / base : 0;
+  if (growth >= static_cast<uint64_t>(g_config.autoAofRewritePerc)) {
+    INFO("start auto aof rewrite, size {}, growth {}%", size_, growth);
+    Rewrite();
+  }
+}
+
+void PAof::startFsyncThread() {
+  stop_ = false;
+  fsyncThread_ = std::thread([this]() { this->fsyncRoutine(); });
+}
+
+void PAof::stopFsyncThread() {
+  {
+    std::unique_lock<std::mutex> guard(mutex_);
+    stop_ = true;
+    cond_.notify_all();
+  }
+
+  if (fsyncThread_.joinable()) {
+    fsyncThread_.join();
+  }
+  closeOldFds();
+}
+
+void PAof::closeOldFds() {
+  std::vector<int> fds;
+  {
+    std::unique_lock<std::mutex> guard(mutex_);
+    fds.swap(closingFds_);
+  }
+
+  for (int fd : fds) {
+    ::fdatasync(fd);
+    ::close(fd);
+  }
+}
+
+// fdatasync may block for a long time when the disk is busy,
+// so it never runs in the event loop for everysec policy.
+void PAof::fsyncRoutine() {
+  std::unique_lock<std::mutex> guard(mutex_);
+
+  while (!stop_) {
+    cond_.wait_for(guard, std::chrono::seconds(1),
+                   [this]() -> bool { return this->stop_ || !this->closingFds_.empty(); });
+    if (stop_) {
+      break;
+    }
+
+    if (!closingFds_.empty()) {
+      guard.unlock();
+      closeOldFds();
+      guard.lock();
+      continue;
+    }
+
+    if (fsyncPolicy_ != PAofFsync_everysec) {
+      continue;
+    }
+
+    uint64_t written = written_;
+    if (written == synced_) {
+      continue;
+    }
+
+    int fd = fd_;
+    uint64_t gen = fileGen_;
+
+    guard.unlock();
+    ::fdatasync(fd);
+    guard.lock();
+
+    if (gen == fileGen_) {
+      synced_ = written;
+    }
+    lastFsync_ = ::Now();
+  }
+}
+
+bool PAof::Load(const PString& dir, const PString& name) {
+  dir_ = dir;
+  name_ = name;
+  if (!loadManifest()) {
+    ERROR("load aof manifest in {} failed", dir_);
+    return false;
+  }
+
+  loading_ = true;
+  int oldDB = PSTORE.GetDB();
+  DEFER {
+    PSTORE.SelectDB(oldDB);
+    loading_ = false;
+  };
+
+  if (!base_.name.empty()) {
+    PDBLoader loader;
+    if (loader.Load(path(base_.name).c_str()) != 0) {
+      ERROR("load aof base {} failed", base_.name);
+      return false;
+    }
+  }
+
+  for (std::size_t i = 0; i < incrs_.size(); ++i) {
+    if (!replay(path(incrs_[i].name), i + 1 == incrs_.size())) {
+      return false;
+    }
+  }
+
+  INFO("load aof {} done, {} incr files", dir_, incrs_.size());
+  return true;
+}
+
+bool PAof::Exists(const PString& dir, const PString& name) {
+  return ::access((dir + "/" + name + ".manifest").c_str(), F_OK) == 0;
+}
+
+bool PAof::replay(const PString& file, bool lastFile) {
+  InputMemoryFile aof;
+  if (!aof.Open(file.c_str())) {
+    // an empty file can not be mapped
+    return FileSize(file) == 0;
+  }
+
+  std::size_t size = std::size_t(-1);
+  const char* const start = aof.Read(size);
+  const char* const end = start + size;
+  const char* ptr = start;
+
+  std::size_t ncmds = 0;
+  PProtoParser parser;
+
+  while (ptr < end) {
+    const char* begin = ptr;
+
+    parser.Reset();
+    const auto ret = parser.ParseRequest(ptr, end);
+    if (ret != PParseResult::ok) {
+      // only a half command at the end of the newest file is a cut-off write
+      if (!lastFile || ret != PParseResult::wait) {
+        ERROR("aof {} is corrupted at offset {}", file, begin - start);
+        return false;
+      }
+
+      // the last write was interrupted, discard the half command
+      WARN("aof {} has truncated tail at offset {}, discard {} bytes", file, begin - start, end - begin);
+      ptr = begin;
+      break;
+    }
+
+    const auto& params = parser.GetParams();
+    const PCommandInfo* info = PCommandTable::GetCommandInfo(params[0]);
+    if (!info) {
+      ERROR("aof {} has unknown command {} at offset {}", file, params[0], begin - start);
+      return false;
+    }
+
+    PCommandTable::ExecuteCmd(params, info, nullptr);
+    ++ncmds;
+  }
+
+  const auto valid = static_cast<off_t>(ptr - start);
+  aof.Close();
+
+  if (valid != static_cast<off_t>(size)) {
+    ::truncate(file.c_str(), valid);
+  }
+
+  INFO("replay aof {}, {} commands, {} bytes", file, ncmds, valid);
+  return true;
+}
+
+void PAof::OnInfoCommand(UnboundedBuffer& res) {
+  char buf[1024];
+  int n = snprintf(buf, sizeof buf - 1,
+                   "aof_enabled:%d\r\n"
+                   "aof_rewrite_in_progress:%d\r\n"
+                   "aof_rewrite_scheduled:%d\r\n"
+                   "aof_last_bgrewrite_status:%s\r\n"
+                   "aof_rewrites:%lu\r\n"
+                   "aof_current_size:%lu\r\n"
+                   "aof_base_size:%lu\r\n"
+                   "aof_incr_files:%lu\r\n"
+                   "aof_buffer_length:%lu\r\n"
+                   "aof_fsync_policy:%s\r\n"
+                   "aof_pending_fsync_bytes:%lu\r\n"
+                   "aof_last_fsync_ms:%ld\r\n"
+                   "aof_write_errors:%lu\r\n",
+                   IsOpen() ? 1 : 0, rewriting_ ? 1 : 0, rewriteScheduled_ ? 1 : 0, lastRewriteOk_ ? "ok" : "err",
+                   rewrites_, size_, rewriteBaseSize_, incrs_.size(), buf_.ReadableSize(), g_config.appendfsync.c_str(),
+                   written_.load() - synced_.load(), lastFsync_.load(), writeErrors_);
+
+  res.PushData(buf, n);
+}
+
+}  // namespace pikiwidb
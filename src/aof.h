@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "pstring.h"
+#include "unbounded_buffer.h"
+
+namespace pikiwidb {
+
+enum PAofFsync {
+  PAofFsync_no,        // let the OS flush the page cache
+  PAofFsync_everysec,  // fdatasync by the background thread once per second
+  PAofFsync_always,    // fdatasync before replies leave the server
+};
+
+// -1 if name is not always, everysec or no
+extern int AofFsyncPolicy(const PString& name);
+
+enum PAofFileType : char {
+  PAofFile_base = 'b',  // rdb format, written by rewrite
+  PAofFile_incr = 'i',  // commands appended after the base
+};
+
+struct PAofFile {
+  PString name;
+  uint64_t seq = 0;
+  char type = PAofFile_incr;
+};
+
+// Append only file.
+// Write commands are buffered in memory by Feed and written to the file
+// with one write(2) per event loop iteration, before the replies of
+// those commands are sent to clients.
+//
+// The aof is a directory of files listed by a manifest: one base file in
+// rdb format and the incr files appended after it. Rewrite starts a new
+// incr file and saves a forkless snapshot as the next base, the manifest
+// is switched to them only when the snapshot is complete, so a crash at
+// any moment leaves a loadable set of files.
+class PAof {
+ public:
+  static PAof& Instance();
+
+  PAof(const PAof&) = delete;
+  void operator=(const PAof&) = delete;
+
+  // open the last incr file for append, the manifest is created if not exist
+  bool Open(const PString& dir, const PString& name);
+  void Close();
+  bool IsOpen() const { return fd_ != -1; }
+
+  // parsed once when the config is loaded or set, the fsync thread
+  // reads the policy instead of the config string
+  bool SetFsyncPolicy(const PString& name);
+
+  // called from Propagate, dbno is the db the command executed on
+  void Feed(int dbno, const std::vector<PString>& params);
+  // group commit: called once per event loop iteration
+  void Flush();
+
+  // load base and incr files at startup, the truncated tail is discarded.
+  // On failure part of the data may be loaded already.
+  bool Load(const PString& dir, const PString& name);
+  static bool Exists(const PString& dir, const PString& name);
+  bool IsLoading() const { return loading_; }
+
+  // rewrite without fork, delayed if another snapshot is running
+  bool Rewrite();
+  bool IsRewriting() const { return rewriting_; }
+  bool IsRewriteScheduled() const { return rewriteScheduled_; }
+  void Cron();
+
+  // info command
+  void OnInfoCommand(UnboundedBuffer& res);
+
+ private:
+  PAof();
+  ~PAof();
+
+  PString path(const PString& file) const { return dir_ + "/" + file; }
+  PString fileName(uint64_t seq, char type) const;
+
+  bool loadManifest();
+  bool saveManifest();
+  void removeUnusedFiles();
+  bool openIncr(const PAofFile& file);
+  bool replay(const PString& file, bool lastFile);
+  void onRewriteDone(bool succ, uint64_t seq);
+
+  void feedCommand(const std::vector<PString>& params);
+  void startFsyncThread();
+  void stopFsyncThread();
+  void fsyncRoutine();
+  void closeOldFds();
+
+  PString dir_;
+  PString name_;
+  PAofFile base_;  // empty name if no base
+  std::vector<PAofFile> incrs_;
+  uint64_t seq_ = 0;  // the max seq used
+
+  int fd_ = -1;
+  int selectedDB_ = -1;
+  bool loading_ = false;
+  UnboundedBuffer buf_;
+
+  uint64_t size_ = 0;             // total size of base and incr files
+  uint64_t rewriteBaseSize_ = 0;  // size_ after last rewrite
+  uint64_t incrSize_ = 0;         // size of the incr file in writing
+  uint64_t writeErrors_ = 0;
+
+  bool rewriting_ = false;
+  bool rewriteScheduled_ = false;
+  bool lastRewriteOk_ = true;
+  uint64_t rewrites_ = 0;
+
+  // background fsync for everysec policy
+  std::thread fsyncThread_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool stop_ = false;
+  uint64_t fileGen_ = 0;              // changed when fd_ is switched
+  std::vector<int> closingFds_;       // switched out by openIncr, closed by the fsync thread
+  std::atomic<uint64_t> written_{0};  // bytes written to fd_
+  std::atomic<uint64_t> synced_{0};   // bytes known to be on disk
+  std::atomic<int64_t> lastFsync_{0};
+  std::atomic<int> fsyncPolicy_{PAofFsync_everysec};
+};
+
+}  // namespace pikiwidb
+
+#define PAOF pikiwidb::PAof::Instance()
@@ -6,7 +6,9 @@
  */
 
 #include "base_cmd.h"
+#include "command_stats.h"
 #include "common.h"
+#include "cycle_clock.h"
 #include "pikiwidb.h"
 
 namespace pikiwidb {
@@ -31,10 +33,12 @@ std::vector<std::string> BaseCmd::CurrentKey(const CmdContext& context) const {
 }
 
 void BaseCmd::Execute(CmdContext& ctx) {
-  if (!DoInitial(ctx)) {
-    return;
+  const uint64_t begin = CycleClock::Now();
+  if (DoInitial(ctx)) {
+    DoCmd(ctx);
   }
-  DoCmd(ctx);
+
+  PCommandStats::Instance().Call(this, name_, CycleClock::ToNs(CycleClock::Now() - begin), ctx.error());
 }
 
 std::string BaseCmd::ToBinlog(uint32_t exec_time, uint32_t term_id, uint64_t logic_id, uint32_t filenum,
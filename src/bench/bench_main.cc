@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+// pikiwidb_bench, the microbenchmarks of the server code, results in json by
+//   ./pikiwidb_bench --benchmark_format=json --benchmark_out=result.json
+
+#include <benchmark/benchmark.h>
+
+#include "log.h"
+
+int main(int argc, char** argv) {
+  // the server code logs by this name, keep it quiet
+  spdlog::register_logger(std::make_shared<spdlog::logger>(logger::Logger::Instance().Name()));
+
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
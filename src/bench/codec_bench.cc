@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+// the encodings of rdb, DUMP, the leveldb backend and the compression codecs
+
+#include <benchmark/benchmark.h>
+
+#include <random>
+
+#include "compress.h"
+#include "db.h"
+#include "hash.h"
+#include "leveldb.h"
+#include "list.h"
+#include "set.h"
+#include "sorted_set.h"
+
+extern "C" {
+#include "lzf/lzf.h"
+}
+
+namespace pikiwidb {
+
+// text of words, compressible as usual values
+static PString MakeText(std::size_t len) {
+  static const char* const words[] = {"pikiwidb", "redis", "value", "user", "2023", "session", "id", "{", "}", ":"};
+  std::mt19937 rng(static_cast<unsigned>(len));
+  PString text;
+  while (text.size() < len) {
+    text += words[rng() % std::size(words)];
+    text += ' ';
+  }
+  text.resize(len);
+  return text;
+}
+
+// the object of type with n members, or a string of n bytes
+static PObject MakeObject(PType type, int64_t n) {
+  auto member = [](int64_t i) { return "member:" + std::to_string(i); };
+  PObject obj;
+  switch (type) {
+    case PType_string:
+      obj = PObject::CreateString(MakeText(n));
+      break;
+    case PType_list:
+      obj = PObject::CreateList();
+      for (int64_t i = 0; i < n; ++i) {
+        obj.CastList()->push_back(member(i));
+      }
+      break;
+    case PType_set:
+      obj = PObject::CreateSet();
+      for (int64_t i = 0; i < n; ++i) {
+        obj.CastSet()->insert(member(i));
+      }
+      break;
+    case PType_sortedSet:
+      obj = PObject::CreateZSet();
+      for (int64_t i = 0; i < n; ++i) {
+        obj.CastSortedSet()->AddMember(member(i), static_cast<double>(i) / 3);
+      }
+      break;
+    case PType_hash:
+      obj = PObject::CreateHash();
+      for (int64_t i = 0; i < n; ++i) {
+        obj.CastHash()->insert({member(i), "value:" + std::to_string(i)});
+      }
+      break;
+    default:
+      break;
+  }
+  return obj;
+}
+
+static const std::vector<int64_t> kTypes = {PType_string, PType_list, PType_set, PType_sortedSet, PType_hash};
+static const std::vector<int64_t> kSizes = {16, 1024, 65536};
+
+static void SetTypeLabel(benchmark::State& state) {
+  static const char* const names[] = {"invalid", "string", "list", "set", "zset", "hash"};
+  const auto type = state.range(0);
+  state.SetLabel(type > 0 && type < static_cast<int64_t>(std::size(names)) ? names[type] : "?");
+}
+
+// DUMP, the object encoded as in rdb, args: type, members or bytes
+static void BM_DumpObject(benchmark::State& state) {
+  const PObject obj = MakeObject(static_cast<PType>(state.range(0)), state.range(1));
+  std::size_t bytes = 0;
+
+  for (auto _ : state) {
+    PString payload = PDBSaver::DumpObject(obj);
+    bytes = payload.size();
+    benchmark::DoNotOptimize(payload.data());
+  }
+
+  SetTypeLabel(state);
+  state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(bytes));
+}
+BENCHMARK(BM_DumpObject)->ArgsProduct({kTypes, kSizes})->Unit(benchmark::kMicrosecond);
+
+// RESTORE, args: type, members or bytes
+static void BM_RestoreObject(benchmark::State& state) {
+  const PString payload = PDBSaver::DumpObject(MakeObject(static_cast<PType>(state.range(0)), state.range(1)));
+
+  for (auto _ : state) {
+    PObject obj;
+    if (!PDBLoader::RestoreObject(payload, obj)) {
+      state.SkipWithError("bad payload");
+      return;
+    }
+    benchmark::DoNotOptimize(obj.value);
+  }
+
+  SetTypeLabel(state);
+  state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(payload.size()));
+}
+BENCHMARK(BM_RestoreObject)->ArgsProduct({kTypes, kSizes})->Unit(benchmark::kMicrosecond);
+
+// the value of the leveldb backend, args: type, members or bytes
+static void BM_LeveldbEncode(benchmark::State& state) {
+  const PObject obj = MakeObject(static_cast<PType>(state.range(0)), state.range(1));
+  PLeveldb codec;
+  UnboundedBuffer value;
+
+  for (auto _ : state) {
+    value.Clear();
+    codec.encodeObject(obj, 0, value);
+    benchmark::DoNotOptimize(value.ReadAddr());
+  }
+
+  SetTypeLabel(state);
+  state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(value.ReadableSize()));
+}
+BENCHMARK(BM_LeveldbEncode)->ArgsProduct({kTypes, kSizes})->Unit(benchmark::kMicrosecond);
+
+static void BM_LeveldbDecode(benchmark::State& state) {
+  const PObject obj = MakeObject(static_cast<PType>(state.range(0)), state.range(1));
+  PLeveldb codec;
+  UnboundedBuffer value;
+  codec.encodeObject(obj, 0, value);
+
+  for (auto _ : state) {
+    int64_t ttl = 0;
+    PObject decoded = codec.decodeObject(value.ReadAddr(), value.ReadableSize(), ttl);
+    benchmark::DoNotOptimize(decoded.value);
+  }
+
+  SetTypeLabel(state);
+  state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(value.ReadableSize()));
+}
+BENCHMARK(BM_LeveldbDecode)->ArgsProduct({kTypes, kSizes})->Unit(benchmark::kMicrosecond);
+
+// lzf as rdb of redis, arg: bytes
+static void BM_LzfCompress(benchmark::State& state) {
+  const PString text = MakeText(state.range(0));
+  PString out(text.size(), '\0');
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(lzf_compress(text.data(), static_cast<unsigned>(text.size()), &out[0],
+                                          static_cast<unsigned>(out.size())));
+  }
+
+  state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(text.size()));
+}
+BENCHMARK(BM_LzfCompress)->RangeMultiplier(16)->Range(64, 4 * 1024 * 1024);
+
+static void BM_LzfDecompress(benchmark::State& state) {
+  const PString text = MakeText(state.range(0));
+  PString compressed(text.size(), '\0');
+  unsigned len = lzf_compress(text.data(), static_cast<unsigned>(text.size()), &compressed[0],
+                              static_cast<unsigned>(compressed.size()));
+  if (len == 0) {
+    state.SkipWithError("not compressible");
+    return;
+  }
+  PString out(text.size(), '\0');
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(lzf_decompress(compressed.data(), len, &out[0], static_cast<unsigned>(out.size())));
+  }
+
+  state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(text.size()));
+}
+BENCHMARK(BM_LzfDecompress)->RangeMultiplier(16)->Range(64, 4 * 1024 * 1024);
+
+// the codecs of rdb-compression-codec and repl-compression, args: codec, bytes
+static void BM_Compress(benchmark::State& state) {
+  const auto codec = static_cast<PCodec>(state.range(0));
+  const PString text = MakeText(state.range(1));
+  PString out;
+
+  for (auto _ : state) {
+    out.clear();
+    benchmark::DoNotOptimize(Compress(codec, 0, text.data(), text.size(), out));
+  }
+
+  state.SetLabel(CodecName(codec));
+  state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(text.size()));
+}
+BENCHMARK(BM_Compress)->ArgsProduct({{PCodec_lzf, PCodec_lz4, PCodec_zstd}, {1024, 64 * 1024, 1024 * 1024}});
+
+}  // namespace pikiwidb
@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+// the data structures behind the commands of sorted set, hash scan and bitcount
+
+#include <benchmark/benchmark.h>
+
+#include <map>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "hash.h"
+#include "helper.h"
+#include "sorted_set.h"
+
+namespace pikiwidb {
+
+static PString Member(int64_t i) { return "member:" + std::to_string(i); }
+
+// shared by the benchmarks of the same size, it takes seconds to build the big ones
+static const PSortedSet& ZSetOf(int64_t members) {
+  static std::map<int64_t, std::unique_ptr<PSortedSet>> cache;
+  auto& zset = cache[members];
+  if (!zset) {
+    zset = std::make_unique<PSortedSet>();
+    std::mt19937_64 rng(members);
+    for (int64_t i = 0; i < members; ++i) {
+      zset->AddMember(Member(i), static_cast<double>(rng() % (members * 4)));
+    }
+  }
+  return *zset;
+}
+
+static const PHash& HashOf(int64_t fields) {
+  static std::map<int64_t, std::unique_ptr<PHash>> cache;
+  auto& hash = cache[fields];
+  if (!hash) {
+    hash = std::make_unique<PHash>();
+    for (int64_t i = 0; i < fields; ++i) {
+      hash->insert({Member(i), "value"});
+    }
+  }
+  return *hash;
+}
+
+// ZADD of new members to an empty zset, arg: members
+static void BM_ZSetAdd(benchmark::State& state) {
+  const int64_t n = state.range(0);
+  std::vector<PString> members;
+  for (int64_t i = 0; i < n; ++i) {
+    members.push_back(Member(i));
+  }
+
+  for (auto _ : state) {
+    PSortedSet zset;
+    for (int64_t i = 0; i < n; ++i) {
+      zset.AddMember(members[i], static_cast<double>(i * 7919 % n));
+    }
+    benchmark::DoNotOptimize(zset.Size());
+  }
+
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_ZSetAdd)->RangeMultiplier(32)->Range(32, 1 << 20)->Unit(benchmark::kMicrosecond);
+
+// ZRANK of random members, arg: members
+static void BM_ZSetRank(benchmark::State& state) {
+  const int64_t n = state.range(0);
+  const PSortedSet& zset = ZSetOf(n);
+  std::mt19937_64 rng(0);
+  std::vector<PString> members;
+  for (int i = 0; i < 1024; ++i) {
+    members.push_back(Member(rng() % n));
+  }
+
+  std::size_t i = 0;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(zset.Rank(members[i++ % members.size()]));
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ZSetRank)->RangeMultiplier(32)->Range(32, 1 << 20)->Unit(benchmark::kMicrosecond);
+
+// ZRANGE of 10 members from the middle, arg: members
+static void BM_ZSetRangeByRank(benchmark::State& state) {
+  const int64_t n = state.range(0);
+  const PSortedSet& zset = ZSetOf(n);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(zset.RangeByRank(n / 2, n / 2 + 9));
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ZSetRangeByRank)->RangeMultiplier(32)->Range(32, 1 << 20)->Unit(benchmark::kMicrosecond);
+
+// one HSCAN call of 10 fields from the middle, args: fields
+static void BM_ScanHashMember(benchmark::State& state) {
+  const int64_t n = state.range(0);
+  const PHash& hash = HashOf(n);
+  std::vector<PHash::const_local_iterator> res;
+
+  for (auto _ : state) {
+    res.clear();
+    benchmark::DoNotOptimize(ScanHashMember(hash, n / 2, 10, res));
+  }
+
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_ScanHashMember)->RangeMultiplier(32)->Range(32, 1 << 20)->Unit(benchmark::kMicrosecond);
+
+// a whole HSCAN by cursor, 10 fields per call, args: fields
+static void BM_ScanHashWhole(benchmark::State& state) {
+  const int64_t n = state.range(0);
+  const PHash& hash = HashOf(n);
+  std::vector<PHash::const_local_iterator> res;
+
+  for (auto _ : state) {
+    std::size_t cursor = 0;
+    do {
+      res.clear();
+      cursor = ScanHashMember(hash, cursor, 10, res);
+    } while (cursor != 0);
+  }
+
+  state.SetItemsProcessed(state.iterations() * n);
+}
+BENCHMARK(BM_ScanHashWhole)->RangeMultiplier(8)->Range(64, 32 * 1024)->Unit(benchmark::kMillisecond);
+
+// BITCOUNT, arg: bytes up to a 100 MB bitmap
+static void BM_BitCount(benchmark::State& state) {
+  const auto len = static_cast<std::size_t>(state.range(0));
+  std::vector<uint8_t> bitmap(len);
+  std::mt19937 rng(0);
+  for (auto& b : bitmap) {
+    b = static_cast<uint8_t>(rng());
+  }
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(BitCount(bitmap.data(), len));
+  }
+
+  state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(len));
+}
+BENCHMARK(BM_BitCount)->Arg(64)->Arg(4 * 1024)->Arg(1024 * 1024)->Arg(100 * 1024 * 1024);
+
+}  // namespace pikiwidb
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+// the request parser and the buffers of the network path
+
+#include <benchmark/benchmark.h>
+
+#include "proto_parser.h"
+#include "unbounded_buffer.h"
+
+namespace pikiwidb {
+
+// commands of SET key:N value
+static PString MakePipeline(int64_t commands, int64_t valueSize) {
+  const PString value(valueSize, 'v');
+  PString out;
+  for (int64_t i = 0; i < commands; ++i) {
+    PString key = "key:" + std::to_string(i);
+    out += "*3\r\n$3\r\nset\r\n$" + std::to_string(key.size()) + "\r\n" + key + "\r\n$" +
+           std::to_string(value.size()) + "\r\n" + value + "\r\n";
+  }
+  return out;
+}
+
+// a pipeline received in one read, args: commands, value size
+static void BM_ParseRequest(benchmark::State& state) {
+  const PString pipeline = MakePipeline(state.range(0), state.range(1));
+  PProtoParser parser;
+
+  for (auto _ : state) {
+    const char* ptr = pipeline.data();
+    const char* const end = ptr + pipeline.size();
+    while (ptr < end) {
+      if (parser.ParseRequest(ptr, end) != PParseResult::ok) {
+        state.SkipWithError("parse failed");
+        return;
+      }
+      benchmark::DoNotOptimize(parser.GetParams().data());
+      parser.Reset();
+    }
+  }
+
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(pipeline.size()));
+}
+BENCHMARK(BM_ParseRequest)->ArgsProduct({{1, 100, 10000}, {16, 1024}});
+
+// a request received in reads of the size, the parser resumes at each, args: value size, read size
+static void BM_ParseRequestSplit(benchmark::State& state) {
+  const PString request = MakePipeline(1, state.range(0));
+  const auto step = static_cast<std::size_t>(state.range(1));
+  PProtoParser parser;
+
+  for (auto _ : state) {
+    const char* ptr = request.data();
+    const char* const end = ptr + request.size();
+    const char* received = ptr;
+    PParseResult ret = PParseResult::wait;
+    while (ret == PParseResult::wait && received < end) {
+      received = std::min(received + step, end);
+      ret = parser.ParseRequest(ptr, received);
+    }
+    if (ret != PParseResult::ok) {
+      state.SkipWithError("parse failed");
+      return;
+    }
+    parser.Reset();
+  }
+
+  state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(request.size()));
+}
+BENCHMARK(BM_ParseRequestSplit)->ArgsProduct({{16 * 1024, 1024 * 1024}, {1460, 16 * 1024}});
+
+// replies appended in pieces then consumed, as the output of a client, arg: piece size
+static void BM_UnboundedBufferWrite(benchmark::State& state) {
+  const PString piece(state.range(0), 'r');
+  const int64_t pieces = (64 * 1024) / state.range(0) + 1;
+  UnboundedBuffer buffer;
+
+  for (auto _ : state) {
+    for (int64_t i = 0; i < pieces; ++i) {
+      buffer.Write(piece.data(), piece.size());
+    }
+    benchmark::DoNotOptimize(buffer.ReadAddr());
+    buffer.AdjustReadPtr(buffer.ReadableSize());
+    buffer.Clear();
+  }
+
+  state.SetBytesProcessed(state.iterations() * pieces * state.range(0));
+}
+BENCHMARK(BM_UnboundedBufferWrite)->RangeMultiplier(8)->Range(8, 8 * 1024);
+
+// a big reply which grows the buffer from empty, arg: bytes
+static void BM_UnboundedBufferGrow(benchmark::State& state) {
+  const PString piece(512, 'r');
+  const int64_t pieces = state.range(0) / static_cast<int64_t>(piece.size());
+
+  for (auto _ : state) {
+    UnboundedBuffer buffer;
+    for (int64_t i = 0; i < pieces; ++i) {
+      buffer.PushData(piece.data(), piece.size());
+    }
+    benchmark::DoNotOptimize(buffer.ReadAddr());
+  }
+
+  state.SetBytesProcessed(state.iterations() * pieces * static_cast<int64_t>(piece.size()));
+}
+BENCHMARK(BM_UnboundedBufferGrow)->RangeMultiplier(16)->Range(64 * 1024, 64 * 1024 * 1024);
+
+}  // namespace pikiwidb
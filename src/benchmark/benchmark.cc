@@ -0,0 +1,875 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+// pikiwidb-benchmark, a load generator on the event loops of pikiwidb: the
+// connections are spread over threads, each of them keeps the pipeline full
+// with the commands of the mix on keys of the distribution, and the latency
+// of each request is recorded into histograms reported in text or json.
+
+#include <signal.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "event_loop.h"
+#include "histogram.h"
+#include "log.h"
+
+namespace pikiwidb {
+
+enum class KeyDist { uniform, zipfian, hotspot };
+
+struct Options {
+  std::string host = "127.0.0.1";
+  int port = 9221;
+  std::string password;
+  int dbnum = -1;
+  int threads = 1;
+  int clients = 50;
+  int pipeline = 1;
+  int64_t requests = 100000;  // 0 is unlimited
+  int duration = 0;           // seconds, 0 is unlimited
+  uint64_t keyspace = 100000;
+  uint64_t fields = 100;  // of hash, set and zset
+  KeyDist dist = KeyDist::uniform;
+  double zipfTheta = 0.99;
+  double hotKeys = 0.2;  // the hot keys in keyspace
+  double hotOps = 0.8;   // the requests to the hot keys
+  std::string mix = "set:50,get:50";
+  std::string valueSpec = "3";
+  std::size_t valueMin = 3;
+  std::size_t valueMax = 3;
+  bool valueLog = false;  // the size is log-uniform in [min, max], small values are more frequent
+  std::string prefix;
+  uint64_t seed = 0;
+  std::string json;  // file, - is stdout
+  bool quiet = false;
+};
+
+// the keys are numbered in [0, keyspace)
+class KeyGenerator {
+ public:
+  explicit KeyGenerator(const Options& opt) : opt_(opt) {
+    if (opt.dist != KeyDist::zipfian) {
+      return;
+    }
+
+    // Gray et al, "Quickly generating billion-record synthetic databases"
+    const double n = static_cast<double>(opt.keyspace);
+    const double theta = opt.zipfTheta;
+    for (uint64_t i = 1; i <= opt.keyspace; ++i) {
+      zetan_ += 1 / std::pow(static_cast<double>(i), theta);
+    }
+    const double zeta2 = 1 + 1 / std::pow(2.0, theta);
+    alpha_ = 1 / (1 - theta);
+    eta_ = (1 - std::pow(2 / n, 1 - theta)) / (1 - zeta2 / zetan_);
+    half_ = 1 + std::pow(0.5, theta);
+  }
+
+  template <typename Rng>
+  uint64_t Next(Rng& rng) const {
+    std::uniform_real_distribution<double> real(0, 1);
+    switch (opt_.dist) {
+      case KeyDist::uniform:
+        return rng() % opt_.keyspace;
+
+      case KeyDist::zipfian: {
+        double u = real(rng);
+        double uz = u * zetan_;
+        if (uz < 1) {
+          return 0;
+        }
+        if (uz < half_) {
+          return 1 % opt_.keyspace;
+        }
+        auto k = static_cast<uint64_t>(opt_.keyspace * std::pow(eta_ * u - eta_ + 1, alpha_));
+        return std::min(k, opt_.keyspace - 1);
+      }
+
+      case KeyDist::hotspot: {
+        uint64_t hot = std::max<uint64_t>(1, static_cast<uint64_t>(opt_.keyspace * opt_.hotKeys));
+        if (hot >= opt_.keyspace || real(rng) < opt_.hotOps) {
+          return rng() % hot;
+        }
+        return hot + rng() % (opt_.keyspace - hot);
+      }
+    }
+
+    return 0;
+  }
+
+ private:
+  const Options& opt_;
+  double zetan_ = 0;
+  double alpha_ = 0;
+  double eta_ = 0;
+  double half_ = 0;
+};
+
+// the commands which can be in the mix, the arguments are made by Request
+enum class OpType {
+  ping,
+  set,
+  get,
+  incr,
+  del,
+  lpush,
+  rpush,
+  lpop,
+  rpop,
+  sadd,
+  sismember,
+  hset,
+  hget,
+  zadd,
+  zrank,
+  zscore,
+};
+
+struct OpDef {
+  const char* name;
+  OpType type;
+};
+
+const OpDef g_opDefs[] = {
+    {"ping", OpType::ping},   {"set", OpType::set},           {"get", OpType::get},     {"incr", OpType::incr},
+    {"del", OpType::del},     {"lpush", OpType::lpush},       {"rpush", OpType::rpush}, {"lpop", OpType::lpop},
+    {"rpop", OpType::rpop},   {"sadd", OpType::sadd},         {"sismember", OpType::sismember},
+    {"hset", OpType::hset},   {"hget", OpType::hget},         {"zadd", OpType::zadd},   {"zrank", OpType::zrank},
+    {"zscore", OpType::zscore},
+};
+
+struct Op {
+  const OpDef* def;
+  unsigned weight;
+};
+
+struct Workload {
+  std::vector<Op> ops;
+  unsigned totalWeight = 0;
+  std::string values;  // the values are the prefixes of it
+};
+
+void AppendArg(std::string& out, std::string_view arg) {
+  char tmp[32];
+  int n = snprintf(tmp, sizeof tmp, "$%zu\r\n", arg.size());
+  out.append(tmp, n);
+  out.append(arg);
+  out.append("\r\n", 2);
+}
+
+void AppendCommand(std::string& out, std::initializer_list<std::string_view> args) {
+  char tmp[32];
+  int n = snprintf(tmp, sizeof tmp, "*%zu\r\n", args.size());
+  out.append(tmp, n);
+  for (auto arg : args) {
+    AppendArg(out, arg);
+  }
+}
+
+// the bytes of the first whole reply, 0 if it's not complete, -1 if it's not RESP
+long ReplyLength(const char* begin, const char* end) {
+  const char* crlf = static_cast<const char*>(memchr(begin, '\r', end - begin));
+  if (!crlf || crlf + 1 >= end) {
+    return 0;
+  }
+
+  long head = crlf + 2 - begin;
+  switch (*begin) {
+    case '+':
+    case '-':
+    case ':':
+      return head;
+
+    case '$': {
+      long len = strtol(begin + 1, nullptr, 10);
+      if (len < 0) {
+        return head;
+      }
+      return end - begin >= head + len + 2 ? head + len + 2 : 0;
+    }
+
+    case '*': {
+      long n = strtol(begin + 1, nullptr, 10);
+      long total = head;
+      for (long i = 0; i < n; ++i) {
+        long len = ReplyLength(begin + total, end);
+        if (len <= 0) {
+          return len;
+        }
+        total += len;
+      }
+      return total;
+    }
+
+    default:
+      return -1;
+  }
+}
+
+using Clock = std::chrono::steady_clock;
+
+inline uint64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// shared by the workers
+std::atomic<int64_t> g_budget{0};  // requests not issued, if Options::requests is not 0
+std::atomic<bool> g_stop{false};
+uint64_t g_deadline = 0;  // ns, 0 is none
+
+class Worker {
+ public:
+  Worker(const Options& opt, const Workload& work, const KeyGenerator& keys, int id, int clients)
+      : opt_(opt), work_(work), keys_(keys), clients_(clients), rng_(opt.seed + id), perOp_(work.ops.size()) {
+    active_ = clients;
+  }
+
+  void Run();
+
+  const Histogram& Latency() const { return latency_; }
+  const Histogram& OpLatency(std::size_t i) const { return perOp_[i].latency; }
+  uint64_t OpErrors(std::size_t i) const { return perOp_[i].errors; }
+  uint64_t Done() const { return done_.load(std::memory_order_relaxed); }
+  uint64_t Errors() const { return errors_; }
+  int FailedClients() const { return failedClients_; }
+
+ private:
+  struct Pending {
+    uint64_t start;  // ns
+    std::size_t op;
+  };
+
+  struct Conn {
+    int skip = 0;  // the replies of auth and select
+    std::deque<Pending> inflight;
+    bool finished = false;
+  };
+
+  struct OpStat {
+    Histogram latency;
+    uint64_t errors = 0;
+  };
+
+  void onConnect(TcpObject* obj);
+  int onReplies(TcpObject* obj, Conn& conn, const char* data, int len);
+  void fill(TcpObject* obj, Conn& conn);
+  bool take() const;
+  void request(std::string& out, std::size_t op);
+  void finish(Conn& conn, bool failed);
+
+  std::string_view key(const char* type, uint64_t n) {
+    int len = snprintf(keyBuf_, sizeof keyBuf_, "%s%s:%012lu", opt_.prefix.c_str(), type, n);
+    return {keyBuf_, static_cast<std::size_t>(std::min<int>(len, sizeof keyBuf_ - 1))};
+  }
+  std::string_view member(const char* type) {
+    int len = snprintf(memberBuf_, sizeof memberBuf_, "%s:%lu", type, rng_() % opt_.fields);
+    return {memberBuf_, static_cast<std::size_t>(len)};
+  }
+  std::string_view value() {
+    std::size_t size = opt_.valueMin;
+    if (opt_.valueMax > opt_.valueMin) {
+      if (opt_.valueLog) {
+        std::uniform_real_distribution<double> exp(std::log(opt_.valueMin), std::log(opt_.valueMax + 1));
+        size = std::min(opt_.valueMax, static_cast<std::size_t>(std::exp(exp(rng_))));
+      } else {
+        size += rng_() % (opt_.valueMax - opt_.valueMin + 1);
+      }
+    }
+    std::size_t offset = rng_() % (work_.values.size() - size + 1);
+    return {work_.values.data() + offset, size};
+  }
+
+  const Options& opt_;
+  const Workload& work_;
+  const KeyGenerator& keys_;
+  const int clients_;
+  std::mt19937_64 rng_;
+  EventLoop* loop_ = nullptr;
+  int active_;  // the connections not finished
+
+  Histogram latency_;
+  std::vector<OpStat> perOp_;
+  std::atomic<uint64_t> done_{0};
+  uint64_t errors_ = 0;
+  int failedClients_ = 0;
+
+  char keyBuf_[256];
+  char memberBuf_[64];
+  char numBuf_[32];
+};
+
+void Worker::Run() {
+  EventLoop loop;
+  loop.SetName("bench-worker");
+  loop_ = &loop;
+
+  for (int i = 0; i < clients_; ++i) {
+    auto fail = [this](EventLoop*, const char* ip, int port) {
+      fprintf(stderr, "can't connect to %s:%d\n", ip, port);
+      Conn conn;
+      finish(conn, true);
+    };
+    auto obj = loop.Connect(opt_.host.c_str(), opt_.port, [this](TcpObject* obj) { onConnect(obj); }, fail);
+    if (!obj) {
+      fprintf(stderr, "can't connect to %s:%d\n", opt_.host.c_str(), opt_.port);
+      Conn conn;
+      finish(conn, true);
+    }
+  }
+
+  if (active_ > 0) {
+    loop.Run();
+  }
+  loop_ = nullptr;
+}
+
+void Worker::onConnect(TcpObject* obj) {
+  auto conn = std::make_shared<Conn>();
+  obj->SetNodelay(true);
+  obj->SetMessageCallback(
+      [this, conn](TcpObject* obj, const char* data, int len) { return onReplies(obj, *conn, data, len); });
+  obj->SetOnDisconnect([this, conn](TcpObject*) {
+    if (!conn->finished) {
+      fprintf(stderr, "connection closed by server\n");
+      finish(*conn, true);
+    }
+  });
+
+  std::string out;
+  if (!opt_.password.empty()) {
+    AppendCommand(out, {"auth", opt_.password});
+    ++conn->skip;
+  }
+  if (opt_.dbnum >= 0) {
+    AppendCommand(out, {"select", std::to_string(opt_.dbnum)});
+    ++conn->skip;
+  }
+  obj->SendPacket(out);
+
+  fill(obj, *conn);
+}
+
+bool Worker::take() const {
+  if (g_stop.load(std::memory_order_relaxed)) {
+    return false;
+  }
+  if (g_deadline != 0 && NowNs() >= g_deadline) {
+    return false;
+  }
+  if (opt_.requests > 0) {
+    return g_budget.fetch_sub(1, std::memory_order_relaxed) > 0;
+  }
+  return true;
+}
+
+void Worker::fill(TcpObject* obj, Conn& conn) {
+  std::string out;
+  uint64_t now = NowNs();
+  std::uniform_int_distribution<unsigned> pick(0, work_.totalWeight - 1);
+  while (static_cast<int>(conn.inflight.size()) < opt_.pipeline && take()) {
+    unsigned w = pick(rng_);
+    std::size_t op = 0;
+    while (w >= work_.ops[op].weight) {
+      w -= work_.ops[op].weight;
+      ++op;
+    }
+
+    request(out, op);
+    conn.inflight.push_back({now, op});
+  }
+
+  if (!out.empty()) {
+    obj->SendPacket(out);
+  }
+  if (conn.inflight.empty() && conn.skip == 0) {
+    finish(conn, false);
+    obj->ActiveClose();
+  }
+}
+
+void Worker::request(std::string& out, std::size_t op) {
+  switch (work_.ops[op].def->type) {
+    case OpType::ping:
+      AppendCommand(out, {"ping"});
+      break;
+    case OpType::set:
+      AppendCommand(out, {"set", key("key", keys_.Next(rng_)), value()});
+      break;
+    case OpType::get:
+      AppendCommand(out, {"get", key("key", keys_.Next(rng_))});
+      break;
+    case OpType::incr:
+      AppendCommand(out, {"incr", key("counter", keys_.Next(rng_))});
+      break;
+    case OpType::del:
+      AppendCommand(out, {"del", key("key", keys_.Next(rng_))});
+      break;
+    case OpType::lpush:
+      AppendCommand(out, {"lpush", key("list", keys_.Next(rng_)), value()});
+      break;
+    case OpType::rpush:
+      AppendCommand(out, {"rpush", key("list", keys_.Next(rng_)), value()});
+      break;
+    case OpType::lpop:
+      AppendCommand(out, {"lpop", key("list", keys_.Next(rng_))});
+      break;
+    case OpType::rpop:
+      AppendCommand(out, {"rpop", key("list", keys_.Next(rng_))});
+      break;
+    case OpType::sadd:
+      AppendCommand(out, {"sadd", key("set", keys_.Next(rng_)), member("member")});
+      break;
+    case OpType::sismember:
+      AppendCommand(out, {"sismember", key("set", keys_.Next(rng_)), member("member")});
+      break;
+    case OpType::hset:
+      AppendCommand(out, {"hset", key("hash", keys_.Next(rng_)), member("field"), value()});
+      break;
+    case OpType::hget:
+      AppendCommand(out, {"hget", key("hash", keys_.Next(rng_)), member("field")});
+      break;
+    case OpType::zadd: {
+      int len = snprintf(numBuf_, sizeof numBuf_, "%lu", rng_() % 1000000);
+      AppendCommand(out, {"zadd", key("zset", keys_.Next(rng_)), std::string_view(numBuf_, len), member("member")});
+      break;
+    }
+    case OpType::zrank:
+      AppendCommand(out, {"zrank", key("zset", keys_.Next(rng_)), member("member")});
+      break;
+    case OpType::zscore:
+      AppendCommand(out, {"zscore", key("zset", keys_.Next(rng_)), member("member")});
+      break;
+  }
+}
+
+int Worker::onReplies(TcpObject* obj, Conn& conn, const char* data, int len) {
+  const char* const end = data + len;
+  const char* ptr = data;
+  uint64_t now = NowNs();
+  uint64_t replies = 0;
+
+  while (ptr < end) {
+    long n = ReplyLength(ptr, end);
+    if (n == 0) {
+      break;
+    }
+    if (n < 0 || (conn.skip == 0 && conn.inflight.empty())) {
+      fprintf(stderr, "unexpected reply from server\n");
+      g_stop = true;
+      finish(conn, true);
+      return -1;
+    }
+
+    if (conn.skip > 0) {
+      --conn.skip;
+      if (*ptr == '-') {
+        fprintf(stderr, "%.*s\n", static_cast<int>(n - 2), ptr);
+        g_stop = true;
+      }
+    } else {
+      const Pending& req = conn.inflight.front();
+      uint64_t cost = now - req.start;
+      latency_.Record(cost);
+      perOp_[req.op].latency.Record(cost);
+      if (*ptr == '-') {
+        ++errors_;
+        ++perOp_[req.op].errors;
+      }
+      conn.inflight.pop_front();
+      ++replies;
+    }
+
+    ptr += n;
+  }
+
+  done_.fetch_add(replies, std::memory_order_relaxed);
+  if (!conn.finished) {
+    fill(obj, conn);
+  }
+
+  return static_cast<int>(ptr - data);
+}
+
+void Worker::finish(Conn& conn, bool failed) {
+  if (conn.finished) {
+    return;
+  }
+
+  conn.finished = true;
+  if (failed) {
+    ++failedClients_;
+  }
+  if (--active_ == 0 && loop_) {
+    loop_->Stop();
+  }
+}
+
+bool ParseMix(const std::string& spec, Workload& work) {
+  std::size_t pos = 0;
+  while (pos < spec.size()) {
+    std::size_t comma = spec.find(',', pos);
+    std::string item = spec.substr(pos, comma == std::string::npos ? std::string::npos : comma - pos);
+    pos = comma == std::string::npos ? spec.size() : comma + 1;
+
+    std::size_t colon = item.find(':');
+    std::string name = item.substr(0, colon);
+    unsigned weight = colon == std::string::npos ? 1 : static_cast<unsigned>(atoi(item.c_str() + colon + 1));
+
+    const OpDef* def = nullptr;
+    for (const auto& d : g_opDefs) {
+      if (strcasecmp(d.name, name.c_str()) == 0) {
+        def = &d;
+      }
+    }
+    if (!def) {
+      fprintf(stderr, "unknown command in mix: %s\n", name.c_str());
+      return false;
+    }
+    if (weight > 0) {
+      work.ops.push_back({def, weight});
+      work.totalWeight += weight;
+    }
+  }
+
+  if (work.totalWeight == 0) {
+    fprintf(stderr, "no command in mix\n");
+    return false;
+  }
+  return true;
+}
+
+// N, MIN-MAX or MIN-MAX:log
+bool ParseValueSize(Options& opt) {
+  const std::string& spec = opt.valueSpec;
+  opt.valueLog = spec.size() > 4 && spec.compare(spec.size() - 4, 4, ":log") == 0;
+  char* end = nullptr;
+  long min = strtol(spec.c_str(), &end, 10);
+  long max = min;
+  if (*end == '-') {
+    max = strtol(end + 1, &end, 10);
+  }
+  if (min <= 0 || max < min || (*end && strcmp(end, ":log") != 0)) {
+    fprintf(stderr, "bad value size: %s\n", spec.c_str());
+    return false;
+  }
+
+  opt.valueMin = static_cast<std::size_t>(min);
+  opt.valueMax = static_cast<std::size_t>(max);
+  return true;
+}
+
+void Usage() {
+  fprintf(stderr,
+          "Usage: pikiwidb-benchmark [options]\n"
+          " -h <host>             server host (default 127.0.0.1)\n"
+          " -p <port>             server port (default 9221)\n"
+          " -a <password>         password to auth\n"
+          " --dbnum <db>          select the db\n"
+          " --threads <n>         threads to run the clients (default 1)\n"
+          " -c <clients>          connections in total (default 50)\n"
+          " -P <pipeline>         requests in flight per connection (default 1)\n"
+          " -n <requests>         requests in total, 0 for no limit (default 100000)\n"
+          " --duration <seconds>  stop after the time\n"
+          " -r <keyspace>         the keys are in [0, keyspace) (default 100000)\n"
+          " --fields <n>          members or fields per key (default 100)\n"
+          " --dist <dist>         uniform, zipfian or hotspot (default uniform)\n"
+          " --zipf-theta <theta>  skew of zipfian in (0, 1) (default 0.99)\n"
+          " --hot-keys <ratio>    the hot keys of hotspot (default 0.2)\n"
+          " --hot-ops <ratio>     the requests to the hot keys (default 0.8)\n"
+          " --mix <mix>           commands and weights (default set:50,get:50), the commands\n"
+          "                       are ping set get incr del lpush rpush lpop rpop sadd\n"
+          "                       sismember hset hget zadd zrank zscore\n"
+          " --value-size <size>   N, MIN-MAX (uniform) or MIN-MAX:log (log-uniform) (default 3)\n"
+          " --prefix <prefix>     prefix of the keys\n"
+          " --seed <seed>         seed of the random numbers (default 0)\n"
+          " --json <file>         write the result in json, - for stdout\n"
+          " -q                    no progress\n"
+          " --help                show this\n");
+}
+
+bool ParseArgs(int argc, char* argv[], Options& opt) {
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--help") {
+      return false;
+    }
+    if (arg == "-q") {
+      opt.quiet = true;
+      continue;
+    }
+
+    if (i + 1 >= argc) {
+      fprintf(stderr, "no value of option %s\n", arg.c_str());
+      return false;
+    }
+    const char* val = argv[++i];
+    if (arg == "-h") {
+      opt.host = val;
+    } else if (arg == "-p") {
+      opt.port = atoi(val);
+    } else if (arg == "-a") {
+      opt.password = val;
+    } else if (arg == "--dbnum") {
+      opt.dbnum = atoi(val);
+    } else if (arg == "--threads") {
+      opt.threads = atoi(val);
+    } else if (arg == "-c") {
+      opt.clients = atoi(val);
+    } else if (arg == "-P") {
+      opt.pipeline = atoi(val);
+    } else if (arg == "-n") {
+      opt.requests = atoll(val);
+    } else if (arg == "--duration") {
+      opt.duration = atoi(val);
+    } else if (arg == "-r") {
+      opt.keyspace = strtoull(val, nullptr, 10);
+    } else if (arg == "--fields") {
+      opt.fields = strtoull(val, nullptr, 10);
+    } else if (arg == "--dist") {
+      if (strcmp(val, "uniform") == 0) {
+        opt.dist = KeyDist::uniform;
+      } else if (strcmp(val, "zipfian") == 0) {
+        opt.dist = KeyDist::zipfian;
+      } else if (strcmp(val, "hotspot") == 0) {
+        opt.dist = KeyDist::hotspot;
+      } else {
+        fprintf(stderr, "unknown distribution %s\n", val);
+        return false;
+      }
+    } else if (arg == "--zipf-theta") {
+      opt.zipfTheta = atof(val);
+    } else if (arg == "--hot-keys") {
+      opt.hotKeys = atof(val);
+    } else if (arg == "--hot-ops") {
+      opt.hotOps = atof(val);
+    } else if (arg == "--mix") {
+      opt.mix = val;
+    } else if (arg == "--value-size") {
+      opt.valueSpec = val;
+    } else if (arg == "--prefix") {
+      opt.prefix = val;
+    } else if (arg == "--seed") {
+      opt.seed = strtoull(val, nullptr, 10);
+    } else if (arg == "--json") {
+      opt.json = val;
+    } else {
+      fprintf(stderr, "unknown option %s\n", arg.c_str());
+      return false;
+    }
+  }
+
+  if (opt.threads <= 0 || opt.clients < opt.threads || opt.pipeline <= 0 || opt.requests < 0 || opt.duration < 0 ||
+      opt.keyspace == 0 || opt.fields == 0) {
+    fprintf(stderr, "bad options, need threads > 0, clients >= threads, pipeline > 0, keyspace > 0, fields > 0\n");
+    return false;
+  }
+  if (opt.requests == 0 && opt.duration == 0) {
+    fprintf(stderr, "no limit of requests or duration\n");
+    return false;
+  }
+  if (opt.zipfTheta <= 0 || opt.zipfTheta >= 1 || opt.hotKeys <= 0 || opt.hotKeys > 1 || opt.hotOps < 0 ||
+      opt.hotOps > 1) {
+    fprintf(stderr, "bad options of distribution\n");
+    return false;
+  }
+
+  return ParseValueSize(opt);
+}
+
+const char* DistName(KeyDist dist) {
+  switch (dist) {
+    case KeyDist::uniform:
+      return "uniform";
+    case KeyDist::zipfian:
+      return "zipfian";
+    case KeyDist::hotspot:
+      return "hotspot";
+  }
+  return "";
+}
+
+std::string LatencyJson(const Histogram& h) {
+  char buf[256];
+  snprintf(buf, sizeof buf,
+           "{\"min\": %.3f, \"mean\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"p999\": %.3f, "
+           "\"max\": %.3f}",
+           h.Min() / 1e3, h.Mean() / 1e3, h.Percentile(50) / 1e3, h.Percentile(90) / 1e3, h.Percentile(99) / 1e3,
+           h.Percentile(99.9) / 1e3, h.Max() / 1e3);
+  return buf;
+}
+
+std::string JsonString(const std::string& s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+    }
+    out += c;
+  }
+  return out + "\"";
+}
+
+// false if any client failed
+bool Report(const Options& opt, const Workload& work, const std::vector<std::unique_ptr<Worker>>& workers,
+            double seconds) {
+  Histogram all;
+  std::vector<Histogram> perOp(work.ops.size());
+  std::vector<uint64_t> opErrors(work.ops.size(), 0);
+  uint64_t errors = 0;
+  int failedClients = 0;
+  for (const auto& w : workers) {
+    all.Merge(w->Latency());
+    for (std::size_t i = 0; i < work.ops.size(); ++i) {
+      perOp[i].Merge(w->OpLatency(i));
+      opErrors[i] += w->OpErrors(i);
+    }
+    errors += w->Errors();
+    failedClients += w->FailedClients();
+  }
+  const double qps = seconds > 0 ? all.Count() / seconds : 0;
+
+  if (opt.json.empty()) {
+    printf("requests: %lu in %.3f seconds, %.2f requests per second, %lu errors\n", all.Count(), seconds, qps,
+           errors);
+    if (failedClients > 0) {
+      printf("clients failed: %d\n", failedClients);
+    }
+    printf("%-10s %10s %10s %10s %10s %10s %10s\n", "command", "requests", "p50(us)", "p99(us)", "p99.9(us)",
+           "max(us)", "errors");
+    auto line = [](const char* name, const Histogram& h, uint64_t errors) {
+      printf("%-10s %10lu %10.1f %10.1f %10.1f %10.1f %10lu\n", name, h.Count(), h.Percentile(50) / 1e3,
+             h.Percentile(99) / 1e3, h.Percentile(99.9) / 1e3, h.Max() / 1e3, errors);
+    };
+    for (std::size_t i = 0; i < work.ops.size(); ++i) {
+      line(work.ops[i].def->name, perOp[i], opErrors[i]);
+    }
+    line("all", all, errors);
+    return failedClients == 0;
+  }
+
+  std::string out = "{\n";
+  char buf[512];
+  snprintf(buf, sizeof buf,
+           "  \"config\": {\"host\": %s, \"port\": %d, \"threads\": %d, \"clients\": %d, \"pipeline\": %d, "
+           "\"keyspace\": %lu, \"fields\": %lu, \"distribution\": \"%s\", \"mix\": %s, \"value_size\": %s},\n",
+           JsonString(opt.host).c_str(), opt.port, opt.threads, opt.clients, opt.pipeline, opt.keyspace, opt.fields,
+           DistName(opt.dist), JsonString(opt.mix).c_str(), JsonString(opt.valueSpec).c_str());
+  out += buf;
+  snprintf(buf, sizeof buf,
+           "  \"requests\": %lu,\n  \"errors\": %lu,\n  \"failed_clients\": %d,\n  \"seconds\": %.3f,\n"
+           "  \"ops_per_sec\": %.2f,\n",
+           all.Count(), errors, failedClients, seconds, qps);
+  out += buf;
+  out += "  \"latency_usec\": " + LatencyJson(all) + ",\n  \"commands\": {";
+  for (std::size_t i = 0; i < work.ops.size(); ++i) {
+    snprintf(buf, sizeof buf, "%s\n    \"%s\": {\"requests\": %lu, \"errors\": %lu, \"latency_usec\": ",
+             i ? "," : "", work.ops[i].def->name, perOp[i].Count(), opErrors[i]);
+    out += buf;
+    out += LatencyJson(perOp[i]) + "}";
+  }
+  out += "\n  }\n}\n";
+
+  FILE* fp = opt.json == "-" ? stdout : fopen(opt.json.c_str(), "w");
+  if (!fp) {
+    fprintf(stderr, "can't open %s: %s\n", opt.json.c_str(), strerror(errno));
+    return false;
+  }
+  fwrite(out.data(), 1, out.size(), fp);
+  if (fp != stdout) {
+    fclose(fp);
+  }
+  return failedClients == 0;
+}
+
+}  // namespace pikiwidb
+
+int main(int argc, char* argv[]) {
+  using namespace pikiwidb;
+
+  Options opt;
+  if (!ParseArgs(argc, argv, opt)) {
+    Usage();
+    return 1;
+  }
+
+  Workload work;
+  if (!ParseMix(opt.mix, work)) {
+    return 1;
+  }
+  std::mt19937_64 rng(opt.seed);
+  work.values.resize(std::max<std::size_t>(opt.valueMax * 2, 4096));
+  for (auto& c : work.values) {
+    c = static_cast<char>('a' + rng() % 26);
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  // the net library logs by this name, keep it quiet
+  spdlog::register_logger(std::make_shared<spdlog::logger>(logger::Logger::Instance().Name()));
+
+  KeyGenerator keys(opt);
+  g_budget = opt.requests;
+  auto start = Clock::now();
+  if (opt.duration > 0) {
+    g_deadline = NowNs() + static_cast<uint64_t>(opt.duration) * 1000000000;
+  }
+
+  std::vector<std::unique_ptr<Worker>> workers;
+  for (int i = 0; i < opt.threads; ++i) {
+    int clients = opt.clients / opt.threads + (i < opt.clients % opt.threads ? 1 : 0);
+    workers.push_back(std::make_unique<Worker>(opt, work, keys, i, clients));
+  }
+
+  std::vector<std::thread> threads;
+  std::atomic<int> running{opt.threads};
+  for (auto& w : workers) {
+    threads.emplace_back([&w, &running]() {
+      w->Run();
+      --running;
+    });
+  }
+
+  uint64_t lastDone = 0;
+  auto last = start;
+  while (running > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    auto now = Clock::now();
+    if (opt.quiet || now - last < std::chrono::seconds(1)) {
+      continue;
+    }
+
+    uint64_t done = 0;
+    for (const auto& w : workers) {
+      done += w->Done();
+    }
+    double secs = std::chrono::duration<double>(now - last).count();
+    fprintf(stderr, "requests: %lu, %.2f requests per second\n", done, (done - lastDone) / secs);
+    lastDone = done;
+    last = now;
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  bool ok = Report(opt, work, workers, std::chrono::duration<double>(Clock::now() - start).count());
+  return ok ? 0 : 1;
+}
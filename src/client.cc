@@ -10,9 +10,13 @@
 #include <algorithm>
 #include "base_cmd.h"
 #include "client.h"
+#include "cluster.h"
 #include "cmd_context.h"
 #include "command.h"
+#include "command_stats.h"
 #include "config.h"
+#include "event_loop.h"
+#include "loading.h"
 #include "pikiwidb.h"
 #include "slow_log.h"
 #include "store.h"
@@ -86,17 +90,71 @@ static int ProcessMaster(const char* start, const char* end) {
       }
       break;
 
+    case PReplState_wait_psync: {
+      const char* crlf = SearchCRLF(start, end - start);
+      if (!crlf) {
+        return 0;
+      }
+
+      PString line(start, crlf);
+      auto fields = SplitString(line, ' ');
+      if (strncasecmp(line.c_str(), "+FULLRESYNC", 11) == 0) {
+        // +FULLRESYNC <replid> <offset> [codec]
+        long offset = 0;
+        PCodec codec = PCodec_none;
+        if (fields.size() < 3 || !TryStr2Long(fields[2].c_str(), fields[2].size(), offset) ||
+            (fields.size() > 3 && !ParseCodec(fields[3], codec))) {
+          ERROR("wrong psync reply {}", line);
+          PClient::Current()->Close();
+          return 0;
+        }
+        PREPL.OnFullResync(fields[1], offset, codec);
+      } else if (strncasecmp(line.c_str(), "+CONTINUE", 9) == 0) {
+        // +CONTINUE [replid [codec]]
+        PCodec codec = PCodec_none;
+        if (fields.size() > 2 && !ParseCodec(fields[2], codec)) {
+          ERROR("wrong psync reply {}", line);
+          PClient::Current()->Close();
+          return 0;
+        }
+        PREPL.OnContinue(fields.size() > 1 ? fields[1] : PString(), codec);
+      } else if (strncasecmp(line.c_str(), "-NOMASTERLINK", 13) == 0 || strncasecmp(line.c_str(), "-LOADING", 8) == 0) {
+        // the master is a slave not synced yet, or it is loading, retry later
+        WARN("psync is refused: {}, retry later", line);
+        PClient::Current()->Close();
+      } else {
+        // the master does not support psync
+        WARN("psync is refused: {}, fall back to sync", line);
+        PClient::Current()->SendPacket("SYNC\r\n", 6);
+        PREPL.OnFullResync(PString(), 0, PCodec_none);
+      }
+
+      return static_cast<int>(crlf + 2 - start);
+    } break;
+
     case PReplState_wait_rdb: {
       const char* ptr = start;
       // recv RDB file
-      if (PREPL.GetRdbSize() == std::size_t(-1)) {
+      if (!PREPL.HasRdbHeader()) {
+        const char* crlf = SearchCRLF(ptr, end - ptr);
+        if (!crlf) {
+          return 0;  // wait for the whole line
+        }
+
         ++ptr;  // skip $
-        int s;
-        if (PParseResult::ok == GetIntUntilCRLF(ptr, end - ptr, s)) {
-          assert(s > 0);  // check error for your masterauth or master config
+        if (end - ptr > 4 && strncmp(ptr, "EOF:", 4) == 0) {
+          // diskless sync, the rdb ends with the mark
+          PREPL.SetRdbEofMark(PString(ptr + 4, crlf));
+          INFO("recv diskless rdb, eof mark {}", PString(ptr + 4, crlf));
+          ptr = crlf + 2;
+        } else {
+          int s;
+          if (PParseResult::ok == GetIntUntilCRLF(ptr, end - ptr, s)) {
+            assert(s > 0);  // check error for your masterauth or master config
 
-          PREPL.SetRdbSize(s);
-          INFO("recv rdb size {}", s);
+            PREPL.SetRdbSize(s);
+            INFO("recv rdb size {}", s);
+          }
         }
       } else {
         std::size_t rdb = static_cast<std::size_t>(end - ptr);
@@ -123,6 +181,7 @@ int PClient::handlePacket(pikiwidb::TcpObject* obj, const char* start, int bytes
 
   const char* const end = start + bytes;
   const char* ptr = start;
+  const bool fresh = parser_.IsInitialState();
 
   if (isPeerMaster()) {
     //  check slave state
@@ -151,14 +210,25 @@ int PClient::handlePacket(pikiwidb::TcpObject* obj, const char* start, int bytes
     parseRet = PParseResult::ok;
   } else if (parseRet != PParseResult::ok) {
     return static_cast<int>(ptr - start);
+  } else if (fresh) {
+    rawData_ = start;
+    rawLen_ = static_cast<std::size_t>(ptr - start);
   }
 
   DEFER { reset(); };
 
-  // handle packet
+  if (!executeRequest()) {
+    return 0;
+  }
+
+  return static_cast<int>(ptr - start);
+}
+
+// execute the request parsed, false if the connection is closed
+bool PClient::executeRequest() {
   const auto& params = parser_.GetParams();
   if (params.empty()) {
-    return static_cast<int>(ptr - start);
+    return true;
   }
 
   PString cmd(params[0]);
@@ -170,13 +240,13 @@ int PClient::handlePacket(pikiwidb::TcpObject* obj, const char* start, int bytes
       if (now <= lastauth_ + 1) {
         // avoid guess password.
         tcp_obj_->ActiveClose();
-        return 0;
+        return false;
       } else {
         lastauth_ = now;
       }
     } else {
       ReplyError(PError_needAuth, &reply_);
-      return static_cast<int>(ptr - start);
+      return true;
     }
   }
 
@@ -188,8 +258,31 @@ int PClient::handlePacket(pikiwidb::TcpObject* obj, const char* start, int bytes
   const PCommandInfo* info = PCommandTable::GetCommandInfo(cmd); // 从CommandTable中获取命令处理函数
 
   if (!info) {  // 如果这个命令不存在，那么就走新的命令处理流程
-    handlePacketNew(obj, params, cmd);
-    return static_cast<int>(ptr - start);
+    handlePacketNew(tcp_obj_, params, cmd);
+    return true;
+  }
+
+  // the keys not loaded are loaded by store when accessed, unless configured to reject.
+  // the commands reading the whole keyspace wait for all, never see a part of it.
+  if (PLOADING.IsLoading() && !IsFlagOn(ClientFlag_master)) {
+    const bool keyspace = info->attr & PAttr_keyspace;
+    if (keyspace && g_config.asyncloadingwait) {
+      PLOADING.LoadAll();
+    } else if (keyspace || (!g_config.asyncloadingwait && PLOADING.HasUnloadedKey(db_, info, params))) {
+      ReplyError(PError_loading, &reply_);
+      return true;
+    }
+  }
+
+  // ASKING takes effect on the next command only
+  const bool asking = IsFlagOn(ClientFlag_asking);
+  ClearFlag(ClientFlag_asking);
+
+  if (g_config.clusterenabled && !IsFlagOn(ClientFlag_master) && !(info->attr & PAttr_admin) &&
+      !PCLUSTER.CheckRedirect(cmd, info, params, asking, IsFlagOn(ClientFlag_readonly), &reply_)) {
+    PCommandStats::Instance().Reject(info, info->cmd);
+    FlagExecWrong();
+    return true;
   }
 
   // check transaction
@@ -197,6 +290,7 @@ int PClient::handlePacket(pikiwidb::TcpObject* obj, const char* start, int bytes
     if (cmd != "multi" && cmd != "exec" && cmd != "watch" && cmd != "unwatch" && cmd != "discard") {
       if (!info->CheckParamsCount(static_cast<int>(params.size()))) {
         ERROR("queue failed: cmd {} has params {}", cmd, params.size());
+        PCommandStats::Instance().Reject(info, info->cmd);
         ReplyError(info ? PError_param : PError_unknowCmd, &reply_);
         FlagExecWrong();
       } else {
@@ -208,7 +302,7 @@ int PClient::handlePacket(pikiwidb::TcpObject* obj, const char* start, int bytes
         INFO("queue cmd {}", cmd);
       }
 
-      return static_cast<int>(ptr - start);
+      return true;
     }
   }
 
@@ -217,7 +311,12 @@ int PClient::handlePacket(pikiwidb::TcpObject* obj, const char* start, int bytes
   if (PREPL.GetMasterState() != PReplState_none && !IsFlagOn(ClientFlag_master) &&
       (info->attr & PCommandAttr::PAttr_write)) {
     err = PError_readonlySlave;
+    PCommandStats::Instance().Reject(info, info->cmd);
     ReplyError(err, &reply_);
+  } else if (!(info->attr & PCommandAttr::PAttr_admin) && isStale()) {
+    err = PError_stale;
+    PCommandStats::Instance().Reject(info, info->cmd);
+    replyStale();
   } else {
     PSlowLog::Instance().Begin();
     err = PCommandTable::ExecuteCmd(params, info, IsFlagOn(ClientFlag_master) ? nullptr : &reply_); // 执行命令
@@ -228,7 +327,7 @@ int PClient::handlePacket(pikiwidb::TcpObject* obj, const char* start, int bytes
     Propagate(params);
   }
 
-  return static_cast<int>(ptr - start);
+  return true;
 }
 
 // 为了兼容老的命令处理流程，新的命令处理流程在这里
@@ -242,10 +341,17 @@ int PClient::handlePacketNew(pikiwidb::TcpObject* obj, const std::vector<std::st
   }
 
   if (!cmdPtr->CheckArg(params.size())) {
+    PCommandStats::Instance().Reject(cmdPtr, cmd);
     ReplyError(PError_param, &reply_);
     return 0;
   }
 
+  if (cmdPtr->HasFlag(CmdFlagsReadonly) && isStale()) {
+    PCommandStats::Instance().Reject(cmdPtr, cmd);
+    replyStale();
+    return 0;
+  }
+
   CmdContext ctx;
   ctx.client_ = this;
   // 因为 params 是一个引用，不能直接传给 ctx.argv_，所以需要拷贝一份，后面可以优化
@@ -267,22 +373,149 @@ PClient::PClient(TcpObject* obj) : tcp_obj_(obj), db_(0), flag_(0), name_("clien
 }
 
 int PClient::HandlePackets(pikiwidb::TcpObject* obj, const char* start, int size) {
+  int total = processPackets(obj, start, size, false);
+
+  // the data after psync reply is in frames, decoded before parsing
+  if (total < size && isPeerMaster() && PREPL.IsMasterLinkCompressed()) {
+    if (decodeByThread()) {
+      feedDecoder(start + total, static_cast<std::size_t>(size - total), true);
+      total = size;
+    } else {
+      auto consumed = PREPL.InflateStream(start + total, size - total, inflated_);
+      if (consumed < 0) {
+        ERROR("corrupted compressed stream from master");
+        Close();
+        return size;
+      }
+
+      total += static_cast<int>(consumed);
+      auto processed = processPackets(obj, inflated_.data(), static_cast<int>(inflated_.size()), true);
+      inflated_.erase(0, processed);
+    }
+  }
+
+  obj->SendPacket(reply_.ReadAddr(), reply_.ReadableSize());
+  reply_.Clear();
+  return total;
+}
+
+int PClient::processPackets(pikiwidb::TcpObject* obj, const char* start, int size, bool inflated) {
   int total = 0;
 
   while (total < size) {
+    if (!inflated && isPeerMaster() && PREPL.IsMasterLinkCompressed()) {
+      break;  // the rest are frames
+    }
+
+    if (decodeByThread()) {
+      feedDecoder(start + total, static_cast<std::size_t>(size - total), false);
+      return size;
+    }
+
+    const bool fromStream = isPeerMaster() && PREPL.GetMasterState() == PReplState_online;
     auto processed = handlePacket(obj, start + total, size - total);
     if (processed <= 0) {
       break;
     }
 
     total += processed;
+
+    // only whole commands are counted in offset and forwarded to sub-slaves,
+    // so psync and the snapshot of bgsave do not begin in the middle of one
+    if (fromStream) {
+      const char* processedData = start + total - processed;
+      if (parser_.IsInitialState() && streamPart_.empty()) {
+        PREPL.FeedStream(processedData, processed);
+      } else {
+        streamPart_.append(processedData, processed);
+        if (parser_.IsInitialState()) {
+          PREPL.FeedStream(streamPart_.data(), streamPart_.size());
+          streamPart_.clear();
+        }
+      }
+    }
   }
 
-  obj->SendPacket(reply_.ReadAddr(), reply_.ReadableSize());
-  reply_.Clear();
   return total;
 }
 
+// the online stream is decoded by thread, switched only between commands
+bool PClient::decodeByThread() const {
+  if (decoder_) {
+    return true;
+  }
+
+  return g_config.repldecodethread && isPeerMaster() && PREPL.GetMasterState() == PReplState_online &&
+         parser_.IsInitialState() && streamPart_.empty();
+}
+
+void PClient::feedDecoder(const char* data, std::size_t len, bool framed) {
+  if (!decoder_) {
+    auto loop = EventLoop::Self();
+    std::weak_ptr<PClient> wcli = shared_from_this();
+    decoder_ = std::make_unique<PReplDecoder>([loop, wcli]() {
+      loop->Execute([wcli]() {
+        if (auto cli = wcli.lock()) {
+          cli->applyDecoded();
+        }
+      });
+    });
+  }
+
+  decoder_->Feed(data, len, framed);
+
+  // slow down master by tcp if the commands are not applied in time
+  if (!readPaused_ && decoder_->PendingBytes() > kMaxDecoderPending) {
+    readPaused_ = true;
+    tcp_obj_->PauseRead(true);
+  }
+}
+
+void PClient::applyDecoded() {
+  // the link may be closed or replaced when the commands are decoded
+  if (!tcp_obj_->Connected() || !isPeerMaster() || PREPL.GetMasterState() != PReplState_online) {
+    return;
+  }
+
+  std::vector<PReplDecoder::Batch> batches;
+  const bool ok = decoder_->Take(batches);
+
+  // executed in the stream order, the offset is updated after each command
+  for (auto& batch : batches) {
+    PREPL.CountInflated(batch.compressedBytes, batch.rawBytes);
+
+    const char* raw = batch.raw.data();
+    for (std::size_t i = 0; i < batch.cmds.size(); ++i) {
+      s_current = this;
+      parser_.SetParams(std::move(batch.cmds[i]));
+      rawData_ = raw;
+      rawLen_ = batch.lens[i];
+      const bool alive = executeRequest();
+      reset();
+
+      PREPL.FeedStream(raw, batch.lens[i]);
+      raw += batch.lens[i];
+      if (!alive) {
+        return;
+      }
+    }
+  }
+
+  tcp_obj_->SendPacket(reply_.ReadAddr(), reply_.ReadableSize());
+  reply_.Clear();
+
+  if (!ok) {
+    ERROR("corrupted stream from master");
+    Close();
+    return;
+  }
+
+  if (readPaused_ && decoder_->PendingBytes() < kMaxDecoderPending / 2) {
+    readPaused_ = false;
+    tcp_obj_->PauseRead(false);
+  }
+}
+
 void PClient::OnConnect() {
   if (isPeerMaster()) {
     PREPL.SetMasterState(PReplState_connected);
@@ -319,6 +552,18 @@ bool PClient::SelectDB(int db) {
 void PClient::reset() {
   s_current = nullptr;
   parser_.Reset();
+  rawData_ = nullptr;
+  rawLen_ = 0;
+}
+
+bool PClient::GetRawRequest(const std::vector<PString>& params, const char*& data, std::size_t& len) const {
+  if (rawLen_ == 0 || &params != &parser_.GetParams()) {
+    return false;
+  }
+
+  data = rawData_;
+  len = rawLen_;
+  return true;
 }
 
 bool PClient::isPeerMaster() const {
@@ -326,6 +571,25 @@ bool PClient::isPeerMaster() const {
   return repl_addr.GetIP() == tcp_obj_->GetPeerIp() && repl_addr.GetPort() == tcp_obj_->GetPeerPort();
 }
 
+bool PClient::isStale() const {
+  if (maxStaleness_ < 0) {
+    return false;
+  }
+
+  const auto staleness = PREPL.Staleness();
+  return staleness < 0 || staleness > maxStaleness_;
+}
+
+// -STALE <staleness ms, -1 if unknown> <master ip:port>, the client reads from master instead
+void PClient::replyStale() {
+  const auto& master = PREPL.GetMasterAddr();
+  char err[128];
+  int len = snprintf(err, sizeof err, "-STALE %ld %s:%hu The data of slave is older than the bound %ld ms\r\n",
+                     static_cast<long>(PREPL.Staleness()), master.GetIP().c_str(), master.GetPort(),
+                     static_cast<long>(maxStaleness_));
+  reply_.PushData(err, std::min<std::size_t>(len, sizeof err - 1));
+}
+
 bool PClient::Watch(int dbno, const PString& key) {
   DEBUG("Client {} watch {}, db {}", name_, key, dbno);
   return watchKeys_[dbno].insert(key).second;
@@ -14,6 +14,7 @@
 #include <unordered_map>
 #include <unordered_set>
 #include "proto_parser.h"
+#include "repl_decoder.h"
 #include "replication.h"
 
 namespace pikiwidb {
@@ -23,6 +24,8 @@ enum ClientFlag {
   ClientFlag_dirty = 0x1 << 1,
   ClientFlag_wrongExec = 0x1 << 2,
   ClientFlag_master = 0x1 << 3,
+  ClientFlag_asking = 0x1 << 4,    // the next command may access an importing slot
+  ClientFlag_readonly = 0x1 << 5,  // by READONLY
 };
 
 class DB;
@@ -41,6 +44,8 @@ class PClient : public std::enable_shared_from_this<PClient> {
   int PeerPort() const { return tcp_obj_->GetPeerPort(); }
   int SendPacket(UnboundedBuffer& data) { return tcp_obj_->SendPacket(data.ReadAddr(), data.ReadableSize()); }
   int SendPacket(const void* data, int size) { return tcp_obj_->SendPacket(data, size); }
+  int SendPacket(const std::shared_ptr<const PString>& data) { return tcp_obj_->SendPacket(data); }
+  std::size_t PendingSize() const { return tcp_obj_->PendingSize(); }
   void Close();
 
   bool SelectDB(int db);
@@ -91,16 +96,31 @@ class PClient : public std::enable_shared_from_this<PClient> {
   static void AddCurrentToMonitor();
   static void FeedMonitors(const std::vector<PString>& params);
 
+  // READONLY: -1 if reads are served however stale the slave is
+  void SetMaxStaleness(int64_t ms) { maxStaleness_ = ms; }
+
   void SetAuth() { auth_ = true; }
   bool GetAuth() const { return auth_; }
-  void RewriteCmd(std::vector<PString>& params) { parser_.SetParams(params); }
+  void RewriteCmd(std::vector<PString>& params) {
+    rawLen_ = 0;
+    parser_.SetParams(params);
+  }
+  // the bytes of request if params is it and not rewritten
+  bool GetRawRequest(const std::vector<PString>& params, const char*& data, std::size_t& len) const;
 
  private:
+  int processPackets(pikiwidb::TcpObject*, const char*, int, bool inflated);
   int handlePacket(pikiwidb::TcpObject*, const char*, int);
+  bool executeRequest();
+  bool decodeByThread() const;
+  void feedDecoder(const char* data, std::size_t len, bool framed);
+  void applyDecoded();
   int handlePacketNew(pikiwidb::TcpObject* obj, const std::vector<std::string>& params, const std::string& cmd);
   int processInlineCmd(const char*, size_t, std::vector<PString>&);
   void reset();
   bool isPeerMaster() const;
+  bool isStale() const;
+  void replyStale();
 
   TcpObject* const tcp_obj_;
 
@@ -126,10 +146,25 @@ class PClient : public std::enable_shared_from_this<PClient> {
   // name
   std::string name_;
 
+  // READONLY with max staleness (ms)
+  int64_t maxStaleness_ = -1;
+
   // auth
   bool auth_ = false;
   time_t lastauth_ = 0;
 
+  // the partial command from master
+  PString streamPart_;
+  // decompressed from master, not parsed yet
+  PString inflated_;
+  // the stream from master is decoded by it, once the link is online
+  std::unique_ptr<PReplDecoder> decoder_;
+  bool readPaused_ = false;
+
+  // the request being executed, if it's received in one packet
+  const char* rawData_ = nullptr;
+  std::size_t rawLen_ = 0;
+
   static PClient* s_current;
   static std::set<std::weak_ptr<PClient>, std::owner_less<std::weak_ptr<PClient> > > s_monitors;
 };
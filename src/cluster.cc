@@ -0,0 +1,1655 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "cluster.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <sstream>
+
+#include "client.h"
+#include "command.h"
+#include "config.h"
+#include "db.h"
+#include "event_loop.h"
+#include "helper.h"
+#include "loading.h"
+#include "log.h"
+#include "replication.h"
+#include "store.h"
+
+namespace pikiwidb {
+
+static const std::size_t kNodeIdSize = 40;
+static const uint64_t kPingInterval = 1000;    // ms, to each node
+static const uint64_t kForgetTime = 60 * 1000;  // ms, a forgotten node is not added back by gossip
+
+static constexpr std::array<uint16_t, 256> makeCrc16Table() {
+  std::array<uint16_t, 256> table{};
+  for (int i = 0; i < 256; ++i) {
+    uint16_t crc = static_cast<uint16_t>(i << 8);
+    for (int j = 0; j < 8; ++j) {
+      crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021) : static_cast<uint16_t>(crc << 1);
+    }
+    table[i] = crc;
+  }
+  return table;
+}
+
+static constexpr auto kCrc16Table = makeCrc16Table();
+
+// crc16 xmodem, the same as redis cluster
+static uint16_t crc16(const char* buf, std::size_t len) {
+  uint16_t crc = 0;
+  for (std::size_t i = 0; i < len; ++i) {
+    crc = static_cast<uint16_t>((crc << 8) ^ kCrc16Table[((crc >> 8) ^ static_cast<uint8_t>(buf[i])) & 0xff]);
+  }
+  return crc;
+}
+
+int KeyHashSlot(const char* key, std::size_t len) {
+  const char* open = static_cast<const char*>(memchr(key, '{', len));
+  if (open) {
+    const char* tag = open + 1;
+    const char* close = static_cast<const char*>(memchr(tag, '}', key + len - tag));
+    if (close && close != tag) {
+      return crc16(tag, close - tag) & (kClusterSlots - 1);
+    }
+  }
+
+  return crc16(key, len) & (kClusterSlots - 1);
+}
+
+// "0-5460,5462" by sep, empty if none
+static PString SlotRanges(const std::bitset<kClusterSlots>& slots, char sep) {
+  PString res;
+  for (int i = 0; i < kClusterSlots; ++i) {
+    if (!slots.test(i)) {
+      continue;
+    }
+
+    int j = i;
+    while (j + 1 < kClusterSlots && slots.test(j + 1)) {
+      ++j;
+    }
+
+    if (!res.empty()) {
+      res.push_back(sep);
+    }
+    res += std::to_string(i);
+    if (j > i) {
+      res += "-" + std::to_string(j);
+    }
+    i = j;
+  }
+
+  return res;
+}
+
+static bool ParseSlot(const PString& str, int& slot) {
+  long val;
+  if (!TryStr2Long(str.c_str(), str.size(), val) || val < 0 || val >= kClusterSlots) {
+    return false;
+  }
+
+  slot = static_cast<int>(val);
+  return true;
+}
+
+// "a-b" or "a"
+static bool ParseSlotRange(const PString& str, int& start, int& end) {
+  auto dash = str.find('-');
+  if (dash == PString::npos) {
+    return ParseSlot(str, start) && ParseSlot(str, end);
+  }
+
+  return ParseSlot(str.substr(0, dash), start) && ParseSlot(str.substr(dash + 1), end) && start <= end;
+}
+
+static bool ParsePort(const PString& str, unsigned short& port) {
+  long val;
+  if (!TryStr2Long(str.c_str(), str.size(), val) || val <= 0 || val > 65535) {
+    return false;
+  }
+
+  port = static_cast<unsigned short>(val);
+  return true;
+}
+
+static bool ParseEpoch(const PString& str, uint64_t& epoch) {
+  long val;
+  if (!TryStr2Long(str.c_str(), str.size(), val) || val < 0) {
+    return false;
+  }
+
+  epoch = static_cast<uint64_t>(val);
+  return true;
+}
+
+static PError ReplyErrorMsg(const PString& msg, UnboundedBuffer* reply) {
+  if (reply) {
+    reply->PushData("-", 1);
+    reply->PushData(msg.data(), msg.size());
+    reply->PushData("\r\n", 2);
+  }
+  return PError_param;
+}
+
+PCluster& PCluster::Instance() {
+  static PCluster cluster;
+  return cluster;
+}
+
+PCluster::PCluster() {
+  slots_.fill(nullptr);
+  migrating_.fill(nullptr);
+  importing_.fill(nullptr);
+}
+
+static unsigned short BusPort() {
+  return g_config.clusterport != 0 ? g_config.clusterport : static_cast<unsigned short>(g_config.port + 10000);
+}
+
+bool PCluster::Init(EventLoop* loop) {
+  if (!loadConfig()) {
+    ERROR("can not load cluster config {}", configFile());
+    return false;
+  }
+
+  // the addresses of myself may be changed by config
+  myself_->port = g_config.port;
+  myself_->busPort = BusPort();
+  if (!g_config.ip.empty() && g_config.ip != "0.0.0.0") {
+    myself_->ip = g_config.ip;
+  }
+
+  if (!saveConfig()) {
+    return false;
+  }
+
+  if (!loop->Listen(g_config.ip.c_str(), myself_->busPort,
+                    [this](TcpObject* obj) { onNewBusConnection(obj, nullptr); })) {
+    ERROR("can not bind cluster bus on port {}", myself_->busPort);
+    return false;
+  }
+
+  if (myself_->IsSlave()) {
+    if (auto master = lookupNode(myself_->masterId)) {
+      PREPL.ReplicaOf(master->ip.c_str(), master->port);
+    }
+  }
+
+  updateState();
+  loop->ScheduleRepeatedly(100, &PCluster::Cron, this);
+
+  INFO("cluster node {} with {} nodes, current epoch {}", myself_->id, nodes_.size(), currentEpoch_);
+  return true;
+}
+
+PCluster::NodePtr PCluster::createNode(const PString& id, const PString& ip, unsigned short port,
+                                       unsigned short busPort, unsigned flags) {
+  auto node = std::make_shared<PClusterNode>();
+  node->id = id;
+  node->ip = ip;
+  node->port = port;
+  node->busPort = busPort;
+  node->flags = flags;
+  node->ctime = ::Now();
+
+  nodes_[id] = node;
+  return node;
+}
+
+PCluster::NodePtr PCluster::lookupNode(const PString& id) const {
+  auto it = nodes_.find(id);
+  return it == nodes_.end() ? nullptr : it->second;
+}
+
+void PCluster::deleteNode(const NodePtr& node) {
+  for (int i = 0; i < kClusterSlots; ++i) {
+    if (slots_[i] == node.get()) {
+      unassignSlot(i);
+    }
+    if (migrating_[i] == node.get()) {
+      migrating_[i] = nullptr;
+    }
+    if (importing_[i] == node.get()) {
+      importing_[i] = nullptr;
+    }
+  }
+
+  if (auto link = node->link.lock()) {
+    link->ActiveClose();
+  }
+
+  nodes_.erase(node->id);
+  markDirty();
+}
+
+void PCluster::renameNode(const NodePtr& node, const PString& id) {
+  nodes_.erase(node->id);
+  node->id = id;
+  nodes_[id] = node;
+  markDirty();
+}
+
+void PCluster::assignSlot(int slot, PClusterNode* node) {
+  if (slots_[slot]) {
+    slots_[slot]->slots.reset(slot);
+  }
+
+  slots_[slot] = node;
+  if (node) {
+    node->slots.set(slot);
+  }
+}
+
+void PCluster::unassignSlot(int slot) { assignSlot(slot, nullptr); }
+
+void PCluster::setMyMaster(const NodePtr& master) {
+  for (int i = 0; i < kClusterSlots; ++i) {
+    if (slots_[i] == myself_.get()) {
+      unassignSlot(i);
+    }
+    migrating_[i] = nullptr;
+    importing_[i] = nullptr;
+  }
+
+  myself_->flags = (myself_->flags & ~PNodeFlag_master) | PNodeFlag_slave;
+  myself_->masterId = master->id;
+  PREPL.ReplicaOf(master->ip.c_str(), master->port);
+  markDirty();
+
+  INFO("cluster node {} replicates {} {}:{}", myself_->id, master->id, master->ip, master->port);
+}
+
+void PCluster::updateState() {
+  bool ok = true;
+  if (g_config.clusterrequirefullcoverage) {
+    ok = std::find(slots_.begin(), slots_.end(), nullptr) == slots_.end();
+  }
+
+  if (ok != stateOk_) {
+    INFO("cluster state changed: {}", ok ? "ok" : "fail");
+    stateOk_ = ok;
+  }
+}
+
+PString PCluster::nodeDescription(const PClusterNode& node) const {
+  std::ostringstream oss;
+  oss << node.id << ' ' << node.ip << ':' << node.port << '@' << node.busPort << ' ';
+
+  PString flags;
+  auto addFlag = [&flags](const char* flag) {
+    if (!flags.empty()) {
+      flags.push_back(',');
+    }
+    flags += flag;
+  };
+  if (node.flags & PNodeFlag_myself) {
+    addFlag("myself");
+  }
+  if (node.flags & PNodeFlag_master) {
+    addFlag("master");
+  }
+  if (node.flags & PNodeFlag_slave) {
+    addFlag("slave");
+  }
+  if (node.flags & PNodeFlag_pfail) {
+    addFlag("fail?");
+  }
+  if (node.flags & PNodeFlag_handshake) {
+    addFlag("handshake");
+  }
+  if (flags.empty()) {
+    flags = "noflags";
+  }
+
+  auto link = node.link.lock();
+  const bool connected = (node.flags & PNodeFlag_myself) || (link && link->Connected());
+  oss << flags << ' ' << (node.masterId.empty() ? "-" : node.masterId) << ' ' << node.pingSent << ' '
+      << node.pongRecv << ' ' << node.configEpoch << ' ' << (connected ? "connected" : "disconnected");
+
+  const PString ranges = SlotRanges(node.slots, ' ');
+  if (!ranges.empty()) {
+    oss << ' ' << ranges;
+  }
+
+  if (node.flags & PNodeFlag_myself) {
+    for (int i = 0; i < kClusterSlots; ++i) {
+      if (migrating_[i]) {
+        oss << " [" << i << "->-" << migrating_[i]->id << ']';
+      } else if (importing_[i]) {
+        oss << " [" << i << "-<-" << importing_[i]->id << ']';
+      }
+    }
+  }
+
+  return oss.str();
+}
+
+PString PCluster::configFile() const {
+  const auto& file = g_config.clusterconfigfile;
+  if (file[0] == '/') {
+    return file;
+  }
+
+  // in the dir of rdb
+  const auto& rdb = g_config.rdbfullname;
+  return rdb.substr(0, rdb.rfind('/') + 1) + file;
+}
+
+bool PCluster::loadConfig() {
+  std::ifstream in(configFile());
+  if (!in) {
+    char id[kNodeIdSize + 1] = "";
+    getRandomHexChars(id, kNodeIdSize);
+    myself_ = createNode(PString(id, kNodeIdSize), "", g_config.port, BusPort(), PNodeFlag_myself | PNodeFlag_master);
+    INFO("no cluster config, new node id {}", myself_->id);
+    return true;
+  }
+
+  // [slot->-id] or [slot-<-id] of myself, resolved after all nodes are loaded
+  std::vector<std::pair<PString, PString> > transfers;
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream iss(line);
+    std::vector<PString> argv;
+    for (PString arg; iss >> arg;) {
+      argv.push_back(std::move(arg));
+    }
+
+    if (argv.empty()) {
+      continue;
+    }
+
+    if (argv[0] == "vars") {
+      for (std::size_t i = 1; i + 1 < argv.size(); i += 2) {
+        if (argv[i] == "currentEpoch" && !ParseEpoch(argv[i + 1], currentEpoch_)) {
+          return false;
+        }
+      }
+      continue;
+    }
+
+    // id ip:port@busport flags master ping-sent pong-recv config-epoch link-state slots...
+    if (argv.size() < 8) {
+      return false;
+    }
+
+    const auto& addr = argv[1];
+    auto colon = addr.rfind(':');
+    auto at = addr.find('@', colon);
+    unsigned short port = 0;
+    unsigned short busPort = 0;
+    if (colon == PString::npos || at == PString::npos || !ParsePort(addr.substr(colon + 1, at - colon - 1), port) ||
+        !ParsePort(addr.substr(at + 1), busPort)) {
+      return false;
+    }
+
+    unsigned flags = 0;
+    for (const auto& flag : SplitString(argv[2], ',')) {
+      if (flag == "myself") {
+        flags |= PNodeFlag_myself;
+      } else if (flag == "master") {
+        flags |= PNodeFlag_master;
+      } else if (flag == "slave") {
+        flags |= PNodeFlag_slave;
+      }
+    }
+
+    auto node = createNode(argv[0], addr.substr(0, colon), port, busPort, flags);
+    if (argv[3] != "-") {
+      node->masterId = argv[3];
+    }
+    if (!ParseEpoch(argv[6], node->configEpoch)) {
+      return false;
+    }
+    if (flags & PNodeFlag_myself) {
+      myself_ = node;
+    }
+
+    for (std::size_t i = 8; i < argv.size(); ++i) {
+      const auto& arg = argv[i];
+      if (arg[0] == '[') {
+        transfers.emplace_back(arg, node->id);
+        continue;
+      }
+
+      int start, end;
+      if (!ParseSlotRange(arg, start, end)) {
+        return false;
+      }
+      for (int slot = start; slot <= end; ++slot) {
+        assignSlot(slot, node.get());
+      }
+    }
+  }
+
+  if (!myself_) {
+    return false;
+  }
+
+  for (const auto& transfer : transfers) {
+    const auto& arg = transfer.first;
+    const bool migrating = arg.find("->-") != PString::npos;
+    auto sep = arg.find(migrating ? "->-" : "-<-");
+    int slot;
+    if (sep == PString::npos || arg.back() != ']' || !ParseSlot(arg.substr(1, sep - 1), slot)) {
+      return false;
+    }
+
+    auto peer = lookupNode(arg.substr(sep + 3, arg.size() - sep - 4));
+    if (peer) {
+      (migrating ? migrating_ : importing_)[slot] = peer.get();
+    }
+  }
+
+  return true;
+}
+
+bool PCluster::saveConfig() {
+  PString content;
+  for (const auto& kv : nodes_) {
+    if (kv.second->flags & PNodeFlag_handshake) {
+      continue;
+    }
+    content += nodeDescription(*kv.second);
+    content.push_back('\n');
+  }
+  content += "vars currentEpoch " + std::to_string(currentEpoch_) + " lastVoteEpoch 0\n";
+
+  // write a tmp file then rename, the config is never half written
+  const PString file = configFile();
+  const PString tmp = file + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::trunc);
+    if (!out || !out.write(content.data(), content.size()) || !out.flush()) {
+      ERROR("can not write cluster config {}", tmp);
+      return false;
+    }
+  }
+
+  if (::rename(tmp.c_str(), file.c_str()) != 0) {
+    ERROR("can not rename cluster config {} to {}", tmp, file);
+    return false;
+  }
+
+  todoSave_ = false;
+  return true;
+}
+
+void PCluster::onNewBusConnection(TcpObject* obj, const NodePtr& node) {
+  auto link = std::make_shared<PClusterLink>();
+  link->inbound = !node;
+  link->node = node;
+
+  obj->SetContext(link);
+  obj->SetMessageCallback([this](TcpObject* obj, const char* data, int len) { return onBusMessage(obj, data, len); });
+  obj->SetNodelay(true);
+}
+
+int PCluster::onBusMessage(TcpObject* obj, const char* data, int len) {
+  auto link = obj->GetContext<PClusterLink>();
+  if (!link) {
+    return -1;
+  }
+
+  const char* ptr = data;
+  const char* const end = data + len;
+  while (ptr < end) {
+    auto res = link->parser.ParseRequest(ptr, end);
+    if (res == PParseResult::wait) {
+      break;
+    }
+
+    if (res == PParseResult::error) {
+      WARN("wrong message on cluster bus from {}", obj->GetPeerIp());
+      obj->ActiveClose();
+      return -1;
+    }
+
+    auto msg = link->parser.TakeParams();
+    link->parser.Reset();
+    ++messagesReceived_;
+
+    if (!processMessage(obj, *link, msg)) {
+      obj->ActiveClose();
+      return -1;
+    }
+  }
+
+  return static_cast<int>(ptr - data);
+}
+
+void PCluster::connectNode(const NodePtr& node, uint64_t now) {
+  std::weak_ptr<PClusterNode> weakNode(node);
+  auto onConnect = [this, weakNode](TcpObject* obj) {
+    auto node = weakNode.lock();
+    if (!node || node->link.lock().get() != obj) {
+      obj->ActiveClose();  // the node is deleted or a newer link is made
+      return;
+    }
+
+    onNewBusConnection(obj, node);
+    sendPing(node, ::Now());
+  };
+  auto onFail = [](EventLoop*, const char* ip, int port) { DEBUG("connect cluster bus {}:{} failed", ip, port); };
+
+  node->link = EventLoop::Self()->Connect(node->ip.c_str(), node->busPort, onConnect, onFail);
+  node->linkTime = now;
+  // the failure is detected since now if it can't be connected
+  if (node->pingSent == 0) {
+    node->pingSent = now;
+  }
+}
+
+void PCluster::sendMessage(TcpObject* obj, const char* type, const PString& peerIp) {
+  std::vector<PString> msg = {type,
+                              myself_->id,
+                              peerIp,
+                              std::to_string(myself_->port),
+                              std::to_string(myself_->busPort),
+                              myself_->IsSlave() ? "slave" : "master",
+                              myself_->masterId.empty() ? "-" : myself_->masterId,
+                              std::to_string(currentEpoch_),
+                              std::to_string(myself_->configEpoch),
+                              SlotRanges(myself_->slots, ',')};
+  if (msg.back().empty()) {
+    msg.back() = "-";
+  }
+
+  // a part of the nodes known, as redis does
+  std::vector<PClusterNode*> candidates;
+  for (const auto& kv : nodes_) {
+    const auto& node = kv.second;
+    if (node != myself_ && !(node->flags & PNodeFlag_handshake) && !node->ip.empty()) {
+      candidates.push_back(node.get());
+    }
+  }
+
+  static std::mt19937 gen(std::random_device{}());
+  std::shuffle(candidates.begin(), candidates.end(), gen);
+  candidates.resize(std::min(candidates.size(), std::max<std::size_t>(3, nodes_.size() / 10)));
+  for (auto node : candidates) {
+    msg.push_back(node->id);
+    msg.push_back(node->ip);
+    msg.push_back(std::to_string(node->port));
+    msg.push_back(std::to_string(node->busPort));
+    msg.push_back(node->IsSlave() ? "slave" : "master");
+  }
+
+  UnboundedBuffer buf;
+  SaveCommand(msg, buf);
+  obj->SendPacket(buf.ReadAddr(), buf.ReadableSize());
+  ++messagesSent_;
+}
+
+void PCluster::sendPing(const NodePtr& node, uint64_t now) {
+  auto link = node->link.lock();
+  if (!link || !link->Connected()) {
+    return;
+  }
+
+  sendMessage(link.get(), (node->flags & PNodeFlag_meet) ? "meet" : "ping", node->ip);
+  node->lastPing = now;
+  if (node->pingSent == 0) {
+    node->pingSent = now;
+  }
+}
+
+// type id my-ip port busport master|slave master-id current-epoch config-epoch slots [gossip...]
+// my-ip is the address of receiver known by sender, each gossip is id ip port busport master|slave
+bool PCluster::processMessage(TcpObject* obj, PClusterLink& link, const std::vector<PString>& msg) {
+  const std::size_t kHeaderSize = 10;
+  if (msg.size() < kHeaderSize || (msg.size() - kHeaderSize) % 5 != 0) {
+    return false;
+  }
+
+  const PString& type = msg[0];
+  const PString& senderId = msg[1];
+  unsigned short port, busPort;
+  uint64_t senderCurrentEpoch, senderConfigEpoch;
+  if ((type != "ping" && type != "pong" && type != "meet") || senderId.size() != kNodeIdSize ||
+      !ParsePort(msg[3], port) || !ParsePort(msg[4], busPort) || !ParseEpoch(msg[7], senderCurrentEpoch) ||
+      !ParseEpoch(msg[8], senderConfigEpoch)) {
+    return false;
+  }
+
+  const bool isMaster = msg[5] == "master";
+  const uint64_t now = ::Now();
+
+  // learn my ip by the address the peer connected to
+  if (link.inbound && myself_->ip.empty() && !msg[2].empty()) {
+    myself_->ip = msg[2];
+    markDirty();
+  }
+
+  auto sender = lookupNode(senderId);
+  if (sender == myself_) {
+    return false;
+  }
+
+  if (!sender && link.inbound && type == "meet" && !blacklist_.count(senderId)) {
+    sender = createNode(senderId, obj->GetPeerIp(), port, busPort, isMaster ? PNodeFlag_master : PNodeFlag_slave);
+    markDirty();
+    INFO("cluster node {} {}:{} meets me", senderId, obj->GetPeerIp(), port);
+  }
+
+  if (!link.inbound) {
+    auto node = link.node.lock();
+    if (!node) {
+      return false;
+    }
+
+    if (type == "pong") {
+      if (node->flags & PNodeFlag_handshake) {
+        if (sender) {
+          deleteNode(node);  // met the same node twice
+          return false;
+        }
+
+        INFO("cluster handshake with {}:{} done, node id {}", node->ip, node->port, senderId);
+        renameNode(node, senderId);
+        node->flags &= ~PNodeFlag_handshake;
+        sender = node;
+      } else if (node != sender) {
+        WARN("cluster node {} is at {}:{} now, not {}", senderId, node->ip, node->busPort, node->id);
+        return false;
+      }
+
+      node->pongRecv = now;
+      node->pingSent = 0;
+      if (node->flags & PNodeFlag_pfail) {
+        INFO("cluster node {} is reachable again", node->id);
+      }
+      node->flags &= ~(PNodeFlag_pfail | PNodeFlag_meet);
+    }
+  } else if (type != "pong") {
+    sendMessage(obj, "pong", obj->GetPeerIp());
+  }
+
+  if (!sender || (sender->flags & PNodeFlag_handshake)) {
+    return true;  // not known yet, it's added by MEET or gossip
+  }
+
+  // the node restarted with another address
+  if (link.inbound && (sender->ip != obj->GetPeerIp() || sender->port != port || sender->busPort != busPort)) {
+    INFO("cluster node {} address changed to {}:{}@{}", senderId, obj->GetPeerIp(), port, busPort);
+    sender->ip = obj->GetPeerIp();
+    sender->port = port;
+    sender->busPort = busPort;
+    if (auto old = sender->link.lock()) {
+      old->ActiveClose();
+    }
+    sender->link.reset();
+    markDirty();
+  }
+
+  if (senderCurrentEpoch > currentEpoch_) {
+    currentEpoch_ = senderCurrentEpoch;
+    markDirty();
+  }
+
+  if (isMaster) {
+    if (!sender->IsMaster()) {
+      sender->flags = (sender->flags & ~PNodeFlag_slave) | PNodeFlag_master;
+      sender->masterId.clear();
+      markDirty();
+    }
+  } else {
+    if (sender->IsMaster()) {
+      for (int i = 0; i < kClusterSlots; ++i) {
+        if (slots_[i] == sender.get()) {
+          unassignSlot(i);  // claimed by its new master
+        }
+      }
+      sender->flags = (sender->flags & ~PNodeFlag_master) | PNodeFlag_slave;
+      markDirty();
+    }
+
+    PString masterId = msg[6] == "-" ? PString() : msg[6];
+    if (sender->masterId != masterId) {
+      sender->masterId = std::move(masterId);
+      markDirty();
+    }
+  }
+
+  if (sender->configEpoch != senderConfigEpoch) {
+    sender->configEpoch = senderConfigEpoch;
+    markDirty();
+  }
+
+  if (isMaster) {
+    std::bitset<kClusterSlots> claimed;
+    if (msg[9] != "-") {
+      for (const auto& range : SplitString(msg[9], ',')) {
+        int start, end;
+        if (!ParseSlotRange(range, start, end)) {
+          return false;
+        }
+        for (int slot = start; slot <= end; ++slot) {
+          claimed.set(slot);
+        }
+      }
+    }
+    updateSlots(sender, claimed, senderConfigEpoch);
+
+    // the masters with the same config epoch, the one with smaller id takes a new epoch
+    if (myself_->IsMaster() && senderConfigEpoch == myself_->configEpoch && myself_->id < senderId) {
+      myself_->configEpoch = ++currentEpoch_;
+      markDirty();
+      INFO("cluster config epoch collision with {}, my epoch is {} now", senderId, currentEpoch_);
+    }
+  }
+
+  processGossip(msg, kHeaderSize);
+  return true;
+}
+
+void PCluster::updateSlots(const NodePtr& sender, const std::bitset<kClusterSlots>& claimed, uint64_t senderEpoch) {
+  const bool hadSlots = myself_->IsMaster() && myself_->slots.any();
+  for (int i = 0; i < kClusterSlots; ++i) {
+    if (!claimed.test(i) || slots_[i] == sender.get() || importing_[i]) {
+      continue;
+    }
+
+    // the claim with the greater config epoch wins
+    if (slots_[i] == nullptr || slots_[i]->configEpoch < senderEpoch) {
+      if (slots_[i] == myself_.get()) {
+        migrating_[i] = nullptr;
+        WARN("cluster slot {} is taken by {} with config epoch {}", i, sender->id, senderEpoch);
+      }
+      assignSlot(i, sender.get());
+      markDirty();
+    }
+  }
+
+  // all my slots are taken by the node, such as a slave failed over, follow it
+  if (hadSlots && myself_->slots.none()) {
+    setMyMaster(sender);
+  }
+}
+
+void PCluster::processGossip(const std::vector<PString>& msg, std::size_t begin) {
+  for (std::size_t i = begin; i + 5 <= msg.size(); i += 5) {
+    const PString& id = msg[i];
+    unsigned short port, busPort;
+    if (id.size() != kNodeIdSize || lookupNode(id) || blacklist_.count(id) || msg[i + 1].empty() ||
+        !ParsePort(msg[i + 2], port) || !ParsePort(msg[i + 3], busPort)) {
+      continue;
+    }
+
+    // known by the node of message, it's confirmed when it replies my ping
+    createNode(id, msg[i + 1], port, busPort, msg[i + 4] == "slave" ? PNodeFlag_slave : PNodeFlag_master);
+    markDirty();
+    INFO("cluster node {} {}:{} is found by gossip", id, msg[i + 1], port);
+  }
+}
+
+void PCluster::Cron() {
+  const uint64_t now = ::Now();
+  const uint64_t timeout = static_cast<uint64_t>(g_config.clusternodetimeout);
+
+  std::vector<NodePtr> expired;
+  for (const auto& kv : nodes_) {
+    const auto& node = kv.second;
+    if (node == myself_) {
+      continue;
+    }
+
+    if ((node->flags & PNodeFlag_handshake) && now - node->ctime > std::max<uint64_t>(timeout, 1000)) {
+      expired.push_back(node);
+      continue;
+    }
+
+    auto link = node->link.lock();
+    if (!link) {
+      if (now - node->linkTime >= kPingInterval) {
+        connectNode(node, now);
+      }
+    } else if (!link->Connected()) {
+      if (now - node->linkTime > timeout) {
+        node->link.reset();  // connecting for too long, a new one is made next time
+      }
+    } else {
+      if (now - node->lastPing >= kPingInterval) {
+        sendPing(node, now);
+      }
+
+      // no pong in half of the timeout, the link may be broken silently
+      if (node->pingSent && now - node->pingSent > timeout / 2 && now - node->linkTime > timeout / 2) {
+        link->ActiveClose();
+        node->link.reset();
+      }
+    }
+
+    if (node->pingSent && now - node->pingSent > timeout && !(node->flags & PNodeFlag_pfail)) {
+      node->flags |= PNodeFlag_pfail;
+      WARN("cluster node {} {}:{} is not reachable", node->id, node->ip, node->port);
+    }
+  }
+
+  for (const auto& node : expired) {
+    INFO("cluster handshake with {}:{} timeout", node->ip, node->port);
+    deleteNode(node);
+  }
+
+  for (auto it = blacklist_.begin(); it != blacklist_.end();) {
+    if (it->second <= now) {
+      it = blacklist_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  updateState();
+  if (todoSave_) {
+    saveConfig();
+  }
+}
+
+bool PCluster::CheckRedirect(const PString& cmd, const PCommandInfo* info, const std::vector<PString>& params,
+                             bool asking, bool readonly, UnboundedBuffer* reply) {
+  std::vector<const PString*> keys;
+  PCommandTable::GetKeys(info, params, keys);
+  if (keys.empty()) {
+    return true;
+  }
+
+  const int slot = KeyHashSlot(*keys[0]);
+  for (std::size_t i = 1; i < keys.size(); ++i) {
+    if (KeyHashSlot(*keys[i]) != slot) {
+      ReplyError(PError_crossSlot, reply);
+      return false;
+    }
+  }
+
+  if (!stateOk_) {
+    ReplyError(PError_clusterDown, reply);
+    return false;
+  }
+
+  auto owner = slots_[slot];
+  if (!owner) {
+    ReplyErrorMsg("CLUSTERDOWN Hash slot not served", reply);
+    return false;
+  }
+
+  auto countMissing = [&keys]() {
+    std::size_t missing = 0;
+    for (auto key : keys) {
+      if (!PSTORE.ExistsKey(*key)) {
+        ++missing;
+      }
+    }
+    return missing;
+  };
+
+  char redirect[128];
+  if (owner == myself_.get()) {
+    if (!migrating_[slot]) {
+      return true;
+    }
+
+    // the keys not here are moved to the target already, or will be created there
+    const std::size_t missing = countMissing();
+    if (missing == 0) {
+      return true;
+    }
+
+    if (missing < keys.size()) {
+      ReplyError(PError_tryAgain, reply);
+      return false;
+    }
+
+    auto target = migrating_[slot];
+    snprintf(redirect, sizeof redirect, "ASK %d %s:%hu", slot, target->ip.c_str(), target->port);
+    ReplyErrorMsg(redirect, reply);
+    return false;
+  }
+
+  if (importing_[slot] && (asking || cmd == "restore-asking")) {
+    if (keys.size() > 1 && countMissing() > 0) {
+      ReplyError(PError_tryAgain, reply);
+      return false;
+    }
+    return true;
+  }
+
+  // the reads of READONLY clients are served by the slave of owner
+  if (readonly && !(info->attr & PAttr_write) && myself_->IsSlave() && myself_->masterId == owner->id) {
+    return true;
+  }
+
+  snprintf(redirect, sizeof redirect, "MOVED %d %s:%hu", slot, owner->ip.c_str(), owner->port);
+  ReplyErrorMsg(redirect, reply);
+  return false;
+}
+
+PError PCluster::Command(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  PString sub(params[1]);
+  std::transform(sub.begin(), sub.end(), sub.begin(), ::tolower);
+  const std::size_t argc = params.size();
+
+  if (sub == "info" && argc == 2) {
+    return info(reply);
+  }
+  if (sub == "myid" && argc == 2) {
+    FormatBulk(myself_->id, reply);
+    return PError_ok;
+  }
+  if (sub == "nodes" && argc == 2) {
+    return nodes(reply);
+  }
+  if (sub == "slots" && argc == 2) {
+    return slots(reply);
+  }
+  if (sub == "shards" && argc == 2) {
+    return shards(reply);
+  }
+  if (sub == "meet" && (argc == 4 || argc == 5)) {
+    return meet(params, reply);
+  }
+  if ((sub == "addslots" || sub == "delslots") && argc >= 3) {
+    return changeSlots(params, sub == "addslots", false, reply);
+  }
+  if ((sub == "addslotsrange" || sub == "delslotsrange") && argc >= 4 && argc % 2 == 0) {
+    return changeSlots(params, sub == "addslotsrange", true, reply);
+  }
+  if (sub == "flushslots" && argc == 2) {
+    if (PSTORE.DBSize() != 0) {
+      return ReplyErrorMsg("ERR DB must be empty to perform CLUSTER FLUSHSLOTS.", reply);
+    }
+    for (int i = 0; i < kClusterSlots; ++i) {
+      if (slots_[i] == myself_.get()) {
+        unassignSlot(i);
+      }
+    }
+    saveConfig();
+    updateState();
+    FormatOK(reply);
+    return PError_ok;
+  }
+  if (sub == "setslot" && argc >= 4) {
+    return setSlot(params, reply);
+  }
+  if (sub == "keyslot" && argc == 3) {
+    FormatInt(KeyHashSlot(params[2]), reply);
+    return PError_ok;
+  }
+  if ((sub == "countkeysinslot" && argc == 3) || (sub == "getkeysinslot" && argc == 4)) {
+    int slot;
+    long count = -1;
+    if (!ParseSlot(params[2], slot)) {
+      return ReplyErrorMsg("ERR Invalid slot", reply);
+    }
+    if (argc == 4 && (!TryStr2Long(params[3].c_str(), params[3].size(), count) || count < 0)) {
+      return ReplyErrorMsg("ERR Invalid number of keys", reply);
+    }
+
+    if (count < 0) {
+      FormatInt(static_cast<long>(PSTORE.CountKeysInSlot(slot)), reply);
+    } else {
+      auto keys = PSTORE.GetKeysInSlot(slot, static_cast<std::size_t>(count));
+      PreFormatMultiBulk(keys.size(), reply);
+      for (const auto& key : keys) {
+        FormatBulk(key, reply);
+      }
+    }
+    return PError_ok;
+  }
+  if (sub == "replicate" && argc == 3) {
+    return replicate(params, reply);
+  }
+  if (sub == "failover" && (argc == 2 || argc == 3)) {
+    return failover(params, reply);
+  }
+  if (sub == "forget" && argc == 3) {
+    return forget(params, reply);
+  }
+  if (sub == "saveconfig" && argc == 2) {
+    if (!saveConfig()) {
+      return ReplyErrorMsg("ERR error saving the cluster node config", reply);
+    }
+    FormatOK(reply);
+    return PError_ok;
+  }
+  if (sub == "bumpepoch" && argc == 2) {
+    const bool bumped = myself_->configEpoch == 0 || myself_->configEpoch != currentEpoch_;
+    if (bumped) {
+      myself_->configEpoch = ++currentEpoch_;
+      saveConfig();
+    }
+    FormatSingle((bumped ? "BUMPED " : "STILL ") + std::to_string(myself_->configEpoch), reply);
+    return PError_ok;
+  }
+
+  return ReplyErrorMsg("ERR Unknown subcommand or wrong number of arguments for '" + params[1] + "'", reply);
+}
+
+// CLUSTER MEET ip port [busport]
+PError PCluster::meet(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  unsigned short port, busPort = 0;
+  struct in_addr addr;
+  if (inet_pton(AF_INET, params[2].c_str(), &addr) != 1 || !ParsePort(params[3], port) ||
+      (params.size() == 5 && !ParsePort(params[4], busPort))) {
+    return ReplyErrorMsg("ERR Invalid node address specified: " + params[2] + ":" + params[3], reply);
+  }
+  if (busPort == 0) {
+    busPort = static_cast<unsigned short>(port + 10000);
+  }
+
+  for (const auto& kv : nodes_) {
+    const auto& node = kv.second;
+    if ((node->flags & PNodeFlag_handshake) && node->ip == params[2] && node->port == port) {
+      FormatOK(reply);
+      return PError_ok;  // in progress
+    }
+  }
+
+  // the id is taken from its pong
+  char id[kNodeIdSize + 1] = "";
+  getRandomHexChars(id, kNodeIdSize);
+  createNode(PString(id, kNodeIdSize), params[2], port, busPort,
+             PNodeFlag_handshake | PNodeFlag_meet | PNodeFlag_master);
+
+  FormatOK(reply);
+  return PError_ok;
+}
+
+PError PCluster::nodes(UnboundedBuffer* reply) {
+  PString res;
+  for (const auto& kv : nodes_) {
+    res += nodeDescription(*kv.second);
+    res.push_back('\n');
+  }
+
+  FormatBulk(res, reply);
+  return PError_ok;
+}
+
+PError PCluster::slots(UnboundedBuffer* reply) {
+  struct Range {
+    int start;
+    int end;
+    PClusterNode* owner;
+  };
+
+  std::vector<Range> ranges;
+  for (int i = 0; i < kClusterSlots; ++i) {
+    if (!slots_[i]) {
+      continue;
+    }
+
+    if (!ranges.empty() && ranges.back().owner == slots_[i] && ranges.back().end == i - 1) {
+      ranges.back().end = i;
+    } else {
+      ranges.push_back({i, i, slots_[i]});
+    }
+  }
+
+  auto formatNode = [reply](const PClusterNode* node) {
+    PreFormatMultiBulk(3, reply);
+    FormatBulk(node->ip, reply);
+    FormatInt(node->port, reply);
+    FormatBulk(node->id, reply);
+  };
+
+  PreFormatMultiBulk(ranges.size(), reply);
+  for (const auto& range : ranges) {
+    std::vector<const PClusterNode*> replicas;
+    for (const auto& kv : nodes_) {
+      const auto& node = kv.second;
+      if (node->IsSlave() && node->masterId == range.owner->id && !(node->flags & PNodeFlag_pfail)) {
+        replicas.push_back(node.get());
+      }
+    }
+
+    PreFormatMultiBulk(3 + replicas.size(), reply);
+    FormatInt(range.start, reply);
+    FormatInt(range.end, reply);
+    formatNode(range.owner);
+    for (auto node : replicas) {
+      formatNode(node);
+    }
+  }
+
+  return PError_ok;
+}
+
+// a shard for each master, the maps of redis are flat arrays of field and value.
+// The offsets of other nodes are not in the gossip, they are reported as 0.
+PError PCluster::shards(UnboundedBuffer* reply) {
+  std::vector<const PClusterNode*> masters;
+  for (const auto& kv : nodes_) {
+    if (kv.second->IsMaster() && !(kv.second->flags & PNodeFlag_handshake)) {
+      masters.push_back(kv.second.get());
+    }
+  }
+
+  auto formatNode = [this, reply](const PClusterNode* node) {
+    const char* health = "online";
+    if (node->flags & PNodeFlag_pfail) {
+      health = "failed";
+    } else if (node == myself_.get() && PLOADING.IsLoading()) {
+      health = "loading";
+    }
+
+    PreFormatMultiBulk(14, reply);
+    FormatBulk("id", reply);
+    FormatBulk(node->id, reply);
+    FormatBulk("port", reply);
+    FormatInt(node->port, reply);
+    FormatBulk("ip", reply);
+    FormatBulk(node->ip, reply);
+    FormatBulk("endpoint", reply);
+    FormatBulk(node->ip, reply);
+    FormatBulk("role", reply);
+    FormatBulk(node->IsMaster() ? "master" : "replica", reply);
+    FormatBulk("replication-offset", reply);
+    FormatInt(node == myself_.get() ? static_cast<long>(PREPL.GetOffset()) : 0, reply);
+    FormatBulk("health", reply);
+    FormatBulk(health, reply);
+  };
+
+  PreFormatMultiBulk(masters.size(), reply);
+  for (auto master : masters) {
+    std::vector<std::pair<int, int>> ranges;
+    for (int i = 0; i < kClusterSlots; ++i) {
+      if (!master->slots.test(i)) {
+        continue;
+      }
+
+      if (!ranges.empty() && ranges.back().second == i - 1) {
+        ranges.back().second = i;
+      } else {
+        ranges.emplace_back(i, i);
+      }
+    }
+
+    std::vector<const PClusterNode*> replicas;
+    for (const auto& kv : nodes_) {
+      if (kv.second->IsSlave() && kv.second->masterId == master->id) {
+        replicas.push_back(kv.second.get());
+      }
+    }
+
+    PreFormatMultiBulk(4, reply);
+    FormatBulk("slots", reply);
+    PreFormatMultiBulk(ranges.size() * 2, reply);
+    for (const auto& range : ranges) {
+      FormatInt(range.first, reply);
+      FormatInt(range.second, reply);
+    }
+
+    FormatBulk("nodes", reply);
+    PreFormatMultiBulk(1 + replicas.size(), reply);
+    formatNode(master);
+    for (auto node : replicas) {
+      formatNode(node);
+    }
+  }
+
+  return PError_ok;
+}
+
+PError PCluster::info(UnboundedBuffer* reply) {
+  std::size_t assigned = 0;
+  std::size_t pfail = 0;
+  for (auto owner : slots_) {
+    if (owner) {
+      ++assigned;
+      if (owner->flags & PNodeFlag_pfail) {
+        ++pfail;
+      }
+    }
+  }
+
+  std::size_t size = 0;
+  for (const auto& kv : nodes_) {
+    if (kv.second->IsMaster() && kv.second->slots.any()) {
+      ++size;
+    }
+  }
+
+  std::ostringstream oss;
+  oss << "cluster_enabled:1\r\n"
+      << "cluster_state:" << (stateOk_ ? "ok" : "fail") << "\r\n"
+      << "cluster_slots_assigned:" << assigned << "\r\n"
+      << "cluster_slots_ok:" << assigned - pfail << "\r\n"
+      << "cluster_slots_pfail:" << pfail << "\r\n"
+      << "cluster_slots_fail:0\r\n"
+      << "cluster_known_nodes:" << nodes_.size() << "\r\n"
+      << "cluster_size:" << size << "\r\n"
+      << "cluster_current_epoch:" << currentEpoch_ << "\r\n"
+      << "cluster_my_epoch:" << myself_->configEpoch << "\r\n"
+      << "cluster_stats_messages_sent:" << messagesSent_ << "\r\n"
+      << "cluster_stats_messages_received:" << messagesReceived_ << "\r\n";
+
+  FormatBulk(oss.str(), reply);
+  return PError_ok;
+}
+
+// ADDSLOTS slot... or ADDSLOTSRANGE start end..., the same for DELSLOTS
+PError PCluster::changeSlots(const std::vector<PString>& params, bool add, bool range, UnboundedBuffer* reply) {
+  std::vector<int> slots;
+  for (std::size_t i = 2; i < params.size(); i += range ? 2 : 1) {
+    int start, end;
+    if (!ParseSlot(params[i], start) || (range && !ParseSlot(params[i + 1], end))) {
+      return ReplyErrorMsg("ERR Invalid or out of range slot", reply);
+    }
+    if (!range) {
+      end = start;
+    }
+    if (start > end) {
+      return ReplyErrorMsg("ERR start slot number " + std::to_string(start) +
+                               " is greater than end slot number " + std::to_string(end),
+                           reply);
+    }
+
+    for (int slot = start; slot <= end; ++slot) {
+      if (add && slots_[slot]) {
+        return ReplyErrorMsg("ERR Slot " + std::to_string(slot) + " is already busy", reply);
+      }
+      if (!add && !slots_[slot]) {
+        return ReplyErrorMsg("ERR Slot " + std::to_string(slot) + " is already unassigned", reply);
+      }
+      slots.push_back(slot);
+    }
+  }
+
+  for (int slot : slots) {
+    if (add) {
+      importing_[slot] = nullptr;
+      assignSlot(slot, myself_.get());
+    } else {
+      unassignSlot(slot);
+    }
+  }
+
+  saveConfig();
+  updateState();
+  FormatOK(reply);
+  return PError_ok;
+}
+
+// SETSLOT slot IMPORTING node-id | MIGRATING node-id | STABLE | NODE node-id
+PError PCluster::setSlot(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  int slot;
+  if (!ParseSlot(params[2], slot)) {
+    return ReplyErrorMsg("ERR Invalid or out of range slot", reply);
+  }
+
+  PString action(params[3]);
+  std::transform(action.begin(), action.end(), action.begin(), ::tolower);
+
+  if (action == "stable" && params.size() == 4) {
+    migrating_[slot] = nullptr;
+    importing_[slot] = nullptr;
+  } else if ((action == "migrating" || action == "importing" || action == "node") && params.size() == 5) {
+    auto node = lookupNode(params[4]);
+    if (!node || (node->flags & PNodeFlag_handshake)) {
+      return ReplyErrorMsg("ERR I don't know about node " + params[4], reply);
+    }
+
+    if (action == "migrating") {
+      if (slots_[slot] != myself_.get()) {
+        return ReplyErrorMsg("ERR I'm not the owner of hash slot " + std::to_string(slot), reply);
+      }
+      if (node == myself_ || !node->IsMaster()) {
+        return ReplyErrorMsg("ERR Target node is not a master", reply);
+      }
+      migrating_[slot] = node.get();
+    } else if (action == "importing") {
+      if (slots_[slot] == myself_.get()) {
+        return ReplyErrorMsg("ERR I'm already the owner of hash slot " + std::to_string(slot), reply);
+      }
+      if (node == myself_ || !node->IsMaster()) {
+        return ReplyErrorMsg("ERR Source node is not a master", reply);
+      }
+      importing_[slot] = node.get();
+    } else {
+      if (!node->IsMaster()) {
+        return ReplyErrorMsg("ERR Target node is not a master", reply);
+      }
+
+      if (slots_[slot] == myself_.get() && node != myself_ && PSTORE.CountKeysInSlot(slot) > 0) {
+        return ReplyErrorMsg("ERR Can't assign hashslot " + std::to_string(slot) +
+                                 " to a different node while I still hold keys for this hash slot.",
+                             reply);
+      }
+
+      if (node != myself_) {
+        migrating_[slot] = nullptr;
+      } else if (importing_[slot]) {
+        // the slot is mine by a new config epoch, which wins the claim of the source
+        importing_[slot] = nullptr;
+        myself_->configEpoch = ++currentEpoch_;
+        INFO("cluster slot {} is imported, my config epoch is {} now", slot, currentEpoch_);
+      }
+      assignSlot(slot, node.get());
+    }
+  } else {
+    return ReplyErrorMsg("ERR Invalid CLUSTER SETSLOT action or number of arguments.", reply);
+  }
+
+  saveConfig();
+  updateState();
+  FormatOK(reply);
+  return PError_ok;
+}
+
+PError PCluster::replicate(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  auto master = lookupNode(params[2]);
+  if (!master || (master->flags & PNodeFlag_handshake)) {
+    return ReplyErrorMsg("ERR Unknown node " + params[2], reply);
+  }
+  if (master == myself_) {
+    return ReplyErrorMsg("ERR Can't replicate myself", reply);
+  }
+  if (!master->IsMaster()) {
+    return ReplyErrorMsg("ERR I can only replicate a master, not a replica.", reply);
+  }
+  if (myself_->IsMaster() && (myself_->slots.any() || PSTORE.DBSize() != 0)) {
+    return ReplyErrorMsg("ERR To set a master the node must be empty and without assigned slots.", reply);
+  }
+
+  setMyMaster(master);
+  saveConfig();
+  updateState();
+  FormatOK(reply);
+  return PError_ok;
+}
+
+// CLUSTER FAILOVER [FORCE|TAKEOVER]: the slave takes the slots of its master by
+// a new config epoch at once, the old master follows it when it knows that
+PError PCluster::failover(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  if (params.size() == 3 && strcasecmp(params[2].c_str(), "force") != 0 &&
+      strcasecmp(params[2].c_str(), "takeover") != 0) {
+    ReplyError(PError_syntax, reply);
+    return PError_syntax;
+  }
+  if (!myself_->IsSlave()) {
+    return ReplyErrorMsg("ERR You should send CLUSTER FAILOVER to a replica", reply);
+  }
+
+  auto master = lookupNode(myself_->masterId);
+  myself_->flags = (myself_->flags & ~PNodeFlag_slave) | PNodeFlag_master;
+  myself_->masterId.clear();
+  myself_->configEpoch = ++currentEpoch_;
+  if (master) {
+    for (int i = 0; i < kClusterSlots; ++i) {
+      if (slots_[i] == master.get()) {
+        assignSlot(i, myself_.get());
+      }
+    }
+  }
+  PREPL.ReplicaOf(nullptr, 0);
+
+  INFO("cluster failover, my config epoch is {} now", currentEpoch_);
+  saveConfig();
+  updateState();
+  FormatOK(reply);
+  return PError_ok;
+}
+
+PError PCluster::forget(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  auto node = lookupNode(params[2]);
+  if (!node) {
+    return ReplyErrorMsg("ERR Unknown node " + params[2], reply);
+  }
+  if (node == myself_) {
+    return ReplyErrorMsg("ERR I tried hard but I can't forget myself...", reply);
+  }
+  if (myself_->IsSlave() && myself_->masterId == node->id) {
+    return ReplyErrorMsg("ERR Can't forget my master!", reply);
+  }
+
+  blacklist_[node->id] = ::Now() + kForgetTime;
+  deleteNode(node);
+  saveConfig();
+  updateState();
+  FormatOK(reply);
+  return PError_ok;
+}
+
+void PCluster::OnInfoCommand(UnboundedBuffer& res) {
+  char buf[64];
+  int n = snprintf(buf, sizeof buf - 1, "# Cluster\r\ncluster_enabled:%d\r\n", g_config.clusterenabled ? 1 : 0);
+
+  if (!res.IsEmpty()) {
+    res.PushData("\r\n", 2);
+  }
+
+  res.PushData(buf, n);
+}
+
+PError cluster(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  if (!g_config.clusterenabled) {
+    ReplyError(PError_noCluster, reply);
+    return PError_noCluster;
+  }
+
+  return PCLUSTER.Command(params, reply);
+}
+
+// the next command of client is served if the slot is importing
+PError asking(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  if (!g_config.clusterenabled) {
+    ReplyError(PError_noCluster, reply);
+    return PError_noCluster;
+  }
+
+  PClient::Current()->SetFlag(ClientFlag_asking);
+  FormatOK(reply);
+  return PError_ok;
+}
+
+// blocking io with the target of MIGRATE, false on error or timeout
+static bool SyncConnect(int fd, const char* ip, unsigned short port, int timeout) {
+  sockaddr_in addr = MakeSockaddr(ip, port);
+  if (::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) == 0) {
+    return true;
+  }
+  if (errno != EINPROGRESS) {
+    return false;
+  }
+
+  pollfd pfd = {fd, POLLOUT, 0};
+  int err = 0;
+  socklen_t len = sizeof err;
+  return ::poll(&pfd, 1, timeout) == 1 && ::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0;
+}
+
+static bool SyncWrite(int fd, const char* data, std::size_t len, int timeout) {
+  while (len > 0) {
+    pollfd pfd = {fd, POLLOUT, 0};
+    if (::poll(&pfd, 1, timeout) != 1) {
+      return false;
+    }
+
+    auto n = ::write(fd, data, len);
+    if (n < 0 && errno != EAGAIN && errno != EINTR) {
+      return false;
+    }
+    if (n > 0) {
+      data += n;
+      len -= n;
+    }
+  }
+
+  return true;
+}
+
+// a line of reply, without CRLF
+static bool SyncReadLine(int fd, PString& buf, PString& line, int timeout) {
+  for (;;) {
+    auto crlf = buf.find("\r\n");
+    if (crlf != PString::npos) {
+      line = buf.substr(0, crlf);
+      buf.erase(0, crlf + 2);
+      return true;
+    }
+
+    pollfd pfd = {fd, POLLIN, 0};
+    if (::poll(&pfd, 1, timeout) != 1) {
+      return false;
+    }
+
+    char tmp[4096];
+    auto n = ::read(fd, tmp, sizeof tmp);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+      return false;
+    }
+    if (n > 0) {
+      buf.append(tmp, n);
+    }
+  }
+}
+
+// MIGRATE host port key|"" destination-db timeout [COPY] [REPLACE] [AUTH password] [KEYS key...]
+// the keys are sent by RESTORE-ASKING in one batch, and deleted here when the target has them
+PError migrate(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  if (PREPL.GetMasterState() != PReplState_none) {
+    ReplyError(PError_readonlySlave, reply);
+    return PError_readonlySlave;
+  }
+
+  unsigned short port;
+  long dbno, timeout;
+  if (!ParsePort(params[2], port) || !TryStr2Long(params[4].c_str(), params[4].size(), dbno) || dbno < 0 ||
+      !TryStr2Long(params[5].c_str(), params[5].size(), timeout)) {
+    ReplyError(PError_syntax, reply);
+    return PError_syntax;
+  }
+  if (timeout <= 0) {
+    timeout = 1000;
+  }
+
+  bool copy = false;
+  bool replace = false;
+  const PString* password = nullptr;
+  std::vector<PString> keys;
+  for (std::size_t i = 6; i < params.size(); ++i) {
+    if (strcasecmp(params[i].c_str(), "copy") == 0) {
+      copy = true;
+    } else if (strcasecmp(params[i].c_str(), "replace") == 0) {
+      replace = true;
+    } else if (strcasecmp(params[i].c_str(), "auth") == 0 && i + 1 < params.size()) {
+      password = &params[++i];
+    } else if (strcasecmp(params[i].c_str(), "keys") == 0 && params[3].empty()) {
+      keys.assign(params.begin() + i + 1, params.end());
+      break;
+    } else {
+      ReplyError(PError_syntax, reply);
+      return PError_syntax;
+    }
+  }
+  if (keys.empty() && !params[3].empty()) {
+    keys.push_back(params[3]);
+  }
+
+  UnboundedBuffer request;
+  std::size_t expected = 0;
+  if (password) {
+    SaveCommand({"auth", *password}, request);
+    ++expected;
+  }
+  if (dbno != 0) {
+    SaveCommand({"select", params[4]}, request);
+    ++expected;
+  }
+
+  const uint64_t now = ::Now();
+  std::vector<PString> sent;
+  for (const auto& key : keys) {
+    PObject* value;
+    if (PSTORE.GetValue(key, value) != PError_ok) {
+      continue;
+    }
+
+    const int64_t ttl = PSTORE.TTL(key, now);
+    std::vector<PString> restore = {"restore-asking", key, std::to_string(ttl > 0 ? ttl : 0),
+                                    PDBSaver::DumpObject(*value)};
+    if (replace) {
+      restore.push_back("replace");
+    }
+    SaveCommand(restore, request);
+    sent.push_back(key);
+  }
+
+  if (sent.empty()) {
+    FormatSingle("NOKEY", 5, reply);
+    return PError_ok;
+  }
+
+  int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return ReplyErrorMsg("IOERR error or timeout connecting to the client", reply);
+  }
+  DEFER { ::close(fd); };
+  ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+  int nodelay = 1;
+  ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay);
+
+  if (!SyncConnect(fd, params[1].c_str(), port, static_cast<int>(timeout))) {
+    return ReplyErrorMsg("IOERR error or timeout connecting to the client", reply);
+  }
+  if (!SyncWrite(fd, request.ReadAddr(), request.ReadableSize(), static_cast<int>(timeout))) {
+    return ReplyErrorMsg("IOERR error or timeout writing to target instance", reply);
+  }
+
+  PString buf;
+  PString line;
+  PString error;
+  std::vector<PString> del = {"del"};
+  for (std::size_t i = 0; i < expected + sent.size(); ++i) {
+    if (!SyncReadLine(fd, buf, line, static_cast<int>(timeout))) {
+      error = "IOERR error or timeout reading to target instance";
+      break;
+    }
+
+    if (line.empty() || line[0] == '-') {
+      if (error.empty()) {
+        error = "ERR Target instance replied with error: " + (line.empty() ? line : line.substr(1));
+      }
+      continue;
+    }
+
+    if (i >= expected && !copy) {
+      const PString& key = sent[i - expected];
+      PSTORE.ClearExpire(key);
+      PSTORE.DeleteKey(key);
+      g_dirtyKeys.push_back(key);
+      del.push_back(key);
+    }
+  }
+
+  // the slaves and aof delete the keys migrated
+  if (del.size() > 1) {
+    Propagate(del);
+  }
+
+  if (!error.empty()) {
+    return ReplyErrorMsg(error, reply);
+  }
+
+  FormatOK(reply);
+  return PError_ok;
+}
+
+}  // namespace pikiwidb
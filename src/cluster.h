@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <array>
+#include <bitset>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "common.h"
+#include "proto_parser.h"
+#include "unbounded_buffer.h"
+
+namespace pikiwidb {
+
+class EventLoop;
+class TcpObject;
+struct PCommandInfo;
+
+const int kClusterSlots = 16384;
+
+// the slot of key by crc16, only the part in the first non empty {hash tag} is hashed
+int KeyHashSlot(const char* key, std::size_t len);
+inline int KeyHashSlot(const PString& key) { return KeyHashSlot(key.data(), key.size()); }
+
+enum PNodeFlag {
+  PNodeFlag_myself = 0x1,
+  PNodeFlag_master = 0x1 << 1,
+  PNodeFlag_slave = 0x1 << 2,
+  PNodeFlag_pfail = 0x1 << 3,      // no pong in cluster-node-timeout
+  PNodeFlag_handshake = 0x1 << 4,  // by CLUSTER MEET, the id is not known until its pong
+  PNodeFlag_meet = 0x1 << 5,       // send MEET instead of PING, so it adds me
+};
+
+struct PClusterNode {
+  PString id;
+  PString ip;
+  unsigned short port = 0;
+  unsigned short busPort = 0;
+  unsigned flags = 0;
+  PString masterId;  // of slave
+  uint64_t configEpoch = 0;
+  std::bitset<kClusterSlots> slots;
+
+  uint64_t ctime = 0;     // ms, when it's added
+  uint64_t pingSent = 0;  // ms, the first ping not answered, 0 if none
+  uint64_t lastPing = 0;  // ms
+  uint64_t pongRecv = 0;  // ms
+
+  // the outbound bus connection, the inbound ones are not bound to node
+  std::weak_ptr<TcpObject> link;
+  uint64_t linkTime = 0;  // ms, when the link is created
+
+  bool IsMaster() const { return flags & PNodeFlag_master; }
+  bool IsSlave() const { return flags & PNodeFlag_slave; }
+};
+
+// the context of bus connection
+struct PClusterLink {
+  PProtoParser parser;
+  std::weak_ptr<PClusterNode> node;  // the peer of outbound link
+  bool inbound = false;
+};
+
+class PCluster {
+ public:
+  static PCluster& Instance();
+
+  PCluster(const PCluster&) = delete;
+  void operator=(const PCluster&) = delete;
+
+  // load or create cluster-config-file and listen on the bus port
+  bool Init(EventLoop* loop);
+  void Cron();
+
+  // the keys of command are served by this node, or the error or redirection
+  // is replied: -CROSSSLOT, -CLUSTERDOWN, -MOVED, -ASK or -TRYAGAIN
+  bool CheckRedirect(const PString& cmd, const PCommandInfo* info, const std::vector<PString>& params, bool asking,
+                     bool readonly, UnboundedBuffer* reply);
+
+  PError Command(const std::vector<PString>& params, UnboundedBuffer* reply);
+  void OnInfoCommand(UnboundedBuffer& res);
+
+ private:
+  PCluster();
+
+  using NodePtr = std::shared_ptr<PClusterNode>;
+
+  NodePtr createNode(const PString& id, const PString& ip, unsigned short port, unsigned short busPort,
+                     unsigned flags);
+  NodePtr lookupNode(const PString& id) const;
+  void deleteNode(const NodePtr& node);
+  void renameNode(const NodePtr& node, const PString& id);
+  void assignSlot(int slot, PClusterNode* node);
+  void unassignSlot(int slot);
+  void setMyMaster(const NodePtr& master);
+  void updateState();
+  PString nodeDescription(const PClusterNode& node) const;
+  void markDirty() { todoSave_ = true; }
+
+  // nodes.conf, in the format of CLUSTER NODES
+  PString configFile() const;
+  bool loadConfig();
+  bool saveConfig();
+
+  // bus, the messages are RESP arrays
+  void onNewBusConnection(TcpObject* obj, const NodePtr& node);
+  int onBusMessage(TcpObject* obj, const char* data, int len);
+  void connectNode(const NodePtr& node, uint64_t now);
+  void sendMessage(TcpObject* obj, const char* type, const PString& peerIp);
+  void sendPing(const NodePtr& node, uint64_t now);
+  bool processMessage(TcpObject* obj, PClusterLink& link, const std::vector<PString>& msg);
+  void updateSlots(const NodePtr& sender, const std::bitset<kClusterSlots>& claimed, uint64_t senderEpoch);
+  void processGossip(const std::vector<PString>& msg, std::size_t begin);
+
+  // subcommands
+  PError meet(const std::vector<PString>& params, UnboundedBuffer* reply);
+  PError nodes(UnboundedBuffer* reply);
+  PError slots(UnboundedBuffer* reply);
+  PError shards(UnboundedBuffer* reply);
+  PError info(UnboundedBuffer* reply);
+  PError changeSlots(const std::vector<PString>& params, bool add, bool range, UnboundedBuffer* reply);
+  PError setSlot(const std::vector<PString>& params, UnboundedBuffer* reply);
+  PError replicate(const std::vector<PString>& params, UnboundedBuffer* reply);
+  PError failover(const std::vector<PString>& params, UnboundedBuffer* reply);
+  PError forget(const std::vector<PString>& params, UnboundedBuffer* reply);
+
+  NodePtr myself_;
+  std::map<PString, NodePtr> nodes_;  // by id, myself included
+  std::array<PClusterNode*, kClusterSlots> slots_;
+  std::array<PClusterNode*, kClusterSlots> migrating_;  // the target if the slot is migrating to it
+  std::array<PClusterNode*, kClusterSlots> importing_;  // the source if the slot is importing from it
+  uint64_t currentEpoch_ = 0;
+  std::map<PString, uint64_t> blacklist_;  // the forgotten nodes not added by gossip until the time, ms
+  bool stateOk_ = false;
+  bool todoSave_ = false;
+
+  uint64_t messagesSent_ = 0;
+  uint64_t messagesReceived_ = 0;
+};
+
+}  // namespace pikiwidb
+
+#define PCLUSTER pikiwidb::PCluster::Instance()
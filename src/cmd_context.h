@@ -53,6 +53,9 @@ class CmdRes {
 
   bool ok() const { return ret_ == kOk || ret_ == kNone; }
 
+  // an error is replied
+  bool error() const { return !ok() || (!message_.empty() && message_[0] == '-'); }
+
   void clear() {
     message_.clear();
     ret_ = kNone;
@@ -6,166 +6,201 @@
  */
 
 #include "command.h"
+#include "cluster.h"
+#include "command_stats.h"
+#include "cycle_clock.h"
 #include "replication.h"
 
 using std::size_t;
 
 namespace pikiwidb {
 
+// SORT key [BY pattern] [LIMIT offset count] [GET pattern ...] [ASC|DESC] [ALPHA] [STORE destination]
+static void sortGetKeys(const std::vector<PString>& params, std::vector<const PString*>& keys) {
+  const PString* store = nullptr;
+  for (size_t i = 2; i < params.size(); ++i) {
+    const char* arg = params[i].c_str();
+    if (strcasecmp(arg, "limit") == 0) {
+      i += 2;
+    } else if (strcasecmp(arg, "get") == 0 || strcasecmp(arg, "by") == 0) {
+      i += 1;
+    } else if (strcasecmp(arg, "store") == 0 && i + 1 < params.size()) {
+      store = &params[++i];  // the last one wins
+    }
+  }
+
+  if (store) {
+    keys.push_back(store);
+  }
+}
+
 const PCommandInfo PCommandTable::s_info[] = {
     // key
-    {"type", PAttr_read, 2, &type},
-    {"exists", PAttr_read, 2, &exists},
-    {"del", PAttr_write, -2, &del},
-    {"expire", PAttr_read, 3, &expire},
-    {"ttl", PAttr_read, 2, &ttl},
-    {"pexpire", PAttr_read, 3, &pexpire},
-    {"pttl", PAttr_read, 2, &pttl},
-    {"expireat", PAttr_read, 3, &expireat},
-    {"pexpireat", PAttr_read, 3, &pexpireat},
-    {"persist", PAttr_read, 2, &persist},
-    {"move", PAttr_write, 3, &move},
-    {"keys", PAttr_read, 2, &keys},
-    {"randomkey", PAttr_read, 1, &randomkey},
-    {"rename", PAttr_write, 3, &rename},
-    {"renamenx", PAttr_write, 3, &renamenx},
-    {"scan", PAttr_read, -2, &scan},
-    {"sort", PAttr_read, -2, &sort},
+    {"type", PAttr_read, 2, &type, 1, 1, 1},
+    {"exists", PAttr_read, 2, &exists, 1, -1, 1},
+    {"del", PAttr_write, -2, &del, 1, -1, 1},
+    {"expire", PAttr_write, 3, &expire, 1, 1, 1},
+    {"ttl", PAttr_read, 2, &ttl, 1, 1, 1},
+    {"pexpire", PAttr_write, 3, &pexpire, 1, 1, 1},
+    {"pttl", PAttr_read, 2, &pttl, 1, 1, 1},
+    {"expireat", PAttr_write, 3, &expireat, 1, 1, 1},
+    {"pexpireat", PAttr_write, 3, &pexpireat, 1, 1, 1},
+    {"persist", PAttr_write, 2, &persist, 1, 1, 1},
+    {"move", PAttr_write, 3, &move, 1, 1, 1},
+    {"keys", PAttr_read | PAttr_keyspace, 2, &keys},
+    {"dump", PAttr_read, 2, &dump, 1, 1, 1},
+    {"restore", PAttr_write, -4, &restore, 1, 1, 1},
+    {"restore-asking", PAttr_write, -4, &restore, 1, 1, 1},
+    {"randomkey", PAttr_read | PAttr_keyspace, 1, &randomkey},
+    {"rename", PAttr_write, 3, &rename, 1, 2, 1},
+    {"renamenx", PAttr_write, 3, &renamenx, 1, 2, 1},
+    {"scan", PAttr_read | PAttr_keyspace, -2, &scan},
+    {"sort", PAttr_read, -2, &sort, 1, 1, 1, &sortGetKeys},
 
     // server
-    {"select", PAttr_read, 2, &select},
-    {"dbsize", PAttr_read, 1, &dbsize},
-    {"bgsave", PAttr_read, 1, &bgsave},
-    {"save", PAttr_read, 1, &save},
-    {"lastsave", PAttr_read, 1, &lastsave},
+    {"select", PAttr_read | PAttr_admin, 2, &select},
+    {"dbsize", PAttr_read | PAttr_keyspace, 1, &dbsize},
+    {"bgsave", PAttr_read | PAttr_admin, 1, &bgsave},
+    {"save", PAttr_read | PAttr_admin, 1, &save},
+    {"lastsave", PAttr_read | PAttr_admin, 1, &lastsave},
+    {"bgrewriteaof", PAttr_read | PAttr_admin, 1, &bgrewriteaof},
     {"flushdb", PAttr_write, 1, &flushdb},
     {"flushall", PAttr_write, 1, &flushall},
-    {"client", PAttr_read, -2, &client},
-    {"debug", PAttr_read, -2, &debug},
-    {"shutdown", PAttr_read, -1, &shutdown},
-    {"ping", PAttr_read, 1, &ping},
-    {"echo", PAttr_read, 2, &echo},
-    {"info", PAttr_read, -1, &info},
-    {"monitor", PAttr_read, 1, &monitor},
-    {"auth", PAttr_read, 2, &auth},
-    {"slowlog", PAttr_read, -2, &slowlog},
-    {"config", PAttr_read, -3, &config},
+    {"client", PAttr_read | PAttr_admin, -2, &client},
+    {"debug", PAttr_read | PAttr_admin, -2, &debug},
+    {"shutdown", PAttr_read | PAttr_admin, -1, &shutdown},
+    {"ping", PAttr_read | PAttr_admin, 1, &ping},
+    {"echo", PAttr_read | PAttr_admin, 2, &echo},
+    {"info", PAttr_read | PAttr_admin, -1, &info},
+    {"monitor", PAttr_read | PAttr_admin, 1, &monitor},
+    {"auth", PAttr_read | PAttr_admin, 2, &auth},
+    {"slowlog", PAttr_read | PAttr_admin, -2, &slowlog},
+    {"config", PAttr_read | PAttr_admin, -2, &config},
+    {"latency", PAttr_read | PAttr_admin, -2, &latency},
 
     // string
-    {"strlen", PAttr_read, 2, &strlen},
-    {"set", PAttr_write, 3, &set},
-    {"mset", PAttr_write, -3, &mset},
-    {"msetnx", PAttr_write, -3, &msetnx},
-    {"setnx", PAttr_write, 3, &setnx},
-    {"setex", PAttr_write, 4, &setex},
-    {"psetex", PAttr_write, 4, &psetex},
-    {"get", PAttr_read, 2, &get},
-    {"getset", PAttr_write, 3, &getset},
-    {"mget", PAttr_read, -2, &mget},
-    {"append", PAttr_write, 3, &append},
-    {"bitcount", PAttr_read, -2, &bitcount},
-    {"bitop", PAttr_write, -4, &bitop},
-    {"getbit", PAttr_read, 3, &getbit},
-    {"setbit", PAttr_write, 4, &setbit},
-    {"incr", PAttr_write, 2, &incr},
-    {"decr", PAttr_write, 2, &decr},
-    {"incrby", PAttr_write, 3, &incrby},
-    {"incrbyfloat", PAttr_write, 3, &incrbyfloat},
-    {"decrby", PAttr_write, 3, &decrby},
-    {"getrange", PAttr_read, 4, &getrange},
-    {"setrange", PAttr_write, 4, &setrange},
+    {"strlen", PAttr_read, 2, &strlen, 1, 1, 1},
+    {"set", PAttr_write, 3, &set, 1, 1, 1},
+    {"mset", PAttr_write, -3, &mset, 1, -1, 2},
+    {"msetnx", PAttr_write, -3, &msetnx, 1, -1, 2},
+    {"setnx", PAttr_write, 3, &setnx, 1, 1, 1},
+    {"setex", PAttr_write, 4, &setex, 1, 1, 1},
+    {"psetex", PAttr_write, 4, &psetex, 1, 1, 1},
+    {"get", PAttr_read, 2, &get, 1, 1, 1},
+    {"getset", PAttr_write, 3, &getset, 1, 1, 1},
+    {"mget", PAttr_read, -2, &mget, 1, -1, 1},
+    {"append", PAttr_write, 3, &append, 1, 1, 1},
+    {"bitcount", PAttr_read, -2, &bitcount, 1, 1, 1},
+    {"bitop", PAttr_write, -4, &bitop, 2, -1, 1},
+    {"getbit", PAttr_read, 3, &getbit, 1, 1, 1},
+    {"setbit", PAttr_write, 4, &setbit, 1, 1, 1},
+    {"incr", PAttr_write, 2, &incr, 1, 1, 1},
+    {"decr", PAttr_write, 2, &decr, 1, 1, 1},
+    {"incrby", PAttr_write, 3, &incrby, 1, 1, 1},
+    {"incrbyfloat", PAttr_write, 3, &incrbyfloat, 1, 1, 1},
+    {"decrby", PAttr_write, 3, &decrby, 1, 1, 1},
+    {"getrange", PAttr_read, 4, &getrange, 1, 1, 1},
+    {"setrange", PAttr_write, 4, &setrange, 1, 1, 1},
 
     // list
-    {"lpush", PAttr_write, -3, &lpush},
-    {"rpush", PAttr_write, -3, &rpush},
-    {"lpushx", PAttr_write, -3, &lpushx},
-    {"rpushx", PAttr_write, -3, &rpushx},
-    {"lpop", PAttr_write, 2, &lpop},
-    {"rpop", PAttr_write, 2, &rpop},
-    {"lindex", PAttr_read, 3, &lindex},
-    {"llen", PAttr_read, 2, &llen},
-    {"lset", PAttr_write, 4, &lset},
-    {"ltrim", PAttr_write, 4, &ltrim},
-    {"lrange", PAttr_read, 4, &lrange},
-    {"linsert", PAttr_write, 5, &linsert},
-    {"lrem", PAttr_write, 4, &lrem},
-    {"rpoplpush", PAttr_write, 3, &rpoplpush},
-    {"blpop", PAttr_write, -3, &blpop},
-    {"brpop", PAttr_write, -3, &brpop},
-    {"brpoplpush", PAttr_write, 4, &brpoplpush},
+    {"lpush", PAttr_write, -3, &lpush, 1, 1, 1},
+    {"rpush", PAttr_write, -3, &rpush, 1, 1, 1},
+    {"lpushx", PAttr_write, -3, &lpushx, 1, 1, 1},
+    {"rpushx", PAttr_write, -3, &rpushx, 1, 1, 1},
+    {"lpop", PAttr_write, 2, &lpop, 1, 1, 1},
+    {"rpop", PAttr_write, 2, &rpop, 1, 1, 1},
+    {"lindex", PAttr_read, 3, &lindex, 1, 1, 1},
+    {"llen", PAttr_read, 2, &llen, 1, 1, 1},
+    {"lset", PAttr_write, 4, &lset, 1, 1, 1},
+    {"ltrim", PAttr_write, 4, &ltrim, 1, 1, 1},
+    {"lrange", PAttr_read, 4, &lrange, 1, 1, 1},
+    {"linsert", PAttr_write, 5, &linsert, 1, 1, 1},
+    {"lrem", PAttr_write, 4, &lrem, 1, 1, 1},
+    {"rpoplpush", PAttr_write, 3, &rpoplpush, 1, 2, 1},
+    {"blpop", PAttr_write, -3, &blpop, 1, -2, 1},
+    {"brpop", PAttr_write, -3, &brpop, 1, -2, 1},
+    {"brpoplpush", PAttr_write, 4, &brpoplpush, 1, 2, 1},
 
     // hash
-    {"hget", PAttr_read, 3, &hget},
-    {"hgetall", PAttr_read, 2, &hgetall},
-    {"hmget", PAttr_read, -3, &hmget},
-    {"hset", PAttr_write, 4, &hset},
-    {"hsetnx", PAttr_write, 4, &hsetnx},
-    {"hmset", PAttr_write, -4, &hmset},
-    {"hlen", PAttr_read, 2, &hlen},
-    {"hexists", PAttr_read, 3, &hexists},
-    {"hkeys", PAttr_read, 2, &hkeys},
-    {"hvals", PAttr_read, 2, &hvals},
-    {"hdel", PAttr_write, -3, &hdel},
-    {"hincrby", PAttr_write, 4, &hincrby},
-    {"hincrbyfloat", PAttr_write, 4, &hincrbyfloat},
-    {"hscan", PAttr_read, -3, &hscan},
-    {"hstrlen", PAttr_read, 3, &hstrlen},
+    {"hget", PAttr_read, 3, &hget, 1, 1, 1},
+    {"hgetall", PAttr_read, 2, &hgetall, 1, 1, 1},
+    {"hmget", PAttr_read, -3, &hmget, 1, 1, 1},
+    {"hset", PAttr_write, 4, &hset, 1, 1, 1},
+    {"hsetnx", PAttr_write, 4, &hsetnx, 1, 1, 1},
+    {"hmset", PAttr_write, -4, &hmset, 1, 1, 1},
+    {"hlen", PAttr_read, 2, &hlen, 1, 1, 1},
+    {"hexists", PAttr_read, 3, &hexists, 1, 1, 1},
+    {"hkeys", PAttr_read, 2, &hkeys, 1, 1, 1},
+    {"hvals", PAttr_read, 2, &hvals, 1, 1, 1},
+    {"hdel", PAttr_write, -3, &hdel, 1, 1, 1},
+    {"hincrby", PAttr_write, 4, &hincrby, 1, 1, 1},
+    {"hincrbyfloat", PAttr_write, 4, &hincrbyfloat, 1, 1, 1},
+    {"hscan", PAttr_read, -3, &hscan, 1, 1, 1},
+    {"hstrlen", PAttr_read, 3, &hstrlen, 1, 1, 1},
 
     // set
-    {"sadd", PAttr_write, -3, &sadd},
-    {"scard", PAttr_read, 2, &scard},
-    {"sismember", PAttr_read, 3, &sismember},
-    {"srem", PAttr_write, -3, &srem},
-    {"smembers", PAttr_read, 2, &smembers},
-    {"sdiff", PAttr_read, -2, &sdiff},
-    {"sdiffstore", PAttr_write, -3, &sdiffstore},
-    {"sinter", PAttr_read, -2, &sinter},
-    {"sinterstore", PAttr_write, -3, &sinterstore},
-    {"sunion", PAttr_read, -2, &sunion},
-    {"sunionstore", PAttr_write, -3, &sunionstore},
-    {"smove", PAttr_write, 4, &smove},
-    {"spop", PAttr_write, 2, &spop},
-    {"srandmember", PAttr_read, 2, &srandmember},
-    {"sscan", PAttr_read, -3, &sscan},
+    {"sadd", PAttr_write, -3, &sadd, 1, 1, 1},
+    {"scard", PAttr_read, 2, &scard, 1, 1, 1},
+    {"sismember", PAttr_read, 3, &sismember, 1, 1, 1},
+    {"srem", PAttr_write, -3, &srem, 1, 1, 1},
+    {"smembers", PAttr_read, 2, &smembers, 1, 1, 1},
+    {"sdiff", PAttr_read, -2, &sdiff, 1, -1, 1},
+    {"sdiffstore", PAttr_write, -3, &sdiffstore, 1, -1, 1},
+    {"sinter", PAttr_read, -2, &sinter, 1, -1, 1},
+    {"sinterstore", PAttr_write, -3, &sinterstore, 1, -1, 1},
+    {"sunion", PAttr_read, -2, &sunion, 1, -1, 1},
+    {"sunionstore", PAttr_write, -3, &sunionstore, 1, -1, 1},
+    {"smove", PAttr_write, 4, &smove, 1, 2, 1},
+    {"spop", PAttr_write, 2, &spop, 1, 1, 1},
+    {"srandmember", PAttr_read, 2, &srandmember, 1, 1, 1},
+    {"sscan", PAttr_read, -3, &sscan, 1, 1, 1},
 
     //
-    {"zadd", PAttr_write, -4, &zadd},
-    {"zcard", PAttr_read, 2, &zcard},
-    {"zrank", PAttr_read, 3, &zrank},
-    {"zrevrank", PAttr_read, 3, &zrevrank},
-    {"zrem", PAttr_write, -3, &zrem},
-    {"zincrby", PAttr_write, 4, &zincrby},
-    {"zscore", PAttr_read, 3, &zscore},
-    {"zrange", PAttr_read, -4, &zrange},
-    {"zrevrange", PAttr_read, -4, &zrevrange},
-    {"zrangebyscore", PAttr_read, -4, &zrangebyscore},
-    {"zrevrangebyscore", PAttr_read, -4, &zrevrangebyscore},
-    {"zremrangebyrank", PAttr_write, 4, &zremrangebyrank},
-    {"zremrangebyscore", PAttr_write, 4, &zremrangebyscore},
+    {"zadd", PAttr_write, -4, &zadd, 1, 1, 1},
+    {"zcard", PAttr_read, 2, &zcard, 1, 1, 1},
+    {"zrank", PAttr_read, 3, &zrank, 1, 1, 1},
+    {"zrevrank", PAttr_read, 3, &zrevrank, 1, 1, 1},
+    {"zrem", PAttr_write, -3, &zrem, 1, 1, 1},
+    {"zincrby", PAttr_write, 4, &zincrby, 1, 1, 1},
+    {"zscore", PAttr_read, 3, &zscore, 1, 1, 1},
+    {"zrange", PAttr_read, -4, &zrange, 1, 1, 1},
+    {"zrevrange", PAttr_read, -4, &zrevrange, 1, 1, 1},
+    {"zrangebyscore", PAttr_read, -4, &zrangebyscore, 1, 1, 1},
+    {"zrevrangebyscore", PAttr_read, -4, &zrevrangebyscore, 1, 1, 1},
+    {"zremrangebyrank", PAttr_write, 4, &zremrangebyrank, 1, 1, 1},
+    {"zremrangebyscore", PAttr_write, 4, &zremrangebyscore, 1, 1, 1},
 
     // pubsub
-    {"subscribe", PAttr_read, -2, &subscribe},
-    {"unsubscribe", PAttr_read, -1, &unsubscribe},
-    {"publish", PAttr_read, 3, &publish},
-    {"psubscribe", PAttr_read, -2, &psubscribe},
-    {"punsubscribe", PAttr_read, -1, &punsubscribe},
-    {"pubsub", PAttr_read, -2, &pubsub},
+    {"subscribe", PAttr_read | PAttr_admin, -2, &subscribe},
+    {"unsubscribe", PAttr_read | PAttr_admin, -1, &unsubscribe},
+    {"publish", PAttr_read | PAttr_admin, 3, &publish},
+    {"psubscribe", PAttr_read | PAttr_admin, -2, &psubscribe},
+    {"punsubscribe", PAttr_read | PAttr_admin, -1, &punsubscribe},
+    {"pubsub", PAttr_read | PAttr_admin, -2, &pubsub},
 
     // multi
-    {"watch", PAttr_read, -2, &watch},
-    {"unwatch", PAttr_read, 1, &unwatch},
-    {"multi", PAttr_read, 1, &multi},
+    {"watch", PAttr_read, -2, &watch, 1, -1, 1},
+    {"unwatch", PAttr_read | PAttr_admin, 1, &unwatch},
+    {"multi", PAttr_read | PAttr_admin, 1, &multi},
     {"exec", PAttr_read, 1, &exec},
-    {"discard", PAttr_read, 1, &discard},
+    {"discard", PAttr_read | PAttr_admin, 1, &discard},
 
     // replication
-    {"sync", PAttr_read, 1, &sync},
-    {"psync", PAttr_read, 1, &sync},
-    {"slaveof", PAttr_read, 3, &slaveof},
-    {"replconf", PAttr_read, -3, &replconf},
+    {"sync", PAttr_read | PAttr_admin, 1, &sync},
+    {"psync", PAttr_read | PAttr_admin, 3, &psync},
+    {"slaveof", PAttr_read | PAttr_admin, 3, &slaveof},
+    {"replconf", PAttr_read | PAttr_admin, -3, &replconf},
+    {"wait", PAttr_read | PAttr_admin, 3, &wait},
+    {"readonly", PAttr_read | PAttr_admin, -1, &readonly},
+    {"readwrite", PAttr_read | PAttr_admin, 1, &readwrite},
+
+    // cluster
+    {"cluster", PAttr_read | PAttr_admin, -2, &cluster},
+    {"asking", PAttr_read | PAttr_admin, 1, &asking},
+    {"migrate", PAttr_read | PAttr_admin, -6, &migrate},
 
     // help
-    {"cmdlist", PAttr_read, 1, &cmdlist},
+    {"cmdlist", PAttr_read | PAttr_admin, 1, &cmdlist},
 };
 
 Delegate<void(UnboundedBuffer&)> g_infoCollector;
@@ -182,7 +217,11 @@ void PCommandTable::Init() {
   g_infoCollector += OnMemoryInfoCollect;
   g_infoCollector += OnServerInfoCollect;
   g_infoCollector += OnClientInfoCollect;
+  g_infoCollector += OnPersistenceInfoCollect;
+  g_infoCollector += OnStatsInfoCollect;
   g_infoCollector += std::bind(&PReplication::OnInfoCommand, &PREPL, std::placeholders::_1);
+  g_infoCollector += std::bind(&PCluster::OnInfoCommand, &PCLUSTER, std::placeholders::_1);
+  g_infoCollector += OnKeyspaceInfoCollect;
 }
 
 const PCommandInfo* PCommandTable::GetCommandInfo(const PString& cmd) {
@@ -194,6 +233,21 @@ const PCommandInfo* PCommandTable::GetCommandInfo(const PString& cmd) {
   return 0;
 }
 
+void PCommandTable::GetKeys(const PCommandInfo* info, const std::vector<PString>& params,
+                            std::vector<const PString*>& keys) {
+  const int argc = static_cast<int>(params.size());
+  if (info->firstKey > 0 && info->firstKey < argc) {
+    const int last = info->lastKey < 0 ? argc + info->lastKey : std::min(info->lastKey, argc - 1);
+    for (int i = info->firstKey; i <= last; i += info->keyStep) {
+      keys.push_back(&params[i]);
+    }
+  }
+
+  if (info->getKeys) {
+    info->getKeys(params, keys);
+  }
+}
+
 bool PCommandTable::AliasCommand(const std::map<PString, PString>& aliases) {
   for (const auto& pair : aliases) {
     if (!AliasCommand(pair.first, pair.second)) {
@@ -232,6 +286,26 @@ bool PCommandTable::AddCommand(const PString& cmd, const PCommandInfo* info) {
   return s_handlers.insert(std::make_pair(cmd, info)).second;
 }
 
+// runs the command and records its stats, it failed if an error was replied,
+// or returned without a reply to write, as a command from the master
+static PError callHandler(const std::vector<PString>& params, const PCommandInfo* info, UnboundedBuffer* reply) {
+  const std::size_t replied = reply ? reply->ReadableSize() : 0;
+  const uint64_t begin = CycleClock::Now();
+
+  PError err = info->handler(params, reply);
+
+  const uint64_t ns = CycleClock::ToNs(CycleClock::Now() - begin);
+  bool failed = false;
+  if (reply) {
+    failed = reply->ReadableSize() > replied && reply->ReadAddr()[replied] == '-';
+  } else {
+    failed = err != PError_ok && err != PError_notExist && err != PError_nop;
+  }
+  PCommandStats::Instance().Call(info, info->cmd, ns, failed);
+
+  return err;
+}
+
 PError PCommandTable::ExecuteCmd(const std::vector<PString>& params, const PCommandInfo* info, UnboundedBuffer* reply) {
   if (params.empty()) {
     ReplyError(PError_param, reply);
@@ -244,11 +318,12 @@ PError PCommandTable::ExecuteCmd(const std::vector<PString>& params, const PComm
   }
 
   if (!info->CheckParamsCount(static_cast<int>(params.size()))) {
+    PCommandStats::Instance().Reject(info, info->cmd);
     ReplyError(PError_param, reply);
     return PError_param;
   }
 
-  return info->handler(params, reply);
+  return callHandler(params, info, reply);
 }
 
 PError PCommandTable::ExecuteCmd(const std::vector<PString>& params, UnboundedBuffer* reply) {
@@ -265,11 +340,12 @@ PError PCommandTable::ExecuteCmd(const std::vector<PString>& params, UnboundedBu
 
   const PCommandInfo* info = it->second;
   if (!info->CheckParamsCount(static_cast<int>(params.size()))) {
+    PCommandStats::Instance().Reject(info, info->cmd);
     ReplyError(PError_param, reply);
     return PError_param;
   }
 
-  return info->handler(params, reply);
+  return callHandler(params, info, reply);
 }
 
 bool PCommandInfo::CheckParamsCount(int nParams) const {
@@ -18,10 +18,14 @@ namespace pikiwidb {
 enum PCommandAttr {
   PAttr_read = 0x1,
   PAttr_write = 0x1 << 1,
+  PAttr_keyspace = 0x1 << 2,  // reading the whole keyspace, not served while async loading
+  PAttr_admin = 0x1 << 3,  // not reading the dataset, served by stale slave
 };
 
 class UnboundedBuffer;
 using PCommandHandler = PError(const std::vector<PString>& params, UnboundedBuffer* reply);
+// the keys of the commands which key positions can not tell
+using PGetKeysHandler = void(const std::vector<PString>& params, std::vector<const PString*>& keys);
 
 // key commands
 PCommandHandler type;
@@ -41,6 +45,8 @@ PCommandHandler rename;
 PCommandHandler renamenx;
 PCommandHandler scan;
 PCommandHandler sort;
+PCommandHandler dump;
+PCommandHandler restore;
 
 // server commands
 PCommandHandler select;
@@ -48,6 +54,7 @@ PCommandHandler dbsize;
 PCommandHandler bgsave;
 PCommandHandler save;
 PCommandHandler lastsave;
+PCommandHandler bgrewriteaof;
 PCommandHandler flushdb;
 PCommandHandler flushall;
 PCommandHandler client;
@@ -60,6 +67,7 @@ PCommandHandler monitor;
 PCommandHandler auth;
 PCommandHandler slowlog;
 PCommandHandler config;
+PCommandHandler latency;
 
 // string commands
 PCommandHandler set;
@@ -170,8 +178,17 @@ PCommandHandler discard;
 
 // replication
 PCommandHandler sync;
+PCommandHandler psync;
 PCommandHandler slaveof;
 PCommandHandler replconf;
+PCommandHandler wait;
+PCommandHandler readonly;
+PCommandHandler readwrite;
+
+// cluster
+PCommandHandler cluster;
+PCommandHandler asking;
+PCommandHandler migrate;
 
 // modules
 PCommandHandler module;
@@ -183,12 +200,21 @@ extern Delegate<void(UnboundedBuffer&)> g_infoCollector;
 extern void OnMemoryInfoCollect(UnboundedBuffer&);
 extern void OnServerInfoCollect(UnboundedBuffer&);
 extern void OnClientInfoCollect(UnboundedBuffer&);
+extern void OnPersistenceInfoCollect(UnboundedBuffer&);
+extern void OnStatsInfoCollect(UnboundedBuffer&);
+extern void OnKeyspaceInfoCollect(UnboundedBuffer&);
 
 struct PCommandInfo {
   PString cmd;
   int attr = -1;
   int params = -1;
   PCommandHandler* handler = nullptr;
+  // the key positions as redis: the index of first and last key, negative
+  // is from the end, and the step. 0 if no key.
+  int firstKey = 0;
+  int lastKey = 0;
+  int keyStep = 0;
+  PGetKeysHandler* getKeys = nullptr;  // the extra keys, such as SORT STORE
   bool CheckParamsCount(int nParams) const;
 };
 
@@ -199,6 +225,9 @@ class PCommandTable {
   static void Init();
 
   static const PCommandInfo* GetCommandInfo(const PString& cmd);
+  // the keys in params by the key positions of info
+  static void GetKeys(const PCommandInfo* info, const std::vector<PString>& params,
+                      std::vector<const PString*>& keys);
   static PError ExecuteCmd(const std::vector<PString>& params, const PCommandInfo* info,
                            UnboundedBuffer* reply = nullptr);
   static PError ExecuteCmd(const std::vector<PString>& params, UnboundedBuffer* reply = nullptr);
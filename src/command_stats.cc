@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "command_stats.h"
+
+#include <strings.h>
+#include <algorithm>
+
+#include "unbounded_buffer.h"
+
+namespace pikiwidb {
+
+PCommandStats& PCommandStats::Instance() {
+  static PCommandStats stats;
+
+  return stats;
+}
+
+PCommandStat& PCommandStats::statOf(const void* cmd, const PString& name) {
+  auto& stat = stats_[cmd];
+  if (stat.name.empty()) {
+    stat.name = name;
+    std::transform(stat.name.begin(), stat.name.end(), stat.name.begin(), ::tolower);
+  }
+
+  return stat;
+}
+
+void PCommandStats::Call(const void* cmd, const PString& name, uint64_t ns, bool failed) {
+  auto& stat = statOf(cmd, name);
+  ++stat.calls;
+  stat.ns += ns;
+  if (failed) {
+    ++stat.failedCalls;
+  }
+
+  if (!stat.latency) {
+    stat.latency = std::make_unique<Histogram>();
+  }
+  stat.latency->Record(ns);
+}
+
+void PCommandStats::Reject(const void* cmd, const PString& name) { ++statOf(cmd, name).rejectedCalls; }
+
+void PCommandStats::Reset() {
+  for (auto& kv : stats_) {
+    auto& stat = kv.second;
+    stat.calls = stat.ns = stat.rejectedCalls = stat.failedCalls = 0;
+    stat.latency.reset();
+  }
+}
+
+std::vector<const PCommandStat*> PCommandStats::Stats() const {
+  std::vector<const PCommandStat*> stats;
+  for (const auto& kv : stats_) {
+    const auto& stat = kv.second;
+    if (stat.calls > 0 || stat.rejectedCalls > 0) {
+      stats.push_back(&stat);
+    }
+  }
+
+  std::sort(stats.begin(), stats.end(), [](const PCommandStat* a, const PCommandStat* b) { return a->name < b->name; });
+  return stats;
+}
+
+const PCommandStat* PCommandStats::Find(const PString& name) const {
+  for (const auto& kv : stats_) {
+    if (strcasecmp(kv.second.name.c_str(), name.c_str()) == 0) {
+      return &kv.second;
+    }
+  }
+
+  return nullptr;
+}
+
+void PCommandStats::OnInfoCommandStats(UnboundedBuffer& res) const {
+  if (!res.IsEmpty()) {
+    res.PushData("\r\n", 2);
+  }
+  res.PushData("# Commandstats\r\n", 16);
+
+  char buf[256];
+  for (const auto* stat : Stats()) {
+    const double usec = stat->ns / 1000.0;
+    int n = snprintf(buf, sizeof buf - 1,
+                     "cmdstat_%s:calls=%lu,usec=%lu,usec_per_call=%.2f,rejected_calls=%lu,failed_calls=%lu\r\n",
+                     stat->name.c_str(), stat->calls, stat->ns / 1000, stat->calls ? usec / stat->calls : 0.0,
+                     stat->rejectedCalls, stat->failedCalls);
+    res.PushData(buf, n);
+  }
+}
+
+void PCommandStats::OnInfoLatencyStats(UnboundedBuffer& res) const {
+  if (!res.IsEmpty()) {
+    res.PushData("\r\n", 2);
+  }
+  res.PushData("# Latencystats\r\n", 16);
+
+  char buf[256];
+  for (const auto* stat : Stats()) {
+    if (!stat->latency) {
+      continue;
+    }
+
+    const auto& latency = *stat->latency;
+    int n = snprintf(buf, sizeof buf - 1, "latency_percentiles_usec_%s:p50=%.3f,p99=%.3f,p99.9=%.3f\r\n",
+                     stat->name.c_str(), latency.Percentile(50) / 1000.0, latency.Percentile(99) / 1000.0,
+                     latency.Percentile(99.9) / 1000.0);
+    res.PushData(buf, n);
+  }
+}
+
+}  // namespace pikiwidb
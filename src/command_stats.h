@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "histogram.h"
+#include "pstring.h"
+
+namespace pikiwidb {
+
+class UnboundedBuffer;
+
+struct PCommandStat {
+  PString name;
+  uint64_t calls = 0;
+  uint64_t ns = 0;
+  uint64_t rejectedCalls = 0;  // refused before execution, such as arity, readonly slave, stale or redirection
+  uint64_t failedCalls = 0;    // executed but replied an error
+  std::unique_ptr<Histogram> latency;  // in ns, allocated at the first call
+};
+
+// the stats of INFO commandstats, INFO latencystats and LATENCY HISTOGRAM,
+// a command is identified by its PCommandInfo or BaseCmd, so an alias shares the stats
+class PCommandStats {
+ public:
+  static PCommandStats& Instance();
+
+  PCommandStats(const PCommandStats&) = delete;
+  void operator=(const PCommandStats&) = delete;
+
+  void Call(const void* cmd, const PString& name, uint64_t ns, bool failed);
+  void Reject(const void* cmd, const PString& name);
+  // CONFIG RESETSTAT
+  void Reset();
+
+  // the commands called or rejected, by name
+  std::vector<const PCommandStat*> Stats() const;
+  const PCommandStat* Find(const PString& name) const;
+
+  void OnInfoCommandStats(UnboundedBuffer& res) const;
+  void OnInfoLatencyStats(UnboundedBuffer& res) const;
+
+ private:
+  PCommandStats() = default;
+
+  PCommandStat& statOf(const void* cmd, const PString& name);
+
+  std::unordered_map<const void*, PCommandStat> stats_;
+};
+
+}  // namespace pikiwidb
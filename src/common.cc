@@ -40,6 +40,25 @@ struct PErrorInfo g_errorInfo[] = {
     {sizeof "-ERR init module failed\r\n" - 1, "-ERR init module failed\r\n"},
     {sizeof "-ERR uninit module failed\r\n" - 1, "-ERR uninit module failed\r\n"},
     {sizeof "-ERR module already loaded\r\n" - 1, "-ERR module already loaded\r\n"},
+    {sizeof "-LOADING PikiwiDB is loading the dataset in memory\r\n" - 1,
+     "-LOADING PikiwiDB is loading the dataset in memory\r\n"},
+    {sizeof "-NOMASTERLINK Can't SYNC while not connected with my master\r\n" - 1,
+     "-NOMASTERLINK Can't SYNC while not connected with my master\r\n"},
+    {sizeof "-ERR WAIT cannot be used with slave instances\r\n" - 1,
+     "-ERR WAIT cannot be used with slave instances\r\n"},
+    {sizeof "-STALE The data of slave is older than the bound of READONLY\r\n" - 1,
+     "-STALE The data of slave is older than the bound of READONLY\r\n"},
+    {sizeof "-BUSYKEY Target key name already exists.\r\n" - 1, "-BUSYKEY Target key name already exists.\r\n"},
+    {sizeof "-ERR DUMP payload version or checksum are wrong\r\n" - 1,
+     "-ERR DUMP payload version or checksum are wrong\r\n"},
+    {sizeof "-CROSSSLOT Keys in request don't hash to the same slot\r\n" - 1,
+     "-CROSSSLOT Keys in request don't hash to the same slot\r\n"},
+    {sizeof "-CLUSTERDOWN The cluster is down\r\n" - 1, "-CLUSTERDOWN The cluster is down\r\n"},
+    {sizeof "-TRYAGAIN Multiple keys request during rehashing of slot\r\n" - 1,
+     "-TRYAGAIN Multiple keys request during rehashing of slot\r\n"},
+    {sizeof "-ERR This instance has cluster support disabled\r\n" - 1,
+     "-ERR This instance has cluster support disabled\r\n"},
+    {sizeof "-ERR SELECT is not allowed in cluster mode\r\n" - 1, "-ERR SELECT is not allowed in cluster mode\r\n"},
 };
 
 int Double2Str(char* ptr, std::size_t nBytes, double val) { return snprintf(ptr, nBytes - 1, "%.6g", val); }
@@ -340,6 +359,10 @@ PParseResult GetIntUntilCRLF(const char*& ptr, std::size_t nBytes, int& val) {
     }
   }
 
+  if (i == nBytes) {
+    return PParseResult::wait;  // the digits may continue in next packet
+  }
+
   if (negtive) {
     value *= -1;
   }
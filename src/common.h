@@ -93,6 +93,17 @@ enum PError {
   PError_moduleinit = 16,
   PError_moduleuninit = 17,
   PError_modulerepeat = 18,
+  PError_loading = 19,
+  PError_noMasterLink = 20,
+  PError_waitOnSlave = 21,
+  PError_stale = 22,
+  PError_busyKey = 23,
+  PError_badPayload = 24,
+  PError_crossSlot = 25,
+  PError_clusterDown = 26,
+  PError_tryAgain = 27,
+  PError_noCluster = 28,
+  PError_selectInCluster = 29,
   PError_max,
 };
 
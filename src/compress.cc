@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "compress.h"
+
+#include <lz4.h>
+#include <math.h>
+#include <strings.h>
+#include <zstd.h>
+#include <algorithm>
+#include <memory>
+
+extern "C" {
+#include "lzf/lzf.h"
+}
+
+namespace pikiwidb {
+
+// the strings shorter are compressed without entropy check
+static const std::size_t kSampleMinLen = 256;
+// sample some blocks spread over the string
+static const std::size_t kSampleBlocks = 16;
+static const std::size_t kSampleBlockSize = 64;
+// bits per byte, random bytes are about 7.8 by the samples
+static const double kMaxEntropy = 7.5;
+
+PCompressStats g_compressStats;
+
+bool ParseCodec(const PString& name, PCodec& codec) {
+  if (strcasecmp(name.c_str(), "none") == 0) {
+    codec = PCodec_none;
+  } else if (strcasecmp(name.c_str(), "lzf") == 0) {
+    codec = PCodec_lzf;
+  } else if (strcasecmp(name.c_str(), "lz4") == 0) {
+    codec = PCodec_lz4;
+  } else if (strcasecmp(name.c_str(), "zstd") == 0) {
+    codec = PCodec_zstd;
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+const char* CodecName(PCodec codec) {
+  switch (codec) {
+    case PCodec_lzf:
+      return "lzf";
+    case PCodec_lz4:
+      return "lz4";
+    case PCodec_zstd:
+      return "zstd";
+    default:
+      return "none";
+  }
+}
+
+bool IsIncompressible(const char* data, std::size_t len) {
+  if (len < kSampleMinLen) {
+    return false;
+  }
+
+  uint32_t counts[256] = {0};
+  std::size_t samples = 0;
+  if (len <= kSampleBlocks * kSampleBlockSize) {
+    for (std::size_t i = 0; i < len; ++i) {
+      ++counts[static_cast<uint8_t>(data[i])];
+    }
+    samples = len;
+  } else {
+    const std::size_t step = (len - kSampleBlockSize) / (kSampleBlocks - 1);
+    for (std::size_t b = 0; b < kSampleBlocks; ++b) {
+      const char* block = data + b * step;
+      for (std::size_t i = 0; i < kSampleBlockSize; ++i) {
+        ++counts[static_cast<uint8_t>(block[i])];
+      }
+    }
+    samples = kSampleBlocks * kSampleBlockSize;
+  }
+
+  double entropy = 0;
+  for (auto count : counts) {
+    if (count > 0) {
+      double p = static_cast<double>(count) / samples;
+      entropy -= p * log2(p);
+    }
+  }
+
+  return entropy > kMaxEntropy;
+}
+
+// the contexts are reused by each saving or loading thread
+static ZSTD_CCtx* zstdCCtx() {
+  thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> ctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+  return ctx.get();
+}
+
+static ZSTD_DCtx* zstdDCtx() {
+  thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> ctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+  return ctx.get();
+}
+
+bool Compress(PCodec codec, int level, const char* data, std::size_t len, PString& out) {
+  if (len <= 4) {
+    return false;
+  }
+
+  // must save 4 bytes at least
+  const std::size_t limit = len - 4;
+  std::size_t outLen = 0;
+
+  switch (codec) {
+    case PCodec_lzf:
+      out.resize(limit + 1);
+      outLen = lzf_compress(data, static_cast<unsigned>(len), &out[0], static_cast<unsigned>(limit));
+      break;
+
+    case PCodec_lz4:
+      out.resize(limit);
+      outLen = LZ4_compress_default(data, &out[0], static_cast<int>(len), static_cast<int>(limit));
+      break;
+
+    case PCodec_zstd: {
+      out.resize(ZSTD_compressBound(len));
+      size_t ret = ZSTD_compressCCtx(zstdCCtx(), &out[0], out.size(), data, len, level);
+      outLen = ZSTD_isError(ret) || ret > limit ? 0 : ret;
+      break;
+    }
+
+    default:
+      break;
+  }
+
+  if (outLen == 0) {
+    return false;
+  }
+
+  out.resize(outLen);
+  return true;
+}
+
+bool Decompress(PCodec codec, const char* data, std::size_t len, char* out, std::size_t rawLen) {
+  switch (codec) {
+    case PCodec_lzf:
+      return lzf_decompress(data, static_cast<unsigned>(len), out, static_cast<unsigned>(rawLen)) == rawLen;
+
+    case PCodec_lz4:
+      return LZ4_decompress_safe(data, out, static_cast<int>(len), static_cast<int>(rawLen)) ==
+             static_cast<int>(rawLen);
+
+    case PCodec_zstd:
+      return ZSTD_decompressDCtx(zstdDCtx(), out, rawLen, data, len) == rawLen;
+
+    default:
+      return false;
+  }
+}
+
+static void encodeFrameHeader(PCodec codec, std::size_t rawLen, std::size_t len, char* hdr) {
+  hdr[0] = static_cast<char>(codec);
+  for (int i = 0; i < 4; ++i) {
+    hdr[1 + i] = static_cast<char>((rawLen >> (8 * i)) & 0xff);
+    hdr[5 + i] = static_cast<char>((len >> (8 * i)) & 0xff);
+  }
+}
+
+static std::size_t decodeFrameLen(const char* p) {
+  std::size_t n = 0;
+  for (int i = 0; i < 4; ++i) {
+    n |= static_cast<std::size_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+  }
+  return n;
+}
+
+std::size_t AppendFrames(PCodec codec, int level, const char* data, std::size_t len, PString& out) {
+  const std::size_t origin = out.size();
+  PString compressed;
+
+  while (len > 0) {
+    const std::size_t rawLen = std::min(len, kMaxFrameRawSize);
+    const bool succ = Compress(codec, level, data, rawLen, compressed);
+    const char* payload = succ ? compressed.data() : data;
+    const std::size_t payloadLen = succ ? compressed.size() : rawLen;
+
+    char hdr[kFrameHeaderSize];
+    encodeFrameHeader(succ ? codec : PCodec_none, rawLen, payloadLen, hdr);
+    out.append(hdr, sizeof hdr);
+    out.append(payload, payloadLen);
+
+    data += rawLen;
+    len -= rawLen;
+  }
+
+  return out.size() - origin;
+}
+
+long DecodeFrames(const char* data, std::size_t len, PString& out) {
+  std::size_t consumed = 0;
+
+  while (len - consumed >= kFrameHeaderSize) {
+    const char* hdr = data + consumed;
+    const auto codec = static_cast<PCodec>(static_cast<uint8_t>(hdr[0]));
+    const std::size_t rawLen = decodeFrameLen(hdr + 1);
+    const std::size_t payloadLen = decodeFrameLen(hdr + 5);
+    if (rawLen > kMaxFrameRawSize || payloadLen > rawLen) {
+      return -1;
+    }
+
+    if (len - consumed - kFrameHeaderSize < payloadLen) {
+      break;  // wait for the whole frame
+    }
+
+    const char* payload = hdr + kFrameHeaderSize;
+    if (codec == PCodec_none) {
+      if (payloadLen != rawLen) {
+        return -1;
+      }
+      out.append(payload, payloadLen);
+    } else {
+      const std::size_t pos = out.size();
+      out.resize(pos + rawLen);
+      if (!Decompress(codec, payload, payloadLen, &out[pos], rawLen)) {
+        return -1;
+      }
+    }
+
+    consumed += kFrameHeaderSize + payloadLen;
+  }
+
+  return static_cast<long>(consumed);
+}
+
+void PCompressStats::OnInfoCommand(UnboundedBuffer& res, const char* codec) const {
+  const uint64_t raw = rawBytes;
+  const uint64_t compressed = compressedBytes;
+
+  char buf[512];
+  int n = snprintf(buf, sizeof buf - 1,
+                   "rdb_compression_codec:%s\r\n"
+                   "rdb_compression_raw_bytes:%lu\r\n"
+                   "rdb_compression_compressed_bytes:%lu\r\n"
+                   "rdb_compression_ratio:%.2f\r\n"
+                   "rdb_compression_skipped:%lu\r\n"
+                   "rdb_compression_no_gain:%lu\r\n",
+                   codec, raw, compressed, compressed > 0 ? static_cast<double>(raw) / compressed : 0.0,
+                   skipped.load(), noGain.load());
+  res.PushData(buf, n);
+}
+
+}  // namespace pikiwidb
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+#include "pstring.h"
+#include "unbounded_buffer.h"
+
+namespace pikiwidb {
+
+enum PCodec {
+  PCodec_none,
+  PCodec_lzf,
+  PCodec_lz4,
+  PCodec_zstd,
+};
+
+bool ParseCodec(const PString& name, PCodec& codec);
+const char* CodecName(PCodec codec);
+
+// estimate the entropy by sampling, true if it's near random bytes
+bool IsIncompressible(const char* data, std::size_t len);
+
+// false if the codec fails or saves less than 4 bytes
+bool Compress(PCodec codec, int level, const char* data, std::size_t len, PString& out);
+bool Decompress(PCodec codec, const char* data, std::size_t len, char* out, std::size_t rawLen);
+
+// a frame of compressed stream: codec(1) raw length(4) length(4) data, the
+// data is stored as is if it's not smaller by compression
+const std::size_t kFrameHeaderSize = 9;
+const std::size_t kMaxFrameRawSize = 64 * 1024;
+
+// append the frames of data to out, return the bytes appended
+std::size_t AppendFrames(PCodec codec, int level, const char* data, std::size_t len, PString& out);
+// decode the whole frames to out, return the bytes consumed, or -1 if corrupted
+long DecodeFrames(const char* data, std::size_t len, PString& out);
+
+// updated by the saving threads
+struct PCompressStats {
+  std::atomic<uint64_t> rawBytes{0};         // of the strings compressed
+  std::atomic<uint64_t> compressedBytes{0};  // after compressed
+  std::atomic<uint64_t> skipped{0};          // not tried, by entropy check
+  std::atomic<uint64_t> noGain{0};           // tried but not smaller
+
+  void OnInfoCommand(UnboundedBuffer& res, const char* codec) const;
+};
+
+extern PCompressStats g_compressStats;
+
+}  // namespace pikiwidb
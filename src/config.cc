@@ -46,14 +46,47 @@ PConfig::PConfig() {
   savechanges = 999999999;
   rdbcompression = true;
   rdbchecksum = true;
+  rdbforkless = true;
+  rdbthreads = 4;
+  rdbloadthreads = 4;
+  rdbcodec = "lzf";
+  rdbcompressionlevel = 3;
+  asyncloading = false;
+  asyncloadingwait = true;
+  warmrestart = false;
+  repldisklesssync = false;
+  repldisklesssyncdelay = 5;
+  replbacklogsize = 1024 * 1024;
+  repldisklessload = "disabled";
+  replcompression = "none";
+  repldecodethread = true;
+  replbuffermemory = 64 * 1024 * 1024UL;
+  replbufferlimit = 4 * 1024 * 1024 * 1024UL;
+  clusterenabled = false;
+  clusterconfigfile = "nodes.conf";
+  clusternodetimeout = 15000;
+  clusterport = 0;
+  clusterrequirefullcoverage = true;
   rdbfullname = "./dump.rdb";
 
+  // aof
+  appendonly = false;
+  appendfsync = "everysec";
+  appenddir = "./appendonlydir";
+  appendfilename = "appendonly.aof";
+  autoAofRewritePerc = 100;
+  autoAofRewriteMinSize = 64 * 1024 * 1024UL;
+
   maxclients = 10000;
 
   // slow log
   slowlogtime = 0;
   slowlogmaxlen = 128;
 
+  latencymonitorthreshold = 0;
+
+  metricsport = 0;
+
   hz = 10;
 
   includefile = "";
@@ -130,14 +163,37 @@ bool LoadPikiwiDBConfig(const char* cfgFile, PConfig& cfg) {
 
   cfg.rdbcompression = (parser.GetData<PString>("rdbcompression") == "yes");
   cfg.rdbchecksum = (parser.GetData<PString>("rdbchecksum") == "yes");
+  cfg.rdbforkless = (parser.GetData<PString>("rdb-forkless", "yes") == "yes");
+  cfg.rdbthreads = parser.GetData<int>("rdb-save-threads", cfg.rdbthreads);
+  cfg.rdbcodec = parser.GetData<PString>("rdb-compression-codec", cfg.rdbcodec);
+  cfg.rdbcompressionlevel = parser.GetData<int>("rdb-compression-level", cfg.rdbcompressionlevel);
+  cfg.rdbloadthreads = parser.GetData<int>("rdb-load-threads", cfg.rdbloadthreads);
+  cfg.asyncloading = (parser.GetData<PString>("async-loading", "no") == "yes");
+  cfg.asyncloadingwait = (parser.GetData<PString>("async-loading-wait", "yes") == "yes");
+  cfg.warmrestart = (parser.GetData<PString>("warm-restart", "no") == "yes");
 
   cfg.rdbfullname = parser.GetData<PString>("dir", "./") + parser.GetData<PString>("dbfilename", "dump.rdb");
 
+  // load aof config
+  cfg.appendonly = (parser.GetData<PString>("appendonly") == "yes");
+  cfg.appendfsync = parser.GetData<PString>("appendfsync", cfg.appendfsync);
+  cfg.appendfilename = parser.GetData<PString>("appendfilename", cfg.appendfilename);
+  EraseQuotes(cfg.appendfilename);
+  PString appenddirname = parser.GetData<PString>("appenddirname", "appendonlydir");
+  EraseQuotes(appenddirname);
+  cfg.appenddir = parser.GetData<PString>("dir", "./") + appenddirname;
+  cfg.autoAofRewritePerc = parser.GetData<int>("auto-aof-rewrite-percentage", cfg.autoAofRewritePerc);
+  cfg.autoAofRewriteMinSize = parser.GetData<uint64_t>("auto-aof-rewrite-min-size", cfg.autoAofRewriteMinSize);
+
   cfg.maxclients = parser.GetData<int>("maxclients", 10000);
 
   cfg.slowlogtime = parser.GetData<int>("slowlog-log-slower-than", 0);
   cfg.slowlogmaxlen = parser.GetData<int>("slowlog-max-len", cfg.slowlogmaxlen);
 
+  cfg.latencymonitorthreshold = parser.GetData<int>("latency-monitor-threshold", cfg.latencymonitorthreshold);
+
+  cfg.metricsport = parser.GetData<int>("metrics-port", cfg.metricsport);
+
   cfg.hz = parser.GetData<int>("hz", 10);
 
   // load master ip port
@@ -147,6 +203,20 @@ bool LoadPikiwiDBConfig(const char* cfgFile, PConfig& cfg) {
     cfg.masterPort = static_cast<unsigned short>(std::stoi(master[1]));
   }
   cfg.masterauth = parser.GetData<PString>("masterauth");
+  cfg.repldisklesssync = (parser.GetData<PString>("repl-diskless-sync", "no") == "yes");
+  cfg.repldisklesssyncdelay = parser.GetData<int>("repl-diskless-sync-delay", 5);
+  cfg.replbacklogsize = parser.GetData<uint64_t>("repl-backlog-size", cfg.replbacklogsize);
+  cfg.repldisklessload = parser.GetData<PString>("repl-diskless-load", cfg.repldisklessload);
+  cfg.replcompression = parser.GetData<PString>("repl-compression", cfg.replcompression);
+  cfg.repldecodethread = (parser.GetData<PString>("repl-decode-thread", "yes") == "yes");
+  cfg.replbuffermemory = parser.GetData<uint64_t>("repl-buffer-memory", cfg.replbuffermemory);
+  cfg.replbufferlimit = parser.GetData<uint64_t>("repl-buffer-limit", cfg.replbufferlimit);
+
+  cfg.clusterenabled = (parser.GetData<PString>("cluster-enabled", "no") == "yes");
+  cfg.clusterconfigfile = parser.GetData<PString>("cluster-config-file", cfg.clusterconfigfile);
+  cfg.clusternodetimeout = parser.GetData<int>("cluster-node-timeout", cfg.clusternodetimeout);
+  cfg.clusterport = parser.GetData<unsigned short>("cluster-port", 0);
+  cfg.clusterrequirefullcoverage = (parser.GetData<PString>("cluster-require-full-coverage", "yes") == "yes");
 
   // load modules' names
   cfg.modules = parser.GetDataVector("loadmodule");
@@ -177,10 +247,28 @@ bool PConfig::CheckArgs() const {
   RETURN_IF_FAIL(databases > 0);
   RETURN_IF_FAIL(maxclients > 0);
   RETURN_IF_FAIL(hz > 0 && hz < 500);
+  RETURN_IF_FAIL(latencymonitorthreshold >= 0);
+  RETURN_IF_FAIL(metricsport >= 0 && metricsport <= 65535 && metricsport != port);
   RETURN_IF_FAIL(maxmemory >= 512 * 1024 * 1024UL);
   RETURN_IF_FAIL(maxmemorySamples > 0 && maxmemorySamples < 10);
   RETURN_IF_FAIL(backend >= BackEndNone && backend < BackEndMax);
   RETURN_IF_FAIL(backendHz >= 1 && backendHz <= 50);
+  RETURN_IF_FAIL(rdbthreads >= 1 && rdbthreads <= 64);
+  RETURN_IF_FAIL(repldisklesssyncdelay >= 0);
+  RETURN_IF_FAIL(replbacklogsize >= 16 * 1024);
+  RETURN_IF_FAIL(repldisklessload == "disabled" || repldisklessload == "swapdb");
+  RETURN_IF_FAIL(replcompression == "none" || replcompression == "lz4" || replcompression == "zstd");
+  RETURN_IF_FAIL(replbufferlimit == 0 || replbufferlimit >= replbuffermemory);
+  RETURN_IF_FAIL(!clusterconfigfile.empty());
+  RETURN_IF_FAIL(clusternodetimeout > 0);
+  RETURN_IF_FAIL(clusterport != 0 || port <= 65535 - 10000);
+  RETURN_IF_FAIL(rdbloadthreads >= 1 && rdbloadthreads <= 64);
+  RETURN_IF_FAIL(rdbcodec == "none" || rdbcodec == "lzf" || rdbcodec == "lz4" || rdbcodec == "zstd");
+  RETURN_IF_FAIL(rdbcompressionlevel >= 1 && rdbcompressionlevel <= 22);
+  RETURN_IF_FAIL(appendfsync == "always" || appendfsync == "everysec" || appendfsync == "no");
+  RETURN_IF_FAIL(!appendonly || backend == BackEndNone);
+  RETURN_IF_FAIL(!appendfilename.empty() && appendfilename.find('/') == PString::npos);
+  RETURN_IF_FAIL(autoAofRewritePerc >= 0);
 
 #undef RETURN_IF_FAIL
 
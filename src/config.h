@@ -43,18 +43,53 @@ struct PConfig {
   int savechanges;
   bool rdbcompression;  // yes
   bool rdbchecksum;     // yes
+  bool rdbforkless;     // yes, save rdb without fork
+  PString rdbcodec;     // lzf, codec of strings in rdb
+  int rdbcompressionlevel;  // 3, zstd level
+  int rdbthreads;       // 4, threads to encode rdb
+  int rdbloadthreads;   // 4, threads to decode rdb
+  bool asyncloading;    // no, serve clients while loading rdb
+  bool asyncloadingwait;  // yes, load the key accessed instead of -LOADING
+  bool warmrestart;     // no, save rdb index at shutdown and attach it at startup
   PString rdbfullname;  // ./dump.rdb
 
+  // @ aof
+  bool appendonly;         // no
+  PString appendfsync;     // everysec
+  PString appenddir;       // ./appendonlydir
+  PString appendfilename;  // appendonly.aof
+  int autoAofRewritePerc;           // 100
+  uint64_t autoAofRewriteMinSize;   // 64MB
+
   int maxclients;  // 10000
 
   int slowlogtime;    // 1000 microseconds
   int slowlogmaxlen;  // 128
 
+  int latencymonitorthreshold;  // 0 milliseconds, disabled
+
+  int metricsport;  // 0, disabled, the port of prometheus /metrics
+
   int hz;  // 10  [1,500]
 
   PString masterIp;
   unsigned short masterPort;  // replication
   PString masterauth;
+  bool repldisklesssync;       // no, stream rdb to slave sockets without disk
+  int repldisklesssyncdelay;  // 5 seconds, wait for more slaves before streaming
+  uint64_t replbacklogsize;    // 1MB, the stream kept for partial resync
+  PString repldisklessload;    // disabled, or swapdb: slave loads rdb while receiving it
+  PString replcompression;     // none, lz4 or zstd: codec of the stream to slaves supporting it
+  bool repldecodethread;       // yes, slave parses the stream of master in a thread
+  uint64_t replbuffermemory;   // 64MB, the stream during full sync kept in memory, the rest spills to file
+  uint64_t replbufferlimit;    // 4GB, full sync is aborted when more is buffered, 0 is no limit
+
+  // @ cluster
+  bool clusterenabled;             // no
+  PString clusterconfigfile;       // nodes.conf, written by the node itself
+  int clusternodetimeout;          // 15000 ms, a node not answering ping is marked pfail
+  unsigned short clusterport;      // 0, the bus port is port + 10000
+  bool clusterrequirefullcoverage; // yes, refuse queries if any slot is not served
 
   PString runid;
 
@@ -37,6 +37,7 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE. */
 
+#include <pthread.h>
 #include <stdint.h>
 
 static const uint64_t crc64_tab[256] = {
@@ -170,7 +171,7 @@ static const uint64_t crc64_tab[256] = {
     UINT64_C(0x536fa08fdfd90e51), UINT64_C(0x29b7d047efec8728),
 };
 
-uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l) {
+static uint64_t crc64_bytewise(uint64_t crc, const unsigned char *s, uint64_t l) {
     uint64_t j;
 
     for (j = 0; j < l; j++) {
@@ -180,12 +181,161 @@ uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l) {
     return crc;
 }
 
+/* Slicing-by-8: crc64_slice[k][n] is the crc of byte n followed by k zero
+ * bytes, so eight input bytes are folded with eight table lookups instead
+ * of eight dependent steps. The tables are built from crc64_tab once. */
+static uint64_t crc64_slice[8][256];
+static pthread_once_t crc64_slice_once = PTHREAD_ONCE_INIT;
+
+static void crc64_slice_init(void) {
+    int k, n;
+
+    for (n = 0; n < 256; n++)
+        crc64_slice[0][n] = crc64_tab[n];
+
+    for (k = 1; k < 8; k++) {
+        for (n = 0; n < 256; n++) {
+            uint64_t crc = crc64_slice[k - 1][n];
+            crc64_slice[k][n] = crc64_tab[crc & 0xff] ^ (crc >> 8);
+        }
+    }
+}
+
+uint64_t crc64(uint64_t crc, const unsigned char *s, uint64_t l) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    pthread_once(&crc64_slice_once, crc64_slice_init);
+
+    /* align the input for the 8 bytes loads */
+    while (l && ((uintptr_t)s & 7)) {
+        crc = crc64_tab[(uint8_t)crc ^ *s++] ^ (crc >> 8);
+        l--;
+    }
+
+    while (l >= 8) {
+        crc ^= *(const uint64_t *)s;
+        crc = crc64_slice[7][crc & 0xff] ^
+              crc64_slice[6][(crc >> 8) & 0xff] ^
+              crc64_slice[5][(crc >> 16) & 0xff] ^
+              crc64_slice[4][(crc >> 24) & 0xff] ^
+              crc64_slice[3][(crc >> 32) & 0xff] ^
+              crc64_slice[2][(crc >> 40) & 0xff] ^
+              crc64_slice[1][(crc >> 48) & 0xff] ^
+              crc64_slice[0][crc >> 56];
+        s += 8;
+        l -= 8;
+    }
+#endif
+
+    return crc64_bytewise(crc, s, l);
+}
+
+/* Combine the crc of two consecutive blocks, the method of zlib's
+ * crc32_combine: appending len2 zero bytes to the first block is a linear
+ * operation on crc1, a 64x64 matrix over GF(2). The operators of 2^n zero
+ * bytes are computed once by squaring, so a combine costs one matrix times
+ * vector per bit set in len2. crc2 is the crc of the second block with
+ * initial value 0, so that
+ * crc64(crc64(0, a, la), b, lb) == crc64_combine(crc64(0, a, la), crc64(0, b, lb), lb). */
+static uint64_t gf2_matrix_times(const uint64_t *mat, uint64_t vec) {
+    uint64_t sum = 0;
+
+    while (vec) {
+        if (vec & 1)
+            sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_matrix_square(uint64_t *square, const uint64_t *mat) {
+    int n;
+
+    for (n = 0; n < 64; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+static uint64_t crc64_zeros_op[64][64]; /* [n]: operator of 2^n zero bytes */
+static pthread_once_t crc64_zeros_once = PTHREAD_ONCE_INIT;
+
+static void crc64_zeros_init(void) {
+    uint64_t op[64], tmp[64];
+    uint64_t row = 1;
+    int n;
+
+    /* operator of one zero bit, crc64_tab[128] is the reflected poly */
+    op[0] = crc64_tab[128];
+    for (n = 1; n < 64; n++) {
+        op[n] = row;
+        row <<= 1;
+    }
+
+    /* square three times for one zero byte */
+    gf2_matrix_square(tmp, op);
+    gf2_matrix_square(op, tmp);
+    gf2_matrix_square(crc64_zeros_op[0], op);
+
+    for (n = 1; n < 64; n++)
+        gf2_matrix_square(crc64_zeros_op[n], crc64_zeros_op[n - 1]);
+}
+
+uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, uint64_t len2) {
+    int n;
+
+    pthread_once(&crc64_zeros_once, crc64_zeros_init);
+
+    for (n = 0; len2 != 0; n++, len2 >>= 1) {
+        if (len2 & 1)
+            crc1 = gf2_matrix_times(crc64_zeros_op[n], crc1);
+    }
+
+    return crc1 ^ crc2;
+}
+
 /* Test main */
 #ifdef TEST_MAIN
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double elapsed(struct timespec *start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
 int main(void) {
+    const char *s = "123456789";
+    const uint64_t size = 256 * 1024 * 1024;
+    unsigned char *buf;
+    uint64_t i, crc1, crc2;
+    struct timespec start;
+    double t1, t2;
+
+    printf("e9c6d914c4b8d9ca == %016llx\n",
+        (unsigned long long) crc64(0,(unsigned char*)s,9));
     printf("e9c6d914c4b8d9ca == %016llx\n",
-        (unsigned long long) crc64(0,(unsigned char*)"123456789",9));
-    return 0;
+        (unsigned long long) crc64_combine(crc64(0,(unsigned char*)s,4),
+                                           crc64(0,(unsigned char*)s+4,5), 5));
+
+    /* benchmark the slicing-by-8 kernel against the byte at a time one */
+    buf = malloc(size + 1);
+    for (i = 0; i < size + 1; i++)
+        buf[i] = (unsigned char)rand();
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    crc1 = crc64_bytewise(0, buf + 1, size);
+    t1 = elapsed(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    crc2 = crc64(0, buf + 1, size);
+    t2 = elapsed(&start);
+
+    printf("%s, bytewise %.0f MB/s, slicing-by-8 %.0f MB/s\n",
+        crc1 == crc2 ? "same crc" : "DIFFERENT crc",
+        size / 1048576.0 / t1, size / 1048576.0 / t2);
+
+    free(buf);
+    return crc1 != crc2;
 }
 #endif
@@ -10,21 +10,33 @@
 #include <arpa/inet.h>
 #include <math.h>
 #include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <iostream>  // the child process use stderr for log
 #include <sstream>
+#include "config.h"
+#include "latency_monitor.h"
+#include "loading.h"
 #include "log.h"
+#include "replication.h"
+#include "snapshot.h"
 
 extern "C" {
-#include "lzf/lzf.h"
 #include "redis_intset.h"
 #include "redis_zip_list.h"
 }
 
 extern "C" uint64_t crc64(uint64_t crc, const unsigned char* s, uint64_t l);
+extern "C" uint64_t crc64_combine(uint64_t crc1, uint64_t crc2, uint64_t len2);
 
 namespace pikiwidb {
 
 time_t g_lastPDBSave = 0;
 pid_t g_qdbPid = -1;
+bool g_qdbForkless = false;
+
+// changes already in the rdb being saved
+static int g_dirtyBeforeBgsave = 0;
 
 // encoding
 static const int8_t kTypeString = 0;
@@ -59,64 +71,214 @@ static const int8_t kEnc8Bits = 0;
 static const int8_t kEnc16Bits = 1;
 static const int8_t kEnc32Bits = 2;
 static const int8_t kEncLZF = 3;
+static const int8_t kEncLZ4 = 4;   // not compatible with redis
+static const int8_t kEncZstd = 5;  // not compatible with redis
+
+// the encoded data is written to file by this size
+static const std::size_t kFlushSize = 1024 * 1024;
+// the loaded data is checked by this size, while it is still in cache
+static const std::size_t kCrcBatchSize = 64 * 1024;
+// the records decoded by one task of the load pool
+static const std::size_t kLoadBatchSize = 256 * 1024;
+
+PDBSaver::PDBSaver() : level_(g_config.rdbcompressionlevel) {
+  if (!ParseCodec(g_config.rdbcodec, codec_)) {
+    codec_ = PCodec_lzf;
+  }
+}
 
 void PDBSaver::Save(const char* qdbFile) {
-  char tmpFile[64] = "";
-  snprintf(tmpFile, sizeof tmpFile, "tmp_qdb_file_%d", getpid());
+  if (!Open(qdbFile)) {
+    assert(false);
+  }
+
+  ThreadPool pool;
+  const uint64_t now = ::Now();
+  for (std::size_t dbno = 0; dbno < PSTORE.dbs_.size(); ++dbno) {
+    const PDB& db = PSTORE.dbs_[dbno];
+    if (db.empty()) {
+      continue;  // But redis will save empty db
+    }
+
+    SaveDB(static_cast<int>(dbno), db.size(), PSTORE.expiredDBs_[dbno].Size());
+    SaveBuckets(pool, db, PSTORE.expiredDBs_[dbno], 0, db.bucket_count(), now);
+  }
 
-  if (!qdb_.Open(tmpFile, false)) {
+  if (!Finish()) {
     assert(false);
   }
+}
+
+bool PDBSaver::Open(const char* qdbFile) {
+  qdbFile_ = qdbFile;
+  tmpFile_ = qdbFile_ + ".tmp." + std::to_string(getpid());
+
+  if (!qdb_.Open(tmpFile_.c_str(), false)) {
+    return false;
+  }
+
+  buffer_.clear();
+  crc_ = 0;
 
   char buf[16];
   snprintf(buf, sizeof buf, "REDIS%04d", kPDBVersion);
-  qdb_.Write(buf, 9);
+  write(buf, 9);
+  saveReplInfo();
+  return true;
+}
 
-  for (int dbno = 0; true; ++dbno) {
-    if (PSTORE.SelectDB(dbno) == -1) {
-      break;
-    }
+bool PDBSaver::Open(Sink sink) {
+  if (!sink) {
+    return false;
+  }
 
-    if (PSTORE.DBSize() == 0) {
-      continue;  // But redis will save empty db
+  sink_ = std::move(sink);
+  buffer_.clear();
+  crc_ = 0;
+
+  char buf[16];
+  snprintf(buf, sizeof buf, "REDIS%04d", kPDBVersion);
+  write(buf, 9);
+  saveReplInfo();
+  return true;
+}
+
+void PDBSaver::SaveDB(int dbno, std::size_t dbsize, std::size_t expiresize) {
+  write(&kSelectDB, 1);
+  SaveLength(dbno);
+
+  if (dbsize > 0) {
+    write(&kResizeDB, 1);
+    SaveLength(dbsize);
+    SaveLength(expiresize);
+  }
+}
+
+void PDBSaver::SaveEntry(const PString& key, const PObject& obj, uint64_t expireAt) {
+  if (expireAt > 0) {
+    write(&kExpireMs, 1);
+    write(&expireAt, sizeof expireAt);
+  }
+
+  SaveType(obj);
+  SaveKey(key);
+  SaveObject(obj);
+}
+
+bool PDBSaver::Finish() {
+  write(&kEOF, 1);
+  flush();
+
+  // crc 8 bytes
+  output(&crc_, sizeof crc_);
+  if (sink_) {
+    sink_ = nullptr;
+    return true;
+  }
+
+  qdb_.Close();
+
+  if (::rename(tmpFile_.c_str(), qdbFile_.c_str()) != 0) {
+    perror("rename error");
+    return false;
+  }
+
+  return true;
+}
+
+void PDBSaver::Abort() {
+  buffer_.clear();
+  if (sink_) {
+    sink_ = nullptr;
+    return;
+  }
+
+  qdb_.Close();
+  ::unlink(tmpFile_.c_str());
+}
+
+void PDBSaver::SaveBuckets(ThreadPool& pool, const PDB& db, const PStore::ExpiredDB& expires, std::size_t first,
+                           std::size_t last, uint64_t now, const SkipFunc& skip, std::size_t bucketsPerChunk) {
+  const std::size_t threads = std::max(1, g_config.rdbthreads);
+  if (threads == 1) {
+    PDBChunk chunk = encodeBuckets(db, expires, first, last, now, skip);
+    SaveChunk(chunk);
+    return;
+  }
+
+  // a window of tasks, written in bucket order as soon as the head is done
+  std::deque<std::future<PDBChunk> > tasks;
+  std::size_t next = first;
+  while (next < last || !tasks.empty()) {
+    while (next < last && tasks.size() < threads * 2) {
+      std::size_t end = std::min(last, next + bucketsPerChunk);
+      tasks.push_back(pool.ExecuteTask(&PDBSaver::encodeBuckets, std::cref(db), std::cref(expires), next, end, now,
+                                       std::cref(skip)));
+      next = end;
     }
 
-    qdb_.Write(&kSelectDB, 1);
-    SaveLength(dbno);
+    PDBChunk chunk = tasks.front().get();
+    tasks.pop_front();
+    SaveChunk(chunk);
+  }
+}
+
+void PDBSaver::SaveChunk(const PDBChunk& chunk) {
+  if (chunk.data.empty()) {
+    return;
+  }
 
-    uint64_t now = ::Now();
-    for (const auto& kv : PSTORE) {
-      int64_t ttl = PSTORE.TTL(kv.first, now);
-      if (ttl > 0) {
-        ttl += now;
+  flush();
+  output(chunk.data.data(), chunk.data.size());
+  crc_ = crc64_combine(crc_, chunk.crc, chunk.data.size());
+}
+
+PDBChunk PDBSaver::encodeBuckets(const PDB& db, const PStore::ExpiredDB& expires, std::size_t first, std::size_t last,
+                                 uint64_t now, const SkipFunc& skip) {
+  PDBSaver encoder;
+  for (std::size_t bucket = first; bucket < last; ++bucket) {
+    for (auto it = db.begin(bucket); it != db.end(bucket); ++it) {
+      if (skip && skip(it->second)) {
+        continue;
+      }
 
-        qdb_.Write(&kExpireMs, 1);
-        qdb_.Write(&ttl, sizeof ttl);
-      } else if (ttl == PStore::ExpireResult::expired) {
+      uint64_t expireAt = expires.ExpireAt(it->first);
+      if (expireAt != 0 && expireAt <= now) {
         continue;
       }
 
-      SaveType(kv.second);
-      SaveKey(kv.first);
-      SaveObject(kv.second);
+      encoder.SaveEntry(it->first, it->second, expireAt);
     }
   }
 
-  qdb_.Write(&kEOF, 1);
+  PDBChunk chunk;
+  chunk.crc = crc64(0, (const unsigned char*)encoder.buffer_.data(), encoder.buffer_.size());
+  chunk.data.swap(encoder.buffer_);
+  return chunk;
+}
 
-  // crc 8 bytes
-  InputMemoryFile file;
-  file.Open(tmpFile);
+void PDBSaver::write(const void* data, std::size_t len) {
+  buffer_.append(static_cast<const char*>(data), len);
+  if (buffer_.size() >= kFlushSize && isOpen()) {
+    flush();
+  }
+}
 
-  auto len = qdb_.Offset();
-  auto data = file.Read(len);
+void PDBSaver::flush() {
+  if (buffer_.empty() || !isOpen()) {
+    return;
+  }
 
-  const uint64_t crc = crc64(0, (const unsigned char*)data, len);
-  qdb_.Write(&crc, sizeof crc);
+  crc_ = crc64(crc_, (const unsigned char*)buffer_.data(), buffer_.size());
+  output(buffer_.data(), buffer_.size());
+  buffer_.clear();
+}
 
-  if (::rename(tmpFile, qdbFile) != 0) {
-    perror("rename error");
-    assert(false);
+void PDBSaver::output(const void* data, std::size_t len) {
+  if (sink_) {
+    sink_(static_cast<const char*>(data), len);
+  } else {
+    qdb_.Write(data, len);
   }
 }
 
@@ -124,23 +286,23 @@ void PDBSaver::SaveType(const PObject& obj) {
   switch (obj.encoding) {
     case PEncode_raw:
     case PEncode_int:
-      qdb_.Write(&kTypeString, 1);
+      write(&kTypeString, 1);
       break;
 
     case PEncode_list:
-      qdb_.Write(&kTypeList, 1);
+      write(&kTypeList, 1);
       break;
 
     case PEncode_hash:
-      qdb_.Write(&kTypeHash, 1);
+      write(&kTypeHash, 1);
       break;
 
     case PEncode_set:
-      qdb_.Write(&kTypeSet, 1);
+      write(&kTypeSet, 1);
       break;
 
     case PEncode_zset:
-      qdb_.Write(&kTypeZSet, 1);
+      write(&kTypeZSet, 1);
       break;
 
     default:
@@ -179,6 +341,19 @@ void PDBSaver::SaveObject(const PObject& obj) {
   }
 }
 
+PString PDBSaver::DumpObject(const PObject& obj) {
+  PDBSaver encoder;
+  encoder.SaveType(obj);
+  encoder.SaveObject(obj);
+
+  // the footer as redis: rdb version in 2 bytes and crc64 of all before it, little endian
+  const uint16_t version = kPDBVersion;
+  encoder.buffer_.append(reinterpret_cast<const char*>(&version), sizeof version);
+  const uint64_t crc = crc64(0, (const unsigned char*)encoder.buffer_.data(), encoder.buffer_.size());
+  encoder.buffer_.append(reinterpret_cast<const char*>(&crc), sizeof crc);
+  return std::move(encoder.buffer_);
+}
+
 /* Copy from redis~
  * Save a double value. Doubles are saved as strings prefixed by an unsigned
  * 8 bit integer specifying the length of the representation.
@@ -204,7 +379,7 @@ void PDBSaver::saveDoubleValue(double val) {
     len = buf[0] + 1;
   }
 
-  qdb_.Write(buf, len);
+  write(buf, len);
 }
 
 void PDBSaver::saveList(const PLIST& l) {
@@ -250,9 +425,25 @@ void PDBSaver::SaveString(const PString& str) {
     }
   }
 
-  if (!SaveLZFString(str)) {
+  if (!SaveCompressedString(str)) {
     SaveLength(str.size());
-    qdb_.Write(str.data(), str.size());
+    write(str.data(), str.size());
+  }
+}
+
+void PDBSaver::saveAux(const PString& key, const PString& val) {
+  write(&kAux, 1);
+  SaveString(key);
+  SaveString(val);
+}
+
+// a slave restarted from the rdb can continue the replication from the offset
+void PDBSaver::saveReplInfo() {
+  PString replid;
+  int64_t offset = 0;
+  if (PREPL.GetMasterReplInfo(replid, offset)) {
+    saveAux("repl-id", replid);
+    saveAux("repl-offset", std::to_string(offset));
   }
 }
 
@@ -262,17 +453,17 @@ void PDBSaver::SaveLength(uint64_t len) {
   if (len < (1 << 6)) {
     len &= kLow6Bits;
     len |= k6Bits << 6;
-    qdb_.Write(&len, 1);
+    write(&len, 1);
   } else if (len < (1 << 14)) {
     uint16_t encodeLen = (len >> 8) & kLow6Bits;
     encodeLen |= k14bits << 6;
     encodeLen |= (len & 0xFF) << 8;
-    qdb_.Write(&encodeLen, 2);
+    write(&encodeLen, 2);
   } else {
     int8_t encFlag = static_cast<int8_t>(k32bits << 6);
-    qdb_.Write(&encFlag, 1);
+    write(&encFlag, 1);
     len = htonl(len);
-    qdb_.Write(&len, 4);
+    write(&len, 4);
   }
 }
 
@@ -281,48 +472,58 @@ void PDBSaver::SaveString(int64_t intVal) {
 
   if ((intVal & ~0x7F) == 0) {
     specialByte |= kEnc8Bits;
-    qdb_.Write(&specialByte, 1);
-    qdb_.Write(&intVal, 1);
+    write(&specialByte, 1);
+    write(&intVal, 1);
   } else if ((intVal & ~0x7FFF) == 0) {
     specialByte |= kEnc16Bits;
-    qdb_.Write(&specialByte, 1);
-    qdb_.Write(&intVal, 2);
+    write(&specialByte, 1);
+    write(&intVal, 2);
   } else if ((intVal & ~0x7FFFFFFF) == 0) {
     specialByte |= kEnc32Bits;
-    qdb_.Write(&specialByte, 1);
-    qdb_.Write(&intVal, 4);
+    write(&specialByte, 1);
+    write(&intVal, 4);
   } else {
     char buf[64];
     auto len = Number2Str(buf, sizeof buf, intVal);
     SaveLength(static_cast<uint64_t>(len));
-    qdb_.Write(buf, len);
+    write(buf, len);
   }
 }
 
-bool PDBSaver::SaveLZFString(const PString& str) {
-  if (str.size() < 20) {
+bool PDBSaver::SaveCompressedString(const PString& str) {
+  if (codec_ == PCodec_none || str.size() < 20) {
     return false;
   }
 
-  unsigned outlen = static_cast<unsigned>(str.size() - 4);
-  std::unique_ptr<char[]> outBuf(new char[outlen + 1]);
-
-  auto compressLen = lzf_compress((const void*)str.data(), static_cast<unsigned>(str.size()), outBuf.get(), outlen);
+  // the blobs already compressed only waste cpu
+  if (IsIncompressible(str.data(), str.size())) {
+    ++g_compressStats.skipped;
+    return false;
+  }
 
-  if (compressLen == 0) {
-    ERROR("compress len = 0");
+  PString out;
+  if (!Compress(codec_, level_, str.data(), str.size(), out)) {
+    ++g_compressStats.noGain;
     return false;
   }
 
-  int8_t specialByte = static_cast<int8_t>(kSpecial << 6) | kEncLZF;
-  qdb_.Write(&specialByte, 1);
+  int8_t encoding = kEncLZF;
+  if (codec_ == PCodec_lz4) {
+    encoding = kEncLZ4;
+  } else if (codec_ == PCodec_zstd) {
+    encoding = kEncZstd;
+  }
+
+  int8_t specialByte = static_cast<int8_t>(kSpecial << 6) | encoding;
+  write(&specialByte, 1);
 
   // compress len + raw len + str data;
-  SaveLength(compressLen);
+  SaveLength(out.size());
   SaveLength(str.size());
-  qdb_.Write(outBuf.get(), compressLen);
+  write(out.data(), out.size());
 
-  DEBUG("compress len {}, raw len {}", compressLen, str.size());
+  g_compressStats.rawBytes += str.size();
+  g_compressStats.compressedBytes += out.size();
 
   return true;
 }
@@ -332,24 +533,75 @@ void PDBSaver::SaveDoneHandler(int exitRet, int whatSignal) {
     INFO("save rdb success");
     g_lastPDBSave = time(nullptr);
 
-    PStore::dirty_ = 0;
+    PStore::dirty_ = std::max(0, PStore::dirty_ - g_dirtyBeforeBgsave);
   } else {
     ERROR("save rdb failed with exit result {}, signal {}", exitRet, whatSignal);
   }
 
   g_qdbPid = -1;
+  g_qdbForkless = false;
+
+  if (PREPL.IsBgsaving()) {
+    PREPL.OnRdbSaveDone();
+  } else {
+    PREPL.TryBgsave();
+  }
 }
 
-int PDBLoader::Load(const char* filename) {
+bool IsBgsaveInProgress() { return g_qdbPid != -1 || g_qdbForkless; }
+
+bool StartBgsave() {
+  // the keys not loaded yet are not in store
+  if (IsBgsaveInProgress() || PLOADING.IsLoading()) {
+    return false;
+  }
+
+  g_dirtyBeforeBgsave = PStore::dirty_;
+
+  // the snapshot may be taken by aof rewrite, fall back to fork then
+  if (g_config.rdbforkless && !PSNAPSHOT.IsRunning()) {
+    auto done = [](bool succ) { PDBSaver::SaveDoneHandler(succ ? 0 : 1, 0); };
+    if (!PSNAPSHOT.Start(g_config.rdbfullname, done)) {
+      ERROR("start forkless rdb save failed");
+      return false;
+    }
+
+    g_qdbForkless = true;
+    return true;
+  }
+
+  const uint64_t begin = CycleClock::Now();
+  int ret = fork();
+  if (ret == 0) {
+    {
+      PDBSaver qdb;
+      qdb.Save(g_config.rdbfullname.c_str());
+      std::cerr << "save rdb done, exiting child\n";
+    }  //  make qdb to be destructed before exit
+    _exit(0);
+  } else if (ret == -1) {
+    ERROR("fork qdb save process failed");
+    return false;
+  }
+
+  const uint64_t forkUsec = CycleClock::ToNs(CycleClock::Now() - begin) / 1000;
+  PLatencyMonitor::Instance().SetForkUsec(forkUsec);
+  PLatencyMonitor::Instance().AddSampleIfNeeded(kLatencyFork, forkUsec);
+
+  g_qdbPid = ret;
+  return true;
+}
+
+int PDBLoader::open(const char* filename) {
   if (!qdb_.Open(filename)) {
     return -__LINE__;
   }
 
   // check the magic string "REDIS" and version number
-  size_t len = 9;
+  size_t len = kHeaderSize;
   const char* data = qdb_.Read(len);
 
-  if (len != 9) {
+  if (len != kHeaderSize) {
     return -__LINE__;
   }
 
@@ -357,7 +609,207 @@ int PDBLoader::Load(const char* filename) {
   if (!Strtol(data + 5, 4, &qdbversion) || qdbversion < 6) {
     return -123;
   }
-  qdb_.Skip(9);
+
+  crc_ = crc64(0, (const unsigned char*)data, len);
+  qdb_.Skip(kHeaderSize);
+  markCrc();
+  return 0;
+}
+
+void PDBLoader::BeginStream() {
+  streaming_ = true;
+  streamDone_ = false;
+  stream_.clear();
+  streamPos_ = 0;
+  streamExpire_ = 0;
+  crc_ = 0;
+  dbno_ = 0;
+  PSTORE.BeginStaging();
+}
+
+bool PDBLoader::Feed(const char* data, std::size_t len) {
+  assert(streaming_);
+  if (streamDone_) {
+    return true;
+  }
+
+  // drop the parsed data, not too often for big values
+  if (streamPos_ > 0 && streamPos_ >= stream_.size() / 2) {
+    stream_.erase(0, streamPos_);
+    streamPos_ = 0;
+  }
+  stream_.append(data, len);
+  qdb_.Attach(stream_.data(), stream_.size());
+
+  if (crc_ == 0 && streamPos_ == 0) {
+    if (stream_.size() < kHeaderSize) {
+      return true;
+    }
+
+    long version;
+    if (strncmp(stream_.data(), "REDIS", 5) != 0 || !Strtol(stream_.data() + 5, 4, &version) || version < 6) {
+      ERROR("wrong rdb header in stream");
+      return false;
+    }
+
+    crc_ = crc64(0, (const unsigned char*)stream_.data(), kHeaderSize);
+    streamPos_ = kHeaderSize;
+  }
+
+  while (!streamDone_ && streamPos_ < stream_.size()) {
+    // decode only the complete record
+    qdb_.Seek(streamPos_);
+    const int8_t indicator = qdb_.Read<int8_t>();
+    if (!skipRecord(indicator)) {
+      ERROR("unknown record type {} in rdb stream", indicator);
+      return false;
+    }
+
+    if (qdb_.Overrun()) {
+      break;  // wait for more data
+    }
+
+    const std::size_t end = qdb_.Offset();
+    const auto record = reinterpret_cast<const unsigned char*>(stream_.data() + streamPos_);
+    if (indicator == kEOF) {
+      crc_ = crc64(crc_, record, 1);
+      uint64_t expect;
+      memcpy(&expect, record + 1, sizeof expect);
+      if (expect != 0 && expect != crc_) {
+        ERROR("rdb stream crc mismatch, expect {:x}, got {:x}", expect, crc_);
+        return false;
+      }
+      streamDone_ = true;
+    } else {
+      crc_ = crc64(crc_, record, end - streamPos_);
+      qdb_.Seek(streamPos_ + 1);
+      if (!loadStreamRecord(indicator)) {
+        return false;
+      }
+      assert(qdb_.Offset() == end);
+    }
+
+    streamPos_ = end;
+  }
+
+  return true;
+}
+
+bool PDBLoader::skipRecord(int8_t indicator) {
+  bool special;
+  switch (indicator) {
+    case kEOF:
+      qdb_.Skip(sizeof(uint64_t));
+      break;
+
+    case kAux:
+      skipString();
+      skipString();
+      break;
+
+    case kResizeDB:
+      LoadLength(special);
+      LoadLength(special);
+      break;
+
+    case kSelectDB:
+      LoadLength(special);
+      break;
+
+    case kExpireMs:
+    case kExpire:
+      qdb_.Skip(sizeof(int64_t));
+      break;
+
+    case kTypeString:
+    case kTypeList:
+    case kTypeZipList:
+    case kTypeSet:
+    case kTypeIntSet:
+    case kTypeHash:
+    case kTypeHashZipList:
+    case kTypeZipMap:
+    case kTypeZSet:
+    case kTypeZSetZipList:
+    case kTypeQuickList:
+      skipString();
+      skipObject(indicator);
+      break;
+
+    default:
+      return false;
+  }
+
+  return true;
+}
+
+bool PDBLoader::loadStreamRecord(int8_t indicator) {
+  switch (indicator) {
+    case kAux:
+      loadAux();
+      break;
+
+    case kResizeDB:
+      loadResizeDB();
+      break;
+
+    case kSelectDB: {
+      bool special;
+      auto dbno = LoadLength(special);
+      if (special || dbno >= static_cast<std::size_t>(g_config.databases)) {
+        ERROR("Abnormal db number {}", dbno);
+        return false;
+      }
+      dbno_ = static_cast<int>(dbno);
+      break;
+    }
+
+    case kExpireMs:
+      streamExpire_ = qdb_.Read<int64_t>();
+      break;
+
+    case kExpire:
+      streamExpire_ = qdb_.Read<int64_t>() * 1000;
+      break;
+
+    default: {
+      PString key = LoadKey();
+      PObject obj = LoadObject(indicator);
+      loadEntry(key, std::move(obj), streamExpire_);
+      streamExpire_ = 0;
+      break;
+    }
+  }
+
+  return true;
+}
+
+int PDBLoader::LoadAux(const char* filename, std::map<PString, PString>& fields) {
+  if (int ret = open(filename); ret != 0) {
+    return ret;
+  }
+
+  while (qdb_.Offset() < qdb_.Size() && qdb_.Read<int8_t>() == kAux) {
+    PString key = loadGenericString();
+    fields[key] = loadGenericString();
+  }
+
+  qdb_.Close();
+  return 0;
+}
+
+int PDBLoader::Load(const char* filename) {
+  if (int ret = open(filename); ret != 0) {
+    return ret;
+  }
+
+  // the records are decoded by the pool, in batches between the offsets
+  // found by this thread, and inserted in file order
+  file_ = filename;
+  threads_ = std::max(1, g_config.rdbloadthreads);
+  if (threads_ > 1) {
+    pool_ = std::make_unique<ThreadPool>();
+  }
 
   //  SELECTDB + dbno
   //  type1 + key + obj
@@ -366,13 +818,27 @@ int PDBLoader::Load(const char* filename) {
   int64_t absTimeout = 0;
   bool eof = false;
   while (!eof) {
+    // the crc of batches is done by the pool
+    if (!pool_ && qdb_.Offset() - crcOffset_ >= kCrcBatchSize) {
+      updateCrc();
+    }
+
+    const std::size_t recordStart = qdb_.Offset();
     int8_t indicator = qdb_.Read<int8_t>();
 
     switch (indicator) {
-      case kEOF:
+      case kEOF: {
         DEBUG("encounter EOF");
         eof = true;
+        if (!drainBatches()) {
+          return -__LINE__;
+        }
+        updateCrc();
+        if (!checkCrc(filename)) {
+          return -__LINE__;
+        }
         break;
+      }
 
       case kAux:
         DEBUG("encounter AUX");
@@ -385,6 +851,11 @@ int PDBLoader::Load(const char* filename) {
         break;
 
       case kSelectDB: {
+        // a batch has keys of one db
+        if (!submitBatch()) {
+          return -__LINE__;
+        }
+
         bool special;
         auto dbno = LoadLength(special);
         assert(!special);
@@ -398,15 +869,22 @@ int PDBLoader::Load(const char* filename) {
           ERROR("DB NUMBER is differ from RDB file");
           return __LINE__;
         }
+        dbno_ = static_cast<int>(dbno);
         DEBUG("encounter Select DB {}", dbno);
         break;
       }
 
       case kExpireMs:
+        if (pool_ && batch_.begin == 0) {
+          batch_.begin = recordStart;
+        }
         absTimeout = qdb_.Read<int64_t>();
         break;
 
       case kExpire:
+        if (pool_ && batch_.begin == 0) {
+          batch_.begin = recordStart;
+        }
         absTimeout = qdb_.Read<int64_t>();
         absTimeout *= 1000;
         break;
@@ -422,38 +900,445 @@ int PDBLoader::Load(const char* filename) {
       case kTypeZSet:
       case kTypeZSetZipList:
       case kTypeQuickList: {
-        PString key = LoadKey();
-        PObject obj = LoadObject(indicator);
-//        DEBUG("encounter key = {}, obj.encoding = {}", key, obj.encoding);
-
-        assert(absTimeout >= 0);
-
-        if (absTimeout == 0) {
-          PSTORE.SetValue(key, std::move(obj));
-        } else if (absTimeout > 0) {
-          if (absTimeout > static_cast<int64_t>(::Now())) {
-            DEBUG("key {} load timeout {}", key, absTimeout);
-            PSTORE.SetValue(key, std::move(obj));
-            PSTORE.SetExpire(key, absTimeout);
-          } else {
-            INFO("key {} is already time out", key);
+        if (pool_) {
+          // only find the end of record, it's decoded by the pool
+          if (batch_.begin == 0) {
+            batch_.begin = recordStart;
           }
-
+          skipString();
+          skipObject(indicator);
+          batch_.end = qdb_.Offset();
           absTimeout = 0;
+
+          if (batch_.end - batch_.begin >= kLoadBatchSize && !submitBatch()) {
+            return -__LINE__;
+          }
+          break;
         }
+
+        PString key = LoadKey();
+        PObject obj = LoadObject(indicator);
+        loadEntry(key, std::move(obj), absTimeout);
+        absTimeout = 0;
         break;
       }
 
       default:
-        printf("%d is unknown\n", indicator);
-        assert(false);
+        ERROR("unknown rdb type {}", indicator);
+        return -__LINE__;
+    }
+  }
+
+  return 0;
+}
+
+bool PDBLoader::checkCrc(const char* filename) {
+  // always check sum, crc 0 means the file is saved without checksum
+  std::size_t len = sizeof(uint64_t);
+  const char* data = qdb_.Read(len);
+  if (len == sizeof(uint64_t)) {
+    uint64_t expect;
+    memcpy(&expect, data, sizeof expect);
+    if (expect != 0 && expect != crc_) {
+      ERROR("rdb {} crc mismatch, expect {:x}, got {:x}", filename, expect, crc_);
+      return false;
+    }
+  }
+
+  return true;
+}
+
+int PDBLoader::scanKeys(const char* filename, const KeyFunc& onKey) {
+  if (int ret = open(filename); ret != 0) {
+    return ret;
+  }
+
+  dbno_ = 0;
+  std::size_t recordStart = 0;  // the expire of key is in its record
+  bool eof = false;
+  while (!eof) {
+    if (qdb_.Offset() >= qdb_.Size()) {
+      ERROR("rdb {} is truncated", filename);
+      return -__LINE__;
+    }
+
+    if (qdb_.Offset() - crcOffset_ >= kCrcBatchSize) {
+      updateCrc();
+    }
+
+    if (recordStart == 0) {
+      recordStart = qdb_.Offset();
+    }
+    int8_t indicator = qdb_.Read<int8_t>();
+
+    switch (indicator) {
+      case kEOF:
+        eof = true;
+        updateCrc();
+        if (!checkCrc(filename)) {
+          return -__LINE__;
+        }
+        break;
+
+      case kAux:
+        loadAux();
         break;
+
+      case kResizeDB: {
+        // the dbs are reserved by the index
+        bool special;
+        LoadLength(special);
+        LoadLength(special);
+        break;
+      }
+
+      case kSelectDB: {
+        bool special;
+        auto dbno = LoadLength(special);
+        if (special || dbno >= static_cast<std::size_t>(g_config.databases)) {
+          ERROR("Abnormal db number {}", dbno);
+          return -__LINE__;
+        }
+        dbno_ = static_cast<int>(dbno);
+        break;
+      }
+
+      case kExpireMs:
+      case kExpire:
+        qdb_.Skip(sizeof(int64_t));
+        continue;
+
+      case kTypeString:
+      case kTypeList:
+      case kTypeZipList:
+      case kTypeSet:
+      case kTypeIntSet:
+      case kTypeHash:
+      case kTypeHashZipList:
+      case kTypeZipMap:
+      case kTypeZSet:
+      case kTypeZSetZipList:
+      case kTypeQuickList: {
+        PString key = LoadKey();
+        skipObject(indicator);
+        onKey(dbno_, std::move(key), recordStart);
+        break;
+      }
+
+      default:
+        ERROR("rdb {} has unknown type {} at offset {}", filename, indicator, recordStart);
+        return -__LINE__;
     }
+
+    recordStart = 0;
   }
 
   return 0;
 }
 
+bool PDBLoader::loadRecords(std::size_t& offset, std::size_t count, const KeyFilter& take) {
+  // the records are checked by scanKeys
+  qdb_.Seek(offset);
+
+  int64_t absTimeout = 0;
+  std::size_t recordStart = 0;  // the expire of key is in its record
+  bool eof = false;
+  while (count > 0 && !eof) {
+    if (recordStart == 0) {
+      recordStart = qdb_.Offset();
+    }
+    int8_t indicator = qdb_.Read<int8_t>();
+
+    switch (indicator) {
+      case kEOF:
+        eof = true;
+        break;
+
+      case kAux:
+        skipString();
+        skipString();
+        break;
+
+      case kResizeDB: {
+        bool special;
+        LoadLength(special);
+        LoadLength(special);
+        break;
+      }
+
+      case kSelectDB: {
+        bool special;
+        dbno_ = static_cast<int>(LoadLength(special));
+        break;
+      }
+
+      case kExpireMs:
+        absTimeout = qdb_.Read<int64_t>();
+        continue;
+
+      case kExpire:
+        absTimeout = qdb_.Read<int64_t>() * 1000;
+        continue;
+
+      default: {
+        PString key = LoadKey();
+        if (take(dbno_, key, recordStart)) {
+          PObject obj = LoadObject(indicator);
+          PSTORE.SelectDB(dbno_);
+          loadEntry(key, std::move(obj), absTimeout);
+        } else {
+          skipObject(indicator);
+        }
+
+        absTimeout = 0;
+        --count;
+        break;
+      }
+    }
+
+    recordStart = 0;
+  }
+
+  offset = qdb_.Offset();
+  return !eof;
+}
+
+void PDBLoader::loadRecordAt(std::size_t offset) {
+  const std::size_t cursor = qdb_.Offset();
+  qdb_.Seek(offset);
+
+  int64_t absTimeout = 0;
+  int8_t indicator = qdb_.Read<int8_t>();
+  if (indicator == kExpireMs) {
+    absTimeout = qdb_.Read<int64_t>();
+    indicator = qdb_.Read<int8_t>();
+  } else if (indicator == kExpire) {
+    absTimeout = qdb_.Read<int64_t>() * 1000;
+    indicator = qdb_.Read<int8_t>();
+  }
+
+  PString key = LoadKey();
+  loadEntry(key, LoadObject(indicator), absTimeout);
+  qdb_.Seek(cursor);
+}
+
+PString PDBLoader::keyAt(std::size_t offset) {
+  const std::size_t cursor = qdb_.Offset();
+  qdb_.Seek(offset);
+
+  int8_t indicator = qdb_.Read<int8_t>();
+  if (indicator == kExpireMs || indicator == kExpire) {
+    qdb_.Skip(sizeof(int64_t) + 1);
+  }
+
+  PString key = LoadKey();
+  qdb_.Seek(cursor);
+  return key;
+}
+
+void PDBLoader::loadEntry(const PString& key, PObject&& obj, int64_t absTimeout) {
+  assert(absTimeout >= 0);
+
+  if (streaming_) {
+    if (absTimeout == 0 || absTimeout > static_cast<int64_t>(::Now())) {
+      PSTORE.SetStagingValue(dbno_, key, std::move(obj), absTimeout);
+    }
+    return;
+  }
+
+  if (absTimeout == 0) {
+    PSTORE.SetValue(key, std::move(obj));
+  } else if (absTimeout > 0) {
+    if (absTimeout > static_cast<int64_t>(::Now())) {
+      DEBUG("key {} load timeout {}", key, absTimeout);
+      PSTORE.SetValue(key, std::move(obj));
+      PSTORE.SetExpire(key, absTimeout);
+    } else {
+      INFO("key {} is already time out", key);
+    }
+  }
+}
+
+bool PDBLoader::submitBatch() {
+  if (!pool_ || batch_.begin == 0) {
+    return true;
+  }
+
+  // the worker also crc the bytes between the batches
+  batch_.dbno = dbno_;
+  batch_.crcBegin = crcOffset_;
+  tasks_.push_back(pool_->ExecuteTask(&PDBLoader::decodeBatch, file_, batch_));
+
+  // the indicator after batch may be read already
+  crcData_ += batch_.end - crcOffset_;
+  crcOffset_ = batch_.end;
+  batch_ = Batch();
+
+  // bound the decoded objects waiting for insert
+  if (tasks_.size() >= static_cast<std::size_t>(threads_) * 2) {
+    return insertBatch();
+  }
+
+  return true;
+}
+
+bool PDBLoader::insertBatch() {
+  Decoded decoded = tasks_.front().get();
+  tasks_.pop_front();
+
+  if (!decoded.ok) {
+    ERROR("decode rdb {} from offset {} failed", file_, decoded.batch.begin);
+    return false;
+  }
+
+  crc_ = crc64_combine(crc_, decoded.crc, decoded.batch.end - decoded.batch.crcBegin);
+
+  PSTORE.SelectDB(decoded.batch.dbno);
+  for (auto& entry : decoded.entries) {
+    loadEntry(entry.key, std::move(entry.obj), entry.absTimeout);
+  }
+
+  return true;
+}
+
+bool PDBLoader::drainBatches() {
+  if (!submitBatch()) {
+    return false;
+  }
+
+  while (!tasks_.empty()) {
+    if (!insertBatch()) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+PDBLoader::Decoded PDBLoader::decodeBatch(const PString& file, const Batch& batch) {
+  Decoded res;
+  res.batch = batch;
+
+  PDBLoader loader;
+  InputMemoryFile& qdb = loader.qdb_;
+  if (!qdb.Open(file.c_str())) {
+    return res;
+  }
+
+  qdb.Skip(batch.crcBegin);
+  std::size_t len = batch.end - batch.crcBegin;
+  res.crc = crc64(0, (const unsigned char*)qdb.Read(len), len);
+  qdb.Skip(batch.begin - batch.crcBegin);
+
+  int64_t absTimeout = 0;
+  while (qdb.Offset() < batch.end) {
+    int8_t indicator = qdb.Read<int8_t>();
+    if (indicator == kExpireMs) {
+      absTimeout = qdb.Read<int64_t>();
+    } else if (indicator == kExpire) {
+      absTimeout = qdb.Read<int64_t>() * 1000;
+    } else {
+      PString key = loader.LoadKey();
+      res.entries.push_back(Entry{std::move(key), loader.LoadObject(indicator), absTimeout});
+      absTimeout = 0;
+    }
+  }
+
+  res.ok = true;
+  return res;
+}
+
+void PDBLoader::skipString() {
+  bool special;
+  const auto len = LoadLength(special);
+  if (!special) {
+    qdb_.Skip(len);
+    return;
+  }
+
+  switch (len) {
+    case kEnc8Bits:
+      qdb_.Skip(1);
+      break;
+
+    case kEnc16Bits:
+      qdb_.Skip(2);
+      break;
+
+    case kEnc32Bits:
+      qdb_.Skip(4);
+      break;
+
+    case kEncLZF:
+    case kEncLZ4:
+    case kEncZstd: {
+      const auto compressLen = LoadLength(special);
+      LoadLength(special);  // raw len
+      qdb_.Skip(compressLen);
+      break;
+    }
+
+    default:
+      assert(false);
+      break;
+  }
+}
+
+void PDBLoader::skipObject(int8_t type) {
+  bool special;
+  switch (type) {
+    case kTypeList:
+    case kTypeSet:
+    case kTypeQuickList: {
+      auto len = LoadLength(special);
+      while (len-- > 0 && !qdb_.Overrun()) {
+        skipString();
+      }
+      break;
+    }
+
+    case kTypeHash: {
+      auto len = LoadLength(special);
+      while (len-- > 0 && !qdb_.Overrun()) {
+        skipString();
+        skipString();
+      }
+      break;
+    }
+
+    case kTypeZSet: {
+      auto len = LoadLength(special);
+      while (len-- > 0 && !qdb_.Overrun()) {
+        skipString();
+        // double value, 253~255 are special values without data
+        const uint8_t byte1st = qdb_.Read<uint8_t>();
+        if (byte1st < 253) {
+          qdb_.Skip(byte1st);
+        }
+      }
+      break;
+    }
+
+    default:  // string, ziplist, intset, zipmap
+      skipString();
+      break;
+  }
+}
+
+void PDBLoader::markCrc() {
+  std::size_t len = 0;
+  crcData_ = qdb_.Read(len);
+  crcOffset_ = qdb_.Offset();
+}
+
+void PDBLoader::updateCrc() {
+  if (crcData_) {
+    crc_ = crc64(crc_, (const unsigned char*)crcData_, qdb_.Offset() - crcOffset_);
+  }
+
+  markCrc();
+}
+
 size_t PDBLoader::LoadLength(bool& special) {
   const int8_t byte = qdb_.Read<int8_t>();
 
@@ -517,7 +1402,9 @@ PObject PDBLoader::LoadSpecialStringObject(size_t specialVal) {
       break;
     }
 
-    case kEncLZF: {
+    case kEncLZF:
+    case kEncLZ4:
+    case kEncZstd: {
       isInt = false;
       break;
     }
@@ -530,7 +1417,7 @@ PObject PDBLoader::LoadSpecialStringObject(size_t specialVal) {
   if (isInt) {
     return PObject::CreateString(val);
   } else {
-    return PObject::CreateString(LoadLZFString());
+    return PObject::CreateString(LoadCompressedString(specialVal));
   }
 }
 
@@ -541,7 +1428,14 @@ PString PDBLoader::LoadString(size_t strLen) {
   return PString(str, strLen);
 }
 
-PString PDBLoader::LoadLZFString() {
+PString PDBLoader::LoadCompressedString(size_t encoding) {
+  PCodec codec = PCodec_lzf;
+  if (encoding == kEncLZ4) {
+    codec = PCodec_lz4;
+  } else if (encoding == kEncZstd) {
+    codec = PCodec_zstd;
+  }
+
   bool special;
   size_t compressLen = LoadLength(special);
   assert(!special);
@@ -551,14 +1445,15 @@ PString PDBLoader::LoadLZFString() {
 
   const char* compressStr = qdb_.Read(compressLen);
 
+  qdb_.Skip(compressLen);
+
   PString val;
   val.resize(rawLen);
-  if (lzf_decompress(compressStr, static_cast<unsigned>(compressLen), &val[0], rawLen) == 0) {
-    ERROR("decompress error");
+  if (!Decompress(codec, compressStr, compressLen, &val[0], rawLen)) {
+    ERROR("{} decompress error", CodecName(codec));
     return PString();
   }
 
-  qdb_.Skip(compressLen);
   return val;
 }
 
@@ -616,6 +1511,50 @@ PObject PDBLoader::LoadObject(int8_t type) {
   return PObject(PType_invalid);
 }
 
+bool PDBLoader::RestoreObject(const PString& payload, PObject& obj) {
+  const std::size_t kFooterSize = sizeof(uint16_t) + sizeof(uint64_t);
+  if (payload.size() <= kFooterSize) {
+    return false;
+  }
+
+  const std::size_t bodySize = payload.size() - kFooterSize;
+  uint16_t version;
+  uint64_t crc;
+  memcpy(&version, payload.data() + bodySize, sizeof version);
+  memcpy(&crc, payload.data() + bodySize + sizeof version, sizeof crc);
+  if (version > kPDBVersion ||
+      crc != crc64(0, (const unsigned char*)payload.data(), bodySize + sizeof version)) {
+    return false;
+  }
+
+  PDBLoader loader;
+  loader.qdb_.Attach(payload.data(), bodySize);
+  const int8_t type = loader.qdb_.Read<int8_t>();
+  // only the types of DumpObject: the ziplist and intset decoders trust
+  // the lengths inside the blob, and anyone can compute the crc
+  switch (type) {
+    case kTypeString:
+    case kTypeList:
+    case kTypeSet:
+    case kTypeZSet:
+    case kTypeHash:
+      break;
+
+    default:
+      return false;
+  }
+
+  // walk it first, the object is decoded only if it fills the payload exactly
+  loader.skipObject(type);
+  if (loader.qdb_.Overrun() || loader.qdb_.Offset() != bodySize) {
+    return false;
+  }
+
+  loader.qdb_.Seek(1);
+  obj = loader.LoadObject(type);
+  return obj.type != PType_invalid;
+}
+
 PString PDBLoader::loadGenericString() {
   bool special;
   size_t len = LoadLength(special);
@@ -731,7 +1670,7 @@ PObject PDBLoader::loadZSet() {
     }
 
     const auto score = loadDoubleValue();
-    zset->AddMember(member, static_cast<long>(score));
+    zset->AddMember(member, score);
     DEBUG("zset member : {}, score : {}", member, score);
   }
 
@@ -958,10 +1897,14 @@ void PDBLoader::loadResizeDB() {
   auto expiresize = LoadLength(special);
   assert(!special);
 
-  // just ignore this
-  (void)special;
-  (void)dbsize;
-  (void)expiresize;
+  if (streaming_) {
+    PSTORE.ReserveStaging(dbno_, dbsize, expiresize);
+    return;
+  }
+
+  // the pool may have switched db to insert
+  PSTORE.SelectDB(dbno_);
+  PSTORE.ReserveDB(dbsize, expiresize);
 }
 
 }  // namespace pikiwidb
@@ -7,26 +7,82 @@
 
 #pragma once
 
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "compress.h"
 #include "memory_file.h"
 #include "store.h"
+#include "thread_pool.h"
 
 namespace pikiwidb {
 
+// the encoded entries of some buckets and its crc
+struct PDBChunk {
+  PString data;
+  uint64_t crc = 0;
+};
+
 class PDBSaver {
  public:
+  using SkipFunc = std::function<bool(const PObject&)>;
+  using Sink = std::function<void(const char* data, std::size_t len)>;
+
+  static const std::size_t kBucketsPerChunk = 1024;
+
+  PDBSaver();
+
+  // the buckets of a db are encoded by rdb-save-threads concurrently
   void Save(const char* qdbFile);
+
+  // incremental save: the data goes to a tmp file, which is
+  // renamed to qdbFile by Finish only if everything is written.
+  bool Open(const char* qdbFile);
+  // or the data goes to sink, such as the sockets of slaves
+  bool Open(Sink sink);
+  // dbsize and expiresize are the resize hints for loader
+  void SaveDB(int dbno, std::size_t dbsize = 0, std::size_t expiresize = 0);
+  void SaveEntry(const PString& key, const PObject& obj, uint64_t expireAt);
+  bool Finish();
+  void Abort();
+
+  // encode buckets [first, last) of db by threads, written in bucket order
+  void SaveBuckets(ThreadPool& pool, const PDB& db, const PStore::ExpiredDB& expires, std::size_t first,
+                   std::size_t last, uint64_t now, const SkipFunc& skip = SkipFunc(),
+                   std::size_t bucketsPerChunk = kBucketsPerChunk);
+  void SaveChunk(const PDBChunk& chunk);
+
   void SaveType(const PObject& obj);
   void SaveKey(const PString& key);
   void SaveObject(const PObject& obj);
   void SaveString(const PString& str);
   void SaveLength(uint64_t len);  // big endian
   void SaveString(int64_t intVal);
-  bool SaveLZFString(const PString& str);
+  // by rdb-compression-codec, false if not compressed
+  bool SaveCompressedString(const PString& str);
+
+  // the DUMP payload: the object as in rdb, followed by rdb version and crc64
+  static PString DumpObject(const PObject& obj);
 
   static void SaveDoneHandler(int exit, int signal);
 
  private:
+  static PDBChunk encodeBuckets(const PDB& db, const PStore::ExpiredDB& expires, std::size_t first, std::size_t last,
+                                uint64_t now, const SkipFunc& skip);
+
+  // encode to buffer_, it is flushed to file if opened
+  void write(const void* data, std::size_t len);
+  void flush();
+  bool isOpen() const { return qdb_.IsOpen() || sink_; }
+  void output(const void* data, std::size_t len);
+
   void saveDoubleValue(double val);
+  void saveAux(const PString& key, const PString& val);
+  void saveReplInfo();
 
   void saveList(const PLIST& l);
   void saveset(const PSET& s);
@@ -34,24 +90,101 @@ class PDBSaver {
   void saveZSet(const PZSET& ss);
 
   OutputMemoryFile qdb_;
+  Sink sink_;
+  PString qdbFile_;
+  PString tmpFile_;
+  PString buffer_;
+  uint64_t crc_ = 0;  // crc of data written to qdb_
+
+  PCodec codec_ = PCodec_lzf;
+  int level_ = 0;
 };
 
 extern time_t g_lastPDBSave;
-extern pid_t g_qdbPid;
+extern pid_t g_qdbPid;        // the child saving rdb, -1 if none
+extern bool g_qdbForkless;    // a forkless snapshot is saving rdb
+
+// save rdb in background, by fork or by forkless snapshot,
+// PDBSaver::SaveDoneHandler is called when the save is done
+bool StartBgsave();
+bool IsBgsaveInProgress();
 
 class PDBLoader {
  public:
+  static constexpr std::size_t kHeaderSize = 9;  // "REDIS" and version
+
+  // records are decoded by rdb-load-threads concurrently
   int Load(const char* filename);
+  // the aux fields before the first db, such as the replication offset
+  int LoadAux(const char* filename, std::map<PString, PString>& fields);
+
+  // streaming load into the staging keyspace of PStore, the rdb is parsed while it's received
+  void BeginStream();
+  // parse the complete records received so far, false if the data is corrupted
+  bool Feed(const char* data, std::size_t len);
+  bool StreamDone() const { return streamDone_; }
 
   size_t LoadLength(bool& special);
   PObject LoadSpecialStringObject(size_t specialVal);
   PString LoadString(size_t strLen);
-  PString LoadLZFString();
+  PString LoadCompressedString(size_t encoding);
 
   PString LoadKey();
   PObject LoadObject(int8_t type);
 
+  // RESTORE, false if the payload is not a valid DUMP of this rdb version
+  static bool RestoreObject(const PString& payload, PObject& obj);
+
  private:
+  friend class PLoading;
+
+  using KeyFunc = std::function<void(int dbno, PString&& key, std::size_t offset)>;
+  using KeyFilter = std::function<bool(int dbno, const PString& key, std::size_t offset)>;
+
+  // open file and check the header
+  int open(const char* filename);
+  bool checkCrc(const char* filename);
+
+  // used by async loading: find the keys and their record offsets, check crc
+  int scanKeys(const char* filename, const KeyFunc& onKey);
+  // load the records taken by filter from offset, until count keys visited, false at EOF
+  bool loadRecords(std::size_t& offset, std::size_t count, const KeyFilter& take);
+  // load the record at offset into current db
+  void loadRecordAt(std::size_t offset);
+  // the key of record at offset, the cursor is not moved
+  PString keyAt(std::size_t offset);
+
+  // the records in [begin, end) of file, and the bytes from crcBegin are crc by worker
+  struct Batch {
+    int dbno = 0;
+    std::size_t crcBegin = 0;
+    std::size_t begin = 0;  // 0 if no record
+    std::size_t end = 0;
+  };
+
+  struct Entry {
+    PString key;
+    PObject obj;
+    int64_t absTimeout;
+  };
+
+  struct Decoded {
+    bool ok = false;
+    Batch batch;
+    uint64_t crc = 0;
+    std::vector<Entry> entries;
+  };
+
+  static Decoded decodeBatch(const PString& file, const Batch& batch);
+  bool submitBatch();
+  bool insertBatch();
+  bool drainBatches();
+  void loadEntry(const PString& key, PObject&& obj, int64_t absTimeout);
+
+  // find the end of record without decoding
+  void skipString();
+  void skipObject(int8_t type);
+
   PString loadGenericString();
   PObject loadList();
   PObject loadSet();
@@ -66,7 +199,32 @@ class PDBLoader {
   void loadAux();
   void loadResizeDB();
 
+  // walk the record in stream, the input overruns if it's incomplete
+  bool skipRecord(int8_t indicator);
+  bool loadStreamRecord(int8_t indicator);
+
+  // crc the data loaded since last mark
+  void markCrc();
+  void updateCrc();
+
   InputMemoryFile qdb_;
+  uint64_t crc_ = 0;
+  const char* crcData_ = nullptr;
+  std::size_t crcOffset_ = 0;
+
+  PString file_;
+  int dbno_ = 0;
+  int threads_ = 1;
+  std::unique_ptr<ThreadPool> pool_;
+  Batch batch_;
+  std::deque<std::future<Decoded> > tasks_;
+
+  // streaming load
+  bool streaming_ = false;
+  bool streamDone_ = false;
+  PString stream_;             // the data not parsed
+  std::size_t streamPos_ = 0;  // the parsed bytes in stream_
+  int64_t streamExpire_ = 0;   // the expire of next key
 };
 
 }  // namespace pikiwidb
@@ -7,6 +7,7 @@
 
 #include <cassert>
 #include <fnmatch.h>
+#include "db.h"
 #include "log.h"
 #include "store.h"
 
@@ -104,9 +105,13 @@ PError pexpire(const std::vector<PString>& params, UnboundedBuffer* reply) {
 
 PError expireat(const std::vector<PString>& params, UnboundedBuffer* reply) {
   const PString& key = params[1];
-  const uint64_t timeout = atoi(params[2].c_str());  // by seconds;
+  long long timeout;  // by seconds, unix time does not fit in atoi
+  if (!Strtoll(params[2].c_str(), params[2].size(), &timeout)) {
+    ReplyError(PError_nan, reply);
+    return PError_nan;
+  }
 
-  int ret = setExpireByMs(key, timeout * 1000);
+  int ret = setExpireByMs(key, timeout < 0 ? 0 : static_cast<uint64_t>(timeout) * 1000);
 
   FormatInt(ret, reply);
   return PError_ok;
@@ -114,9 +119,13 @@ PError expireat(const std::vector<PString>& params, UnboundedBuffer* reply) {
 
 PError pexpireat(const std::vector<PString>& params, UnboundedBuffer* reply) {
   const PString& key = params[1];
-  const uint64_t timeout = atoi(params[2].c_str());  // by milliseconds;
+  long long timeout;  // by milliseconds, unix time does not fit in atoi
+  if (!Strtoll(params[2].c_str(), params[2].size(), &timeout)) {
+    ReplyError(PError_nan, reply);
+    return PError_nan;
+  }
 
-  int ret = setExpireByMs(key, timeout);
+  int ret = setExpireByMs(key, timeout < 0 ? 0 : static_cast<uint64_t>(timeout));
 
   FormatInt(ret, reply);
   return PError_ok;
@@ -199,6 +208,69 @@ PError move(const std::vector<PString>& params, UnboundedBuffer* reply) {
   return PError_ok;
 }
 
+PError dump(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  PObject* value;
+  PError err = PSTORE.GetValue(params[1], value);
+  if (err != PError_ok) {
+    FormatNull(reply);
+    return err;
+  }
+
+  FormatBulk(PDBSaver::DumpObject(*value), reply);
+  return PError_ok;
+}
+
+// RESTORE key ttl payload [REPLACE] [ABSTTL] [IDLETIME seconds] [FREQ frequency]
+PError restore(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  const PString& key = params[1];
+  long ttl;
+  if (!TryStr2Long(params[2].c_str(), params[2].size(), ttl) || ttl < 0) {
+    ReplyError(PError_nan, reply);
+    return PError_nan;
+  }
+
+  bool replace = false;
+  bool absttl = false;
+  for (std::size_t i = 4; i < params.size(); ++i) {
+    if (strcasecmp(params[i].c_str(), "replace") == 0) {
+      replace = true;
+    } else if (strcasecmp(params[i].c_str(), "absttl") == 0) {
+      absttl = true;
+    } else if ((strcasecmp(params[i].c_str(), "idletime") == 0 || strcasecmp(params[i].c_str(), "freq") == 0) &&
+               i + 1 < params.size()) {
+      ++i;  // lru and lfu are not kept
+    } else {
+      ReplyError(PError_syntax, reply);
+      return PError_syntax;
+    }
+  }
+
+  if (!replace && PSTORE.ExistsKey(key)) {
+    ReplyError(PError_busyKey, reply);
+    return PError_busyKey;
+  }
+
+  PObject obj;
+  if (!PDBLoader::RestoreObject(params[3], obj)) {
+    ReplyError(PError_badPayload, reply);
+    return PError_badPayload;
+  }
+
+  const uint64_t now = ::Now();
+  const uint64_t expireAt = ttl == 0 ? 0 : (absttl ? ttl : now + ttl);
+  PSTORE.ClearExpire(key);
+  PSTORE.DeleteKey(key);
+  if (expireAt == 0 || expireAt > now) {
+    PSTORE.SetValue(key, std::move(obj));
+    if (expireAt != 0) {
+      PSTORE.SetExpire(key, expireAt);
+    }
+  }
+
+  FormatOK(reply);
+  return PError_ok;
+}
+
 PError keys(const std::vector<PString>& params, UnboundedBuffer* reply) {
   const PString& pattern = params[1];
 
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "latency_monitor.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "config.h"
+#include "unbounded_buffer.h"
+
+namespace pikiwidb {
+
+const char* const kLatencyFork = "fork";
+const char* const kLatencyExpireCycle = "expire-cycle";
+const char* const kLatencyEvictionCycle = "eviction-cycle";
+const char* const kLatencyBackendFlush = "backend-flush";
+const char* const kLatencyRehash = "rehash";
+
+std::vector<PLatencySample> PLatencyEvent::History() const {
+  std::vector<PLatencySample> history;
+  for (int i = 0; i < kHistory; ++i) {
+    const auto& sample = samples[(next + i) % kHistory];
+    if (sample.time != 0) {
+      history.push_back(sample);
+    }
+  }
+
+  return history;
+}
+
+PLatencyMonitor& PLatencyMonitor::Instance() {
+  static PLatencyMonitor monitor;
+
+  return monitor;
+}
+
+bool PLatencyMonitor::IsEnabled() const { return g_config.latencymonitorthreshold > 0; }
+
+void PLatencyMonitor::AddSampleIfNeeded(const char* event, uint64_t usec) {
+  const uint64_t ms = usec / 1000;
+  if (!IsEnabled() || ms < static_cast<uint64_t>(g_config.latencymonitorthreshold)) {
+    return;
+  }
+
+  auto& e = events_[event];
+  const auto latency = static_cast<uint32_t>(std::min<uint64_t>(ms, UINT32_MAX));
+  const time_t now = ::time(nullptr);
+  e.max = std::max(e.max, latency);
+
+  // the samples of the same second are merged
+  auto& latest = e.samples[(e.next + PLatencyEvent::kHistory - 1) % PLatencyEvent::kHistory];
+  if (latest.time == now) {
+    latest.latency = std::max(latest.latency, latency);
+    return;
+  }
+
+  e.samples[e.next].time = now;
+  e.samples[e.next].latency = latency;
+  e.next = (e.next + 1) % PLatencyEvent::kHistory;
+}
+
+std::size_t PLatencyMonitor::Reset(const std::vector<PString>& events) {
+  if (events.empty()) {
+    std::size_t n = events_.size();
+    events_.clear();
+    return n;
+  }
+
+  std::size_t n = 0;
+  for (const auto& event : events) {
+    n += events_.erase(event);
+  }
+
+  return n;
+}
+
+const PLatencyEvent* PLatencyMonitor::Find(const PString& event) const {
+  auto it = events_.find(event);
+  return it == events_.end() ? nullptr : &it->second;
+}
+
+static const char* AdviceOf(const PString& event) {
+  if (event == kLatencyFork) {
+    return "the fork of a background save copies the page table, it grows with the memory used. "
+           "Set rdb-forkless yes to save without fork, or keep the dataset of an instance smaller.";
+  }
+  if (event == kLatencyExpireCycle) {
+    return "many keys expire at the same time, spread their expire times with some randomness.";
+  }
+  if (event == kLatencyEvictionCycle) {
+    return "the memory exceeds maxmemory and keys are evicted by samples, raise maxmemory, "
+           "lower maxmemorySamples or write slower.";
+  }
+  if (event == kLatencyBackendFlush) {
+    return "the dirty keys are put to the backend slowly, check the disk of backendpath or lower backendhz.";
+  }
+  if (event == kLatencyRehash) {
+    return "a database is rehashed as it grows, the pause is proportional to its keys, "
+           "split big databases into more instances.";
+  }
+
+  return "no advice for this event.";
+}
+
+PString PLatencyMonitor::Doctor() const {
+  PString report;
+  if (!IsEnabled()) {
+    report = "The latency monitor is disabled, enable it with CONFIG SET latency-monitor-threshold <milliseconds>.\n";
+    if (events_.empty()) {
+      return report;
+    }
+    report += "\n";
+  }
+
+  if (events_.empty()) {
+    return "No latency spike was observed, all events are below " +
+           std::to_string(g_config.latencymonitorthreshold) + " milliseconds.\n";
+  }
+
+  report += "Latency spikes were observed in this instance:\n\n";
+  int i = 0;
+  for (const auto& kv : events_) {
+    auto history = kv.second.History();
+    if (history.empty()) {
+      continue;
+    }
+
+    double avg = 0;
+    for (const auto& s : history) {
+      avg += s.latency;
+    }
+    avg /= history.size();
+
+    double mad = 0;
+    for (const auto& s : history) {
+      mad += std::fabs(s.latency - avg);
+    }
+    mad /= history.size();
+
+    long period = 0;
+    if (history.size() > 1) {
+      period = static_cast<long>(history.back().time - history.front().time) / static_cast<long>(history.size() - 1);
+    }
+
+    char buf[256];
+    snprintf(buf, sizeof buf,
+             "%d. %s: %zu latency spikes (average %.0fms, mean deviation %.0fms, period %ld sec). "
+             "Worst all time event %ums.\n",
+             ++i, kv.first.c_str(), history.size(), avg, mad, period, kv.second.max);
+    report += buf;
+  }
+
+  report += "\nAdvices:\n";
+  for (const auto& kv : events_) {
+    report += "- " + kv.first + ": " + AdviceOf(kv.first) + "\n";
+  }
+
+  return report;
+}
+
+void PLatencyMonitor::OnInfoCommand(UnboundedBuffer& res) const {
+  char buf[64];
+  int n = snprintf(buf, sizeof buf, "latest_fork_usec:%lu\r\n", latestForkUsec_);
+  res.PushData(buf, n);
+}
+
+}  // namespace pikiwidb
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <ctime>
+#include <map>
+#include <vector>
+
+#include "cycle_clock.h"
+#include "pstring.h"
+
+namespace pikiwidb {
+
+class UnboundedBuffer;
+
+// the internal events sampled by the latency monitor
+extern const char* const kLatencyFork;
+extern const char* const kLatencyExpireCycle;
+extern const char* const kLatencyEvictionCycle;
+extern const char* const kLatencyBackendFlush;
+extern const char* const kLatencyRehash;
+
+struct PLatencySample {
+  time_t time = 0;
+  uint32_t latency = 0;  // milliseconds
+};
+
+// the samples of an event in a ring, a sample per second at most, the max of the second
+struct PLatencyEvent {
+  static const int kHistory = 160;
+
+  PLatencySample samples[kHistory];
+  int next = 0;  // where the next sample goes
+  uint32_t max = 0;
+
+  // the samples from the oldest one
+  std::vector<PLatencySample> History() const;
+  const PLatencySample& Latest() const { return samples[(next + kHistory - 1) % kHistory]; }
+};
+
+// LATENCY LATEST/HISTORY/RESET/DOCTOR, events lasting latency-monitor-threshold
+// milliseconds or more are sampled
+class PLatencyMonitor {
+ public:
+  static PLatencyMonitor& Instance();
+
+  PLatencyMonitor(const PLatencyMonitor&) = delete;
+  void operator=(const PLatencyMonitor&) = delete;
+
+  bool IsEnabled() const;
+  void AddSampleIfNeeded(const char* event, uint64_t usec);
+
+  // the events of the names, all if empty, returns how many were reset
+  std::size_t Reset(const std::vector<PString>& events);
+
+  const std::map<PString, PLatencyEvent>& Events() const { return events_; }
+  const PLatencyEvent* Find(const PString& event) const;
+  PString Doctor() const;
+
+  // the fork is recorded whether the monitor is enabled or not
+  void SetForkUsec(uint64_t usec) { latestForkUsec_ = usec; }
+  void OnInfoCommand(UnboundedBuffer& res) const;
+
+ private:
+  PLatencyMonitor() = default;
+
+  std::map<PString, PLatencyEvent> events_;
+  uint64_t latestForkUsec_ = 0;
+};
+
+// samples the scope as the event, it costs nothing if the monitor is disabled or the event is null
+class PLatencyScope {
+ public:
+  explicit PLatencyScope(const char* event) : event_(event) {
+    if (event_ && PLatencyMonitor::Instance().IsEnabled()) {
+      begin_ = CycleClock::Now();
+    }
+  }
+
+  ~PLatencyScope() {
+    if (begin_ != 0) {
+      PLatencyMonitor::Instance().AddSampleIfNeeded(event_, CycleClock::ToNs(CycleClock::Now() - begin_) / 1000);
+    }
+  }
+
+  PLatencyScope(const PLatencyScope&) = delete;
+  void operator=(const PLatencyScope&) = delete;
+
+ private:
+  const char* event_;
+  uint64_t begin_ = 0;
+};
+
+}  // namespace pikiwidb
@@ -32,23 +32,23 @@ class PLeveldb : public PDumpInterface {
   bool Put(const PString& key, const PObject& obj, int64_t ttl = 0) override;
   bool Delete(const PString& key) override;
 
+  // the value codec, it doesn't need the db to be opened
+  // value format: type + ttl(if has) + qobject
+  void encodeObject(const PObject& obj, int64_t absttl, UnboundedBuffer& v);
+  // the unit of @remainTtlSeconds is second.
+  PObject decodeObject(const char* data, size_t len, int64_t& remainTtlSeconds);
+
  private:
   leveldb::DB* db_ = nullptr;
 
   // encoding stuff
-
-  // value format: type + ttl(if has) + qobject
-  void encodeObject(const PObject& obj, int64_t absttl, UnboundedBuffer& v);
-
   void encodeString(const PString& str, UnboundedBuffer& v);
   void encodeHash(const PHASH&, UnboundedBuffer& v);
   void encodeList(const PLIST&, UnboundedBuffer& v);
   void encodeSet(const PSET&, UnboundedBuffer& v);
   void encodeZSet(const PZSET&, UnboundedBuffer& v);
 
-  // decoding stuff. the unit of @remainTtlSeconds is second.
-  PObject decodeObject(const char* data, size_t len, int64_t& remainTtlSeconds);
-
+  // decoding stuff
   PString decodeString(const char* data, size_t len);
   PObject decodeHash(const char* data, size_t len);
   PObject decodeList(const char* data, size_t len);
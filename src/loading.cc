@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "loading.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "command.h"
+#include "config.h"
+#include "event_loop.h"
+#include "helper.h"
+#include "log.h"
+#include "replication.h"
+#include "store.h"
+
+namespace pikiwidb {
+
+// time budget of one slice, the loop runs a slice every millisecond
+static const auto kSliceTime = std::chrono::microseconds(1000);
+// check the clock every some keys
+static const std::size_t kKeysPerCheck = 64;
+
+// slot: hash tag 24 bits | record offset 40 bits
+static const int kTagShift = 40;
+static const uint64_t kOffsetMask = (1ULL << kTagShift) - 1;
+static const uint64_t kEmptySlot = 0;
+static const uint64_t kDeletedSlot = 1;  // records are after header, never at 1
+
+// the saved index: header, IndexDB of each db, then the slots of each db
+static const char kIndexMagic[8] = {'P', 'I', 'K', 'I', 'I', 'D', 'X', '\0'};
+// bump it when the layout or the key hash is changed
+static const uint32_t kIndexLayout = 1;
+
+struct IndexHeader {
+  char magic[8];
+  uint32_t layout;
+  uint32_t dbs;
+  uint64_t rdbSize;
+  uint64_t rdbCrc;  // the checksum at the end of rdb
+};
+
+struct IndexDB {
+  uint64_t mask;
+  uint64_t count;
+};
+
+static uint32_t hashKey(const PString& key) { return dictGenHashFunction(key.data(), static_cast<int>(key.size())); }
+
+static uint64_t makeSlot(uint32_t hash, std::size_t offset) {
+  return (static_cast<uint64_t>(hash >> 8) << kTagShift) | offset;
+}
+
+static bool tagMatch(uint64_t slot, uint32_t hash) { return (slot >> kTagShift) == (hash >> 8); }
+
+static uint64_t rdbTrailingCrc(InputMemoryFile& rdb) {
+  uint64_t crc = 0;
+  std::size_t len = sizeof crc;
+  if (rdb.Size() >= PDBLoader::kHeaderSize + len) {
+    rdb.Seek(rdb.Size() - len);
+    memcpy(&crc, rdb.Read(len), len);
+  }
+
+  return crc;
+}
+
+PLoading& PLoading::Instance() {
+  static PLoading loading;
+  return loading;
+}
+
+bool PLoading::Start(const PString& file) {
+  if (loading_) {
+    return false;
+  }
+
+  const auto begin = std::chrono::steady_clock::now();
+
+  KeyOffsets keys(g_config.databases);
+  auto onKey = [&keys](int dbno, PString&& key, std::size_t offset) { keys[dbno].emplace_back(hashKey(key), offset); };
+  if (loader_.scanKeys(file.c_str(), onKey) != 0) {
+    loader_.qdb_.Close();
+    return false;
+  }
+
+  index_ = buildIndex(keys);
+  this->begin(file, "indexed", begin);
+  return true;
+}
+
+bool PLoading::Attach(const PString& file) {
+  if (loading_) {
+    return false;
+  }
+
+  const auto begin = std::chrono::steady_clock::now();
+  const PString idxFile = IndexFile(file);
+  int fd = ::open(idxFile.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  ::fstat(fd, &st);
+  const std::size_t size = st.st_size;
+  // private writable mapping, the loaded keys are erased in memory only
+  void* addr = size > 0 ? ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  ::close(fd);
+  if (addr == MAP_FAILED) {
+    return false;
+  }
+
+  const char* base = static_cast<const char*>(addr);
+  const auto* header = reinterpret_cast<const IndexHeader*>(base);
+  const std::size_t dbs = g_config.databases;
+  const std::size_t slotsBegin = sizeof(IndexHeader) + dbs * sizeof(IndexDB);
+
+  bool match = size >= slotsBegin && memcmp(header->magic, kIndexMagic, sizeof kIndexMagic) == 0 &&
+               header->layout == kIndexLayout && header->dbs == dbs && loader_.open(file.c_str()) == 0 &&
+               header->rdbSize == loader_.qdb_.Size() && header->rdbCrc == rdbTrailingCrc(loader_.qdb_);
+
+  std::vector<Table> index(dbs);
+  std::size_t offset = slotsBegin;
+  for (std::size_t i = 0; match && i < dbs; ++i) {
+    const auto* db = reinterpret_cast<const IndexDB*>(base + sizeof(IndexHeader)) + i;
+    const std::size_t bytes = (db->mask + 1) * sizeof(uint64_t);
+    if (offset + bytes > size) {
+      match = false;
+      break;
+    }
+
+    index[i].slots = reinterpret_cast<uint64_t*>(static_cast<char*>(addr) + offset);
+    index[i].mask = db->mask;
+    index[i].count = db->count;
+    offset += bytes;
+  }
+
+  if (!match) {
+    WARN("index {} does not match {}, load rdb", idxFile, file);
+    ::munmap(addr, size);
+    loader_.qdb_.Close();
+    return false;
+  }
+
+  index_.swap(index);
+  mapped_ = addr;
+  mappedSize_ = size;
+  this->begin(file, "attached", begin);
+  return true;
+}
+
+bool PLoading::SaveIndex(const PString& file) {
+  PDBLoader loader;
+  KeyOffsets keys(g_config.databases);
+  auto onKey = [&keys](int dbno, PString&& key, std::size_t offset) { keys[dbno].emplace_back(hashKey(key), offset); };
+  if (loader.scanKeys(file.c_str(), onKey) != 0) {
+    ERROR("can not index rdb {}", file);
+    return false;
+  }
+
+  IndexHeader header;
+  memcpy(header.magic, kIndexMagic, sizeof kIndexMagic);
+  header.layout = kIndexLayout;
+  header.dbs = static_cast<uint32_t>(keys.size());
+  header.rdbSize = loader.qdb_.Size();
+  header.rdbCrc = rdbTrailingCrc(loader.qdb_);
+
+  std::vector<Table> index = buildIndex(keys);
+
+  // write to tmp file, then rename
+  const PString idxFile = IndexFile(file);
+  const PString tmpFile = idxFile + ".tmp";
+  FILE* fp = fopen(tmpFile.c_str(), "wb");
+  if (!fp) {
+    ERROR("can not open index {}", tmpFile);
+    return false;
+  }
+
+  bool ok = fwrite(&header, sizeof header, 1, fp) == 1;
+  for (const auto& table : index) {
+    IndexDB db{table.mask, table.count};
+    ok = ok && fwrite(&db, sizeof db, 1, fp) == 1;
+  }
+  for (const auto& table : index) {
+    ok = ok && fwrite(table.slots, sizeof(uint64_t), table.mask + 1, fp) == table.mask + 1;
+  }
+  ok = (fflush(fp) == 0) && ok && ::fsync(fileno(fp)) == 0;
+  fclose(fp);
+
+  if (!ok || ::rename(tmpFile.c_str(), idxFile.c_str()) != 0) {
+    ERROR("save index {} failed", idxFile);
+    ::unlink(tmpFile.c_str());
+    return false;
+  }
+
+  INFO("saved index {} of rdb {}", idxFile, file);
+  return true;
+}
+
+std::vector<PLoading::Table> PLoading::buildIndex(const KeyOffsets& keys) {
+  std::vector<Table> index(keys.size());
+  for (std::size_t i = 0; i < keys.size(); ++i) {
+    // load factor is at most 0.5, so there are always empty slots
+    std::size_t capacity = 1;
+    while (capacity < keys[i].size() * 2) {
+      capacity <<= 1;
+    }
+
+    Table& table = index[i];
+    table.owned.assign(capacity, kEmptySlot);
+    table.slots = table.owned.data();
+    table.mask = capacity - 1;
+    table.count = keys[i].size();
+
+    for (const auto& [hash, offset] : keys[i]) {
+      std::size_t pos = hash & table.mask;
+      while (table.slots[pos] != kEmptySlot) {
+        pos = (pos + 1) & table.mask;
+      }
+      table.slots[pos] = makeSlot(hash, offset);
+    }
+  }
+
+  return index;
+}
+
+uint64_t* PLoading::find(int dbno, const PString& key) {
+  Table& table = index_[dbno];
+  if (table.count == 0) {
+    return nullptr;
+  }
+
+  const uint32_t hash = hashKey(key);
+  for (std::size_t pos = hash & table.mask;; pos = (pos + 1) & table.mask) {
+    uint64_t& slot = table.slots[pos];
+    if (slot == kEmptySlot) {
+      return nullptr;
+    }
+
+    if (slot != kDeletedSlot && tagMatch(slot, hash) && loader_.keyAt(slot & kOffsetMask) == key) {
+      return &slot;
+    }
+  }
+}
+
+void PLoading::erase(int dbno, uint64_t* slot) {
+  *slot = kDeletedSlot;
+  --index_[dbno].count;
+}
+
+void PLoading::begin(const PString& file, const char* how, std::chrono::steady_clock::time_point start) {
+  offset_ = PDBLoader::kHeaderSize;
+  totalKeys_ = 0;
+  loadedKeys_ = 0;
+  onDemandKeys_ = 0;
+
+  // reserve the dbs for the keys
+  const int olddb = PSTORE.GetDB();
+  for (std::size_t i = 0; i < index_.size(); ++i) {
+    totalKeys_ += index_[i].count;
+    if (index_[i].count > 0) {
+      PSTORE.SelectDB(static_cast<int>(i));
+      PSTORE.ReserveDB(index_[i].count, 0);
+    }
+  }
+  PSTORE.SelectDB(olddb);
+
+  startTime_ = ::time(nullptr);
+  loading_ = true;
+  timer_ = EventLoop::Self()->ScheduleRepeatedly(1, [this]() { this->step(); });
+
+  auto cost = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+  INFO("async loading {} started, {} keys {} in {}ms", file, totalKeys_, how, cost.count());
+}
+
+void PLoading::LoadAll() {
+  if (!loading_) {
+    return;
+  }
+
+  const int olddb = PSTORE.GetDB();
+  auto take = [this](int dbno, const PString& key, std::size_t offset) { return this->takeKey(dbno, key, offset); };
+  while (loader_.loadRecords(offset_, kKeysPerCheck, take)) {
+  }
+  PSTORE.SelectDB(olddb);
+
+  finish();
+}
+
+void PLoading::LoadKey(int dbno, const PString& key) {
+  uint64_t* slot = find(dbno, key);
+  if (!slot) {
+    return;
+  }
+
+  // erase first, the key is set to store by loader
+  const std::size_t offset = *slot & kOffsetMask;
+  erase(dbno, slot);
+
+  assert(dbno == PSTORE.GetDB());
+  loader_.loadRecordAt(offset);
+  ++onDemandKeys_;
+}
+
+void PLoading::DropKey(int dbno, const PString& key) {
+  if (uint64_t* slot = find(dbno, key)) {
+    erase(dbno, slot);
+  }
+}
+
+void PLoading::DropDB(int dbno) {
+  for (std::size_t i = 0; i < index_.size(); ++i) {
+    if (dbno == -1 || dbno == static_cast<int>(i)) {
+      Table& table = index_[i];
+      std::fill(table.slots, table.slots + table.mask + 1, kEmptySlot);
+      table.count = 0;
+    }
+  }
+}
+
+bool PLoading::HasUnloadedKey(int dbno, const PCommandInfo* info, const std::vector<PString>& params) {
+  std::vector<const PString*> keys;
+  PCommandTable::GetKeys(info, params, keys);
+  return std::any_of(keys.begin(), keys.end(), [&](const PString* key) { return find(dbno, *key) != nullptr; });
+}
+
+bool PLoading::takeKey(int dbno, const PString& key, std::size_t offset) {
+  Table& table = index_[dbno];
+  if (table.count == 0) {
+    return false;
+  }
+
+  // the record is known by offset, no need to compare key
+  for (std::size_t pos = hashKey(key) & table.mask;; pos = (pos + 1) & table.mask) {
+    uint64_t& slot = table.slots[pos];
+    if (slot == kEmptySlot) {
+      return false;
+    }
+
+    if ((slot & kOffsetMask) == offset) {
+      erase(dbno, &slot);
+      ++loadedKeys_;
+      return true;
+    }
+  }
+}
+
+void PLoading::step() {
+  const auto begin = std::chrono::steady_clock::now();
+  const int olddb = PSTORE.GetDB();
+
+  auto take = [this](int dbno, const PString& key, std::size_t offset) { return this->takeKey(dbno, key, offset); };
+  bool more = true;
+  do {
+    more = loader_.loadRecords(offset_, kKeysPerCheck, take);
+  } while (more && std::chrono::steady_clock::now() - begin < kSliceTime);
+
+  PSTORE.SelectDB(olddb);
+
+  if (!more) {
+    finish();
+  }
+}
+
+void PLoading::finish() {
+  EventLoop::Self()->Cancel(timer_);
+
+  loading_ = false;
+  loader_.qdb_.Close();
+  std::vector<Table>().swap(index_);
+  if (mapped_) {
+    ::munmap(mapped_, mappedSize_);
+    mapped_ = nullptr;
+    mappedSize_ = 0;
+  }
+
+  INFO("async loading done in {}s, {} keys loaded, {} by access", ::time(nullptr) - startTime_,
+       loadedKeys_ + onDemandKeys_, onDemandKeys_);
+
+  // the bgsave for slaves waits for loading
+  PREPL.TryBgsave();
+}
+
+void PLoading::OnInfoCommand(UnboundedBuffer& res) {
+  char buf[512];
+  int n = snprintf(buf, sizeof buf - 1, "loading:%d\r\n", loading_ ? 1 : 0);
+  res.PushData(buf, n);
+
+  if (!loading_) {
+    return;
+  }
+
+  const std::size_t total = loader_.qdb_.Size();
+  n = snprintf(buf, sizeof buf - 1,
+               "loading_start_time:%ld\r\n"
+               "loading_total_bytes:%lu\r\n"
+               "loading_loaded_bytes:%lu\r\n"
+               "loading_loaded_perc:%.2f\r\n"
+               "loading_total_keys:%lu\r\n"
+               "loading_loaded_keys:%lu\r\n"
+               "loading_keys_by_access:%lu\r\n",
+               static_cast<long>(startTime_), total, offset_, total > 0 ? offset_ * 100.0 / total : 0.0, totalKeys_,
+               loadedKeys_ + onDemandKeys_, onDemandKeys_);
+  res.PushData(buf, n);
+}
+
+}  // namespace pikiwidb
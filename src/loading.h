@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <vector>
+
+#include "db.h"
+#include "net/reactor.h"
+#include "unbounded_buffer.h"
+
+namespace pikiwidb {
+
+struct PCommandInfo;
+
+// Async loading of rdb at startup.
+// The file is scanned and checked first, to index the record of every key.
+// Then the records are loaded in time slices from the event loop while the
+// clients are served. A key accessed before its record is loaded is loaded
+// at once, a key overwritten or deleted before that is not loaded any more.
+//
+// The index holds file offsets only, so it can be saved beside the rdb at
+// shutdown and mapped by the restarted process instead of scanning the rdb.
+class PLoading {
+ public:
+  static PLoading& Instance();
+
+  PLoading(const PLoading&) = delete;
+  void operator=(const PLoading&) = delete;
+
+  bool Start(const PString& file);
+  // start with the saved index of file, false if it does not match
+  bool Attach(const PString& file);
+  // load the rest at once, before the dataset is saved
+  void LoadAll();
+  bool IsLoading() const { return loading_; }
+
+  // index the rdb just saved for the next Attach
+  static bool SaveIndex(const PString& file);
+  static PString IndexFile(const PString& file) { return file + ".idx"; }
+
+  // called by PStore before key is accessed
+  void LoadKey(int dbno, const PString& key);
+  // called by PStore before key is overwritten
+  void DropKey(int dbno, const PString& key);
+  // called by PStore before db is cleared, -1 for all dbs
+  void DropDB(int dbno);
+
+  // if any key of the command is not loaded yet
+  bool HasUnloadedKey(int dbno, const PCommandInfo* info, const std::vector<PString>& params);
+
+  void OnInfoCommand(UnboundedBuffer& res);
+
+ private:
+  PLoading() {}
+
+  // open addressing of record offsets, with the hash tag of key in high bits
+  struct Table {
+    uint64_t* slots = nullptr;
+    std::size_t mask = 0;
+    std::size_t count = 0;
+    std::vector<uint64_t> owned;  // empty if slots is mapped
+  };
+
+  using KeyOffsets = std::vector<std::vector<std::pair<uint32_t, std::size_t> > >;
+
+  static std::vector<Table> buildIndex(const KeyOffsets& keys);
+  uint64_t* find(int dbno, const PString& key);
+  void erase(int dbno, uint64_t* slot);
+
+  void begin(const PString& file, const char* how, std::chrono::steady_clock::time_point start);
+  bool takeKey(int dbno, const PString& key, std::size_t offset);
+  void step();
+  void finish();
+
+  bool loading_ = false;
+  PDBLoader loader_;
+  std::vector<Table> index_;
+  void* mapped_ = nullptr;  // the saved index attached
+  std::size_t mappedSize_ = 0;
+  std::size_t offset_ = 0;  // the next record to load
+
+  std::size_t totalKeys_ = 0;
+  std::size_t loadedKeys_ = 0;
+  std::size_t onDemandKeys_ = 0;
+  time_t startTime_ = 0;
+  TimerId timer_ = 0;
+};
+
+}  // namespace pikiwidb
+
+#define PLOADING pikiwidb::PLoading::Instance()
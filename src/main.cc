@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+//
+//  main.cc, the server is built as libpikiwidb, shared with the benchmarks
+
+#include <spawn.h>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+
+#include "log.h"
+
+#include "config.h"
+#include "pikiwidb.h"
+
+// 信号处理函数
+static void SignalHandler(int num) {
+  if (g_pikiwidb) {
+    g_pikiwidb->Stop();
+  }
+}
+
+// 初始化信号处理
+static void InitSignal() {
+  struct sigaction sig;
+  ::memset(&sig, 0, sizeof(sig));
+
+  // Set SignalHandler as the handler for SIGINT (interrupt signal)
+  sig.sa_handler = SignalHandler;
+  sigaction(SIGINT, &sig, NULL); // SIGINT->SignalHandler
+
+  // ignore sigpipe
+  sig.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sig, NULL); // SIGPIPE->SIG_IGN
+}
+
+// 初始化日志信息
+static void InitLogs() {
+  logger::Init("logs/pikiwidb_server.log");
+
+#if BUILD_DEBUG
+  spdlog::set_level(spdlog::level::debug);
+#else
+  spdlog::set_level(spdlog::level::info);
+#endif
+}
+
+int main(int ac, char* av[]) {
+  g_pikiwidb = std::make_unique<PikiwiDB>();
+
+  InitSignal();
+  InitLogs();
+  INFO("pikiwidb server start...");
+
+  // Parse and check whether related configuration Settings exist
+  if (!g_pikiwidb->ParseArgs(ac - 1, av + 1)) {
+    PikiwiDB::Usage();
+    return -1;
+  }
+
+  // load the config file if the config file is existed
+  if (!g_pikiwidb->GetConfigName().empty()) {
+    if (!LoadPikiwiDBConfig(g_pikiwidb->GetConfigName().c_str(), pikiwidb::g_config)) {
+      std::cerr << "Load config file [" << g_pikiwidb->GetConfigName() << "] failed!\n";
+      return -1;
+    }
+  }
+
+  /*
+  The current process is turned into a daemon by calling the posix_spawn function. 
+  The newly created child process executes the same code as the parent process and 
+  inherits the parent's properties and environment.
+  @todo 父子进程都接受客户端的连接请求且使用相同的端口号进行监听，不会产生冲突么?
+  */
+  if (pikiwidb::g_config.daemonize) {
+    pid_t pid;
+    ::posix_spawn(&pid, av[0], nullptr, nullptr, av, nullptr);
+  }
+
+  if (g_pikiwidb->Init()) {
+    g_pikiwidb->Run();
+  }
+
+  return 0;
+}
@@ -0,0 +1,246 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "metrics.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+
+#include "command.h"
+#include "command_stats.h"
+#include "common.h"
+#include "event_loop.h"
+#include "log.h"
+#include "unbounded_buffer.h"
+
+namespace pikiwidb {
+
+static const uint64_t kSnapshotMaxAge = 1000;  // ms
+static const char* const kPrefix = "pikiwidb_";
+
+PMetrics& PMetrics::Instance() {
+  static PMetrics metrics;
+
+  return metrics;
+}
+
+bool PMetrics::Start(const PString& ip, int port) {
+  server_ = EventLoop::Self()->ListenHTTP(ip.c_str(), port);
+  if (!server_) {
+    return false;
+  }
+
+  server_->HandleFunc("/metrics", [this](const HttpRequest&, std::shared_ptr<HttpContext>) {
+    std::unique_ptr<HttpResponse> rsp(new HttpResponse);
+    rsp->SetCode(200);
+    rsp->SetStatus("OK");
+    rsp->SetHeader("Content-Type", "text/plain; version=0.0.4");
+    rsp->SetBody(Snapshot());
+    return rsp;
+  });
+
+  INFO("serve metrics on {}:{}", ip, port);
+  return true;
+}
+
+const PString& PMetrics::Snapshot() {
+  const auto now = static_cast<uint64_t>(::Now());
+  if (snapshotTime_ > 0 && now < snapshotTime_ + kSnapshotMaxAge) {
+    return snapshot_;
+  }
+
+  UnboundedBuffer info;
+  g_infoCollector(info);
+  PCommandStats::Instance().OnInfoCommandStats(info);
+  PCommandStats::Instance().OnInfoLatencyStats(info);
+
+  snapshot_ = FromInfo(info.ReadAddr(), info.ReadableSize());
+  snapshotTime_ = now;
+  return snapshot_;
+}
+
+namespace {
+
+// the samples of a metric must be grouped, the lines of INFO are not
+class Families {
+ public:
+  void Add(const PString& name, const PString& labels, const PString& value) {
+    auto it = index_.find(name);
+    if (it == index_.end()) {
+      it = index_.insert({name, families_.size()}).first;
+      families_.push_back({name, {}});
+    }
+
+    auto& samples = families_[it->second].second;
+    samples += kPrefix + name;
+    if (!labels.empty()) {
+      samples += "{" + labels + "}";
+    }
+    samples += " " + value + "\n";
+  }
+
+  PString Text() const {
+    PString text;
+    for (const auto& family : families_) {
+      text += PString("# TYPE ") + kPrefix + family.first + " untyped\n";
+      text += family.second;
+    }
+    return text;
+  }
+
+ private:
+  std::map<PString, std::size_t> index_;
+  std::vector<std::pair<PString, PString>> families_;
+};
+
+bool IsNumber(const PString& value) {
+  if (value.empty()) {
+    return false;
+  }
+
+  char* end = nullptr;
+  strtod(value.c_str(), &end);
+  return *end == '\0';
+}
+
+// [a-zA-Z0-9_] of metric and label names
+PString NameOf(const PString& s) {
+  PString name(s);
+  for (auto& c : name) {
+    if (!isalnum(static_cast<unsigned char>(c))) {
+      c = '_';
+    }
+  }
+  return name;
+}
+
+PString Label(const PString& name, const PString& value) {
+  PString label = NameOf(name) + "=\"";
+  for (char c : value) {
+    if (c == '\\' || c == '"') {
+      label += '\\';
+      label += c;
+    } else if (c == '\n') {
+      label += "\\n";
+    } else {
+      label += c;
+    }
+  }
+  return label + "\"";
+}
+
+// a=1,b=2 of cmdstat_get, db0 or slave0
+std::vector<std::pair<PString, PString>> FieldsOf(const PString& value) {
+  std::vector<std::pair<PString, PString>> fields;
+  std::size_t begin = 0;
+  while (begin < value.size()) {
+    auto end = value.find(',', begin);
+    if (end == PString::npos) {
+      end = value.size();
+    }
+
+    auto field = value.substr(begin, end - begin);
+    auto eq = field.find('=');
+    if (eq != PString::npos) {
+      fields.emplace_back(field.substr(0, eq), field.substr(eq + 1));
+    }
+    begin = end + 1;
+  }
+  return fields;
+}
+
+bool StartsWith(const PString& s, const char* prefix, PString* rest) {
+  const std::size_t len = ::strlen(prefix);
+  if (s.compare(0, len, prefix) != 0) {
+    return false;
+  }
+
+  *rest = s.substr(len);
+  return true;
+}
+
+// dbN or slaveN
+bool IsIndexed(const PString& key, const char* prefix, PString* index) {
+  return StartsWith(key, prefix, index) && !index->empty() &&
+         index->find_first_not_of("0123456789") == PString::npos;
+}
+
+}  // namespace
+
+PString PMetrics::FromInfo(const char* info, std::size_t len) {
+  Families families;
+  const PString text(info, len);
+
+  std::size_t begin = 0;
+  while (begin < text.size()) {
+    auto end = text.find("\r\n", begin);
+    if (end == PString::npos) {
+      end = text.size();
+    }
+
+    const PString line = text.substr(begin, end - begin);
+    begin = end + 2;
+
+    const auto colon = line.find(':');
+    if (line.empty() || line[0] == '#' || colon == PString::npos) {
+      continue;
+    }
+
+    const PString key = line.substr(0, colon);
+    const PString value = line.substr(colon + 1);
+    PString name;
+
+    if (StartsWith(key, "cmdstat_", &name)) {
+      // cmdstat_get:calls=1,usec=2,...
+      for (const auto& field : FieldsOf(value)) {
+        if (IsNumber(field.second)) {
+          families.Add("command_" + NameOf(field.first), Label("cmd", name), field.second);
+        }
+      }
+    } else if (StartsWith(key, "latency_percentiles_usec_", &name)) {
+      // latency_percentiles_usec_get:p50=1.0,p99=2.0,p99.9=3.0
+      for (const auto& field : FieldsOf(value)) {
+        if (field.first.size() > 1 && field.first[0] == 'p' && IsNumber(field.second)) {
+          char quantile[32];
+          snprintf(quantile, sizeof quantile, "%g", atof(field.first.c_str() + 1) / 100);
+          families.Add("command_latency_usec", Label("cmd", name) + "," + Label("quantile", quantile), field.second);
+        }
+      }
+    } else if (IsIndexed(key, "db", &name)) {
+      // db0:keys=1,expires=0
+      for (const auto& field : FieldsOf(value)) {
+        families.Add("db_" + NameOf(field.first), Label("db", name), field.second);
+      }
+    } else if (IsIndexed(key, "slave", &name)) {
+      // slave0:ip=...,port=...,state=online,offset=1,lag_bytes=0,lag_ms=0
+      auto fields = FieldsOf(value);
+      PString labels = Label("slave", name);
+      for (const auto& field : fields) {
+        if (field.first == "ip" || field.first == "port" || field.first == "state") {
+          labels += "," + Label(field.first, field.second);
+        }
+      }
+      for (const auto& field : fields) {
+        if (field.first != "port" && IsNumber(field.second)) {
+          families.Add("slave_" + NameOf(field.first), labels, field.second);
+        }
+      }
+    } else if (IsNumber(value)) {
+      families.Add(NameOf(key), "", value);
+    } else if (key.size() < 6 || key.compare(key.size() - 6, 6, "_human") != 0) {
+      // the state as a label, such as role:master
+      families.Add(NameOf(key), Label(key, value), "1");
+    }
+  }
+
+  return families.Text();
+}
+
+}  // namespace pikiwidb
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <memory>
+
+#include "pstring.h"
+
+namespace pikiwidb {
+
+class HttpServer;
+
+// GET /metrics on metrics-port in the text format of prometheus, converted from
+// INFO all. A scrape reuses the snapshot taken in the last second, so scrapers
+// cost at most one INFO per second to the command loop.
+class PMetrics {
+ public:
+  static PMetrics& Instance();
+
+  PMetrics(const PMetrics&) = delete;
+  void operator=(const PMetrics&) = delete;
+
+  bool Start(const PString& ip, int port);
+
+  const PString& Snapshot();
+
+  // the exposition of the lines of INFO
+  static PString FromInfo(const char* info, std::size_t len);
+
+ private:
+  PMetrics() = default;
+
+  std::shared_ptr<HttpServer> server_;
+  PString snapshot_;
+  uint64_t snapshotTime_ = 0;  // ms
+};
+
+}  // namespace pikiwidb
+
+#define PMETRICS pikiwidb::PMetrics::Instance()
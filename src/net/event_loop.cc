@@ -48,6 +48,10 @@ void EventLoop::Run() {
       }
     }
 
+    for (const auto& f : before_poll_) {
+      f();
+    }
+
     // 调用后端反应器的轮询函数，等待和处理事件
     if (!reactor_->Poll()) {
       ERROR("Reactor poll failed");
@@ -70,6 +74,12 @@ void EventLoop::Stop() {
   notifier_->Notify(); // 通知所有对象
 }
 
+// 注册每次轮询之前执行的函数
+void EventLoop::RunBeforePoll(std::function<void()> f) {
+  assert(InThisLoop());
+  before_poll_.push_back(std::move(f));
+}
+
 // 取消定时器
 std::future<bool> EventLoop::Cancel(TimerId id) {
   if (InThisLoop()) { // 如果当前线程是事件循环所在的线程
@@ -186,7 +196,9 @@ std::shared_ptr<HttpServer> EventLoop::ListenHTTP(const char* ip, int port, Http
 
   // capture server to make it long live with TcpListener
   auto ncb = [server](TcpObject* conn) { server->OnNewConnection(conn); };
-  Listen(ip, port, ncb);
+  if (!Listen(ip, port, ncb)) {
+    return nullptr;
+  }
 
   return server;
 }
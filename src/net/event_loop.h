@@ -54,6 +54,12 @@ class EventLoop {
   template <typename F, typename... Args>
   TimerId ScheduleLater(int delay_ms, F&& f, Args&&... args);
 
+  // Exec func before every reactor poll, must be called in loop thread.
+  // Replies are only put into the output buffers during one poll, so funcs
+  // here run before the results of the last loop reach the peers.
+  // 每次轮询之前执行的函数，必须在事件循环线程中调用
+  void RunBeforePoll(std::function<void()> f);
+
   // cancel timer
   // 取消定时器
   std::future<bool> Cancel(TimerId id);
@@ -72,7 +78,7 @@ class EventLoop {
   // TCP client
   std::shared_ptr<TcpObject> Connect(const char* ip, int port, NewTcpConnCallback ccb, TcpConnFailCallback fcb);
 
-  // HTTP server
+  // HTTP server, null if it can't listen
   std::shared_ptr<HttpServer> ListenHTTP(const char* ip, int port,
                                          HttpServer::OnNewClient cb = HttpServer::OnNewClient());
 
@@ -104,6 +110,7 @@ class EventLoop {
 
   std::mutex task_mutex_; // 任务互斥锁
   std::vector<std::function<void()>> tasks_; // 待执行的任务列表
+  std::vector<std::function<void()>> before_poll_; // 每次轮询之前执行的函数
 
   std::string name_;  // for top command 事件循环的名称
   std::atomic<bool> running_{true}; // 事件循环是否正在运行的标记
@@ -201,6 +201,36 @@ bool TcpObject::SendPacket(const evbuffer_iovec* iovecs, int nvecs) {
   return true;
 }
 
+bool TcpObject::SendPacket(const std::shared_ptr<const std::string>& data) {
+  if (state_ != State::kConnected) {
+    ERROR("send tcp data in wrong state {}", static_cast<int>(state_));
+    return false;
+  }
+
+  if (!data || data->empty()) {
+    return true;
+  }
+
+  assert(loop_->InThisLoop());
+  // the buffer holds a reference until the data is written
+  auto holder = new std::shared_ptr<const std::string>(data);
+  auto cleanup = [](const void*, size_t, void* arg) { delete static_cast<std::shared_ptr<const std::string>*>(arg); };
+  auto output = bufferevent_get_output(bev_);
+  if (evbuffer_add_reference(output, data->data(), data->size(), cleanup, holder) != 0) {
+    delete holder;
+    return false;
+  }
+  return true;
+}
+
+std::size_t TcpObject::PendingSize() const {
+  if (!bev_) {
+    return 0;
+  }
+
+  return evbuffer_get_length(bufferevent_get_output(bev_));
+}
+
 // 处理连接失败
 void TcpObject::HandleConnectFailed() {
   assert(loop_->InThisLoop());
@@ -270,6 +300,17 @@ void TcpObject::SetNodelay(bool enable) {
   }
 }
 
+void TcpObject::PauseRead(bool pause) {
+  assert(loop_->InThisLoop());
+  if (bev_) {
+    if (pause) {
+      bufferevent_disable(bev_, EV_READ);
+    } else {
+      bufferevent_enable(bev_, EV_READ);
+    }
+  }
+}
+
 // 检测是否超过了空闲超时时间
 bool TcpObject::CheckIdleTimeout() const {
   using namespace std::chrono;
@@ -41,6 +41,8 @@ class TcpObject : public EventObject {
   bool SendPacket(const std::string&); // 发送数据包（字符串）
   bool SendPacket(const void*, size_t); // 发送数据包（二进制形式）
   bool SendPacket(const evbuffer_iovec* iovecs, int nvecs); // 发送数据包（iovec形式）
+  bool SendPacket(const std::shared_ptr<const std::string>& data); // 发送共享的数据包，不拷贝，引用计数直到发送完成
+  std::size_t PendingSize() const; // 输出缓存区中尚未发送的字节数
 
   void SetNewConnCallback(NewTcpConnCallback cb) { on_new_conn_ = std::move(cb); } // 设置新连接的回调函数
   void SetOnDisconnect(TcpDisconnectCallback cb) { on_disconnect_ = std::move(cb); } // 设置断开连接回调函数
@@ -71,6 +73,9 @@ class TcpObject : public EventObject {
   // Nagle algorithm
   void SetNodelay(bool enable);  // 设置Nagle算法
 
+  // stop reading the socket until resumed, the peer is slowed down by tcp
+  void PauseRead(bool pause);  // 暂停或恢复读取
+
  private:
   // check if idle timeout
   bool CheckIdleTimeout() const; // 检查是否达到空闲超时时间
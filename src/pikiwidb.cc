@@ -8,21 +8,24 @@
 //
 //  PikiwiDB.cc
 
-#include <spawn.h>
 #include <sys/wait.h>
 #include <unistd.h>
-#include <csignal>
 #include <iostream>
 #include <thread>
 
 #include "log.h"
 
+#include "aof.h"
 #include "client.h"
+#include "cluster.h"
 #include "command.h"
 #include "store.h"
 
 #include "config.h"
+#include "cycle_clock.h"
 #include "db.h"
+#include "loading.h"
+#include "metrics.h"
 #include "pubsub.h"
 #include "slow_log.h"
 
@@ -31,27 +34,6 @@
 
 std::unique_ptr<PikiwiDB> g_pikiwidb;
 
-// 信号处理函数
-static void SignalHandler(int num) {
-  if (g_pikiwidb) {
-    g_pikiwidb->Stop();
-  }
-}
-
-// 初始化信号处理
-static void InitSignal() {
-  struct sigaction sig;
-  ::memset(&sig, 0, sizeof(sig));
-
-  // Set SignalHandler as the handler for SIGINT (interrupt signal)
-  sig.sa_handler = SignalHandler;
-  sigaction(SIGINT, &sig, NULL); // SIGINT->SignalHandler
-
-  // ignore sigpipe
-  sig.sa_handler = SIG_IGN;
-  sigaction(SIGPIPE, &sig, NULL); // SIGPIPE->SIG_IGN
-}
-
 // 生成pikiwidb实例唯一标识runid的长度
 const unsigned PikiwiDB::kRunidSize = 40;
 
@@ -59,7 +41,7 @@ PikiwiDB::PikiwiDB() : port_(0), masterPort_(0) { cmdTableManager_ = std::make_u
 
 PikiwiDB::~PikiwiDB() {}
 
-static void Usage() {
+void PikiwiDB::Usage() {
   std::cerr << "Usage:  ./pikiwidb-server [/path/to/redis.conf] [options]\n\
         ./pikiwidb-server -v or --version\n\
         ./pikiwidb-server -h or --help\n\
@@ -116,36 +98,63 @@ bool PikiwiDB::ParseArgs(int ac, char* av[]) {
 static void PdbCron() {
   using namespace pikiwidb;
 
-  if (g_qdbPid != -1) {
+  if (IsBgsaveInProgress()) {
     return;
   }
 
   // 如果当前时间大于上次保存时间加上配置的保存时间，并且 PStore 的 dirty_ 大于等于保存更改的配置值
   if (Now() > (g_lastPDBSave + unsigned(g_config.saveseconds)) * 1000UL && PStore::dirty_ >= g_config.savechanges) {
-    int ret = fork();
-    if (ret == 0) {
-      {
-        PDBSaver qdb;
-        qdb.Save(g_config.rdbfullname.c_str());
-        std::cerr << "ServerCron child save rdb done, exiting child\n";
-      }  //  make qdb to be destructed before exit
-      _exit(0);
-    } else if (ret == -1) {
-      ERROR("fork qdb save process failed");
-    } else {
-      g_qdbPid = ret;
+    if (StartBgsave()) {
+      INFO("ServerCron save rdb file {}", g_config.rdbfullname);
     }
-
-    INFO("ServerCron save rdb file {}", g_config.rdbfullname);
   }
 }
 
 // 从磁盘加载db
-static void LoadDBFromDisk() {
+static bool LoadDBFromDisk() {
   using namespace pikiwidb;
 
+  // aof has the newer data if both exist, the rdb is only for no aof:
+  // a failed load may leave part of the aof in memory
+  if (g_config.appendonly && PAof::Exists(g_config.appenddir, g_config.appendfilename)) {
+    if (!PAOF.Load(g_config.appenddir, g_config.appendfilename)) {
+      ERROR("load aof {} failed", g_config.appenddir);
+      return false;
+    }
+    return true;
+  }
+
+  // the index saved at shutdown saves the scan of rdb
+  if (g_config.warmrestart && PLOADING.Attach(g_config.rdbfullname)) {
+    return true;
+  }
+
+  // serve clients while loading, an rdb failing the scan is loaded at once
+  if (g_config.asyncloading && PLOADING.Start(g_config.rdbfullname)) {
+    return true;
+  }
+
   PDBLoader loader;
   loader.Load(g_config.rdbfullname.c_str());
+  return true;
+}
+
+// a slave continues the replication from the offset of the rdb
+static void LoadReplInfo() {
+  using namespace pikiwidb;
+
+  std::map<PString, PString> aux;
+  if (PDBLoader().LoadAux(g_config.rdbfullname.c_str(), aux) != 0) {
+    return;
+  }
+
+  long offset = 0;
+  const PString& replid = aux["repl-id"];
+  const PString& val = aux["repl-offset"];
+  if (!replid.empty() && TryStr2Long(val.c_str(), val.size(), offset)) {
+    INFO("rdb replication id {}, offset {}", replid, offset);
+    PREPL.SetCachedMaster(replid, offset);
+  }
 }
 
 // 检查执行db保存的子进程的状态
@@ -168,12 +177,8 @@ static void CheckChild() {
     }
 
     if (pid == g_qdbPid) { // 如果子进程的进程id等于全局变量g_qdbPid（db保存的子进程）
-      PDBSaver::SaveDoneHandler(exit, signal); // 调用 PDBSaver 类的 SaveDoneHandler 方法，处理保存完成的操作
-      if (PREPL.IsBgsaving()) { // 如果 PREPL 对象正在进行后台保存操作
-        PREPL.OnRdbSaveDone(); // 调用 PREPL 类的 OnRdbSaveDone 方法，处理 RDB 文件保存完成的操作
-      } else {
-        PREPL.TryBgsave(); // 调用 PREPL 类的 TryBgsave 方法，尝试进行后台保存操作
-      }
+      // 处理保存完成的操作，并通知 PREPL 发送 RDB 文件或尝试进行后台保存
+      PDBSaver::SaveDoneHandler(exit, signal);
     } else { // 如果子进程的进程 ID 不等于全局变量 g_qdbPid
       ERROR("{} is not rdb process", pid);
       assert(!!!"Is there any back process except rdb?");
@@ -231,6 +236,12 @@ bool PikiwiDB::Init() {
     return false;
   }
 
+  if (g_config.metricsport > 0 && !PMETRICS.Start(g_config.ip, g_config.metricsport)) {
+    ERROR("can not bind metrics on port {}", g_config.metricsport);
+    return false;
+  }
+
+  CycleClock::Init();
   PCommandTable::Init();
   PCommandTable::AliasCommand(g_config.aliases);
   PSTORE.Init(g_config.databases);
@@ -241,20 +252,41 @@ bool PikiwiDB::Init() {
   PPubsub::Instance().InitPubsubTimer();
 
   // Only if there is no backend, load rdb
-  if (g_config.backend == pikiwidb::BackEndNone) {
-    LoadDBFromDisk();
+  if (g_config.backend == pikiwidb::BackEndNone && !LoadDBFromDisk()) {
+    return false;
   }
 
+  // validated by the config check already
+  PAOF.SetFsyncPolicy(g_config.appendfsync);
+  if (g_config.appendonly && !PAOF.Open(g_config.appenddir, g_config.appendfilename)) {
+    return false;
+  }
+  event_loop_.RunBeforePoll([]() {
+    PAOF.Flush();
+    PREPL.Flush();
+  });
+
   PSlowLog::Instance().SetThreshold(g_config.slowlogtime);
   PSlowLog::Instance().SetLogLimit(static_cast<std::size_t>(g_config.slowlogmaxlen));
 
   event_loop_.ScheduleRepeatedly(1000 / pikiwidb::g_config.hz, PdbCron);
   event_loop_.ScheduleRepeatedly(1000, &PReplication::Cron, &PREPL);
+  event_loop_.ScheduleRepeatedly(10, &PReplication::LoopCheckWaiters, &PREPL);
+  event_loop_.ScheduleRepeatedly(1000, &PAof::Cron, &PAOF);
   event_loop_.ScheduleRepeatedly(1, CheckChild);
 
+  if (g_config.clusterenabled && !PCLUSTER.Init(&event_loop_)) {
+    return false;
+  }
+
   // master ip
-  if (!g_config.masterIp.empty()) {
+  if (!g_config.masterIp.empty() && !g_config.clusterenabled) {
     PREPL.SetMasterAddr(g_config.masterIp.c_str(), g_config.masterPort);
+
+    // the aof may have newer data than the offset of rdb
+    if (g_config.backend == pikiwidb::BackEndNone && !g_config.appendonly) {
+      LoadReplInfo();
+    }
   }
 
   // output logo to console
@@ -279,6 +311,7 @@ void PikiwiDB::Run() {
 
 // 回收资源
 void PikiwiDB::Recycle() {
+  PAOF.Close();
   std::cerr << "PikiwiDB::recycle: server is exiting.. BYE BYE\n";
 }
 
@@ -287,53 +320,3 @@ void PikiwiDB::Stop() { event_loop_.Stop(); }
 
 // 获取cmd表管理器
 std::unique_ptr<pikiwidb::CmdTableManager>& PikiwiDB::CmdTableManager() { return cmdTableManager_; }
-
-// 初始化日志信息
-static void InitLogs() {
-  logger::Init("logs/pikiwidb_server.log");
-
-#if BUILD_DEBUG
-  spdlog::set_level(spdlog::level::debug);
-#else
-  spdlog::set_level(spdlog::level::info);
-#endif
-}
-
-int main(int ac, char* av[]) {
-  g_pikiwidb = std::make_unique<PikiwiDB>();
-
-  InitSignal();
-  InitLogs();
-  INFO("pikiwidb server start...");
-
-  // Parse and check whether related configuration Settings exist
-  if (!g_pikiwidb->ParseArgs(ac - 1, av + 1)) {
-    Usage();
-    return -1;
-  }
-
-  // load the config file if the config file is existed
-  if (!g_pikiwidb->GetConfigName().empty()) {
-    if (!LoadPikiwiDBConfig(g_pikiwidb->GetConfigName().c_str(), pikiwidb::g_config)) {
-      std::cerr << "Load config file [" << g_pikiwidb->GetConfigName() << "] failed!\n";
-      return -1;
-    }
-  }
-
-  /*
-  The current process is turned into a daemon by calling the posix_spawn function. 
-  The newly created child process executes the same code as the parent process and 
-  inherits the parent's properties and environment.
-  @todo 父子进程都接受客户端的连接请求且使用相同的端口号进行监听，不会产生冲突么?
-  */
-  if (pikiwidb::g_config.daemonize) {
-    pid_t pid;
-    ::posix_spawn(&pid, av[0], nullptr, nullptr, av, nullptr);
-  }
-
-  if (g_pikiwidb->Init()) {
-    g_pikiwidb->Run();
-  }
-
-  return 0;
-}
@@ -19,6 +19,8 @@ class PikiwiDB final {
 
   // 解析输入参数
   bool ParseArgs(int ac, char* av[]);
+  // 打印用法
+  static void Usage();
   // 获取配置文件名
   const pikiwidb::PString& GetConfigName() const { return cfgFile_; }
 
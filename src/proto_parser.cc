@@ -55,7 +55,12 @@ PParseResult PProtoParser::parseMulti(const char*& ptr, const char* end, int& re
 
   ++ptr;
 
-  return GetIntUntilCRLF(ptr, end - ptr, result);
+  const auto ret = GetIntUntilCRLF(ptr, end - ptr, result);
+  if (ret != PParseResult::ok) {
+    --ptr;
+  }
+
+  return ret;
 }
 
 PParseResult PProtoParser::parseStrlist(const char*& ptr, const char* end, std::vector<PString>& results) {
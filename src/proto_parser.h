@@ -7,6 +7,7 @@
 
 #pragma once
 
+#include <utility>
 #include <vector>
 
 #include "common.h"
@@ -21,6 +22,7 @@ class PProtoParser {
 
   const std::vector<PString>& GetParams() const { return params_; }
   void SetParams(std::vector<PString> p) { params_ = std::move(p); }
+  std::vector<PString> TakeParams() { return std::exchange(params_, {}); }
 
   bool IsInitialState() const { return multi_ == -1; }
 
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "repl_decoder.h"
+
+#include "compress.h"
+
+namespace pikiwidb {
+
+PReplDecoder::PReplDecoder(std::function<void()> notify) : notify_(std::move(notify)) {
+  thread_ = std::thread([this]() { this->decodeRoutine(); });
+}
+
+PReplDecoder::~PReplDecoder() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stop_ = true;
+  }
+  cond_.notify_one();
+
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+}
+
+void PReplDecoder::Feed(const char* data, std::size_t len, bool framed) {
+  pending_ += len;
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    input_.emplace_back(PString(data, len), framed);
+  }
+  cond_.notify_one();
+}
+
+bool PReplDecoder::Take(std::vector<Batch>& batches) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  for (auto& batch : output_) {
+    pending_ -= batch.raw.size();
+  }
+  batches.swap(output_);
+  output_.clear();
+  return !failed_;
+}
+
+void PReplDecoder::decodeRoutine() {
+  std::vector<std::pair<PString, bool>> input;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> guard(mutex_);
+      cond_.wait(guard, [this]() -> bool { return this->stop_ || !this->input_.empty(); });
+      if (stop_) {
+        return;
+      }
+      input.swap(input_);
+    }
+
+    Batch batch;
+    bool ok = true;
+    for (const auto& [data, framed] : input) {
+      pending_ -= data.size();
+      ok = ok && decode(data, framed, batch);
+    }
+    input.clear();
+
+    // the loop is notified only for the first batch, it takes all at once
+    bool notify = false;
+    if (!batch.cmds.empty() || !ok) {
+      std::lock_guard<std::mutex> guard(mutex_);
+      notify = output_.empty();
+      failed_ = !ok;
+      pending_ += batch.raw.size();
+      output_.push_back(std::move(batch));
+    }
+
+    if (notify) {
+      notify_();
+    }
+
+    if (!ok) {
+      return;  // the link is to be closed
+    }
+  }
+}
+
+bool PReplDecoder::decode(const PString& data, bool framed, Batch& batch) {
+  if (framed) {
+    frames_.append(data);
+    const std::size_t origin = buf_.size();
+    const long consumed = DecodeFrames(frames_.data(), frames_.size(), buf_);
+    if (consumed < 0) {
+      return false;
+    }
+
+    frames_.erase(0, static_cast<std::size_t>(consumed));
+    batch.compressedBytes += static_cast<uint64_t>(consumed);
+    batch.rawBytes += buf_.size() - origin;
+  } else {
+    buf_.append(data);
+  }
+
+  // the parser resumes at parsed_ for the partial command
+  std::size_t start = 0;
+  const char* ptr = buf_.data() + parsed_;
+  const char* const end = buf_.data() + buf_.size();
+  while (ptr < end) {
+    auto ret = parser_.ParseRequest(ptr, end);
+    if (ret == PParseResult::error) {
+      return false;
+    }
+    if (ret != PParseResult::ok) {
+      break;
+    }
+
+    const auto len = static_cast<std::size_t>(ptr - buf_.data()) - start;
+    batch.cmds.push_back(parser_.TakeParams());
+    batch.lens.push_back(len);
+    start += len;
+    parser_.Reset();
+  }
+
+  parsed_ = static_cast<std::size_t>(ptr - buf_.data()) - start;
+  batch.raw.append(buf_, 0, start);
+  buf_.erase(0, start);
+  return true;
+}
+
+}  // namespace pikiwidb
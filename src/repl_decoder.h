@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "proto_parser.h"
+#include "pstring.h"
+
+namespace pikiwidb {
+
+// stop reading from master when so many bytes are not applied yet
+const std::size_t kMaxDecoderPending = 64 * 1024 * 1024;
+
+// Decodes the stream from master in a thread: inflates the frames and parses
+// the commands, so the event loop only executes them, in the stream order.
+class PReplDecoder {
+ public:
+  struct Batch {
+    std::vector<std::vector<PString>> cmds;
+    std::vector<std::size_t> lens;  // the raw length of each command
+    PString raw;                    // the commands as received, after inflated
+    uint64_t compressedBytes = 0;   // the frames decoded for the batch
+    uint64_t rawBytes = 0;
+  };
+
+  // notify is called in the decoding thread when the decoded become ready
+  explicit PReplDecoder(std::function<void()> notify);
+  ~PReplDecoder();
+
+  PReplDecoder(const PReplDecoder&) = delete;
+  void operator=(const PReplDecoder&) = delete;
+
+  // data is in frames if framed, it's copied
+  void Feed(const char* data, std::size_t len, bool framed);
+  // move out the batches decoded, false if the stream is corrupted
+  bool Take(std::vector<Batch>& batches);
+  // the bytes fed or decoded but not taken
+  std::size_t PendingBytes() const { return pending_; }
+
+ private:
+  void decodeRoutine();
+  bool decode(const PString& data, bool framed, Batch& batch);
+
+  std::function<void()> notify_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  bool stop_ = false;
+  bool failed_ = false;
+  std::vector<std::pair<PString, bool>> input_;
+  std::vector<Batch> output_;
+  std::atomic<std::size_t> pending_{0};
+
+  // used by the decoding thread only
+  PString frames_;          // the partial frame
+  PString buf_;             // the partial command
+  std::size_t parsed_ = 0;  // bytes of buf_ consumed by parser_
+  PProtoParser parser_;
+};
+
+}  // namespace pikiwidb
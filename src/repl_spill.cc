@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "repl_spill.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+
+#include "log.h"
+
+namespace pikiwidb {
+
+bool PSpillFile::Open(const PString& name) {
+  Close();
+
+  fd_ = ::open(name.c_str(), O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0644);
+  if (fd_ == -1) {
+    ERROR("open repl spill file {} failed: {}", name, strerror(errno));
+    return false;
+  }
+
+  name_ = name;
+  size_ = 0;
+  return true;
+}
+
+bool PSpillFile::Append(const char* data, std::size_t len) {
+  while (len > 0) {
+    ssize_t n = ::write(fd_, data, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+
+      ERROR("write repl spill file {} failed: {}", name_, strerror(errno));
+      return false;
+    }
+
+    data += n;
+    len -= static_cast<std::size_t>(n);
+    size_ += static_cast<uint64_t>(n);
+  }
+
+  return true;
+}
+
+bool PSpillFile::Read(uint64_t off, std::size_t len, PString& out) const {
+  out.resize(len);
+  std::size_t got = 0;
+  while (got < len) {
+    ssize_t n = ::pread(fd_, &out[got], len - got, static_cast<off_t>(off + got));
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (n <= 0) {
+      ERROR("read repl spill file {} failed: {}", name_, n < 0 ? strerror(errno) : "eof");
+      return false;
+    }
+
+    got += static_cast<std::size_t>(n);
+  }
+
+  return true;
+}
+
+void PSpillFile::Close() {
+  if (fd_ == -1) {
+    return;
+  }
+
+  ::close(fd_);
+  ::unlink(name_.c_str());
+  fd_ = -1;
+  size_ = 0;
+}
+
+}  // namespace pikiwidb
@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+#include "pstring.h"
+
+namespace pikiwidb {
+
+// An append only file of the stream buffered during full sync beyond
+// repl-buffer-memory, it's read back in blocks when sent to slaves.
+class PSpillFile {
+ public:
+  PSpillFile() = default;
+  ~PSpillFile() { Close(); }
+
+  PSpillFile(const PSpillFile&) = delete;
+  void operator=(const PSpillFile&) = delete;
+
+  // the file is truncated
+  bool Open(const PString& name);
+  bool IsOpen() const { return fd_ != -1; }
+  bool Append(const char* data, std::size_t len);
+  // read at most len bytes from off
+  bool Read(uint64_t off, std::size_t len, PString& out) const;
+  uint64_t Size() const { return size_; }
+  // close and remove the file
+  void Close();
+
+ private:
+  PString name_;
+  int fd_ = -1;
+  uint64_t size_ = 0;
+};
+
+}  // namespace pikiwidb
@@ -8,7 +8,10 @@
 #include "replication.h"
 
 #include <unistd.h>
+#include <algorithm>
+#include <cstring>
 #include <iostream>  // the child process use stdout for log
+#include <limits>
 #include <sstream>
 
 #include "client.h"
@@ -16,25 +19,48 @@
 #include "config.h"
 #include "db.h"
 #include "event_loop.h"
+#include "helper.h"
+#include "loading.h"
 #include "log.h"
 #include "net/util.h"
 #include "pikiwidb.h"
+#include "snapshot.h"
 
 namespace pikiwidb {
 
-
+// the length of eof mark of diskless sync, and of replication id
+static const int kEofMarkSize = 40;
+// stop visiting buckets while a slave has so many bytes not sent
+static const std::size_t kMaxSlavePending = 16 * 1024 * 1024;
+// the rdb is sent in blocks, each is compressed once for slaves with the same codec
+static const std::size_t kRdbBlockSize = 1024 * 1024;
+// the stream is compressed in event loop, so the fastest level of zstd
+static const int kStreamZstdLevel = 1;
+// REPLCONF HEARTBEAT with the clock of master, slaves know how stale they are
+static const int64_t kHeartbeatInterval = 100;
 
 PReplication& PReplication::Instance() {
   static PReplication rep;
   return rep;
 }
 
-PReplication::PReplication() {}
+PReplication::PReplication() {
+  char replid[kEofMarkSize + 1] = "";
+  getRandomHexChars(replid, kEofMarkSize);
+  replid_.assign(replid, kEofMarkSize);
+}
 
 bool PReplication::IsBgsaving() const { return bgsaving_; }
 
 void PReplication::AddSlave(pikiwidb::PClient* cli) {
   slaves_.push_back(std::static_pointer_cast<PClient>(cli->shared_from_this()));
+
+  // the stream is kept since the first slave
+  if (!backlogActive_) {
+    backlogActive_ = true;
+    backlogHistlen_ = 0;
+    backlogOff_ = offset_ + 1;
+  }
 }
 
 bool PReplication::HasAnyWaitingBgsave() const {
@@ -49,41 +75,60 @@ bool PReplication::HasAnyWaitingBgsave() const {
 }
 
 void PReplication::OnRdbSaveDone() {
-  bgsaving_ = false;
+  if (diskless_) {
+    return;  // the bgsave not for replication is done
+  }
 
-  InputMemoryFile rdb;
+  bgsaving_ = false;
 
   // send rdb to slaves that wait rdb end, set state
+  std::vector<std::shared_ptr<PClient> > ready;
   for (auto& wptr : slaves_) {
     auto cli = wptr.lock();
-    if (!cli) {
-      continue;
-    }
-
-    if (cli->GetSlaveInfo()->state == PSlaveState_wait_bgsave_end) {
+    if (cli && cli->GetSlaveInfo()->state == PSlaveState_wait_bgsave_end) {
       cli->GetSlaveInfo()->state = PSlaveState_online;
+      ready.push_back(cli);
+    }
+  }
 
-      if (!rdb.IsOpen() && !rdb.Open(g_config.rdbfullname.c_str())) {
-        ERROR("can not open rdb when replication\n");
-        return;  // fatal error;
-      }
+  if (!ready.empty()) {
+    InputMemoryFile rdb;
+    if (!rdb.Open(g_config.rdbfullname.c_str())) {
+      ERROR("can not open rdb when replication\n");
+      return;  // fatal error;
+    }
 
-      std::size_t size = std::size_t(-1);
-      const char* data = rdb.Read(size);
+    std::size_t size = std::size_t(-1);
+    const char* data = rdb.Read(size);
 
-      // $file_len + filedata
-      char tmp[32];
-      int n = snprintf(tmp, sizeof tmp - 1, "$%ld\r\n", (long)size);
+    // $file_len + filedata
+    char tmp[32];
+    int n = snprintf(tmp, sizeof tmp - 1, "$%ld\r\n", (long)size);
+    for (const auto& cli : ready) {
+      sendToSlave(cli.get(), tmp, n);
+    }
 
-      cli->SendPacket(tmp, n);
-      cli->SendPacket(data, size);
-      cli->SendPacket(buffer_);
+    for (std::size_t off = 0; off < size; off += kRdbBlockSize) {
+      auto block = std::make_shared<const PString>(data + off, std::min(kRdbBlockSize, size - off));
+      for (const auto& cli : ready) {
+        sendToSlave(cli.get(), block);
+      }
+    }
 
-      INFO("Send to slave rdb {}, buffer {}", size, buffer_.ReadableSize());
+    for (const auto& cli : ready) {
+      sendBuffered(cli.get());
     }
+
+    INFO("Send to {} slaves rdb {}, buffer {} bytes, spilled {} bytes", ready.size(), size, bufferBytes_,
+         spill_.Size() - spillStart_);
   }
 
-  buffer_.Clear();
+  buffer_.clear();
+  bufferBytes_ = 0;
+  drainSpill();
+
+  // slaves may arrive during the bgsave
+  TryBgsave();
 }
 
 void PReplication::TryBgsave() {
@@ -92,30 +137,57 @@ void PReplication::TryBgsave() {
   }
 
   if (!HasAnyWaitingBgsave()) {
+    waitSince_ = 0;
     return;
   }
 
-  int ret = fork();
-  if (ret == 0) {
-    {
-      PDBSaver qdb;
-      qdb.Save(g_config.rdbfullname.c_str());
-      DEBUG("PReplication save rdb done, exiting child");
+  if (g_config.repldisklesssync) {
+    // wait for more slaves, they share one stream
+    time_t now = ::time(nullptr);
+    if (waitSince_ == 0) {
+      waitSince_ = now;
+    }
+    if (now - waitSince_ < g_config.repldisklesssyncdelay) {
+      return;
+    }
+
+    // the snapshot is taken by bgsave or aof rewrite, retried by Cron
+    if (PSNAPSHOT.IsRunning() || PLOADING.IsLoading()) {
+      return;
     }
-    _exit(0);
-  } else if (ret == -1) {
+
+    waitSince_ = 0;
+    Flush();
+    if (!startDiskless()) {
+      ERROR("PReplication diskless sync FATAL ERROR");
+      onStartBgsave(false);
+    }
+    return;
+  }
+
+  // wait for the bgsave not for replication or async loading, retried when it is done
+  if (IsBgsaveInProgress() || PLOADING.IsLoading()) {
+    return;
+  }
+
+  // the stream before the snapshot is not in buffer_
+  Flush();
+  if (!StartBgsave()) {
     ERROR("PReplication save rdb FATAL ERROR");
     onStartBgsave(false);
   } else {
     INFO("PReplication save rdb START");
-    g_qdbPid = ret;
     onStartBgsave(true);
   }
 }
 
 void PReplication::onStartBgsave(bool succ) {
-  buffer_.Clear();
+  buffer_.clear();
+  bufferBytes_ = 0;
+  spillStart_ = spill_.Size();
+  bufferAborted_ = false;
   bgsaving_ = succ;
+  seldb_ = -1;  // the buffer_ starts with select
 
   for (auto& c : slaves_) {
     auto cli = c.lock();
@@ -128,6 +200,17 @@ void PReplication::onStartBgsave(bool succ) {
       if (succ) {
         INFO("onStartBgsave set cli wait bgsave end {}", cli->GetName());
         cli->GetSlaveInfo()->state = PSlaveState_wait_bgsave_end;
+        if (cli->GetSlaveInfo()->psync) {
+          // +FULLRESYNC <replid> <offset> [codec], the data after it is in frames of codec
+          auto slave = cli->GetSlaveInfo();
+          slave->codec = negotiateCodec(slave);
+
+          char fullresync[128];
+          int n = snprintf(fullresync, sizeof fullresync, "+FULLRESYNC %s %ld%s%s\r\n", replid_.c_str(),
+                           (long)offset_, slave->codec == PCodec_none ? "" : " ",
+                           slave->codec == PCodec_none ? "" : CodecName(slave->codec));
+          cli->SendPacket(fullresync, n);
+        }
       } else {
         cli->Close();  // release slave
       }
@@ -135,31 +218,477 @@ void PReplication::onStartBgsave(bool succ) {
   }
 }
 
+bool PReplication::startDiskless() {
+  auto sink = [this](const char* data, std::size_t len) {
+    auto block = std::make_shared<const PString>(data, len);
+    for (auto& wptr : slaves_) {
+      auto cli = wptr.lock();
+      if (cli && cli->GetSlaveInfo()->state == PSlaveState_wait_bgsave_end) {
+        sendToSlave(cli.get(), block);
+      }
+    }
+  };
+
+  // flow control, the keys are not encoded faster than the slowest slave receives
+  auto pause = [this]() {
+    for (auto& wptr : slaves_) {
+      auto cli = wptr.lock();
+      if (cli && cli->GetSlaveInfo()->state == PSlaveState_wait_bgsave_end && cli->PendingSize() > kMaxSlavePending) {
+        return true;
+      }
+    }
+    return false;
+  };
+
+  auto done = [this](bool succ) { onDisklessDone(succ); };
+  if (!PSNAPSHOT.Start(sink, pause, done)) {
+    return false;
+  }
+
+  char mark[kEofMarkSize + 1] = "";
+  getRandomHexChars(mark, kEofMarkSize);
+  eofMark_.assign(mark, kEofMarkSize);
+
+  diskless_ = true;
+  onStartBgsave(true);
+
+  // $EOF:<mark> tells slave to read until the mark
+  PString header = "$EOF:" + eofMark_ + "\r\n";
+  for (auto& wptr : slaves_) {
+    auto cli = wptr.lock();
+    if (cli && cli->GetSlaveInfo()->state == PSlaveState_wait_bgsave_end) {
+      sendToSlave(cli.get(), header.data(), header.size());
+    }
+  }
+
+  INFO("PReplication diskless sync START");
+  return true;
+}
+
+void PReplication::onDisklessDone(bool succ) {
+  for (auto& wptr : slaves_) {
+    auto cli = wptr.lock();
+    if (!cli || cli->GetSlaveInfo()->state != PSlaveState_wait_bgsave_end) {
+      continue;
+    }
+
+    if (succ) {
+      cli->GetSlaveInfo()->state = PSlaveState_online;
+      sendToSlave(cli.get(), eofMark_.data(), eofMark_.size());
+      sendBuffered(cli.get());
+      INFO("Diskless sync to slave {} done, buffer {} bytes, spilled {} bytes", cli->GetName(), bufferBytes_,
+           spill_.Size() - spillStart_);
+    } else {
+      cli->Close();
+    }
+  }
+
+  buffer_.clear();
+  bufferBytes_ = 0;
+  bgsaving_ = false;
+  diskless_ = false;
+  drainSpill();
+
+  // slaves may arrive during the transfer
+  TryBgsave();
+}
+
+// append to the stream block of this loop iteration
+struct StreamWriter {
+  PString& out;
+  void Write(const void* data, std::size_t len) { out.append(static_cast<const char*>(data), len); }
+};
+
 void PReplication::SendToSlaves(const std::vector<PString>& params) {
-  if (IsBgsaving()) {  // During the execution of RDB, there are cache changes.
-    SaveCommand(params, buffer_);
+  // never had a slave, or this is a slave forwarding the stream of master by FeedStream
+  if (!backlogActive_ || masterInfo_.addr.IsValid()) {
+    return;
+  }
+
+  StreamWriter writer{pending_};
+  if (PSTORE.GetDB() != seldb_) {
+    seldb_ = PSTORE.GetDB();
+    SaveCommand({"select", std::to_string(seldb_)}, writer);
+  }
+
+  // the request of client is forwarded as it is, unless the command is rewritten
+  const char* raw = nullptr;
+  std::size_t rawLen = 0;
+  PClient* cli = PClient::Current();
+  if (cli && cli->GetRawRequest(params, raw, rawLen)) {
+    pending_.append(raw, rawLen);
+  } else {
+    SaveCommand(params, writer);
+  }
+}
+
+void PReplication::FeedStream(const char* data, std::size_t len) {
+  masterInfo_.offset += static_cast<int64_t>(len);
+  if (backlogActive_) {
+    pending_.append(data, len);
+  } else {
+    offset_ += static_cast<int64_t>(len);
+  }
+}
+
+void PReplication::Flush() {
+  // the slaves ack at once for the clients of WAIT
+  if (getAck_) {
+    getAck_ = false;
+    StreamWriter writer{pending_};
+    SaveCommand({"replconf", "getack", "*"}, writer);
+  }
+
+  // between commands, a slave forwards the heartbeats of master instead
+  if (backlogActive_ && !masterInfo_.addr.IsValid() && !slaves_.empty()) {
+    const auto now = ::Now();
+    if (now - lastHeartbeat_ >= kHeartbeatInterval) {
+      lastHeartbeat_ = now;
+      StreamWriter writer{pending_};
+      SaveCommand({"replconf", "heartbeat", std::to_string(now)}, writer);
+    }
+  }
+
+  if (pending_.empty()) {
+    drainSpill();
+    return;
+  }
+
+  // the block is shared by backlog, buffer_ and the output buffers of slaves
+  auto block = std::make_shared<const PString>(std::move(pending_));
+  pending_.clear();
+
+  feedBacklog(block);
+
+  // During the execution of RDB, there are cache changes, online slaves still get them.
+  bufferBlock(block);
+
+  for (const auto& wptr : slaves_) {
+    auto cli = wptr.lock();
+    if (cli && cli->GetSlaveInfo()->state == PSlaveState_online && cli->GetSlaveInfo()->spillOffset < 0) {
+      sendToSlave(cli.get(), block);
+    }
+  }
+
+  drainSpill();
+}
+
+static PString SpillFileName() {
+  const auto& rdb = g_config.rdbfullname;
+  return rdb.substr(0, rdb.rfind('/') + 1) + "repl-buffer.spill";
+}
+
+void PReplication::bufferBlock(const PReplBlock& block) {
+  // spill_ is also kept for the slaves still reading it
+  if ((!IsBgsaving() || bufferAborted_) && !spill_.IsOpen()) {
     return;
   }
 
-  UnboundedBuffer ub;
+  if (!spill_.IsOpen() && bufferBytes_ + block->size() > g_config.replbuffermemory) {
+    if (!spill_.Open(SpillFileName())) {
+      abortBuffer("can not open spill file");
+      return;
+    }
+
+    spillStart_ = 0;
+    INFO("Repl buffer is over {} bytes, spill to file", g_config.replbuffermemory);
+  }
+
+  if (!spill_.IsOpen()) {
+    buffer_.push_back(block);
+    bufferBytes_ += block->size();
+  } else if (!spill_.Append(block->data(), block->size())) {
+    abortBuffer("can not write spill file");
+    return;
+  }
+
+  if (g_config.replbufferlimit > 0 && bufferBytes_ + spill_.Size() > g_config.replbufferlimit) {
+    abortBuffer("is over repl-buffer-limit");
+  }
+}
+
+void PReplication::abortBuffer(const char* reason) {
+  ERROR("Repl buffer {}, memory {} bytes, spilled {} bytes, close the slaves in full sync", reason, bufferBytes_,
+        spill_.Size());
+
+  for (const auto& wptr : slaves_) {
+    auto cli = wptr.lock();
+    if (!cli) {
+      continue;
+    }
+
+    auto slave = cli->GetSlaveInfo();
+    if (slave->state == PSlaveState_wait_bgsave_end ||
+        (slave->state == PSlaveState_online && slave->spillOffset >= 0)) {
+      slave->state = PSlaveState_none;
+      cli->Close();
+    }
+  }
+
+  buffer_.clear();
+  bufferBytes_ = 0;
+  spill_.Close();
+  spillStart_ = 0;
+  bufferAborted_ = IsBgsaving();
+}
+
+void PReplication::sendBuffered(PClient* cli) {
+  for (const auto& block : buffer_) {
+    sendToSlave(cli, block);
+  }
 
+  cli->GetSlaveInfo()->spillOffset = spill_.IsOpen() ? static_cast<int64_t>(spillStart_) : -1;
+}
+
+void PReplication::drainSpill() {
+  if (!spill_.IsOpen()) {
+    return;
+  }
+
+  // read as fast as slaves receive, they get the stream directly when reaching the end
+  bool reading = false;
   for (const auto& wptr : slaves_) {
     auto cli = wptr.lock();
-    if (!cli || cli->GetSlaveInfo()->state != PSlaveState_online) {
+    if (!cli || cli->GetSlaveInfo()->state != PSlaveState_online || cli->GetSlaveInfo()->spillOffset < 0) {
+      continue;
+    }
+
+    auto slave = cli->GetSlaveInfo();
+    const auto size = static_cast<int64_t>(spill_.Size());
+    while (slave->spillOffset < size && cli->PendingSize() < kMaxSlavePending) {
+      const auto len = std::min<std::size_t>(kRdbBlockSize, static_cast<std::size_t>(size - slave->spillOffset));
+      PString data;
+      if (!spill_.Read(static_cast<uint64_t>(slave->spillOffset), len, data)) {
+        slave->state = PSlaveState_none;
+        cli->Close();
+        break;
+      }
+
+      sendToSlave(cli.get(), std::make_shared<const PString>(std::move(data)));
+      slave->spillOffset += static_cast<int64_t>(len);
+    }
+
+    if (slave->spillOffset == size) {
+      slave->spillOffset = -1;
+      INFO("Slave {} has read the spill file", cli->GetName());
+    } else if (slave->state == PSlaveState_online) {
+      reading = true;
+    }
+  }
+
+  // the bgsave in progress may use it
+  if (!reading && !IsBgsaving()) {
+    spill_.Close();
+    spillStart_ = 0;
+  }
+}
+
+PCodec PReplication::negotiateCodec(PSlaveInfo* slave) const {
+  PCodec codec = PCodec_none;
+  if (!slave->psync || !(slave->capa & PSlaveCapa_psync2) || !ParseCodec(g_config.replcompression, codec) ||
+      !(slave->capa & (1u << codec))) {
+    return PCodec_none;
+  }
+
+  return codec;
+}
+
+void PReplication::sendToSlave(PClient* cli, const char* data, std::size_t len) {
+  const PCodec codec = cli->GetSlaveInfo()->codec;
+  if (codec == PCodec_none) {
+    cli->SendPacket(data, static_cast<int>(len));
+    return;
+  }
+
+  PString frames;
+  AppendFrames(codec, kStreamZstdLevel, data, len, frames);
+  compressRawBytes_ += len;
+  compressedBytes_ += frames.size();
+  cli->SendPacket(frames.data(), static_cast<int>(frames.size()));
+}
+
+void PReplication::sendToSlave(PClient* cli, const PReplBlock& block) {
+  const PCodec codec = cli->GetSlaveInfo()->codec;
+  if (codec == PCodec_none) {
+    cli->SendPacket(block);
+    return;
+  }
+
+  if (framedBlock_ != block || framedCodec_ != codec) {
+    PString frames;
+    AppendFrames(codec, kStreamZstdLevel, block->data(), block->size(), frames);
+    frames_ = std::make_shared<const PString>(std::move(frames));
+    framedBlock_ = block;
+    framedCodec_ = codec;
+  }
+
+  compressRawBytes_ += block->size();
+  compressedBytes_ += frames_->size();
+  cli->SendPacket(frames_);
+}
+
+void PReplication::feedBacklog(const PReplBlock& block) {
+  offset_ += static_cast<int64_t>(block->size());
+  backlogHistlen_ += block->size();
+  backlog_.push_back(block);
+  backlogTimes_.push_back(static_cast<uint64_t>(::Now()));
+
+  // keep at least repl-backlog-size bytes
+  while (backlogHistlen_ - backlog_.front()->size() >= g_config.replbacklogsize) {
+    backlogHistlen_ -= backlog_.front()->size();
+    backlog_.pop_front();
+    backlogTimes_.pop_front();
+  }
+
+  backlogOff_ = offset_ - static_cast<int64_t>(backlogHistlen_) + 1;
+}
+
+uint64_t PReplication::lagOf(int64_t ackOffset, uint64_t now) const {
+  if (ackOffset >= offset_ || backlog_.empty()) {
+    return 0;
+  }
+
+  // the block having the first byte not acked, or the oldest one
+  int64_t end = backlogOff_ - 1;
+  for (std::size_t i = 0; i < backlog_.size(); ++i) {
+    end += static_cast<int64_t>(backlog_[i]->size());
+    if (end > ackOffset) {
+      return now > backlogTimes_[i] ? now - backlogTimes_[i] : 0;
+    }
+  }
+
+  return 0;
+}
+
+void PReplication::OnAck(PClient* cli, int64_t offset) {
+  auto slave = cli->GetSlaveInfo();
+  slave->ackOffset = std::max(slave->ackOffset, offset);
+  slave->ackTime = static_cast<uint64_t>(::Now());
+
+  if (!waiters_.empty()) {
+    serveWaiters();
+  }
+}
+
+int PReplication::countAcked(int64_t offset) const {
+  int n = 0;
+  for (const auto& wptr : slaves_) {
+    auto cli = wptr.lock();
+    if (cli && cli->GetSlaveInfo()->state == PSlaveState_online && cli->GetSlaveInfo()->ackOffset >= offset) {
+      ++n;
+    }
+  }
+
+  return n;
+}
+
+void PReplication::WaitForSlaves(PClient* cli, long numSlaves, uint64_t timeout, UnboundedBuffer* reply) {
+  // the commands of this loop iteration are not flushed yet
+  const int64_t offset = offset_ + static_cast<int64_t>(pending_.size());
+  const int acked = countAcked(offset);
+  if (acked >= numSlaves || cli->IsFlagOn(ClientFlag_multi)) {
+    FormatInt(acked, reply);
+    return;
+  }
+
+  uint64_t deadline = timeout > 0 ? static_cast<uint64_t>(::Now()) + timeout : std::numeric_limits<uint64_t>::max();
+  waiters_.push_back({std::static_pointer_cast<PClient>(cli->shared_from_this()), deadline, offset, numSlaves});
+  getAck_ = true;
+}
+
+void PReplication::serveWaiters() {
+  for (auto it = waiters_.begin(); it != waiters_.end();) {
+    auto cli = it->client.lock();
+    if (!cli) {
+      it = waiters_.erase(it);
       continue;
     }
 
-    if (ub.IsEmpty()) {
-      SaveCommand(params, ub);
+    const int acked = countAcked(it->offset);
+    if (acked >= it->numSlaves) {
+      UnboundedBuffer reply;
+      FormatInt(acked, &reply);
+      cli->SendPacket(reply);
+      it = waiters_.erase(it);
+    } else {
+      ++it;
     }
+  }
+}
 
-    cli->SendPacket(ub);
+void PReplication::LoopCheckWaiters() {
+  const auto now = static_cast<uint64_t>(::Now());
+  for (auto it = waiters_.begin(); it != waiters_.end();) {
+    auto cli = it->client.lock();
+    if (!cli) {
+      it = waiters_.erase(it);
+    } else if (it->timeout <= now) {
+      UnboundedBuffer reply;
+      FormatInt(countAcked(it->offset), &reply);
+      cli->SendPacket(reply);
+      it = waiters_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+bool PReplication::TryPartialResync(PClient* cli, const PString& replid, int64_t offset) {
+  if (!backlogActive_) {
+    return false;
+  }
+
+  // a slave of the previous master may continue until the promotion
+  auto slave = cli->GetSlaveInfo();
+  if (replid != replid_ &&
+      (replid != replid2_ || offset > secondOffset_ || !(slave->capa & PSlaveCapa_psync2))) {
+    return false;
+  }
+
+  Flush();
+  if (offset < backlogOff_ || offset > backlogOff_ + static_cast<int64_t>(backlogHistlen_)) {
+    INFO("psync offset {} is out of backlog [{}, {}]", offset, backlogOff_, backlogOff_ + backlogHistlen_);
+    return false;
+  }
+
+  // +CONTINUE [replid [codec]], the data after it is in frames of codec
+  slave->codec = negotiateCodec(slave);
+  PString reply = "+CONTINUE";
+  if (slave->capa & PSlaveCapa_psync2) {
+    reply.append(" ").append(replid_);
+    if (slave->codec != PCodec_none) {
+      reply.append(" ").append(CodecName(slave->codec));
+    }
+  }
+  reply.append("\r\n");
+  cli->SendPacket(reply.data(), static_cast<int>(reply.size()));
+
+  // the first block may be sent partly
+  std::size_t skip = static_cast<std::size_t>(offset - backlogOff_);
+  const std::size_t missed = backlogHistlen_ - skip;
+  for (const auto& block : backlog_) {
+    if (skip >= block->size()) {
+      skip -= block->size();
+    } else if (skip > 0) {
+      sendToSlave(cli, block->data() + skip, block->size() - skip);
+      skip = 0;
+    } else {
+      sendToSlave(cli, block);
+    }
   }
+
+  slave->state = PSlaveState_online;
+  INFO("Partial resync with {} from offset {}, {} bytes", cli->GetName(), offset, missed);
+  return true;
 }
 
 void PReplication::Cron() {
   static unsigned pingCron = 0;
 
+  if (g_config.repldisklesssync) {
+    TryBgsave();
+  }
+
   if (pingCron++ % 50 == 0) {
     for (auto it = slaves_.begin(); it != slaves_.end();) {
       auto cli = it->lock();
@@ -167,12 +696,14 @@ void PReplication::Cron() {
         it = slaves_.erase(it);
       } else {
         ++it;
-
-        if (cli->GetSlaveInfo()->state == PSlaveState_online) {
-          cli->SendPacket("PING\r\n", 6);
-        }
       }
     }
+
+    // the ping is in the stream, so the offsets of slaves go on; a slave forwards the pings of master
+    if (backlogActive_ && !masterInfo_.addr.IsValid()) {
+      StreamWriter writer{pending_};
+      SaveCommand({"ping"}, writer);
+    }
   }
 
   if (masterInfo_.addr.IsValid()) {
@@ -189,6 +720,7 @@ void PReplication::Cron() {
         }
 
         INFO("Try connect to master {}", AddrToString(&masterInfo_.addr.GetAddr()));
+        masterInfo_.codec = PCodec_none;  // until the psync reply of new connection
 
         auto on_new_conn = [](TcpObject* obj) {
           if (g_pikiwidb) {
@@ -235,7 +767,9 @@ void PReplication::Cron() {
         } else if (master->GetAuth()) {
           // send replconf
           char req[128];
-          auto len = snprintf(req, sizeof req - 1, "replconf listening-port %hu\r\n", g_config.port);
+          // the codecs supported, master may compress the data by one of them
+          auto len = snprintf(req, sizeof req - 1, "replconf listening-port %hu capa psync2 capa lz4 capa zstd\r\n",
+                              g_config.port);
           master->SendPacket(req, len);
           masterInfo_.state = PReplState_wait_replconf;
 
@@ -252,23 +786,35 @@ void PReplication::Cron() {
           masterInfo_.downSince = ::time(nullptr);
           WARN("Master is down from wait_replconf to none");
         } else {
-          // request sync rdb file
-          master->SendPacket("SYNC\r\n", 6);
-          INFO("Request SYNC");
-
-          rdb_.Open(slaveRdbFile, false);
-          masterInfo_.rdbRecved = 0;
-          masterInfo_.rdbSize = std::size_t(-1);
-          masterInfo_.state = PReplState_wait_rdb;
-          ;
+          // continue from the processed offset, or request sync rdb file
+          char req[128];
+          int len = 0;
+          if (masterInfo_.replid.empty()) {
+            len = snprintf(req, sizeof req, "PSYNC ? -1\r\n");
+          } else {
+            len = snprintf(req, sizeof req, "PSYNC %s %ld\r\n", masterInfo_.replid.c_str(),
+                           (long)(masterInfo_.offset + 1));
+          }
+          master->SendPacket(req, len);
+          INFO("Request {}", PString(req, len - 2));
+
+          masterInfo_.state = PReplState_wait_psync;
         }
       } break;
 
+      case PReplState_wait_psync:
       case PReplState_wait_rdb:
+        if (!master_.lock()) {
+          abortStreamLoad();
+          masterInfo_.state = PReplState_none;
+          masterInfo_.downSince = ::time(nullptr);
+          WARN("Master is down while syncing");
+        }
         break;
 
       case PReplState_online:
         if (auto master = master_.lock()) {
+          SendAck();
         } else {
           masterInfo_.state = PReplState_none;
           masterInfo_.downSince = ::time(nullptr);
@@ -294,23 +840,93 @@ void PReplication::Cron() {
 }
 
 void PReplication::SaveTmpRdb(const char* data, std::size_t& len) {
+  if (!masterInfo_.eofMark.empty()) {
+    // the mark may be split by packets, so the tail is kept until more data come
+    const PString& mark = masterInfo_.eofMark;
+    PString buf = std::move(masterInfo_.eofTail);
+    const std::size_t tailSize = buf.size();
+    buf.append(data, len);
+
+    auto pos = buf.find(mark);
+    if (pos == PString::npos) {
+      std::size_t keep = std::min(buf.size(), mark.size() - 1);
+      saveRdb(buf.data(), buf.size() - keep);
+      masterInfo_.rdbRecved += buf.size() - keep;
+      masterInfo_.eofTail.assign(buf, buf.size() - keep, keep);
+      return;
+    }
+
+    saveRdb(buf.data(), pos);
+    masterInfo_.rdbRecved += pos;
+    len = pos + mark.size() - tailSize;  // the bytes after mark are commands
+    masterInfo_.rdbSize = masterInfo_.rdbRecved;
+    onRdbRecved();
+    return;
+  }
+
   if (masterInfo_.rdbRecved + len > masterInfo_.rdbSize) {
     len = masterInfo_.rdbSize - masterInfo_.rdbRecved;
   }
 
-  rdb_.Write(data, len);
+  saveRdb(data, len);
   masterInfo_.rdbRecved += len;
 
   if (masterInfo_.rdbRecved == masterInfo_.rdbSize) {
-    INFO("Rdb recv complete, bytes {}", masterInfo_.rdbSize);
+    onRdbRecved();
+  }
+}
 
+void PReplication::saveRdb(const char* data, std::size_t len) {
+  if (!streamLoader_) {
+    rdb_.Write(data, len);
+    return;
+  }
+
+  if (!streamFailed_ && !streamLoader_->Feed(data, len)) {
+    streamFailed_ = true;
+  }
+}
+
+void PReplication::abortStreamLoad() {
+  if (streamLoader_) {
+    streamLoader_.reset();
+    PSTORE.AbortStaging();
+  }
+}
+
+void PReplication::onRdbRecved() {
+  INFO("Rdb recv complete, bytes {}", masterInfo_.rdbSize);
+
+  if (streamLoader_) {
+    const bool succ = !streamFailed_ && streamLoader_->StreamDone();
+    if (!succ) {
+      // resync from scratch, the current keyspace is kept
+      ERROR("Streaming load of rdb failed");
+      abortStreamLoad();
+      if (auto master = master_.lock()) {
+        master->Close();
+      }
+      masterInfo_.state = PReplState_none;
+      masterInfo_.downSince = ::time(nullptr);
+      return;
+    }
+
+    PSTORE.CommitStaging();
+    streamLoader_.reset();
+  } else {
     PSTORE.ResetDB();
 
     PDBLoader loader;
     loader.Load(slaveRdbFile);
-    masterInfo_.state = PReplState_online;
-    masterInfo_.downSince = 0;
   }
+
+  // sub-slaves get the stream of master with the same replid and offsets
+  resetStream(masterInfo_.syncReplid, masterInfo_.syncOffset);
+
+  masterInfo_.replid = std::move(masterInfo_.syncReplid);
+  masterInfo_.offset = masterInfo_.syncOffset;
+  masterInfo_.state = PReplState_online;
+  masterInfo_.downSince = 0;
 }
 
 void PReplication::SetMaster(const std::shared_ptr<PClient>& cli) { master_ = cli; }
@@ -331,14 +947,193 @@ void PReplication::SetMasterAddr(const char* ip, unsigned short port) {
 
 void PReplication::SetRdbSize(std::size_t s) { masterInfo_.rdbSize = s; }
 
+void PReplication::SetRdbEofMark(const PString& mark) {
+  masterInfo_.eofMark = mark;
+  masterInfo_.eofTail.clear();
+}
+
+void PReplication::SendAck() {
+  if (auto master = master_.lock()) {
+    char req[64];
+    int len = snprintf(req, sizeof req, "replconf ack %ld\r\n", (long)masterInfo_.offset);
+    master->SendPacket(req, len);
+  }
+}
+
+bool PReplication::HasRdbHeader() const {
+  return masterInfo_.rdbSize != std::size_t(-1) || !masterInfo_.eofMark.empty();
+}
+
+void PReplication::OnFullResync(const PString& replid, int64_t offset, PCodec codec) {
+  INFO("Full resync with master, replid {}, offset {}, compression {}", replid, offset, CodecName(codec));
+  masterInfo_.codec = codec;
+
+  // the data set of sub-slaves is replaced too, they sync again when this is online
+  disconnectSlaves();
+
+  // the data set is dropped, it can not continue until the rdb is loaded
+  masterInfo_.replid.clear();
+  masterInfo_.offset = 0;
+  masterInfo_.syncReplid = replid;
+  masterInfo_.syncOffset = offset;
+
+  // the rdb is parsed while it's received, or saved to file and loaded when done
+  abortStreamLoad();
+  streamFailed_ = false;
+  if (g_config.repldisklessload == "swapdb") {
+    streamLoader_ = std::make_unique<PDBLoader>();
+    streamLoader_->BeginStream();
+  } else {
+    rdb_.Open(slaveRdbFile, false);
+  }
+  masterInfo_.rdbRecved = 0;
+  masterInfo_.rdbSize = std::size_t(-1);
+  masterInfo_.eofMark.clear();
+  masterInfo_.eofTail.clear();
+  masterInfo_.state = PReplState_wait_rdb;
+}
+
+void PReplication::OnContinue(const PString& replid, PCodec codec) {
+  INFO("Partial resync with master from offset {}, compression {}", masterInfo_.offset + 1, CodecName(codec));
+  masterInfo_.codec = codec;
+
+  if (!replid.empty() && replid != masterInfo_.replid) {
+    // the master was promoted, continue by the new replid and tell sub-slaves
+    INFO("Master replid changed from {} to {}", masterInfo_.replid, replid);
+    masterInfo_.replid = replid;
+
+    Flush();
+    replid2_ = replid_;
+    secondOffset_ = offset_ + 1;
+    replid_ = replid;
+    disconnectSlaves();
+  }
+  masterInfo_.state = PReplState_online;
+  masterInfo_.downSince = 0;
+}
+
+long PReplication::InflateStream(const char* data, std::size_t len, PString& out) {
+  const std::size_t origin = out.size();
+  const long consumed = DecodeFrames(data, len, out);
+  if (consumed > 0) {
+    CountInflated(static_cast<uint64_t>(consumed), out.size() - origin);
+  }
+
+  return consumed;
+}
+
+void PReplication::CountInflated(uint64_t compressedBytes, uint64_t rawBytes) {
+  masterInfo_.compressedBytes += compressedBytes;
+  masterInfo_.rawBytes += rawBytes;
+}
+
+bool PReplication::GetMasterReplInfo(PString& replid, int64_t& offset) const {
+  if (!masterInfo_.addr.IsValid() || masterInfo_.replid.empty()) {
+    return false;
+  }
+
+  replid = masterInfo_.replid;
+  offset = masterInfo_.offset;
+  return true;
+}
+
+void PReplication::SetCachedMaster(const PString& replid, int64_t offset) {
+  masterInfo_.replid = replid;
+  masterInfo_.offset = offset;
+  resetStream(replid, offset);
+}
+
+void PReplication::CacheMyselfAsMaster() {
+  Flush();
+  masterInfo_.replid = replid_;
+  masterInfo_.offset = offset_;
+}
+
+void PReplication::BecomeMaster() {
+  Flush();
+  replid2_ = replid_;
+  secondOffset_ = offset_ + 1;
+
+  char replid[kEofMarkSize + 1] = "";
+  getRandomHexChars(replid, kEofMarkSize);
+  replid_.assign(replid, kEofMarkSize);
+  seldb_ = -1;  // the db selected by the stream of master is unknown
+
+  masterInfo_.replid.clear();  // the data set diverges from now on
+  masterInfo_.offset = 0;
+
+  // they reconnect and continue by replid2
+  disconnectSlaves();
+  INFO("Become master with replid {}, replid2 {} until offset {}", replid_, replid2_, secondOffset_);
+}
+
+void PReplication::resetStream(const PString& replid, int64_t offset) {
+  disconnectSlaves();
+
+  if (replid.empty()) {
+    char newid[kEofMarkSize + 1] = "";
+    getRandomHexChars(newid, kEofMarkSize);
+    replid_.assign(newid, kEofMarkSize);
+  } else {
+    replid_ = replid;
+  }
+
+  offset_ = offset;
+  replid2_.clear();
+  secondOffset_ = -1;
+  seldb_ = -1;
+
+  pending_.clear();
+  buffer_.clear();
+  bufferBytes_ = 0;
+  spill_.Close();
+  spillStart_ = 0;
+  backlog_.clear();
+  backlogTimes_.clear();
+  backlogHistlen_ = 0;
+  backlogOff_ = offset_ + 1;
+}
+
+void PReplication::disconnectSlaves() {
+  for (const auto& wptr : slaves_) {
+    if (auto cli = wptr.lock()) {
+      cli->GetSlaveInfo()->state = PSlaveState_none;
+      cli->Close();
+    }
+  }
+}
+
 std::size_t PReplication::GetRdbSize() const { return masterInfo_.rdbSize; }
 
+int64_t PReplication::Staleness() const {
+  if (!masterInfo_.addr.IsValid()) {
+    return 0;
+  }
+
+  if (masterInfo_.heartbeat == 0 || masterInfo_.state == PReplState_wait_rdb) {
+    return -1;
+  }
+
+  // the clocks of master and slave are assumed to be synchronized
+  return std::max<int64_t>(0, ::Now() - masterInfo_.heartbeat);
+}
+
 PError replconf(const std::vector<PString>& params, UnboundedBuffer* reply) {
   if (params.size() % 2 == 0) {
     ReplyError(PError_syntax, reply);
     return PError_syntax;
   }
 
+  auto slaveInfo = []() {
+    auto info = PClient::Current()->GetSlaveInfo();
+    if (!info) {
+      PClient::Current()->SetSlaveInfo();
+      info = PClient::Current()->GetSlaveInfo();
+      PREPL.AddSlave(PClient::Current());
+    }
+    return info;
+  };
+
   for (size_t i = 1; i < params.size(); i += 2) {
     if (strncasecmp(params[i].c_str(), "listening-port", 14) == 0) {
       long port;
@@ -347,13 +1142,37 @@ PError replconf(const std::vector<PString>& params, UnboundedBuffer* reply) {
         return PError_param;
       }
 
+      slaveInfo()->listenPort = static_cast<unsigned short>(port);
+    } else if (strcasecmp(params[i].c_str(), "ack") == 0) {
+      // from slave, no reply
+      long offset;
       auto info = PClient::Current()->GetSlaveInfo();
-      if (!info) {
-        PClient::Current()->SetSlaveInfo();
-        info = PClient::Current()->GetSlaveInfo();
-        PREPL.AddSlave(PClient::Current());
+      if (info && TryStr2Long(params[i + 1].c_str(), params[i + 1].size(), offset)) {
+        PREPL.OnAck(PClient::Current(), offset);
+      }
+      return PError_ok;
+    } else if (strcasecmp(params[i].c_str(), "getack") == 0) {
+      // from master in the stream, no reply
+      if (PClient::Current()->IsFlagOn(ClientFlag_master)) {
+        PREPL.SendAck();
+      }
+      return PError_ok;
+    } else if (strcasecmp(params[i].c_str(), "heartbeat") == 0) {
+      // from master in the stream, no reply
+      long masterTime;
+      if (PClient::Current()->IsFlagOn(ClientFlag_master) &&
+          TryStr2Long(params[i + 1].c_str(), params[i + 1].size(), masterTime)) {
+        PREPL.OnHeartbeat(masterTime);
+      }
+      return PError_ok;
+    } else if (strncasecmp(params[i].c_str(), "capa", 4) == 0) {
+      // the unknown capabilities are ignored
+      PCodec codec;
+      if (strcasecmp(params[i + 1].c_str(), "psync2") == 0) {
+        slaveInfo()->capa |= PSlaveCapa_psync2;
+      } else if (ParseCodec(params[i + 1], codec) && codec != PCodec_none) {
+        slaveInfo()->capa |= 1u << codec;
       }
-      info->listenPort = static_cast<unsigned short>(port);
     } else {
         break;
     }
@@ -375,29 +1194,51 @@ void PReplication::OnInfoCommand(UnboundedBuffer& res) {
 
   std::ostringstream oss;
   int index = 0;
+  const auto now = static_cast<uint64_t>(::Now());
   for (const auto& c : slaves_) {
     auto cli = c.lock();
     if (cli) {
       oss << "slave" << index << ":";
       index++;
 
-      oss << cli->PeerIP();
+      oss << "ip=" << cli->PeerIP();
 
+      // the lag of acked offset, in bytes and in ms since the first byte not acked was sent
       auto slaveInfo = cli->GetSlaveInfo();
       auto state = slaveInfo ? slaveInfo->state : 0;
-      oss << "," << (slaveInfo ? slaveInfo->listenPort : 0) << "," << slaveState[state] << "\r\n";
+      const int64_t ack = slaveInfo ? slaveInfo->ackOffset : 0;
+      oss << ",port=" << (slaveInfo ? slaveInfo->listenPort : 0) << ",state=" << slaveState[state]
+          << ",offset=" << ack << ",lag_bytes=" << std::max<int64_t>(offset_ - ack, 0)
+          << ",lag_ms=" << lagOf(ack, now) << "\r\n";
     }
   }
 
   std::string slaveInfo(oss.str());
 
-  char buf[1024] = {};
+  char buf[2048] = {};
   bool isMaster = !GetMasterAddr().IsValid();
   int n = snprintf(buf, sizeof buf - 1,
                    "# Replication\r\n"
                    "role:%s\r\n"
-                   "connected_slaves:%d\r\n%s",
-                   isMaster ? "master" : "slave", index, slaveInfo.c_str());
+                   "connected_slaves:%d\r\n%s"
+                   "master_replid:%s\r\n"
+                   "master_replid2:%s\r\n"
+                   "master_repl_offset:%ld\r\n"
+                   "second_repl_offset:%ld\r\n"
+                   "repl_backlog_active:%d\r\n"
+                   "repl_backlog_size:%lu\r\n"
+                   "repl_backlog_first_byte_offset:%ld\r\n"
+                   "repl_backlog_histlen:%lu\r\n"
+                   "repl_compression:%s\r\n"
+                   "repl_compression_raw_bytes:%lu\r\n"
+                   "repl_compression_compressed_bytes:%lu\r\n"
+                   "repl_buffer_bytes:%lu\r\n"
+                   "repl_buffer_spilled_bytes:%lu\r\n",
+                   isMaster ? "master" : "slave", index, slaveInfo.c_str(), replid_.c_str(),
+                   replid2_.empty() ? "0000000000000000000000000000000000000000" : replid2_.c_str(), (long)offset_,
+                   (long)secondOffset_,
+                   backlogActive_ ? 1 : 0, g_config.replbacklogsize, (long)backlogOff_, backlogHistlen_,
+                   g_config.replcompression.c_str(), compressRawBytes_, compressedBytes_, bufferBytes_, spill_.Size());
 
   std::ostringstream masterInfo;
   if (!isMaster) {
@@ -406,6 +1247,11 @@ void PReplication::OnInfoCommand(UnboundedBuffer& res) {
 
     auto master = master_.lock();
     masterInfo << (master ? "up\r\n" : "down\r\n");
+    masterInfo << "slave_repl_offset:" << masterInfo_.offset << "\r\n";
+    masterInfo << "master_link_compression:" << CodecName(masterInfo_.codec) << "\r\n";
+    masterInfo << "master_link_raw_bytes:" << masterInfo_.rawBytes << "\r\n";
+    masterInfo << "master_link_compressed_bytes:" << masterInfo_.compressedBytes << "\r\n";
+    masterInfo << "master_staleness_ms:" << Staleness() << "\r\n";
     if (!master) {
       if (!masterInfo_.downSince) {
         assert(0);
@@ -427,20 +1273,39 @@ void PReplication::OnInfoCommand(UnboundedBuffer& res) {
   }
 }
 
+void PReplication::ReplicaOf(const char* ip, unsigned short port) {
+  if (!ip) {
+    if (masterInfo_.addr.IsValid()) {
+      SetMasterAddr(nullptr, 0);
+      BecomeMaster();
+    }
+    return;
+  }
+
+  SocketAddr reqMaster(ip, port);
+  if (port > 0 && masterInfo_.addr != reqMaster) {
+    if (!masterInfo_.addr.IsValid()) {
+      CacheMyselfAsMaster();  // try to continue with the new master by my stream
+    }
+    SetMasterAddr(ip, port);
+    SetMasterState(PReplState_none);
+  }
+}
+
 PError slaveof(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  // the replicas are set by CLUSTER REPLICATE
+  if (g_config.clusterenabled) {
+    reply->PushData("-ERR SLAVEOF not allowed in cluster mode.\r\n",
+                    sizeof "-ERR SLAVEOF not allowed in cluster mode.\r\n" - 1);
+    return PError_param;
+  }
+
   if (strncasecmp(params[1].data(), "no", 2) == 0 && strncasecmp(params[2].data(), "one", 3) == 0) {
-    PREPL.SetMasterAddr(nullptr, 0);
+    PREPL.ReplicaOf(nullptr, 0);
   } else {
     long tmpPort = 0;
     Strtol(params[2].c_str(), params[2].size(), &tmpPort);
-    unsigned short port = static_cast<unsigned short>(tmpPort);
-
-    SocketAddr reqMaster(params[1].c_str(), port);
-
-    if (port > 0 && PREPL.GetMasterAddr() != reqMaster) {
-      PREPL.SetMasterAddr(params[1].c_str(), port);
-      PREPL.SetMasterState(PReplState_none);
-    }
+    PREPL.ReplicaOf(params[1].c_str(), static_cast<unsigned short>(tmpPort));
   }
 
   FormatOK(reply);
@@ -448,6 +1313,11 @@ PError slaveof(const std::vector<PString>& params, UnboundedBuffer* reply) {
 }
 
 PError sync(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  if (!PREPL.CanServeSync()) {
+    ReplyError(PError_noMasterLink, reply);
+    return PError_noMasterLink;
+  }
+
   PClient* cli = PClient::Current();
   auto slave = cli->GetSlaveInfo();
   if (!slave) {
@@ -468,4 +1338,85 @@ PError sync(const std::vector<PString>& params, UnboundedBuffer* reply) {
   return PError_ok;
 }
 
+// psync <replid> <offset>
+PError psync(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  if (!PREPL.CanServeSync()) {
+    ReplyError(PError_noMasterLink, reply);
+    return PError_noMasterLink;
+  }
+
+  PClient* cli = PClient::Current();
+  auto slave = cli->GetSlaveInfo();
+  if (!slave) {
+    cli->SetSlaveInfo();
+    slave = cli->GetSlaveInfo();
+    PREPL.AddSlave(cli);
+  }
+
+  if (slave->state == PSlaveState_wait_bgsave_end || slave->state == PSlaveState_online) {
+    WARN("{} state is {}, ignore this psync request", cli->GetName(), slave->state);
+    return PError_ok;
+  }
+
+  long offset = -1;
+  if (!TryStr2Long(params[2].c_str(), params[2].size(), offset)) {
+    ReplyError(PError_param, reply);
+    return PError_param;
+  }
+
+  slave->psync = true;
+  if (PREPL.TryPartialResync(cli, params[1], offset)) {
+    return PError_ok;
+  }
+
+  // +FULLRESYNC is replied when the bgsave starts
+  slave->state = PSlaveState_wait_bgsave_start;
+  PREPL.TryBgsave();
+
+  return PError_ok;
+}
+
+// wait <numreplicas> <timeout>
+PError wait(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  if (PREPL.GetMasterAddr().IsValid()) {
+    ReplyError(PError_waitOnSlave, reply);
+    return PError_waitOnSlave;
+  }
+
+  long numSlaves = 0;
+  long timeout = 0;
+  if (!TryStr2Long(params[1].c_str(), params[1].size(), numSlaves) ||
+      !TryStr2Long(params[2].c_str(), params[2].size(), timeout) || timeout < 0) {
+    ReplyError(PError_nan, reply);
+    return PError_nan;
+  }
+
+  PREPL.WaitForSlaves(PClient::Current(), numSlaves, static_cast<uint64_t>(timeout), reply);
+  return PError_ok;
+}
+
+// READONLY [max-staleness-ms], the slave refuses reads of the client when its
+// data is older than the bound, so the client turns to master. In cluster mode
+// the slaves serve reads of the slots of their master to READONLY clients
+PError readonly(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  long maxStaleness = -1;
+  if (params.size() > 2 ||
+      (params.size() == 2 && (!TryStr2Long(params[1].c_str(), params[1].size(), maxStaleness) || maxStaleness < 0))) {
+    ReplyError(PError_syntax, reply);
+    return PError_syntax;
+  }
+
+  PClient::Current()->SetFlag(ClientFlag_readonly);
+  PClient::Current()->SetMaxStaleness(maxStaleness);
+  FormatOK(reply);
+  return PError_ok;
+}
+
+PError readwrite(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  PClient::Current()->ClearFlag(ClientFlag_readonly);
+  PClient::Current()->SetMaxStaleness(-1);
+  FormatOK(reply);
+  return PError_ok;
+}
+
 }  // namespace pikiwidb
@@ -7,13 +7,16 @@
 
 #pragma once
 
+#include <deque>
 #include <list>
 #include <memory>
 #include <vector>
 
+#include "compress.h"
 #include "memory_file.h"
 #include "net/util.h"
 #include "pstring.h"
+#include "repl_spill.h"
 #include "unbounded_buffer.h"
 
 namespace pikiwidb {
@@ -57,6 +60,9 @@ inline void SaveCommand(const std::vector<PString>& params, DEST& dst) {
   }
 }
 
+// a block of replication stream, shared by slaves and backlog
+using PReplBlock = std::shared_ptr<const PString>;
+
 // master side
 enum PSlaveState {
   PSlaveState_none,
@@ -66,11 +72,28 @@ enum PSlaveState {
   PSlaveState_online,
 };
 
+// the slave understands +CONTINUE <replid>, and the codecs are in bit (1 << PCodec)
+const unsigned PSlaveCapa_psync2 = 1u << 16;
+
 struct PSlaveInfo {
   PSlaveState state;
   unsigned short listenPort;  // slave listening port
-
-  PSlaveInfo() : state(PSlaveState_none), listenPort(0) {}
+  bool psync;                 // reply +FULLRESYNC before the rdb
+  unsigned capa;              // PSlaveCapa_psync2 and the codecs slave can decompress
+  PCodec codec;               // the data after psync reply is in frames of it
+  int64_t ackOffset;          // by REPLCONF ACK
+  uint64_t ackTime;           // ms
+  int64_t spillOffset;        // online but reading the spill file from it after rdb, -1 if not
+
+  PSlaveInfo()
+      : state(PSlaveState_none),
+        listenPort(0),
+        psync(false),
+        capa(0),
+        codec(PCodec_none),
+        ackOffset(0),
+        ackTime(0),
+        spillOffset(-1) {}
 };
 
 // slave side
@@ -80,6 +103,7 @@ enum PReplState {
   PReplState_connected,
   PReplState_wait_auth,      // wait auth to be confirmed
   PReplState_wait_replconf,  // wait replconf to be confirmed
+  PReplState_wait_psync,     // wait +FULLRESYNC or +CONTINUE
   PReplState_wait_rdb,       // wait to recv rdb file
   PReplState_online,
 };
@@ -92,8 +116,33 @@ struct PMasterInfo {
   // For recv rdb
   std::size_t rdbSize;
   std::size_t rdbRecved;
+  // diskless sync, the rdb ends with the mark instead of a known size
+  PString eofMark;
+  PString eofTail;  // the last bytes which may be a prefix of the mark
+
+  // the replication stream, kept after disconnection to psync
+  PString replid;
+  int64_t offset;  // bytes of the stream processed
+  // from +FULLRESYNC, they take effect when the rdb is loaded
+  PString syncReplid;
+  int64_t syncOffset;
+
+  // the data after psync reply is in frames if compressed
+  PCodec codec;
+  uint64_t rawBytes;         // decompressed
+  uint64_t compressedBytes;  // received in frames
+
+  // the clock of master (ms) in the last REPLCONF HEARTBEAT applied, the data
+  // is as fresh as master at that time
+  int64_t heartbeat;
 
   PMasterInfo() {
+    codec = PCodec_none;
+    rawBytes = 0;
+    compressedBytes = 0;
+    heartbeat = 0;
+    offset = 0;
+    syncOffset = 0;
     state = PReplState_none;
     downSince = 0;
     rdbSize = std::size_t(-1);
@@ -105,6 +154,7 @@ struct PMasterInfo {
 const char* const slaveRdbFile = "slave.rdb";
 
 class PClient;
+class PDBLoader;
 
 class PReplication {
  public:
@@ -120,20 +170,58 @@ class PReplication {
   bool HasAnyWaitingBgsave() const;
   void AddSlave(PClient* cli);
   void TryBgsave();
-  bool StartBgsave();
-  void OnStartBgsave();
   void OnRdbSaveDone();
+  bool IsDisklessSyncing() const { return diskless_; }
+  // the commands are sent to slaves once per loop iteration by Flush
   void SendToSlaves(const std::vector<PString>& params);
+  void Flush();
+  // reply +CONTINUE and the missed stream if offset is still in backlog
+  bool TryPartialResync(PClient* cli, const PString& replid, int64_t offset);
+  void OnAck(PClient* cli, int64_t offset);
+  // WAIT, reply the number of slaves acked the stream until now, at once or
+  // when numSlaves acked or timeout (ms, 0 is forever)
+  void WaitForSlaves(PClient* cli, long numSlaves, uint64_t timeout, UnboundedBuffer* reply);
+  void LoopCheckWaiters();
+  std::size_t WaitingSize() const { return waiters_.size(); }
 
   // slave side
   void SaveTmpRdb(const char* data, std::size_t& len);
   void SetMaster(const std::shared_ptr<PClient>& cli);
   void SetMasterState(PReplState s);
   void SetMasterAddr(const char* ip, unsigned short port);
+  // SLAVEOF, no one if ip is null
+  void ReplicaOf(const char* ip, unsigned short port);
   void SetRdbSize(std::size_t s);
+  void SetRdbEofMark(const PString& mark);
+  bool HasRdbHeader() const;
+  // REPLCONF ACK <offset> to master
+  void SendAck();
+  void OnHeartbeat(int64_t masterTime) { masterInfo_.heartbeat = masterTime; }
+  // how old the data is (ms) by the heartbeats of master, 0 on master, -1 if
+  // unknown: no heartbeat yet or receiving the rdb
+  int64_t Staleness() const;
+  void OnFullResync(const PString& replid, int64_t offset, PCodec codec);
+  void OnContinue(const PString& replid, PCodec codec);
+  bool IsMasterLinkCompressed() const { return masterInfo_.codec != PCodec_none; }
+  // decode the whole frames from master, return the bytes consumed, or -1
+  long InflateStream(const char* data, std::size_t len, PString& out);
+  // the frames decoded by the decoding thread of master link
+  void CountInflated(uint64_t compressedBytes, uint64_t rawBytes);
+  // the whole commands processed from master, forwarded to sub-slaves as they are
+  void FeedStream(const char* data, std::size_t len);
+  // slaveof no one, sub-slaves continue by the previous replid
+  void BecomeMaster();
+  // slaveof a new master, it may be a promoted slave having my stream
+  void CacheMyselfAsMaster();
+  // a slave serves sync only if it's synced with its master
+  bool CanServeSync() const { return !masterInfo_.addr.IsValid() || masterInfo_.state == PReplState_online; }
+  // the stream position of the data set, saved to and restored from rdb
+  bool GetMasterReplInfo(PString& replid, int64_t& offset) const;
+  void SetCachedMaster(const PString& replid, int64_t offset);
   PReplState GetMasterState() const;
   SocketAddr GetMasterAddr() const;
   std::size_t GetRdbSize() const;
+  int64_t GetOffset() const { return offset_; }
 
   // info command
   void OnInfoCommand(UnboundedBuffer& res);
@@ -141,16 +229,81 @@ class PReplication {
  private:
   PReplication();
   void onStartBgsave(bool succ);
+  bool startDiskless();
+  void onDisklessDone(bool succ);
+  // the stream during bgsave, in memory then in spill_ beyond repl-buffer-memory
+  void bufferBlock(const PReplBlock& block);
+  void abortBuffer(const char* reason);
+  // the buffered stream follows the rdb, the part in spill_ is sent by drainSpill
+  void sendBuffered(PClient* cli);
+  void drainSpill();
+  void onRdbRecved();
+  void saveRdb(const char* data, std::size_t len);
+  void abortStreamLoad();
+  void feedBacklog(const PReplBlock& block);
+  // the stream goes on from replid and offset of master, or a new replid if it's empty
+  void resetStream(const PString& replid, int64_t offset);
+  void disconnectSlaves();
+  int countAcked(int64_t offset) const;
+  void serveWaiters();
+  // ms since the first byte not acked was sent
+  uint64_t lagOf(int64_t ackOffset, uint64_t now) const;
+  PCodec negotiateCodec(PSlaveInfo* slave) const;
+  // the data after psync reply, in frames if the slave negotiated a codec
+  void sendToSlave(PClient* cli, const char* data, std::size_t len);
+  void sendToSlave(PClient* cli, const PReplBlock& block);
 
   // master side
   bool bgsaving_;
-  UnboundedBuffer buffer_;
+  std::vector<PReplBlock> buffer_;  // the stream during bgsave, for syncing slaves
+  uint64_t bufferBytes_ = 0;
+  PSpillFile spill_;             // kept until all the slaves reading it reach the end
+  uint64_t spillStart_ = 0;      // the stream of the bgsave in progress starts here in spill_
+  bool bufferAborted_ = false;   // over repl-buffer-limit, the syncing slaves are closed
+  bool diskless_ = false;  // the rdb is streamed to slaves by snapshot
+  time_t waitSince_ = 0;   // the first slave waiting for diskless sync
+  PString eofMark_;
+  PString replid_;      // the same as master of this slave
+  int64_t offset_ = 0;  // bytes of the stream sent
+  // the previous replid which is continued until secondOffset
+  PString replid2_;
+  int64_t secondOffset_ = -1;
+  int seldb_ = -1;      // the db selected in the stream
+
+  PString pending_;  // the stream of this loop iteration
+
+  // the last blocks of the stream
+  bool backlogActive_ = false;
+  std::deque<PReplBlock> backlog_;
+  std::deque<uint64_t> backlogTimes_;  // when each block was sent, ms
+  std::size_t backlogHistlen_ = 0;  // the bytes in backlog
+  int64_t backlogOff_ = 0;          // the stream offset of first byte, 1 based
+
+  // the frames of the last block, shared by slaves with the same codec
+  PReplBlock framedBlock_;
+  PCodec framedCodec_ = PCodec_none;
+  PReplBlock frames_;
+  uint64_t compressRawBytes_ = 0;  // sent to slaves in frames
+  uint64_t compressedBytes_ = 0;
+
+  // the clients of WAIT
+  struct Waiter {
+    std::weak_ptr<PClient> client;
+    uint64_t timeout;  // ms
+    int64_t offset;    // the stream until the command
+    long numSlaves;
+  };
+  std::list<Waiter> waiters_;
+  bool getAck_ = false;  // send REPLCONF GETACK by Flush
+  int64_t lastHeartbeat_ = 0;
   std::list<std::weak_ptr<PClient> > slaves_;
 
   // slave side
   PMasterInfo masterInfo_;
   std::weak_ptr<PClient> master_;
   OutputMemoryFile rdb_;
+  std::unique_ptr<PDBLoader> streamLoader_;  // repl-diskless-load swapdb
+  bool streamFailed_ = false;
 };
 
 }  // namespace pikiwidb
@@ -8,15 +8,22 @@
 #include <fnmatch.h>
 #include <sys/utsname.h>
 #include <unistd.h>
+#include <algorithm>
 #include <cassert>
 
+#include "aof.h"
 #include "client.h"
+#include "command_stats.h"
+#include "compress.h"
 #include "config.h"
 #include "db.h"
 #include "delegate.h"
+#include "latency_monitor.h"
+#include "loading.h"
 #include "log.h"
 #include "pikiwidb.h"
 #include "slow_log.h"
+#include "snapshot.h"
 #include "store.h"
 
 namespace pikiwidb {
@@ -27,7 +34,9 @@ PError select(const std::vector<PString>& params, UnboundedBuffer* reply) {
   auto client = PClient::Current();
 
   if (client) {
-    if (client->SelectDB(newDB)) {
+    if (g_config.clusterenabled && newDB != 0) {
+      ReplyError(PError_selectInCluster, reply);
+    } else if (client->SelectDB(newDB)) {
       FormatOK(reply);
     } else {
       ReplyError(PError_invalidDB, reply);
@@ -75,38 +84,33 @@ PError flushall(const std::vector<PString>& params, UnboundedBuffer* reply) {
 }
 
 PError bgsave(const std::vector<PString>& params, UnboundedBuffer* reply) {
-  if (g_qdbPid != -1) {
+  if (IsBgsaveInProgress()) {
     FormatBulk("-ERR Background save already in progress",
                sizeof "-ERR Background save already in progress" - 1, reply);
 
     return PError_ok;
   }
 
-  int ret = fork();
-  if (ret == 0) {
-    {
-      PDBSaver qdb;
-      qdb.Save(g_config.rdbfullname.c_str());
-    }
-    _exit(0);
-  } else if (ret == -1) {
-    FormatSingle("Background saving FAILED", 24, reply);
-  } else {
-    g_qdbPid = ret;
+  if (StartBgsave()) {
     FormatSingle("Background saving started", 25, reply);
+  } else {
+    FormatSingle("Background saving FAILED", 24, reply);
   }
 
   return PError_ok;
 }
 
 PError save(const std::vector<PString>& params, UnboundedBuffer* reply) {
-  if (g_qdbPid != -1) {
+  if (IsBgsaveInProgress()) {
     FormatBulk("-ERR Background save already in progress",
                sizeof "-ERR Background save already in progress" - 1, reply);
 
     return PError_ok;
   }
 
+  // the keys not loaded yet must be saved too
+  PLOADING.LoadAll();
+
   PDBSaver qdb;
   qdb.Save(g_config.rdbfullname.c_str());
   g_lastPDBSave = time(nullptr);
@@ -120,6 +124,30 @@ PError lastsave(const std::vector<PString>& params, UnboundedBuffer* reply) {
   return PError_ok;
 }
 
+PError bgrewriteaof(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  if (!PAOF.IsOpen()) {
+    const char err[] = "-ERR Append only file is not enabled\r\n";
+    reply->PushData(err, sizeof err - 1);
+    return PError_ok;
+  }
+
+  if (PAOF.IsRewriting()) {
+    const char err[] = "-ERR Background append only file rewriting already in progress\r\n";
+    reply->PushData(err, sizeof err - 1);
+    return PError_ok;
+  }
+
+  if (!PAOF.Rewrite()) {
+    FormatSingle("Background append only file rewriting FAILED", 44, reply);
+  } else if (PAOF.IsRewriteScheduled()) {
+    FormatSingle("Background append only file rewriting scheduled", 47, reply);
+  } else {
+    FormatSingle("Background append only file rewriting started", 45, reply);
+  }
+
+  return PError_ok;
+}
+
 PError client(const std::vector<PString>& params, UnboundedBuffer* reply) {
   // getname   setname    kill  list
   PError err = PError_ok;
@@ -186,8 +214,16 @@ PError debug(const std::vector<PString>& params, UnboundedBuffer* reply) {
 
 PError shutdown(const std::vector<PString>& params, UnboundedBuffer* reply) {
   if (params.size() == 2 && strncasecmp(params[1].c_str(), "save", 4) == 0) {
+    // the snapshot writes to the same tmp file
+    PSNAPSHOT.Abort();
+    PLOADING.LoadAll();
+
     PDBSaver qdb;
     qdb.Save(g_config.rdbfullname.c_str());
+
+    if (g_config.warmrestart) {
+      PLoading::SaveIndex(g_config.rdbfullname);
+    }
   }
 
   if (g_pikiwidb) {
@@ -207,6 +243,96 @@ PError echo(const std::vector<PString>& params, UnboundedBuffer* reply) {
   return PError_ok;
 }
 
+// the latency of the command by power of two buckets in usec, as LATENCY HISTOGRAM of redis
+static void FormatLatencyHistogram(const PCommandStat& stat, UnboundedBuffer* reply) {
+  std::vector<std::pair<uint64_t, uint64_t>> buckets;  // the upper bound in usec, calls not greater than it
+  uint64_t calls = 0;
+  if (stat.latency) {
+    stat.latency->ForEach([&](uint64_t low, uint64_t high, uint64_t count) {
+      uint64_t bound = 1;
+      while (bound * 1000 <= high && bound < (1ULL << 40)) {
+        bound <<= 1;
+      }
+
+      calls += count;
+      if (!buckets.empty() && buckets.back().first == bound) {
+        buckets.back().second = calls;
+      } else {
+        buckets.emplace_back(bound, calls);
+      }
+    });
+  }
+
+  FormatBulk(stat.name, reply);
+  PreFormatMultiBulk(4, reply);
+  FormatBulk("calls", 5, reply);
+  FormatInt(static_cast<long>(stat.calls), reply);
+  FormatBulk("histogram_usec", 14, reply);
+  PreFormatMultiBulk(buckets.size() * 2, reply);
+  for (const auto& bucket : buckets) {
+    FormatInt(static_cast<long>(bucket.first), reply);
+    FormatInt(static_cast<long>(bucket.second), reply);
+  }
+}
+
+// LATENCY LATEST | HISTORY event | RESET [event ...] | DOCTOR | HISTOGRAM [command ...]
+PError latency(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  auto& monitor = PLatencyMonitor::Instance();
+  if (strcasecmp(params[1].c_str(), "latest") == 0) {
+    PreFormatMultiBulk(monitor.Events().size(), reply);
+    for (const auto& kv : monitor.Events()) {
+      const auto& latest = kv.second.Latest();
+      PreFormatMultiBulk(4, reply);
+      FormatBulk(kv.first, reply);
+      FormatInt(static_cast<long>(latest.time), reply);
+      FormatInt(static_cast<long>(latest.latency), reply);
+      FormatInt(static_cast<long>(kv.second.max), reply);
+    }
+  } else if (strcasecmp(params[1].c_str(), "history") == 0) {
+    if (params.size() != 3) {
+      ReplyError(PError_param, reply);
+      return PError_param;
+    }
+
+    const auto* event = monitor.Find(params[2]);
+    const auto history = event ? event->History() : std::vector<PLatencySample>();
+    PreFormatMultiBulk(history.size(), reply);
+    for (const auto& sample : history) {
+      PreFormatMultiBulk(2, reply);
+      FormatInt(static_cast<long>(sample.time), reply);
+      FormatInt(static_cast<long>(sample.latency), reply);
+    }
+  } else if (strcasecmp(params[1].c_str(), "reset") == 0) {
+    FormatInt(static_cast<long>(monitor.Reset({params.begin() + 2, params.end()})), reply);
+  } else if (strcasecmp(params[1].c_str(), "doctor") == 0) {
+    FormatBulk(monitor.Doctor(), reply);
+  } else if (strcasecmp(params[1].c_str(), "histogram") == 0) {
+    std::vector<const PCommandStat*> stats;
+    if (params.size() == 2) {
+      stats = PCommandStats::Instance().Stats();
+    } else {
+      for (std::size_t i = 2; i < params.size(); ++i) {
+        const auto* stat = PCommandStats::Instance().Find(params[i]);
+        if (stat && stat->calls > 0 && std::find(stats.begin(), stats.end(), stat) == stats.end()) {
+          stats.push_back(stat);
+        }
+      }
+    }
+
+    stats.erase(std::remove_if(stats.begin(), stats.end(), [](const PCommandStat* s) { return s->calls == 0; }),
+                stats.end());
+    PreFormatMultiBulk(stats.size() * 2, reply);
+    for (const auto* stat : stats) {
+      FormatLatencyHistogram(*stat, reply);
+    }
+  } else {
+    ReplyError(PError_syntax, reply);
+    return PError_syntax;
+  }
+
+  return PError_ok;
+}
+
 void OnMemoryInfoCollect(UnboundedBuffer& res) {
   // memory info
   auto minfo = getMemoryInfo();
@@ -240,12 +366,13 @@ void OnServerInfoCollect(UnboundedBuffer& res) {
   uname(&name);
   int n = snprintf(buf, sizeof buf - 1,
                    "# Server\r\n"
-                   "redis_mode:standalone\r\n"  // not cluster node yet
+                   "redis_mode:%s\r\n"
                    "os:%s %s %s\r\n"
                    "run_id:%s\r\n"
                    "hz:%d\r\n"
                    "tcp_port:%hu\r\n",
-                   name.sysname, name.release, name.machine, g_config.runid.data(), g_config.hz, g_config.port);
+                   g_config.clusterenabled ? "cluster" : "standalone", name.sysname, name.release, name.machine,
+                   g_config.runid.data(), g_config.hz, g_config.port);
 
   if (!res.IsEmpty()) {
     res.PushData("\r\n", 2);
@@ -262,7 +389,7 @@ void OnClientInfoCollect(UnboundedBuffer& res) {
                    "# Clients\r\n"
                    "connected_clients:%lu\r\n"
                    "blocked_clients:%lu\r\n",
-                   nconnected, PSTORE.BlockedSize());
+                   nconnected, PSTORE.BlockedSize() + PREPL.WaitingSize());
 
   if (!res.IsEmpty()) {
     res.PushData("\r\n", 2);
@@ -271,13 +398,116 @@ void OnClientInfoCollect(UnboundedBuffer& res) {
   res.PushData(buf, n);
 }
 
+void OnPersistenceInfoCollect(UnboundedBuffer& res) {
+  char buf[512];
+  int n = snprintf(buf, sizeof buf - 1,
+                   "# Persistence\r\n"
+                   "rdb_changes_since_last_save:%d\r\n"
+                   "rdb_bgsave_in_progress:%d\r\n"
+                   "rdb_last_save_time:%ld\r\n",
+                   PStore::dirty_, IsBgsaveInProgress() ? 1 : 0, static_cast<long>(g_lastPDBSave));
+
+  if (!res.IsEmpty()) {
+    res.PushData("\r\n", 2);
+  }
+
+  res.PushData(buf, n);
+  PLatencyMonitor::Instance().OnInfoCommand(res);
+  g_compressStats.OnInfoCommand(res, g_config.rdbcodec.c_str());
+  PLOADING.OnInfoCommand(res);
+  PAOF.OnInfoCommand(res);
+}
+
+void OnStatsInfoCollect(UnboundedBuffer& res) {
+  char buf[256];
+  int n = snprintf(buf, sizeof buf - 1,
+                   "# Stats\r\n"
+                   "expired_keys:%lu\r\n"
+                   "evicted_keys:%lu\r\n",
+                   PStore::expiredKeys_, PStore::evictedKeys_);
+
+  if (!res.IsEmpty()) {
+    res.PushData("\r\n", 2);
+  }
+
+  res.PushData(buf, n);
+}
+
+void OnKeyspaceInfoCollect(UnboundedBuffer& res) {
+  // the keys loaded so far are not the keyspace, see INFO keyspace
+  if (PLOADING.IsLoading()) {
+    return;
+  }
+
+  if (!res.IsEmpty()) {
+    res.PushData("\r\n", 2);
+  }
+  res.PushData("# Keyspace\r\n", 12);
+
+  char buf[128];
+  for (int dbno = 0; dbno < PSTORE.DBCount(); ++dbno) {
+    if (PSTORE.DBSize(dbno) > 0) {
+      int n = snprintf(buf, sizeof buf - 1, "db%d:keys=%lu,expires=%lu\r\n", dbno, PSTORE.DBSize(dbno),
+                       PSTORE.ExpireSize(dbno));
+      res.PushData(buf, n);
+    }
+  }
+}
+
+// the lines of the section from its header "# Name" to the next section
+static PString InfoSection(const char* text, std::size_t len, const PString& section) {
+  PString res;
+  bool in = false;
+  const char* const end = text + len;
+  while (text < end) {
+    const char* eol = std::search(text, end, "\r\n", "\r\n" + 2);
+    PString line(text, eol);
+    text = eol == end ? end : eol + 2;
+
+    if (line.size() > 2 && line[0] == '#' && line[1] == ' ') {
+      in = strcasecmp(line.c_str() + 2, section.c_str()) == 0;
+    }
+    if (in && !line.empty()) {
+      res += line;
+      res += "\r\n";
+    }
+  }
+
+  return res;
+}
+
+// INFO [section], commandstats and latencystats are not default sections
 PError info(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  PString section(params.size() > 1 ? params[1] : "");
+  std::transform(section.begin(), section.end(), section.begin(), ::tolower);
+
+  // the keyspace asked for explicitly is the whole one, as KEYS and DBSIZE
+  if (section == "keyspace" && PLOADING.IsLoading()) {
+    if (!g_config.asyncloadingwait) {
+      ReplyError(PError_loading, reply);
+      return PError_loading;
+    }
+    PLOADING.LoadAll();
+  }
+
   UnboundedBuffer res;
 
   extern Delegate<void(UnboundedBuffer&)> g_infoCollector;
   g_infoCollector(res);
 
-  FormatBulk(res.ReadAddr(), res.ReadableSize(), reply);
+  const bool all = section == "all" || section == "everything";
+  if (all || section == "commandstats") {
+    PCommandStats::Instance().OnInfoCommandStats(res);
+  }
+  if (all || section == "latencystats") {
+    PCommandStats::Instance().OnInfoLatencyStats(res);
+  }
+
+  if (section.empty() || section == "default" || all) {
+    FormatBulk(res.ReadAddr(), res.ReadableSize(), reply);
+  } else {
+    FormatBulk(InfoSection(res.ReadAddr(), res.ReadableSize(), section), reply);
+  }
   return PError_ok;
 }
 
@@ -366,19 +596,45 @@ std::map<PString, ConfigInfo> configOptions = {
     {"logfile", {Config_string, false, &g_config.logdir}},
     {"loglevel", {Config_string, true, &g_config.loglevel}},
     {"masterauth", {Config_string, true, &g_config.masterauth}},
+    {"repl-diskless-sync", {Config_bool, true, &g_config.repldisklesssync}},
+    {"repl-diskless-sync-delay", {Config_int, true, &g_config.repldisklesssyncdelay}},
+    {"repl-backlog-size", {Config_int64, false, &g_config.replbacklogsize}},
+    {"repl-diskless-load", {Config_string, true, &g_config.repldisklessload}},
+    {"repl-compression", {Config_string, true, &g_config.replcompression}},
+    {"repl-decode-thread", {Config_bool, true, &g_config.repldecodethread}},
+    {"repl-buffer-memory", {Config_int64, true, &g_config.replbuffermemory}},
+    {"repl-buffer-limit", {Config_int64, true, &g_config.replbufferlimit}},
+    {"cluster-enabled", {Config_bool, false, &g_config.clusterenabled}},
+    {"cluster-config-file", {Config_string, false, &g_config.clusterconfigfile}},
+    {"cluster-node-timeout", {Config_int, true, &g_config.clusternodetimeout}},
+    {"cluster-require-full-coverage", {Config_bool, true, &g_config.clusterrequirefullcoverage}},
     {"maxclients", {Config_int, true, &g_config.maxclients}},
     {"port", {Config_int, false, &g_config.port}},
     {"requirepass", {Config_string, true, &g_config.password}},
     {"rdbchecksum", {Config_bool, false, &g_config.rdbchecksum}},
     {"rdbcompression", {Config_bool, false, &g_config.rdbcompression}},
+    {"rdb-forkless", {Config_bool, true, &g_config.rdbforkless}},
+    {"rdb-compression-codec", {Config_string, false, &g_config.rdbcodec}},
+    {"rdb-compression-level", {Config_int, true, &g_config.rdbcompressionlevel}},
+    {"rdb-save-threads", {Config_int, true, &g_config.rdbthreads}},
+    {"rdb-load-threads", {Config_int, true, &g_config.rdbloadthreads}},
+    {"async-loading", {Config_bool, false, &g_config.asyncloading}},
+    {"async-loading-wait", {Config_bool, true, &g_config.asyncloadingwait}},
+    {"warm-restart", {Config_bool, true, &g_config.warmrestart}},
     {"slowlog-log-slower-than", {Config_int, true, &g_config.slowlogtime}},
     {"slowlog-max-len", {Config_int, true, &g_config.slowlogmaxlen}},
+    {"latency-monitor-threshold", {Config_int, true, &g_config.latencymonitorthreshold}},
+    {"metrics-port", {Config_int, false, &g_config.metricsport}},
     {"slaveof", {Config_string, false, &g_config.masterIp}},
     {"maxmemory", {Config_int64, true, &g_config.maxmemory}},
     {"maxmemorySamples", {Config_int, true, &g_config.maxmemorySamples}},
     {"maxmemory-noevict", {Config_bool, true, &g_config.noeviction}},
     {"backend", {Config_int, false, &g_config.backend}},
     {"backendhz", {Config_int, false, &g_config.backendHz}},
+    {"appendonly", {Config_bool, false, &g_config.appendonly}},
+    {"appendfsync", {Config_string, true, &g_config.appendfsync}},
+    {"auto-aof-rewrite-percentage", {Config_int, true, &g_config.autoAofRewritePerc}},
+    {"auto-aof-rewrite-min-size", {Config_int64, true, &g_config.autoAofRewriteMinSize}},
 };
 
 static std::vector<PString> GetConfig(const PString& option) {
@@ -459,6 +715,11 @@ static PError SetConfig(const PString& option, const PString& value) {
       break;
 
     case Config_string:
+      // the aof reads the parsed policy from its fsync thread
+      if (option == "appendfsync" && !PAOF.SetFsyncPolicy(value)) {
+        return PError_syntax;
+      }
+
       *(PString*)it->second.value = value;
       break;
 
@@ -492,7 +753,18 @@ static PError SetConfig(const PString& option, const PString& value) {
 }
 
 PError config(const std::vector<PString>& params, UnboundedBuffer* reply) {
+  if (strcasecmp(params[1].c_str(), "resetstat") == 0) {
+    PCommandStats::Instance().Reset();
+    FormatOK(reply);
+    return PError_ok;
+  }
+
   // at least 3 params
+  if (params.size() < 3) {
+    ReplyError(PError_param, reply);
+    return PError_param;
+  }
+
   if (strncasecmp(params[1].c_str(), "get", 3) == 0) {
     auto res = GetConfig(params[2]);
     PreFormatMultiBulk(res.size(), reply);
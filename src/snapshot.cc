@@ -0,0 +1,226 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "snapshot.h"
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+#include "config.h"
+#include "event_loop.h"
+#include "log.h"
+
+namespace pikiwidb {
+
+// time budget of one slice, the loop runs a slice every millisecond
+static const auto kSliceTime = std::chrono::microseconds(1000);
+// check the clock every some buckets of each thread
+static const std::size_t kBucketsPerCheck = 64;
+
+PSnapshot& PSnapshot::Instance() {
+  static PSnapshot snapshot;
+  return snapshot;
+}
+
+bool PSnapshot::Start(const PString& file, DoneCallback cb) {
+  if (running_) {
+    return false;
+  }
+
+  if (!saver_.Open(file.c_str())) {
+    ERROR("snapshot can not open file {}", file);
+    return false;
+  }
+
+  pause_ = nullptr;
+  begin(std::move(cb));
+  INFO("snapshot {} started, epoch {}", file, epoch_);
+  return true;
+}
+
+bool PSnapshot::Start(PDBSaver::Sink sink, PauseFunc pause, DoneCallback cb) {
+  if (running_) {
+    return false;
+  }
+
+  if (!saver_.Open(std::move(sink))) {
+    return false;
+  }
+
+  pause_ = std::move(pause);
+  begin(std::move(cb));
+  INFO("snapshot to sink started, epoch {}", epoch_);
+  return true;
+}
+
+void PSnapshot::begin(DoneCallback cb) {
+  ++epoch_;
+  running_ = true;
+  done_ = std::move(cb);
+  dbno_ = 0;
+  bucket_ = 0;
+  savedDB_ = -1;
+
+  // freeze the bucket layout, so the cursor stays valid until the end
+  auto& dbs = PSTORE.dbs_;
+  sources_.clear();
+  sources_.resize(dbs.size());
+  for (std::size_t i = 0; i < dbs.size(); ++i) {
+    Source& src = sources_[i];
+    src.db = &dbs[i];
+    src.expires = &PSTORE.expiredDBs_[i];
+    src.maxLoadFactor = dbs[i].max_load_factor();
+    dbs[i].max_load_factor(std::numeric_limits<float>::max());
+  }
+
+  if (!pool_) {
+    pool_ = std::make_unique<ThreadPool>();
+  }
+
+  timer_ = EventLoop::Self()->ScheduleRepeatedly(1, [this]() { this->step(); });
+}
+
+void PSnapshot::Abort() {
+  if (running_) {
+    WARN("snapshot aborted at db {} bucket {}", dbno_, bucket_);
+    finish(false);
+  }
+}
+
+void PSnapshot::SaveKey(int dbno, const PString& key, PObject& obj) {
+  if (IsSaved(dbno, key, obj)) {
+    return;
+  }
+
+  obj.snapshotEpoch = epoch_;
+  saveEntry(dbno, sources_[dbno], key, obj, ::Now());
+}
+
+bool PSnapshot::IsSaved(int dbno, const PString& key, const PObject& obj) const {
+  // fast path: saved, or created after the snapshot started
+  if (!running_ || obj.snapshotEpoch == epoch_) {
+    return true;
+  }
+
+  if (dbno < dbno_) {
+    return true;
+  }
+
+  const Source& src = sources_[dbno];
+  if (src.detachedDB) {
+    return true;  // the live db only has new keys
+  }
+
+  return dbno == dbno_ && src.db->bucket(key) < bucket_;
+}
+
+void PSnapshot::DetachDB(int dbno, PDB& db, PStore::ExpiredDB& expires) {
+  if (dbno < dbno_) {
+    return;
+  }
+
+  Source& src = sources_[dbno];
+  if (src.detachedDB) {
+    return;
+  }
+
+  // the moved hash table keeps its buckets
+  src.detachedDB = std::make_unique<PDB>(std::move(db));
+  src.detachedExpires = std::make_unique<PStore::ExpiredDB>(std::move(expires));
+  src.db = src.detachedDB.get();
+  src.expires = src.detachedExpires.get();
+
+  db.clear();
+  db.max_load_factor(src.maxLoadFactor);
+}
+
+void PSnapshot::step() {
+  if (!running_) {
+    return;
+  }
+
+  // the sink is busy, keys touched meanwhile are still saved by SaveKey
+  if (pause_ && pause_()) {
+    return;
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  const uint64_t now = ::Now();
+  const uint32_t epoch = epoch_;
+  const PDBSaver::SkipFunc saved = [epoch](const PObject& obj) { return obj.snapshotEpoch == epoch; };
+
+  // the loop waits for the encoding threads, so the dbs are not changed meanwhile
+  const std::size_t buckets = kBucketsPerCheck * std::max(1, g_config.rdbthreads);
+  while (dbno_ < static_cast<int>(sources_.size())) {
+    const Source& src = sources_[dbno_];
+    if (src.db->empty() || bucket_ >= src.db->bucket_count()) {
+      ++dbno_;
+      bucket_ = 0;
+      continue;
+    }
+
+    if (savedDB_ != dbno_) {
+      saver_.SaveDB(dbno_, src.db->size(), src.expires->Size());
+      savedDB_ = dbno_;
+    }
+
+    std::size_t last = std::min(src.db->bucket_count(), bucket_ + buckets);
+    saver_.SaveBuckets(*pool_, *src.db, *src.expires, bucket_, last, now, saved, kBucketsPerCheck);
+
+    bucket_ = last;
+    if (std::chrono::steady_clock::now() - start > kSliceTime) {
+      return;
+    }
+  }
+
+  finish(true);
+}
+
+void PSnapshot::saveEntry(int dbno, const Source& src, const PString& key, const PObject& obj, uint64_t now) {
+  uint64_t expireAt = src.expires->ExpireAt(key);
+  if (expireAt != 0 && expireAt <= now) {
+    return;
+  }
+
+  if (dbno != savedDB_) {
+    saver_.SaveDB(dbno);
+    savedDB_ = dbno;
+  }
+
+  saver_.SaveEntry(key, obj, expireAt);
+}
+
+void PSnapshot::finish(bool succ) {
+  EventLoop::Self()->Cancel(timer_);
+
+  if (succ) {
+    succ = saver_.Finish();
+  } else {
+    saver_.Abort();
+  }
+
+  // restore the rehash policy, dbs may be rehashed on next insert
+  auto& dbs = PSTORE.dbs_;
+  for (std::size_t i = 0; i < sources_.size() && i < dbs.size(); ++i) {
+    dbs[i].max_load_factor(sources_[i].maxLoadFactor);
+  }
+
+  sources_.clear();
+  pause_ = nullptr;
+  running_ = false;
+
+  INFO("snapshot epoch {} done, {}", epoch_, succ ? "succ" : "fail");
+
+  auto cb = std::move(done_);
+  done_ = nullptr;
+  if (cb) {
+    cb(succ);
+  }
+}
+
+}  // namespace pikiwidb
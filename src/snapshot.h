@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "db.h"
+#include "net/reactor.h"
+#include "store.h"
+#include "thread_pool.h"
+
+namespace pikiwidb {
+
+// Forkless snapshot of the whole keyspace.
+// The dbs are saved bucket by bucket in time slices from the event loop, and
+// they are not rehashed until the snapshot is done. A key read or modified
+// before its bucket is visited is saved at once, so the file holds the keyspace
+// as it was when Start was called, without fork and without copying values.
+class PSnapshot {
+ public:
+  using DoneCallback = std::function<void(bool succ)>;
+  using PauseFunc = std::function<bool()>;
+
+  static PSnapshot& Instance();
+
+  PSnapshot(const PSnapshot&) = delete;
+  void operator=(const PSnapshot&) = delete;
+
+  bool Start(const PString& file, DoneCallback cb);
+  // stream to sink, the buckets are not visited while pause returns true
+  bool Start(PDBSaver::Sink sink, PauseFunc pause, DoneCallback cb);
+  void Abort();
+  bool IsRunning() const { return running_; }
+  uint32_t CurrentEpoch() const { return epoch_; }
+
+  // called by PStore before obj is accessed
+  void SaveKey(int dbno, const PString& key, PObject& obj);
+  // obj may be changed: its old value is saved, or not in the snapshot
+  bool IsSaved(int dbno, const PString& key, const PObject& obj) const;
+  // called by PStore before db is cleared, snapshot takes it over
+  void DetachDB(int dbno, PDB& db, PStore::ExpiredDB& expires);
+
+ private:
+  PSnapshot() {}
+
+  struct Source {
+    PDB* db = nullptr;
+    const PStore::ExpiredDB* expires = nullptr;
+    float maxLoadFactor = 1.0f;
+
+    // the db was cleared while snapshot running
+    std::unique_ptr<PDB> detachedDB;
+    std::unique_ptr<PStore::ExpiredDB> detachedExpires;
+  };
+
+  void begin(DoneCallback cb);
+  void step();
+  void saveEntry(int dbno, const Source& src, const PString& key, const PObject& obj, uint64_t now);
+  void finish(bool succ);
+
+  bool running_ = false;
+  uint32_t epoch_ = 0;
+
+  std::vector<Source> sources_;
+  int dbno_ = 0;            // the db being visited
+  std::size_t bucket_ = 0;  // the next bucket to visit
+  int savedDB_ = -1;        // the db of last saved entry
+
+  PDBSaver saver_;
+  std::unique_ptr<ThreadPool> pool_;  // encode buckets concurrently
+  DoneCallback done_;
+  PauseFunc pause_;
+  TimerId timer_ = 0;
+};
+
+}  // namespace pikiwidb
+
+#define PSNAPSHOT pikiwidb::PSnapshot::Instance()
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "cycle_clock.h"
+
+#include <fstream>
+#include <string>
+#include <thread>
+
+bool CycleClock::s_tsc = false;
+double CycleClock::s_nsPerTick = 1.0;
+
+// the flags of the first cpu in /proc/cpuinfo
+static bool HasCpuFlags(const char* const* flags, int n) {
+  std::ifstream cpuinfo("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(cpuinfo, line)) {
+    if (line.compare(0, 5, "flags") != 0) {
+      continue;
+    }
+
+    line += ' ';
+    for (int i = 0; i < n; ++i) {
+      if (line.find(std::string(" ") + flags[i] + " ") == std::string::npos) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  return false;
+}
+
+void CycleClock::Init() {
+#if defined(__x86_64__) || defined(__i386__)
+  static const char* const kFlags[] = {"constant_tsc", "nonstop_tsc"};
+  if (s_tsc || !HasCpuFlags(kFlags, 2)) {
+    return;
+  }
+
+  using namespace std::chrono;
+  auto begin = steady_clock::now();
+  uint64_t ticks = __rdtsc();
+  std::this_thread::sleep_for(milliseconds(10));
+  ticks = __rdtsc() - ticks;
+  auto ns = duration_cast<nanoseconds>(steady_clock::now() - begin).count();
+
+  if (ticks > 0 && ns > 0) {
+    s_nsPerTick = static_cast<double>(ns) / ticks;
+    s_tsc = true;
+  }
+#endif
+}
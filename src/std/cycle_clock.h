@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  include <x86intrin.h>
+#endif
+
+// A cheap clock to time the commands: the time stamp counter if it ticks at a
+// constant rate across cores and sleep states, otherwise the steady clock in
+// nanoseconds. Only the difference of two Now() makes sense, by ToNs().
+class CycleClock {
+ public:
+  // checks the cpu and calibrates the tsc, about 10ms, before Now() is used
+  static void Init();
+
+  static uint64_t Now() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (s_tsc) {
+      return __rdtsc();
+    }
+#endif
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  static uint64_t ToNs(uint64_t ticks) { return s_tsc ? static_cast<uint64_t>(ticks * s_nsPerTick) : ticks; }
+
+  static bool IsTsc() { return s_tsc; }
+
+ private:
+  static bool s_tsc;
+  static double s_nsPerTick;
+};
@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#include "histogram.h"
+
+#include <algorithm>
+#include <cmath>
+
+Histogram::Histogram() : counts_(kBuckets, 0) {}
+
+int Histogram::BucketOf(uint64_t value) {
+  if (value > kMaxValue) {
+    value = kMaxValue;
+  }
+
+  if (value < kSubBuckets) {
+    return static_cast<int>(value);
+  }
+
+  // the highest bit selects the range, the next kSubBits bits the bucket in it
+  int shift = 63 - __builtin_clzll(value) - kSubBits;
+  return static_cast<int>((shift + 1) * kSubBuckets + (value >> shift) - kSubBuckets);
+}
+
+uint64_t Histogram::LowestOf(int bucket) {
+  if (bucket < static_cast<int>(kSubBuckets)) {
+    return bucket;
+  }
+
+  int shift = bucket / kSubBuckets - 1;
+  return (kSubBuckets + bucket % kSubBuckets) << shift;
+}
+
+void Histogram::Record(uint64_t value, uint64_t count) {
+  if (count == 0) {
+    return;
+  }
+
+  counts_[BucketOf(value)] += count;
+  count_ += count;
+  sum_ += value * count;
+  min_ = std::min(min_, value);
+  max_ = std::max(max_, value);
+}
+
+void Histogram::Merge(const Histogram& other) {
+  if (other.count_ == 0) {
+    return;
+  }
+
+  for (int i = 0; i < kBuckets; ++i) {
+    counts_[i] += other.counts_[i];
+  }
+  count_ += other.count_;
+  sum_ += other.sum_;
+  min_ = std::min(min_, other.min_);
+  max_ = std::max(max_, other.max_);
+}
+
+void Histogram::Reset() {
+  std::fill(counts_.begin(), counts_.end(), 0);
+  count_ = 0;
+  sum_ = 0;
+  min_ = UINT64_MAX;
+  max_ = 0;
+}
+
+uint64_t Histogram::Percentile(double p) const {
+  if (count_ == 0) {
+    return 0;
+  }
+
+  p = std::clamp(p, 0.0, 100.0);
+  auto rank = static_cast<uint64_t>(std::ceil(p / 100 * count_));
+  if (rank == 0) {
+    rank = 1;
+  }
+
+  uint64_t seen = 0;
+  for (int i = 0; i < kBuckets; ++i) {
+    seen += counts_[i];
+    if (seen >= rank) {
+      return std::min(HighestOf(i), max_);
+    }
+  }
+
+  return max_;
+}
+
+void Histogram::ForEach(const std::function<void(uint64_t low, uint64_t high, uint64_t count)>& func) const {
+  for (int i = 0; i < kBuckets && count_ > 0; ++i) {
+    if (counts_[i] > 0) {
+      func(LowestOf(i), HighestOf(i), counts_[i]);
+    }
+  }
+}
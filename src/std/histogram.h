@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2023-present, Qihoo, Inc.  All rights reserved.
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// A log-linear histogram of non-negative integers such as latencies, like
+// HdrHistogram: each power of two range is split into kSubBuckets linear
+// buckets, so a value is reported within 1/kSubBuckets (about 3%) of itself.
+// Values beyond kMaxValue are counted as kMaxValue.
+class Histogram {
+ public:
+  static const int kSubBits = 5;
+  static const uint64_t kSubBuckets = 1ULL << kSubBits;
+  static const int kMaxBits = 40;
+  static const uint64_t kMaxValue = (1ULL << kMaxBits) - 1;
+  static const int kBuckets = (kMaxBits - kSubBits + 1) * kSubBuckets;
+
+  Histogram();
+
+  void Record(uint64_t value, uint64_t count = 1);
+  void Merge(const Histogram& other);
+  void Reset();
+
+  uint64_t Count() const { return count_; }
+  uint64_t Sum() const { return sum_; }
+  uint64_t Min() const { return count_ ? min_ : 0; }
+  uint64_t Max() const { return max_; }
+  double Mean() const { return count_ ? static_cast<double>(sum_) / count_ : 0; }
+
+  // the value which p (0 - 100) percent of the values are not greater than,
+  // the highest value of its bucket but not greater than Max()
+  uint64_t Percentile(double p) const;
+
+  // the not empty buckets in order, [low, high] are the values of a bucket
+  void ForEach(const std::function<void(uint64_t low, uint64_t high, uint64_t count)>& func) const;
+
+  static int BucketOf(uint64_t value);
+  static uint64_t LowestOf(int bucket);
+  static uint64_t HighestOf(int bucket) { return LowestOf(bucket + 1) - 1; }
+
+ private:
+  std::vector<uint64_t> counts_;
+  uint64_t count_ = 0;
+  uint64_t sum_ = 0;
+  uint64_t min_ = UINT64_MAX;
+  uint64_t max_ = 0;
+};
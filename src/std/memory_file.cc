@@ -52,16 +52,26 @@ bool InputMemoryFile::Open(const char* file) {
   return _MapReadOnly();
 }
 
+void InputMemoryFile::Attach(const char* data, std::size_t size) {
+  Close();
+
+  pMemory_ = const_cast<char*>(data);
+  size_ = size;
+  offset_ = 0;
+}
+
 void InputMemoryFile::Close() {
   if (file_ != kInvalidFile) {
     ::munmap(pMemory_, size_);
     ::close(file_);
 
     file_ = kInvalidFile;
-    size_ = 0;
-    pMemory_ = kInvalidAddr;
-    offset_ = 0;
   }
+
+  size_ = 0;
+  pMemory_ = kInvalidAddr;
+  offset_ = 0;
+  overrun_ = false;
 }
 
 const char* InputMemoryFile::Read(std::size_t& len) {
@@ -77,8 +87,19 @@ const char* InputMemoryFile::Read(std::size_t& len) {
 }
 
 void InputMemoryFile::Skip(size_t len) {
+  if (offset_ + len > size_) {
+    overrun_ = true;
+    offset_ = size_;
+    return;
+  }
+
   offset_ += len;
-  assert(offset_ <= size_);
+}
+
+void InputMemoryFile::Seek(std::size_t offset) {
+  assert(offset <= size_);
+  offset_ = offset;
+  overrun_ = false;
 }
 
 bool InputMemoryFile::IsOpen() const { return file_ != kInvalidFile; }
@@ -15,12 +15,19 @@ class InputMemoryFile {
   ~InputMemoryFile();
 
   bool Open(const char* file);
+  // read the memory instead of a file, it's not owned
+  void Attach(const char* data, std::size_t size);
   void Close();
 
   const char* Read(std::size_t& len);
   template <typename T>
   T Read();
   void Skip(std::size_t len);
+  std::size_t Offset() const { return offset_; }
+  std::size_t Size() const { return size_; }
+  void Seek(std::size_t offset);
+  // true if a read or skip passed the end, the data may be incomplete
+  bool Overrun() const { return overrun_; }
 
   bool IsOpen() const;
 
@@ -31,10 +38,17 @@ class InputMemoryFile {
   char* pMemory_;
   std::size_t offset_;
   std::size_t size_;
+  bool overrun_ = false;
 };
 
 template <typename T>
 inline T InputMemoryFile::Read() {
+  if (offset_ + sizeof(T) > size_) {
+    overrun_ = true;
+    offset_ = size_;
+    return T();
+  }
+
   T res(*reinterpret_cast<T*>(pMemory_ + offset_));
   offset_ += sizeof(T);
 
@@ -34,6 +34,7 @@ void ThreadPool::JoinAll() {
 
     shutdown_ = true;
     cond_.notify_all();
+    monitorCond_.notify_all();
 
     tmp.swap(workers_);
     workers_.clear();
@@ -85,9 +86,9 @@ void ThreadPool::_WorkerRoutine() {
 
 void ThreadPool::_MonitorRoutine() {
   while (!shutdown_) {
-    std::this_thread::sleep_for(std::chrono::seconds(1));
-
     std::unique_lock<std::mutex> guard(mutex_);
+    // woken up by JoinAll, so a short lived pool is not joined a second later
+    monitorCond_.wait_for(guard, std::chrono::seconds(1), [this]() { return this->shutdown_; });
     if (shutdown_) {
       return;
     }
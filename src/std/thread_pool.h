@@ -44,6 +44,7 @@ class ThreadPool final {
 
   std::mutex mutex_;
   std::condition_variable cond_;
+  std::condition_variable monitorCond_;
   unsigned waiters_;
   bool shutdown_;
   std::deque<std::function<void()> > tasks_;
@@ -6,14 +6,20 @@
  */
 
 #include "store.h"
+#include <algorithm>
 #include <cassert>
 #include <limits>
+#include "aof.h"
 #include "client.h"
+#include "cluster.h"
 #include "config.h"
 #include "event_loop.h"
+#include "latency_monitor.h"
 #include "leveldb.h"
+#include "loading.h"
 #include "log.h"
 #include "multi.h"
+#include "snapshot.h"
 
 namespace pikiwidb {
 
@@ -111,6 +117,8 @@ void PObject::freeValue() {
 }
 
 int PStore::dirty_ = 0;
+uint64_t PStore::expiredKeys_ = 0;
+uint64_t PStore::evictedKeys_ = 0;
 
 void PStore::ExpiredDB::SetExpire(const PString& key, uint64_t when) { expireKeys_[key] = when; }
 
@@ -122,6 +130,9 @@ int64_t PStore::ExpiredDB::TTL(const PString& key, uint64_t now) {
   ExpireResult ret = ExpireIfNeed(key, now);
   switch (ret) {
     case ExpireResult::expired:
+      ++PStore::expiredKeys_;
+      return ret;
+
     case ExpireResult::persist:
       return ret;
 
@@ -137,6 +148,11 @@ bool PStore::ExpiredDB::ClearExpire(const PString& key) {
   return ExpireResult::expired == ExpireIfNeed(key, std::numeric_limits<uint64_t>::max());
 }
 
+uint64_t PStore::ExpiredDB::ExpireAt(const PString& key) const {
+  auto it(expireKeys_.find(key));
+  return it != expireKeys_.end() ? it->second : 0;
+}
+
 PStore::ExpireResult PStore::ExpiredDB::ExpireIfNeed(const PString& key, uint64_t now) {
   auto it(expireKeys_.find(key));
 
@@ -173,6 +189,7 @@ int PStore::ExpiredDB::LoopCheck(uint64_t now) {
       expireKeys_.erase(it++);
 
       ++nDel;
+      ++PStore::expiredKeys_;
     } else {
       ++it;
     }
@@ -356,6 +373,51 @@ void PStore::Init(int dbNum) {
   dbs_.resize(dbNum);
   expiredDBs_.resize(dbNum);
   blockedClients_.resize(dbNum);
+
+  if (g_config.clusterenabled) {
+    slotKeys_.resize(kClusterSlots);
+  }
+}
+
+void PStore::indexKey(const PString& key, bool add) const {
+  if (slotKeys_.empty() || dbno_ != 0) {
+    return;
+  }
+
+  auto& keys = slotKeys_[KeyHashSlot(key)];
+  if (add) {
+    keys.insert(key);
+  } else {
+    keys.erase(key);
+  }
+}
+
+void PStore::rebuildSlotIndex() {
+  if (slotKeys_.empty()) {
+    return;
+  }
+
+  std::vector<PSet>(kClusterSlots).swap(slotKeys_);
+  for (const auto& kv : dbs_[0]) {
+    slotKeys_[KeyHashSlot(kv.first)].insert(kv.first);
+  }
+}
+
+size_t PStore::CountKeysInSlot(int slot) const { return slotKeys_.empty() ? 0 : slotKeys_[slot].size(); }
+
+std::vector<PString> PStore::GetKeysInSlot(int slot, size_t count) const {
+  std::vector<PString> res;
+  if (slotKeys_.empty()) {
+    return res;
+  }
+
+  const auto& keys = slotKeys_[slot];
+  res.reserve(std::min(count, keys.size()));
+  for (auto it = keys.begin(); it != keys.end() && res.size() < count; ++it) {
+    res.push_back(*it);
+  }
+
+  return res;
 }
 
 int PStore::LoopCheckExpire(uint64_t now) { return expiredDBs_[dbno_].LoopCheck(now); }
@@ -380,8 +442,11 @@ int PStore::SelectDB(int dbno) {
 int PStore::GetDB() const { return dbno_; }
 
 const PObject* PStore::GetObject(const PString& key) const {
+  // the object returned may be changed in place
+  beforeWrite(key);
+
   auto db = &dbs_[dbno_];
-  PDB::const_iterator it(db->find(key));
+  PDB::iterator it(db->find(key));
   if (it != db->end()) {
     return &it->second;
   }
@@ -398,8 +463,10 @@ const PObject* PStore::GetObject(const PString& key) const {
       DEBUG("GetKey from leveldb:{}", key);
 
       (*db)[key] = std::move(obj);
+      indexKey(key, true);
       PObject& realobj = (*db)[key];
       realobj.lru = PObject::lruclock;
+      realobj.snapshotEpoch = PSNAPSHOT.CurrentEpoch();
 
       // trick: use lru field to store the remain seconds to be expired.
       unsigned int remainTtlSeconds = obj.lru;
@@ -414,14 +481,50 @@ const PObject* PStore::GetObject(const PString& key) const {
   return nullptr;
 }
 
+void PStore::beforeWrite(const PString& key) const {
+  if (PLOADING.IsLoading()) {
+    PLOADING.LoadKey(dbno_, key);
+  }
+
+  if (!PSNAPSHOT.IsRunning()) {
+    return;
+  }
+
+  auto db = &dbs_[dbno_];
+  auto it(db->find(key));
+  if (it != db->end()) {
+    PSNAPSHOT.SaveKey(dbno_, it->first, it->second);
+  }
+}
+
+void PStore::assertSaved(const PString& key) const {
+#ifndef NDEBUG
+  if (!PSNAPSHOT.IsRunning()) {
+    return;
+  }
+
+  auto db = &dbs_[dbno_];
+  auto it(db->find(key));
+  assert(it == db->end() || PSNAPSHOT.IsSaved(dbno_, it->first, it->second));
+#endif
+}
+
 bool PStore::DeleteKey(const PString& key) {
+  beforeWrite(key);
+
   auto db = &dbs_[dbno_];
   // add to dirty queue
   if (!waitSyncKeys_.empty()) {
     waitSyncKeys_[dbno_][key] = nullptr;  // null implies delete data
   }
 
-  return db->erase(key) != 0;
+  assertSaved(key);
+  if (db->erase(key) == 0) {
+    return false;
+  }
+
+  indexKey(key, false);
+  return true;
 }
 
 bool PStore::ExistsKey(const PString& key) const {
@@ -495,6 +598,7 @@ PError PStore::GetValueByTypeNoTouch(const PString& key, PObject*& value, PType
 
 PError PStore::getValueByType(const PString& key, PObject*& value, PType type, bool touch) {
   if (expireIfNeed(key, ::Now()) == ExpireResult::expired) {
+    ++expiredKeys_;
     return PError_notExist;
   }
 
@@ -517,10 +621,27 @@ PError PStore::getValueByType(const PString& key, PObject*& value, PType type, b
 }
 
 PObject* PStore::SetValue(const PString& key, PObject&& value) {
+  // the value in rdb is overwritten
+  if (PLOADING.IsLoading()) {
+    PLOADING.DropKey(dbno_, key);
+  }
+  beforeWrite(key);
+
   auto db = &dbs_[dbno_];
-  (*db)[key] = std::move(value);
+  assertSaved(key);
+  {
+    // a new key may grow the buckets, which rehashes all the keys at once
+    const bool rehash = db->size() + 1 > db->max_load_factor() * db->bucket_count();
+    PLatencyScope latency(rehash ? kLatencyRehash : nullptr);
+    const size_t oldSize = db->size();
+    (*db)[key] = std::move(value);
+    if (db->size() != oldSize) {
+      indexKey(key, true);
+    }
+  }
   PObject& obj = (*db)[key];
   obj.lru = PObject::lruclock;
+  obj.snapshotEpoch = PSNAPSHOT.CurrentEpoch();
 
   // put this key to sync list
   if (!waitSyncKeys_.empty()) {
@@ -530,11 +651,29 @@ PObject* PStore::SetValue(const PString& key, PObject&& value) {
   return &obj;
 }
 
-void PStore::SetExpire(const PString& key, uint64_t when) const { expiredDBs_[dbno_].SetExpire(key, when); }
+void PStore::SetExpire(const PString& key, uint64_t when) const {
+  beforeWrite(key);
+  assertSaved(key);
+  expiredDBs_[dbno_].SetExpire(key, when);
+}
+
+void PStore::ReserveDB(size_t dbsize, size_t expiresize) {
+  // rehash would break the bucket cursor of snapshot
+  if (PSNAPSHOT.IsRunning()) {
+    return;
+  }
+
+  dbs_[dbno_].reserve(dbsize);
+  expiredDBs_[dbno_].Reserve(expiresize);
+}
 
 int64_t PStore::TTL(const PString& key, uint64_t now) { return expiredDBs_[dbno_].TTL(key, now); }
 
-bool PStore::ClearExpire(const PString& key) { return expiredDBs_[dbno_].ClearExpire(key); }
+bool PStore::ClearExpire(const PString& key) {
+  beforeWrite(key);
+  assertSaved(key);
+  return expiredDBs_[dbno_].ClearExpire(key);
+}
 
 PStore::ExpireResult PStore::expireIfNeed(const PString& key, uint64_t now) {
   return expiredDBs_[dbno_].ExpireIfNeed(key, now);
@@ -544,6 +683,7 @@ void PStore::InitExpireTimer() {
   auto loop = EventLoop::Self();
   for (int i = 0; i < static_cast<int>(expiredDBs_.size()); ++i) {
     loop->ScheduleRepeatedly(1, [&, i]() {
+      PLatencyScope latency(kLatencyExpireCycle);
       int old_db = PSTORE.SelectDB(i);
       PSTORE.LoopCheckExpire(Now());
       PSTORE.SelectDB(old_db);
@@ -551,11 +691,72 @@ void PStore::InitExpireTimer() {
   }
 }
 
+void PStore::ClearCurrentDB() {
+  if (PLOADING.IsLoading()) {
+    PLOADING.DropDB(dbno_);
+  }
+
+  if (PSNAPSHOT.IsRunning()) {
+    PSNAPSHOT.DetachDB(dbno_, dbs_[dbno_], expiredDBs_[dbno_]);
+  }
+
+  dbs_[dbno_].clear();
+  if (dbno_ == 0) {
+    rebuildSlotIndex();
+  }
+}
+
 void PStore::ResetDB() {
+  if (PLOADING.IsLoading()) {
+    PLOADING.DropDB(-1);
+  }
+
+  if (PSNAPSHOT.IsRunning()) {
+    for (int i = 0; i < static_cast<int>(dbs_.size()); ++i) {
+      PSNAPSHOT.DetachDB(i, dbs_[i], expiredDBs_[i]);
+    }
+  }
+
   std::vector<PDB>(dbs_.size()).swap(dbs_);
   std::vector<ExpiredDB>(expiredDBs_.size()).swap(expiredDBs_);
   std::vector<BlockedClients>(blockedClients_.size()).swap(blockedClients_);
   dbno_ = 0;
+  rebuildSlotIndex();
+}
+
+void PStore::BeginStaging() {
+  std::vector<PDB>(dbs_.size()).swap(stagingDBs_);
+  std::vector<ExpiredDB>(expiredDBs_.size()).swap(stagingExpiredDBs_);
+}
+
+void PStore::ReserveStaging(int dbno, size_t dbsize, size_t expiresize) {
+  stagingDBs_[dbno].reserve(dbsize);
+  stagingExpiredDBs_[dbno].Reserve(expiresize);
+}
+
+void PStore::SetStagingValue(int dbno, const PString& key, PObject&& value, uint64_t expireAt) {
+  PObject& obj = stagingDBs_[dbno][key];
+  obj = std::move(value);
+  obj.lru = PObject::lruclock;
+
+  if (expireAt != 0) {
+    stagingExpiredDBs_[dbno].SetExpire(key, expireAt);
+  }
+}
+
+void PStore::CommitStaging() {
+  ResetDB();
+
+  // the snapshot has detached the old dbs, so the new keys are not saved by it
+  dbs_.swap(stagingDBs_);
+  expiredDBs_.swap(stagingExpiredDBs_);
+  rebuildSlotIndex();
+  AbortStaging();
+}
+
+void PStore::AbortStaging() {
+  std::vector<PDB>().swap(stagingDBs_);
+  std::vector<ExpiredDB>().swap(stagingExpiredDBs_);
 }
 
 size_t PStore::BlockedSize() const {
@@ -591,6 +792,7 @@ void PStore::InitBlockedTimer() {
 
 // allkeys-lru policy
 static void EvictItems() {
+  PLatencyScope latency(kLatencyEvictionCycle);
   PObject::lruclock = static_cast<uint32_t>(::time(nullptr));
   PObject::lruclock &= kMaxLRUValue;
 
@@ -634,6 +836,7 @@ static void EvictItems() {
 
       if (!evictKey.empty()) {
         PSTORE.DeleteKey(evictKey);
+        ++PStore::evictedKeys_;
         WARN("Evict '{}' in db {}, idle time: {}, used mem: {}", evictKey, dbno, choosedIdle, usedMem);
       }
     }
@@ -682,6 +885,7 @@ void PStore::InitDumpBackends() {
   auto loop = EventLoop::Self();
   for (int i = 0; i < static_cast<int>(backends_.size()); ++i) {
     loop->ScheduleRepeatedly(1000 / g_config.backendHz, [&, i]() {
+      PLatencyScope latency(kLatencyBackendFlush);
       int old_db = PSTORE.SelectDB(i);
       PSTORE.DumpToBackends(i);
       PSTORE.SelectDB(old_db);
@@ -756,6 +960,7 @@ void Propagate(const std::vector<PString>& params) {
     PSTORE.AddDirtyKey(params[1]);  // TODO optimize
   }
 
+  PAOF.Feed(PSTORE.GetDB(), params);
   PREPL.SendToSlaves(params);
 }
 
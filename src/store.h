@@ -44,6 +44,7 @@ struct PObject {
   unsigned int lru : kLRUBits; /* LRU time (relative to global lru_clock) or
                                 * LFU data (least significant 8 bits frequency
                                 * and most significant 16 bits access time). */
+  uint32_t snapshotEpoch = 0;  // the last snapshot which has saved or created this object
 
   void* value = nullptr;
 
@@ -101,7 +102,17 @@ class PStore {
   PType KeyType(const PString& key) const;
   PString RandomKey(PObject** val = nullptr) const;
   size_t DBSize() const { return dbs_[dbno_].size(); }
+  size_t ExpireSize() const { return expiredDBs_[dbno_].Size(); }
+  // of any db, without selecting it
+  int DBCount() const { return static_cast<int>(dbs_.size()); }
+  size_t DBSize(int dbno) const { return dbs_[dbno].size(); }
+  size_t ExpireSize(int dbno) const { return expiredDBs_[dbno].Size(); }
+  // pre-size the current db before loading, ignored while snapshot running
+  void ReserveDB(size_t dbsize, size_t expiresize);
   size_t ScanKey(size_t cursor, size_t count, std::vector<PString>& res) const;
+  // cluster mode only uses db 0, its keys are indexed by hash slot
+  size_t CountKeysInSlot(int slot) const;
+  std::vector<PString> GetKeysInSlot(int slot, size_t count) const;
 
   // iterator
   PDB::const_iterator begin() const { return dbs_[dbno_].begin(); }
@@ -131,9 +142,17 @@ class PStore {
   void InitExpireTimer();
 
   // danger cmd
-  void ClearCurrentDB() { dbs_[dbno_].clear(); }
+  void ClearCurrentDB();
   void ResetDB();
 
+  // the keyspace built aside while the old one is served, such as by the
+  // streaming load of slave, CommitStaging swaps it in and drops the old one
+  void BeginStaging();
+  void ReserveStaging(int dbno, size_t dbsize, size_t expiresize);
+  void SetStagingValue(int dbno, const PString& key, PObject&& value, uint64_t expireAt);
+  void CommitStaging();
+  void AbortStaging();
+
   // for blocked list
   bool BlockClient(const PString& key, PClient* client, uint64_t timeout, ListPosition pos, const PString* dstList = 0);
   size_t UnblockClient(PClient* client);
@@ -145,6 +164,8 @@ class PStore {
   size_t BlockedSize() const;
 
   static int dirty_;
+  static uint64_t expiredKeys_;
+  static uint64_t evictedKeys_;
 
   // eviction timer for lru
   void InitEvictionTimer();
@@ -155,10 +176,23 @@ class PStore {
   void AddDirtyKey(const PString& key, const PObject* value);
 
  private:
+  friend class PDBSaver;
+  friend class PSnapshot;
+
   PStore() : dbno_(0) {}
 
+  // every change of a key or its ttl must call it first: the key is loaded if
+  // async loading has not loaded it, and saved to the running snapshot.
+  void beforeWrite(const PString& key) const;
+  // debug builds check the key went through beforeWrite where dbs_ is changed
+  void assertSaved(const PString& key) const;
+
   PError getValueByType(const PString& key, PObject*& value, PType type = PType_invalid, bool touch = true);
 
+  // keep the slot index of db 0 in cluster mode
+  void indexKey(const PString& key, bool add) const;
+  void rebuildSlotIndex();
+
   ExpireResult expireIfNeed(const PString& key, uint64_t now);
 
   class ExpiredDB {
@@ -167,6 +201,9 @@ class PStore {
     int64_t TTL(const PString& key, uint64_t now);
     bool ClearExpire(const PString& key);
     ExpireResult ExpireIfNeed(const PString& key, uint64_t now);
+    uint64_t ExpireAt(const PString& key) const;  // 0 if no ttl
+    size_t Size() const { return expireKeys_.size(); }
+    void Reserve(size_t size) { expireKeys_.reserve(size); }
 
     int LoopCheck(uint64_t now);
 
@@ -198,7 +235,10 @@ class PStore {
   mutable std::vector<PDB> dbs_;
   mutable std::vector<ExpiredDB> expiredDBs_;
   std::vector<BlockedClients> blockedClients_;
+  std::vector<PDB> stagingDBs_;
+  std::vector<ExpiredDB> stagingExpiredDBs_;
   std::vector<std::unique_ptr<PDumpInterface> > backends_;
+  mutable std::vector<PSet> slotKeys_;  // the keys of db 0 by slot, empty if not cluster mode
 
   using ToSyncDB = std::unordered_map<PString, const PObject*, my_hash, std::equal_to<PString> >;
   std::vector<ToSyncDB> waitSyncKeys_;